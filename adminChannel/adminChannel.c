@@ -0,0 +1,548 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+/* FTP LIBS */
+#include "library/connection.h"
+#include "library/dynamicMemory.h"
+#include "library/serverHelpers.h"
+#include "library/log.h"
+#include "library/metrics.h"
+
+#include "ftpServer.h"
+#include "ftpData.h"
+#include "debugHelper.h"
+#include "adminChannel.h"
+
+struct adminClient
+{
+    int socket;
+    int length;
+    char command[ADMIN_COMMAND_SIZE];
+
+    /* Replies not sent yet, the control loop never waits on an admin client */
+    char *output;
+    int outputLength;
+    int outputSize;
+    int outputFailed;
+} typedef adminClient_DataType;
+
+static int adminSocket = -1;
+static pid_t adminParentPid = 0;
+static adminClient_DataType adminClients[ADMIN_MAX_CLIENTS];
+
+static void acceptAdminClient(ftpDataType *ftpData);
+static void readAdminClient(ftpDataType *ftpData, adminClient_DataType *client);
+static void closeAdminClient(ftpDataType *ftpData, adminClient_DataType *client);
+static void flushAdminClient(ftpDataType *ftpData, adminClient_DataType *client);
+static void processAdminCommand(ftpDataType *ftpData, adminClient_DataType *client, char *command);
+static void adminReply(adminClient_DataType *client, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static int parseSessionId(ftpDataType *ftpData, adminClient_DataType *client, const char *argument);
+static void listSessions(ftpDataType *ftpData, adminClient_DataType *client);
+static void killSession(ftpDataType *ftpData, adminClient_DataType *client, int session);
+static void cancelTransfer(ftpDataType *ftpData, adminClient_DataType *client, int session);
+static void setRateLimit(ftpDataType *ftpData, adminClient_DataType *client, int session, const char *argument);
+static void requestDrain(ftpDataType *ftpData, adminClient_DataType *client);
+static void reportMemory(ftpDataType *ftpData, adminClient_DataType *client);
+
+/*
+ * Binds ADMIN_SOCKET in the control loop of this process, a worker other than
+ * the first appends its index to the path. Only the owner can connect.
+ */
+int adminChannelInit(ftpDataType *ftpData)
+{
+    struct sockaddr_un address;
+    int pathLength;
+
+    for (int i = 0; i < ADMIN_MAX_CLIENTS; i++)
+    {
+        adminClients[i].socket = -1;
+        adminClients[i].output = NULL;
+    }
+
+    if (ftpData->ftpParameters.adminSocketPath[0] == '\0')
+        return 0;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (ftpData->workerProcessIndex == 0)
+        pathLength = snprintf(address.sun_path, sizeof(address.sun_path), "%s", ftpData->ftpParameters.adminSocketPath);
+    else
+        pathLength = snprintf(address.sun_path, sizeof(address.sun_path), "%s.%d", ftpData->ftpParameters.adminSocketPath, ftpData->workerProcessIndex);
+
+    if (pathLength < 0 || pathLength >= (int) sizeof(address.sun_path))
+    {
+        LOGF_ERROR("Admin socket path too long: %s", ftpData->ftpParameters.adminSocketPath);
+        return -1;
+    }
+
+    adminSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (adminSocket == -1)
+    {
+        LOGF_ERROR("Admin socket error: %s", strerror(errno));
+        return -1;
+    }
+
+    /* a socket left by a previous run */
+    unlink(address.sun_path);
+
+    if (bind(adminSocket, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        chmod(address.sun_path, S_IRUSR | S_IWUSR) != 0 ||
+        listen(adminSocket, ADMIN_MAX_CLIENTS) != 0)
+    {
+        LOGF_ERROR("Admin socket %s error: %s", address.sun_path, strerror(errno));
+        close(adminSocket);
+        adminSocket = -1;
+        return -1;
+    }
+
+    /* the respawn supervisor, or the prefork master, relays a drain to the whole server */
+    adminParentPid = getppid();
+
+    fdAddServiceSocket(ftpData, adminSocket);
+    LOGF_INFO("Admin socket listening on %s", address.sun_path);
+    return 1;
+}
+
+/* Called on every pass of the control loop after select */
+void evaluateAdminChannel(ftpDataType *ftpData)
+{
+    if (adminSocket == -1)
+        return;
+
+    if (FD_ISSET(adminSocket, &ftpData->connectionData.rset))
+        acceptAdminClient(ftpData);
+
+    for (int i = 0; i < ADMIN_MAX_CLIENTS; i++)
+    {
+        if (adminClients[i].socket != -1 &&
+            FD_ISSET(adminClients[i].socket, &ftpData->connectionData.rset))
+            readAdminClient(ftpData, &adminClients[i]);
+
+        if (adminClients[i].socket != -1 &&
+            FD_ISSET(adminClients[i].socket, &ftpData->connectionData.wset))
+            flushAdminClient(ftpData, &adminClients[i]);
+    }
+}
+
+static void acceptAdminClient(ftpDataType *ftpData)
+{
+    static const char tooMany[] = "ERR too many admin connections\n";
+    int client = accept(adminSocket, NULL, NULL);
+
+    if (client == -1)
+        return;
+
+    /* not passed to a new binary on an upgrade */
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+
+    for (int i = 0; i < ADMIN_MAX_CLIENTS; i++)
+    {
+        if (adminClients[i].socket != -1)
+            continue;
+
+        adminClients[i].socket = client;
+        adminClients[i].length = 0;
+        adminClients[i].outputLength = 0;
+        adminClients[i].outputFailed = 0;
+        fdAddServiceSocket(ftpData, client);
+        return;
+    }
+
+    send(client, tooMany, sizeof(tooMany) - 1, MSG_NOSIGNAL);
+    close(client);
+}
+
+/* Reads what select reported, the complete lines are run in order */
+static void readAdminClient(ftpDataType *ftpData, adminClient_DataType *client)
+{
+    char *lineEnd;
+    ssize_t bytes = read(client->socket, client->command + client->length, ADMIN_COMMAND_SIZE - 1 - client->length);
+
+    if (bytes <= 0)
+    {
+        closeAdminClient(ftpData, client);
+        return;
+    }
+
+    client->length += bytes;
+    client->command[client->length] = '\0';
+
+    while ((lineEnd = strchr(client->command, '\n')) != NULL)
+    {
+        *lineEnd = '\0';
+        if (lineEnd > client->command && lineEnd[-1] == '\r')
+            lineEnd[-1] = '\0';
+
+        processAdminCommand(ftpData, client, client->command);
+
+        client->length -= (int) (lineEnd + 1 - client->command);
+        memmove(client->command, lineEnd + 1, client->length + 1);
+    }
+
+    if (client->length == ADMIN_COMMAND_SIZE - 1)
+    {
+        adminReply(client, "ERR command too long\n");
+        flushAdminClient(ftpData, client);
+        closeAdminClient(ftpData, client);
+        return;
+    }
+
+    flushAdminClient(ftpData, client);
+}
+
+static void closeAdminClient(ftpDataType *ftpData, adminClient_DataType *client)
+{
+    fdRemoveServiceSocket(ftpData, client->socket);
+    fdSetServiceWriteInterest(ftpData, client->socket, 0);
+    close(client->socket);
+    client->socket = -1;
+    client->length = 0;
+
+    free(client->output);
+    client->output = NULL;
+    client->outputLength = 0;
+    client->outputSize = 0;
+}
+
+/* Sends what the socket takes, the rest waits for the write interest */
+static void flushAdminClient(ftpDataType *ftpData, adminClient_DataType *client)
+{
+    ssize_t sent = 0;
+
+    if (client->outputFailed == 1)
+    {
+        LOG_ERROR("Admin reply too long, closing the admin connection");
+        closeAdminClient(ftpData, client);
+        return;
+    }
+
+    if (client->outputLength > 0)
+        sent = send(client->socket, client->output, client->outputLength, MSG_NOSIGNAL);
+
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        closeAdminClient(ftpData, client);
+        return;
+    }
+
+    if (sent > 0)
+    {
+        client->outputLength -= (int) sent;
+        memmove(client->output, client->output + sent, client->outputLength);
+    }
+
+    fdSetServiceWriteInterest(ftpData, client->socket, client->outputLength > 0);
+}
+
+/* Queued, flushAdminClient sends it once the command is done */
+static void adminReply(adminClient_DataType *client, const char *format, ...)
+{
+    char line[CLIENT_COMMAND_STRING_SIZE + MAXIMUM_INODE_NAME + 256];
+    va_list arguments;
+    int length;
+    char *output;
+
+    va_start(arguments, format);
+    length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+
+    if (length < 0 || client->outputFailed == 1)
+        return;
+    if (length >= (int) sizeof(line))
+    {
+        length = sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+
+    if (client->outputLength + length > client->outputSize)
+    {
+        int outputSize = client->outputSize > 0 ? client->outputSize : (int) sizeof(line);
+
+        while (outputSize < client->outputLength + length)
+            outputSize *= 2;
+
+        /* a reader that never reads is closed instead of growing the queue */
+        if (outputSize > ADMIN_OUTPUT_LIMIT ||
+            (output = realloc(client->output, outputSize)) == NULL)
+        {
+            client->outputFailed = 1;
+            return;
+        }
+
+        client->output = output;
+        client->outputSize = outputSize;
+    }
+
+    memcpy(client->output + client->outputLength, line, length);
+    client->outputLength += length;
+}
+
+static void processAdminCommand(ftpDataType *ftpData, adminClient_DataType *client, char *command)
+{
+    char *name, *argument, *value, *context = NULL;
+    int session;
+
+    name = strtok_r(command, " \t", &context);
+    argument = strtok_r(NULL, " \t", &context);
+    value = strtok_r(NULL, " \t", &context);
+
+    if (name == NULL)
+        return;
+
+    LOGF_INFO("Admin command: %s%s%s%s%s", name, argument != NULL ? " " : "", argument != NULL ? argument : "",
+              value != NULL ? " " : "", value != NULL ? value : "");
+
+    if (strcmp(name, "sessions") == 0)
+    {
+        listSessions(ftpData, client);
+    }
+    else if (strcmp(name, "kill") == 0)
+    {
+        if ((session = parseSessionId(ftpData, client, argument)) != -1)
+            killSession(ftpData, client, session);
+    }
+    else if (strcmp(name, "cancel") == 0)
+    {
+        if ((session = parseSessionId(ftpData, client, argument)) != -1)
+            cancelTransfer(ftpData, client, session);
+    }
+    else if (strcmp(name, "ratelimit") == 0)
+    {
+        if ((session = parseSessionId(ftpData, client, argument)) != -1)
+            setRateLimit(ftpData, client, session, value);
+    }
+    else if (strcmp(name, "drain") == 0)
+    {
+        requestDrain(ftpData, client);
+    }
+    else if (strcmp(name, "memory") == 0)
+    {
+        reportMemory(ftpData, client);
+    }
+    else if (strcmp(name, "help") == 0)
+    {
+        adminReply(client, "sessions\nkill <id>\ncancel <id>\nratelimit <id> <KB/s|default>\ndrain\nmemory\nOK\n");
+    }
+    else
+    {
+        adminReply(client, "ERR unknown command %s, try help\n", name);
+    }
+}
+
+/* The id of a connected session, -1 after replying with the error */
+static int parseSessionId(ftpDataType *ftpData, adminClient_DataType *client, const char *argument)
+{
+    char *end;
+    long session;
+
+    if (argument == NULL)
+    {
+        adminReply(client, "ERR session id missing\n");
+        return -1;
+    }
+
+    session = strtol(argument, &end, 10);
+    if (*end != '\0' || session < 0 || session >= ftpData->ftpParameters.maxClients ||
+        isClientConnected(ftpData, (int) session) == 0 ||
+        ftpData->clients[session].closeTheClient == 1)
+    {
+        adminReply(client, "ERR no session %s\n", argument);
+        return -1;
+    }
+
+    return (int) session;
+}
+
+/* One line per session, the transfer values are read while the transfer threads run */
+static void listSessions(ftpDataType *ftpData, adminClient_DataType *client)
+{
+    int now = (int)time(NULL), sessions = 0;
+    unsigned long long int firstByte, elapsed;
+    long long int bytes, limit, transferSize;
+    double rate;
+    char transfer[CLIENT_COMMAND_STRING_SIZE + 64], size[32], limitText[32];
+    const char *ipAddress;
+
+    for (int i = 0; i < ftpData->ftpParameters.maxClients; i++)
+    {
+        clientDataType *session = &ftpData->clients[i];
+
+        if (isClientConnected(ftpData, i) == 0)
+            continue;
+
+        sessions++;
+        snprintf(transfer, sizeof(transfer), "none");
+
+        /* IPv4 clients of a dual stack listener are shown without the ::ffff: prefix */
+        ipAddress = session->clientIpAddress;
+        #ifdef IPV6_ENABLED
+        if (is_ipv4_mapped_ipv6(ipAddress))
+            ipAddress += strlen("::ffff:");
+        #endif
+
+        if (session->workerData.threadIsAlive == 1 && session->workerData.commandReceived == 1)
+        {
+            bytes = __atomic_load_n(&session->workerData.transferredBytes, __ATOMIC_RELAXED);
+            firstByte = __atomic_load_n(&session->workerData.phaseTime[METRICS_PHASE_FIRST_BYTE], __ATOMIC_RELAXED);
+            elapsed = firstByte != 0 ? HIST_Now() - firstByte : 0;
+            rate = elapsed > 0 ? bytes / 1024.0 / (elapsed / 1e9) : 0.0;
+
+            transferSize = __atomic_load_n(&session->workerData.transferSize, __ATOMIC_RELAXED);
+
+            size[0] = '\0';
+            if (transferSize > 0)
+                snprintf(size, sizeof(size), "/%lld", transferSize);
+
+            snprintf(transfer, sizeof(transfer), "\"%.*s\" bytes=%lld%s rate=%.1fKB/s",
+                     (int) strcspn(session->workerData.theCommandReceived, "\r\n"), session->workerData.theCommandReceived,
+                     bytes, size, rate);
+        }
+
+        limit = __atomic_load_n(&session->transferRateLimit, __ATOMIC_RELAXED);
+        if (limit < 0)
+            limit = (long long int) ftpData->ftpParameters.transferRateLimit * 1024;
+        if (limit > 0)
+            snprintf(limitText, sizeof(limitText), "%lldKB/s", limit / 1024);
+        else
+            snprintf(limitText, sizeof(limitText), "none");
+
+        adminReply(client, "%d user=%s ip=%s:%d cwd=%s connected=%ds idle=%ds command=\"%s\" transfer=%s limit=%s\n",
+                   i,
+                   session->login.userLoggedIn == 1 && session->login.name.text != NULL ? session->login.name.text : "-",
+                   ipAddress, session->clientPort,
+                   session->login.ftpPath.text != NULL ? session->login.ftpPath.text : "-",
+                   now - (int) session->connectionTimeStamp, now - (int) session->lastActivityTimeStamp,
+                   session->lastCommand, transfer, limitText);
+    }
+
+    adminReply(client, "OK %d sessions\n", sessions);
+}
+
+/* Closed by the control loop in this pass, as a drained session */
+static void killSession(ftpDataType *ftpData, adminClient_DataType *client, int session)
+{
+    closeSessionWithReply(ftpData, session, "421 Session closed by the administrator.\r\n");
+    LOGF_INFO("Admin: session %d from %s closed", session, ftpData->clients[session].clientIpAddress);
+    adminReply(client, "OK session %d closed\n", session);
+}
+
+/* Same as ABOR, the data thread is cancelled and the client told so */
+static void cancelTransfer(ftpDataType *ftpData, adminClient_DataType *client, int session)
+{
+    if (ftpData->clients[session].workerData.threadIsAlive != 1)
+    {
+        adminReply(client, "ERR session %d has no transfer running\n", session);
+        return;
+    }
+
+    handleThreadReuse(ftpData, session);
+
+    if (socketPrintf(ftpData, session, "s", "426 Transfer cancelled by the administrator.\r\n") <= 0)
+        ftpData->clients[session].closeTheClient = 1;
+
+    LOGF_INFO("Admin: transfer of session %d from %s cancelled", session, ftpData->clients[session].clientIpAddress);
+    adminReply(client, "OK transfer of session %d cancelled\n", session);
+}
+
+/* Applies to the running transfer too, see throttleTransfer */
+static void setRateLimit(ftpDataType *ftpData, adminClient_DataType *client, int session, const char *argument)
+{
+    long long int limit;
+    char *end;
+
+    if (argument == NULL)
+    {
+        adminReply(client, "ERR rate limit missing\n");
+        return;
+    }
+
+    if (strcmp(argument, "default") == 0)
+    {
+        limit = -1;
+    }
+    else
+    {
+        limit = strtoll(argument, &end, 10);
+        if (*end != '\0' || limit < 0)
+        {
+            adminReply(client, "ERR invalid rate limit %s\n", argument);
+            return;
+        }
+
+        limit *= 1024;
+    }
+
+    __atomic_store_n(&ftpData->clients[session].transferRateLimit, limit, __ATOMIC_RELAXED);
+    adminReply(client, "OK session %d rate limit %s\n", session, argument);
+}
+
+/* The same path as SIGTERM, the parent relays it to every process of the server */
+static void requestDrain(ftpDataType *ftpData, adminClient_DataType *client)
+{
+    if (ftpData->drainIsActive == 1)
+    {
+        adminReply(client, "OK drain already running\n");
+        return;
+    }
+
+    if (adminParentPid > 1 && getppid() == adminParentPid)
+        kill(adminParentPid, SIGTERM);
+    else
+        raise(SIGTERM);
+
+    adminReply(client, "OK drain started, %d sessions on this process\n", ftpData->connectedClients);
+}
+
+/* What the control loop used to print on every pass in debug builds */
+static void reportMemory(ftpDataType *ftpData, adminClient_DataType *client)
+{
+    adminReply(client, "used=%lld\n", DYNMEM_GetTotalMemory());
+
+    for (int i = 0; i < ftpData->ftpParameters.maxClients; i++)
+    {
+        if (ftpData->clients[i].memoryTable != NULL)
+            adminReply(client, "%d memoryTable=%s\n", i, ftpData->clients[i].memoryTable->theName);
+        if (ftpData->clients[i].workerData.memoryTable != NULL)
+            adminReply(client, "%d workerData.memoryTable=%s\n", i, ftpData->clients[i].workerData.memoryTable->theName);
+        if (ftpData->clients[i].workerData.directoryInfo.memoryTable != NULL)
+            adminReply(client, "%d workerData.directoryInfo.memoryTable=%s\n", i, ftpData->clients[i].workerData.directoryInfo.memoryTable->theName);
+    }
+
+    adminReply(client, "OK\n");
+}
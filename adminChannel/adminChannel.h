@@ -0,0 +1,44 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef ADMIN_CHANNEL_H
+#define ADMIN_CHANNEL_H
+
+#include "ftpData.h"
+
+/*
+ * Local admin commands on a unix socket, one command per line:
+ * sessions, kill <id>, cancel <id>, ratelimit <id> <KB/s|default>, drain,
+ * memory and help. Every reply ends with a line starting with OK or ERR.
+ * The socket is served by the control loop that owns the sessions, with
+ * several worker processes each one has its own socket.
+ */
+#define ADMIN_MAX_CLIENTS       4
+#define ADMIN_COMMAND_SIZE      256
+#define ADMIN_OUTPUT_LIMIT      (4 * 1024 * 1024)
+
+int adminChannelInit(ftpDataType *ftpData);
+void evaluateAdminChannel(ftpDataType *ftpData);
+
+#endif /* ADMIN_CHANNEL_H */
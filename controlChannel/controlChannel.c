@@ -22,6 +22,8 @@
  * THE SOFTWARE.
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_CONTROL
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -45,35 +47,187 @@
 #include "library/errorHandling.h"
 #include "library/daemon.h"
 #include "library/log.h"
+#include "library/sharedState.h"
+#include "library/metrics.h"
 
 #include "ftpServer.h"
 #include "ftpData.h"
 #include "ftpCommandsElaborate.h"
 #include "debugHelper.h"
 #include "controlChannel.h"
+#include "adminChannel/adminChannel.h"
 
 /* Private function definition */
 static int processCommand(int processingElement, ftpDataType *ftpData);
-static void memoryDebug(ftpDataType *ftpData);
 static int isTransferCommand(int processingElement, ftpDataType *ftpData);
+static void processReceivedBytes(ftpDataType *ftpData, int processingSock, int startIndex);
+static void processCompletedAuthJobs(ftpDataType *ftpData);
+static void checkPendingAuthTimeout(ftpDataType *ftpData, int processingSock);
+static int tlsHasPendingData(ftpDataType *ftpData, int processingSock);
+static void startServerUpgrade(ftpDataType *ftpData);
+static void checkServerUpgrade(ftpDataType *ftpData);
+static void startServerDrain(ftpDataType *ftpData);
+static void drainSessions(ftpDataType *ftpData);
+static void closeDrainedSession(ftpDataType *ftpData, int processingSock);
+static int isTransferRunning(ftpDataType *ftpData, int processingSock);
+static void checkIdleExit(ftpDataType *ftpData, int selectTimedOut);
+
+//command handler structure, the index is also the command latency histogram slot
+static const CommandMapEntry commandMap[] = {
+    {"USER", parseCommandUser},
+    {"PASS", parseCommandPass},
+    {"SITE", parseCommandSite},
+    {"AUTH TLS", parseCommandAuth},
+    {"PROT", parseCommandProt},
+    {"PBSZ", parseCommandPbsz},
+    {"CCC", parseCommandCcc},
+    {"PWD", parseCommandPwd},
+    {"XPWD", parseCommandPwd},
+    {"SYST", parseCommandSyst},
+    {"FEAT", parseCommandFeat},
+    {"TYPE I", parseCommandTypeI},
+    {"TYPE A", parseCommandTypeI},
+    {"STRU F", parseCommandStruF},
+    {"MODE S", parseCommandModeS},
+    {"EPSV", parseCommandEpsv},
+    {"PASV", parseCommandPasv},
+    {"PORT", parseCommandPort},
+    {"EPRT", parseCommandEprt},
+    {"LIST", parseCommandList},
+    {"STAT", parseCommandStat},
+    {"CDUP", parseCommandCdup},
+    {"XCUP", parseCommandCdup},
+    {"CWD ..", parseCommandCdup},
+    {"CWD", parseCommandCwd},
+    {"REST", parseCommandRest},
+    {"RETR", parseCommandRetr},
+    {"STOR", parseCommandStor},
+    {"MKD", parseCommandMkd},
+    {"XMKD", parseCommandMkd},
+    {"ABOR", parseCommandAbor},
+    {"DELE", parseCommandDele},
+    {"OPTS", parseCommandOpts},
+    {"MDTM", parseCommandMdtm},
+    {"NLST", parseCommandNlst},
+    {"QUIT", parseCommandQuit},
+    {"RMD", parseCommandRmd},
+    {"XRMD", parseCommandRmd},
+    {"RNFR", parseCommandRnfr},
+    {"RNTO", parseCommandRnto},
+    {"SIZE", parseCommandSize},
+    {"APPE", parseCommandAppe},
+    {"NOOP", parseCommandNoop},
+    {"ACCT", parseCommandAcct}
+};
+
+#define COMMAND_MAP_SIZE (sizeof(commandMap) / sizeof(CommandMapEntry))
+
+#ifdef OPENSSL_ENABLED
+static int continueTlsHandshake(ftpDataType *ftpData, int processingSock);
+static int applyTlsHandshakeStep(ftpDataType *ftpData, int processingSock, int returnCode, int sslError);
+static void submitTlsHandshake(ftpDataType *ftpData, int processingSock);
+static void processCompletedTlsHandshakes(ftpDataType *ftpData);
+static void readTlsCommands(ftpDataType *ftpData, int processingSock);
+static void setTlsWantsWrite(ftpDataType *ftpData, int processingSock, int wantsWrite);
+#endif
 
 void evaluateControlChannel(ftpDataType *ftpData)
 {
-    int returnCode = 0;
+    int returnCode = 0, selectTimedOut = 0;
 
     //Update watchdog timer
    	updateWatchDogTime((int)time(NULL));
 
-    //debug memory usage
-    memoryDebug(ftpData);
+    #ifdef OPENSSL_ENABLED
+    tlsLogSessionStatistics(time(NULL));
+    #endif
+
+    METRICS_PublishProcessGauges(time(NULL));
 
     /* waits for socket activity, if no activity then checks for client socket timeouts */
     if (selectWait(ftpData) == 0)
     {
+        selectTimedOut = 1;
         checkClientConnectionTimeout(ftpData);
-        flushLoginWrongTriesData(ftpData);
     }
 
+    /* commands queued behind others in this pass wait from here */
+    ftpData->loopWakeTime = HIST_Now();
+
+    checkIdleExit(ftpData, selectTimedOut);
+
+    /* SIGHUP, the configuration and the certificate are reloaded in the background */
+    if (signalTakeReloadRequest())
+    {
+        if (reloadConfiguration() == 0)
+            LOG_INFO("Configuration reload already running, request ignored");
+    }
+
+    applyReloadedConfiguration(ftpData);
+
+    /* SIGUSR2, a new binary takes over the listening sockets */
+    if (signalTakeUpgradeRequest())
+    {
+        startServerUpgrade(ftpData);
+    }
+
+    if (ftpData->upgradeReadyDescriptor != -1)
+    {
+        checkServerUpgrade(ftpData);
+    }
+
+    /* once the new binary serves this process only completes its sessions */
+    if (ftpData->listenSocketsReleased == 0 &&
+        SHST_UpgradeState() == SHST_UPGRADE_READY)
+    {
+        releaseListenSockets(ftpData, ftpData->workerProcessIndex != 0);
+        LOGF_INFO("Upgrade: stopped accepting, %d sessions left", ftpData->connectedClients);
+    }
+
+    /* SIGTERM, the sessions are closed as their transfers complete */
+    if (signalTakeDrainRequest())
+    {
+        startServerDrain(ftpData);
+    }
+
+    if (ftpData->drainIsActive == 1)
+    {
+        drainSessions(ftpData);
+    }
+
+    if (ftpData->listenSocketsReleased == 1 && ftpData->connectedClients == 0)
+    {
+        if (ftpData->drainIsActive == 1)
+        {
+            LOG_INFO("Drain: every session completed, the process exits");
+            deallocateMemory();
+            exit(SERVER_STOPPED_EXIT_STATUS);
+        }
+
+        LOG_INFO("Upgrade: every session completed, the process exits");
+        deallocateMemory();
+        exit(99);
+    }
+
+    /* Logins completed by the auth workers */
+    if (ftpData->authWorkersOn == 1 &&
+        FD_ISSET(WPOOL_NotifySocket(&ftpData->authWorkers), &ftpData->connectionData.rset))
+    {
+        processCompletedAuthJobs(ftpData);
+    }
+
+    #ifdef OPENSSL_ENABLED
+    /* Handshake steps completed by the TLS pool */
+    if (ftpData->tlsHandshakeWorkersOn == 1 &&
+        FD_ISSET(WPOOL_NotifySocket(&ftpData->tlsHandshakeWorkers), &ftpData->connectionData.rset))
+    {
+        processCompletedTlsHandshakes(ftpData);
+    }
+    #endif
+
+    /* Local admin commands, before the sessions so a killed one is closed in this pass */
+    evaluateAdminChannel(ftpData);
+
     /*Main loop handle client commands */
     for (int processingSock = 0; processingSock < ftpData->ftpParameters.maxClients; processingSock++)
     {
@@ -97,49 +251,57 @@ void evaluateControlChannel(ftpDataType *ftpData)
             continue;
         }
 
+        /* the socket is not watched until the login running on the auth workers completes */
+        if (ftpData->clients[processingSock].authIsPending == 1)
+        {
+            checkPendingAuthTimeout(ftpData, processingSock);
+            continue;
+        }
+
+    #ifdef OPENSSL_ENABLED
+        /* the socket is not watched while a handshake step runs on the TLS pool */
+        if (ftpData->clients[processingSock].tlsHandshakeIsPending == 1)
+            continue;
+
+        /* checked on every pass, a silent client must not keep the handshake open */
+        if (ftpData->clients[processingSock].tlsIsNegotiating == 1 &&
+            ((int)time(NULL) - ftpData->clients[processingSock].tlsNegotiatingTimeStart) > TLS_NEGOTIATING_TIMEOUT)
+        {
+            LOGF_AT(LOG_SUBSYSTEM_TLS, LOG_LEVEL_DEBUG, LOG_DEBUG_PREFIX, "TLS timeout closing the client time:%lld, start time: %lld..", (long long)time(NULL), (long long)ftpData->clients[processingSock].tlsNegotiatingTimeStart); 
+            closeClient(ftpData, processingSock);
+            continue;
+        }
+    #endif
+
         if (FD_ISSET(ftpData->clients[processingSock].socketDescriptor, &ftpData->connectionData.rset) || 
-            FD_ISSET(ftpData->clients[processingSock].socketDescriptor, &ftpData->connectionData.eset))
+            FD_ISSET(ftpData->clients[processingSock].socketDescriptor, &ftpData->connectionData.wset) ||
+            FD_ISSET(ftpData->clients[processingSock].socketDescriptor, &ftpData->connectionData.eset) ||
+            tlsHasPendingData(ftpData, processingSock))
         {
 
         #ifdef OPENSSL_ENABLED
             if (ftpData->clients[processingSock].tlsIsNegotiating == 1)
             {
-                returnCode = SSL_accept(ftpData->clients[processingSock].ssl);
-
-                if (returnCode <= 0)
+                if (ftpData->tlsHandshakeWorkersOn == 1)
                 {
-                    //my_printf("\nSSL NOT YET ACCEPTED: %d", returnCode);
-                    ftpData->clients[processingSock].tlsIsEnabled = 0;
-                    ftpData->clients[processingSock].tlsIsNegotiating = 1;
-
-                    if ( ((int)time(NULL) - ftpData->clients[processingSock].tlsNegotiatingTimeStart) > TLS_NEGOTIATING_TIMEOUT )
-                    {
-                        ftpData->clients[processingSock].closeTheClient = 1;
-                        LOGF("%sTLS timeout closing the client time:%lld, start time: %lld..", LOG_DEBUG_PREFIX, (int)time(NULL), ftpData->clients[processingSock].tlsNegotiatingTimeStart); 
-                        //my_printf("\nTLS timeout closing the client time:%lld, start time: %lld..", (int)time(NULL), ftpData->clients[processingSock].tlsNegotiatingTimeStart);
-                    }
-                }
-                else
-                {
-                    //my_printf("\nSSL ACCEPTED");
-                    ftpData->clients[processingSock].tlsIsEnabled = 1;
-                    ftpData->clients[processingSock].tlsIsNegotiating = 0;
+                    submitTlsHandshake(ftpData, processingSock);
+                    continue;
                 }
 
-                continue;
+                /* records sent right after the handshake are read in the same pass */
+                if (continueTlsHandshake(ftpData, processingSock) != 1 ||
+                    SSL_pending(ftpData->clients[processingSock].ssl) <= 0)
+                    continue;
             }
-        #endif
 
             if (ftpData->clients[processingSock].tlsIsEnabled == 1)
             {
-                #ifdef OPENSSL_ENABLED
-                ftpData->clients[processingSock].bufferIndex = SSL_read(ftpData->clients[processingSock].ssl, ftpData->clients[processingSock].buffer, CLIENT_BUFFER_STRING_SIZE);
-                #endif
-            }
-            else
-            {
-                ftpData->clients[processingSock].bufferIndex = read(ftpData->clients[processingSock].socketDescriptor, ftpData->clients[processingSock].buffer, CLIENT_BUFFER_STRING_SIZE);
+                readTlsCommands(ftpData, processingSock);
+                continue;
             }
+        #endif
+
+            ftpData->clients[processingSock].bufferIndex = read(ftpData->clients[processingSock].socketDescriptor, ftpData->clients[processingSock].buffer, CLIENT_BUFFER_STRING_SIZE);
 
         //The client is not connected anymore
         if ((ftpData->clients[processingSock].bufferIndex) == 0)
@@ -151,89 +313,459 @@ void evaluateControlChannel(ftpDataType *ftpData)
         //Some commands has been received
         if (ftpData->clients[processingSock].bufferIndex > 0)
         {
-            int i = 0;
-            int commandProcessStatus = 0;
-            for (i = 0; i < ftpData->clients[processingSock].bufferIndex; i++)
+            processReceivedBytes(ftpData, processingSock, 0);
+        }
+    }
+    }
+
+    /* Replies a full socket could not take */
+    flushControlOutput(ftpData);
+}
+
+/* Private static functions */
+
+/* Decrypted bytes buffered inside OpenSSL don't make the socket readable */
+static int tlsHasPendingData(ftpDataType *ftpData, int processingSock)
+{
+#ifdef OPENSSL_ENABLED
+    if (ftpData->clients[processingSock].tlsIsEnabled == 1 &&
+        SSL_pending(ftpData->clients[processingSock].ssl) > 0)
+        return 1;
+#endif
+
+    return 0;
+}
+
+#ifdef OPENSSL_ENABLED
+static void setTlsWantsWrite(ftpDataType *ftpData, int processingSock, int wantsWrite)
+{
+    if (ftpData->clients[processingSock].tlsWantsWrite != wantsWrite)
+    {
+        ftpData->clients[processingSock].tlsWantsWrite = wantsWrite;
+        fdSetWriteInterest(ftpData, processingSock, wantsWrite);
+    }
+}
+
+/* Returns 1 once the handshake is complete, 0 while in progress, -1 on failure */
+static int continueTlsHandshake(ftpDataType *ftpData, int processingSock)
+{
+    int returnCode = SSL_accept(ftpData->clients[processingSock].ssl);
+
+    return applyTlsHandshakeStep(ftpData, processingSock, returnCode,
+                                 returnCode == 1 ? SSL_ERROR_NONE : SSL_get_error(ftpData->clients[processingSock].ssl, returnCode));
+}
+
+static int applyTlsHandshakeStep(ftpDataType *ftpData, int processingSock, int returnCode, int sslError)
+{
+    if (returnCode == 1)
+    {
+        setTlsWantsWrite(ftpData, processingSock, 0);
+        ftpData->clients[processingSock].tlsIsEnabled = 1;
+        ftpData->clients[processingSock].tlsIsNegotiating = 0;
+        tlsRecordHandshake(ftpData->clients[processingSock].ssl, 0);
+
+        /* implicit FTPS greets the client over the new TLS session */
+        if (ftpData->clients[processingSock].implicitTls == 1 &&
+            socketPrintf(ftpData, processingSock, "s", ftpData->welcomeMessage) <= 0)
+        {
+            ftpData->clients[processingSock].closeTheClient = 1;
+            return -1;
+        }
+
+        return 1;
+    }
+
+    switch (sslError)
+    {
+        case SSL_ERROR_WANT_READ:
+            setTlsWantsWrite(ftpData, processingSock, 0);
+            return 0;
+
+        case SSL_ERROR_WANT_WRITE:
+            setTlsWantsWrite(ftpData, processingSock, 1);
+            return 0;
+
+        default:
+            LOG_AT(LOG_SUBSYSTEM_TLS, LOG_LEVEL_DEBUG, LOG_DEBUG_PREFIX, "Control channel TLS handshake failed");
+            METRICS_Add(METRICS_TLS_HANDSHAKES_FAILED, 1);
+            setTlsWantsWrite(ftpData, processingSock, 0);
+            ftpData->clients[processingSock].closeTheClient = 1;
+            return -1;
+    }
+}
+
+/* The queue holds maxClients jobs and a client has at most one step in flight, so it can't be full */
+static void submitTlsHandshake(ftpDataType *ftpData, int processingSock)
+{
+    tlsHandshakeJob_DataType *job = &ftpData->tlsHandshakeJobs[processingSock];
+
+    if (ftpData->clients[processingSock].tlsHandshakeStartTime == 0)
+        ftpData->clients[processingSock].tlsHandshakeStartTime = tlsMonotonicMicroseconds();
+
+    /* the write interest is cleared with the socket and restored by the step result */
+    fdRemove(ftpData, processingSock);
+    ftpData->clients[processingSock].tlsWantsWrite = 0;
+    ftpData->clients[processingSock].tlsHandshakeIsPending = 1;
+
+    job->clientId = processingSock;
+    job->ssl = ftpData->clients[processingSock].ssl;
+    job->handshakeStartTime = ftpData->clients[processingSock].tlsHandshakeStartTime;
+    tlsQueueHandshakeJob(job);
+    WPOOL_Submit(&ftpData->tlsHandshakeWorkers, job);
+}
+
+static void processCompletedTlsHandshakes(ftpDataType *ftpData)
+{
+    tlsHandshakeJob_DataType *job;
+
+    while ((job = WPOOL_GetCompleted(&ftpData->tlsHandshakeWorkers)) != NULL)
+    {
+        int clientId = job->clientId;
+
+        ftpData->clients[clientId].tlsHandshakeIsPending = 0;
+
+        /* closed while the step was running */
+        if (ftpData->clients[clientId].closeTheClient == 1)
+        {
+            closeClient(ftpData, clientId);
+            continue;
+        }
+
+        fdAdd(ftpData, clientId);
+
+        switch (applyTlsHandshakeStep(ftpData, clientId, job->returnCode, job->sslError))
+        {
+            case 1:
+                tlsRecordOffloadedHandshake(job);
+                ftpData->clients[clientId].tlsHandshakeStartTime = 0;
+
+                if (ftpData->clients[clientId].closeTheClient == 0 &&
+                    SSL_pending(ftpData->clients[clientId].ssl) > 0)
+                    readTlsCommands(ftpData, clientId);
+                break;
+
+            case -1:
+                ftpData->clients[clientId].tlsHandshakeStartTime = 0;
+                break;
+        }
+    }
+}
+
+/* Reads records until OpenSSL has nothing buffered, pipelined commands are all processed */
+static void readTlsCommands(ftpDataType *ftpData, int processingSock)
+{
+    do
+    {
+        ftpData->clients[processingSock].bufferIndex = SSL_read(ftpData->clients[processingSock].ssl, ftpData->clients[processingSock].buffer, CLIENT_BUFFER_STRING_SIZE);
+
+        if (ftpData->clients[processingSock].bufferIndex > 0)
+        {
+            setTlsWantsWrite(ftpData, processingSock, 0);
+            processReceivedBytes(ftpData, processingSock, 0);
+
+            /* the rest stays buffered in OpenSSL until the login completes */
+            if (ftpData->clients[processingSock].authIsPending == 1 ||
+                ftpData->clients[processingSock].closeTheClient == 1 ||
+                ftpData->clients[processingSock].tlsIsEnabled != 1)
+                return;
+
+            continue;
+        }
+
+        switch (SSL_get_error(ftpData->clients[processingSock].ssl, ftpData->clients[processingSock].bufferIndex))
+        {
+            case SSL_ERROR_WANT_READ:
+                setTlsWantsWrite(ftpData, processingSock, 0);
+                return;
+
+            case SSL_ERROR_WANT_WRITE:
+                setTlsWantsWrite(ftpData, processingSock, 1);
+                return;
+
+            default:
+                /* close_notify, reset or protocol error */
+                setTlsWantsWrite(ftpData, processingSock, 0);
+                closeClient(ftpData, processingSock);
+                return;
+        }
+    } while (SSL_pending(ftpData->clients[processingSock].ssl) > 0);
+}
+#endif
+
+static void processReceivedBytes(ftpDataType *ftpData, int processingSock, int startIndex)
+{
+    int i = 0;
+    int commandProcessStatus = 0;
+    for (i = startIndex; i < ftpData->clients[processingSock].bufferIndex; i++)
+    {
+        if (ftpData->clients[processingSock].commandIndex < CLIENT_COMMAND_STRING_SIZE)
+        {
+            if (ftpData->clients[processingSock].buffer[i] != '\r' && ftpData->clients[processingSock].buffer[i] != '\n')
             {
-                if (ftpData->clients[processingSock].commandIndex < CLIENT_COMMAND_STRING_SIZE)
+                ftpData->clients[processingSock].theCommandReceived[ftpData->clients[processingSock].commandIndex++] = ftpData->clients[processingSock].buffer[i];
+            }
+
+            if (ftpData->clients[processingSock].buffer[i] == '\n') 
                 {
-                    if (ftpData->clients[processingSock].buffer[i] != '\r' && ftpData->clients[processingSock].buffer[i] != '\n')
+                    ftpData->clients[processingSock].socketCommandReceived = 1;
+                    //my_printf("\n Processing the command: %s", ftpData->clients[processingSock].theCommandReceived);
+                    commandProcessStatus = processCommand(processingSock, ftpData);
+                    //Echo unrecognized commands
+                    if (commandProcessStatus == FTP_COMMAND_NOT_RECONIZED) 
                     {
-                        ftpData->clients[processingSock].theCommandReceived[ftpData->clients[processingSock].commandIndex++] = ftpData->clients[processingSock].buffer[i];
-                    }
-
-                    if (ftpData->clients[processingSock].buffer[i] == '\n') 
+                        int returnCode = 0;
+                        returnCode = socketPrintf(ftpData, processingSock, "s", "500 Unknown command\r\n");
+                        if (returnCode < 0)
                         {
-                            ftpData->clients[processingSock].socketCommandReceived = 1;
-                            //my_printf("\n Processing the command: %s", ftpData->clients[processingSock].theCommandReceived);
-                            commandProcessStatus = processCommand(processingSock, ftpData);
-                            //Echo unrecognized commands
-                            if (commandProcessStatus == FTP_COMMAND_NOT_RECONIZED) 
-                            {
-                                int returnCode = 0;
-                                returnCode = socketPrintf(ftpData, processingSock, "s", "500 Unknown command\r\n");
-                                if (returnCode < 0)
-                                {
-                                    ftpData->clients[processingSock].closeTheClient = 1;
-                                    LOG_ERROR("socketPrintf"); 
-                                }
-                                my_printf("\n COMMAND NOT SUPPORTED ********* %s", ftpData->clients[processingSock].buffer);
-                                LOGF("%sCommand not supported: %s", LOG_DEBUG_PREFIX, ftpData->clients[processingSock].buffer);
-                            }
-                            else if (commandProcessStatus == FTP_COMMAND_PROCESSED)
-                            {
-                                ftpData->clients[processingSock].lastActivityTimeStamp = (int)time(NULL);
-                            }
-                            else if (commandProcessStatus == FTP_COMMAND_PROCESSED_WRITE_ERROR)
-                            {
-                                ftpData->clients[processingSock].closeTheClient = 1;
-                                LOG_ERROR("ftp command processed error"); 
-                                my_printf("\n Write error WARNING!");
-                            }
+                            ftpData->clients[processingSock].closeTheClient = 1;
+                            LOG_ERROR("socketPrintf"); 
                         }
-                }
-                else
-                {
-                    //Command overflow can't be processed
-                    int returnCode;
-                    ftpData->clients[processingSock].commandIndex = 0;
-                    memset(ftpData->clients[processingSock].theCommandReceived, 0, CLIENT_COMMAND_STRING_SIZE+1);
-                    returnCode = socketPrintf(ftpData, processingSock, "s", "500 Unknown command\r\n");
-                    if (returnCode <= 0) 
+                        my_printf("\n COMMAND NOT SUPPORTED ********* %s", ftpData->clients[processingSock].buffer);
+                        LOGF_DEBUG("Command not supported: %s", ftpData->clients[processingSock].buffer);
+                    }
+                    else if (commandProcessStatus == FTP_COMMAND_PROCESSED)
+                    {
+                        ftpData->clients[processingSock].lastActivityTimeStamp = (int)time(NULL);
+                    }
+                    else if (commandProcessStatus == FTP_COMMAND_PROCESSED_WRITE_ERROR)
                     {
                         ftpData->clients[processingSock].closeTheClient = 1;
-                        LOG_ERROR("socketPrintf"); 
+                        LOG_ERROR("ftp command processed error"); 
+                        my_printf("\n Write error WARNING!");
+                    }
+
+                    /* pipelined commands wait for the login result */
+                    if (ftpData->clients[processingSock].authIsPending == 1)
+                    {
+                        ftpData->clients[processingSock].bufferOffset = i + 1;
+                        return;
                     }
-                    my_printf("\n Command too long closing the client.");
-                    break;
                 }
+        }
+        else
+        {
+            //Command overflow can't be processed
+            int returnCode;
+            ftpData->clients[processingSock].commandIndex = 0;
+            memset(ftpData->clients[processingSock].theCommandReceived, 0, CLIENT_COMMAND_STRING_SIZE+1);
+            returnCode = socketPrintf(ftpData, processingSock, "s", "500 Unknown command\r\n");
+            if (returnCode <= 0) 
+            {
+                ftpData->clients[processingSock].closeTheClient = 1;
+                LOG_ERROR("socketPrintf"); 
             }
-            memset(ftpData->clients[processingSock].buffer, 0, CLIENT_BUFFER_STRING_SIZE+1);
+            my_printf("\n Command too long closing the client.");
+            break;
         }
     }
+
+    ftpData->clients[processingSock].bufferOffset = 0;
+    memset(ftpData->clients[processingSock].buffer, 0, CLIENT_BUFFER_STRING_SIZE+1);
+}
+
+static void processCompletedAuthJobs(ftpDataType *ftpData)
+{
+    authJob_DataType *job;
+
+    while ((job = WPOOL_GetCompleted(&ftpData->authWorkers)) != NULL)
+    {
+        int clientId = job->clientId;
+
+        /* results for clients that timed out or disconnected meanwhile are dropped */
+        if (ftpData->clients[clientId].authIsPending == 1 &&
+            ftpData->clients[clientId].authSerial == job->serial)
+        {
+            ftpData->clients[clientId].authIsPending = 0;
+
+            if (completeCommandPass(ftpData, clientId, job) == FTP_COMMAND_PROCESSED_WRITE_ERROR)
+            {
+                ftpData->clients[clientId].closeTheClient = 1;
+                LOG_ERROR("ftp command processed error");
+            }
+
+            fdAdd(ftpData, clientId);
+            ftpData->clients[clientId].lastActivityTimeStamp = (int)time(NULL);
+
+            if (ftpData->clients[clientId].closeTheClient == 0)
+            {
+                processReceivedBytes(ftpData, clientId, ftpData->clients[clientId].bufferOffset);
+            }
+        }
+
+        memset(job->password, 0, sizeof(job->password));
+        DYNMEM_free(job, &ftpData->authJobsMemoryTable);
     }
 }
 
-/* Private static functions */
-static void memoryDebug(ftpDataType *ftpData)
+static void checkPendingAuthTimeout(ftpDataType *ftpData, int processingSock)
+{
+    int returnCode;
+
+    if (((int)time(NULL) - ftpData->clients[processingSock].authStartTimeStamp) <= ftpData->ftpParameters.authTimeout)
+        return;
+
+    cancelPendingAuth(ftpData, processingSock);
+
+    LOGF_AT(LOG_SUBSYSTEM_AUTH, LOG_LEVEL_ERROR, LOG_ERROR_PREFIX, "Authentication timeout for user %s from ip %s", ftpData->clients[processingSock].login.name.text, ftpData->clients[processingSock].clientIpAddress);
+
+    returnCode = socketPrintf(ftpData, processingSock, "s", "430 Authentication timeout\r\n");
+    if (returnCode <= 0) 
+    {
+        ftpData->clients[processingSock].closeTheClient = 1;
+        LOG_ERROR("socketPrintf"); 
+    }
+
+    fdAdd(ftpData, processingSock);
+}
+
+/* Stops accepting, the sessions left are closed by drainSessions */
+static void startServerDrain(ftpDataType *ftpData)
+{
+    if (ftpData->drainIsActive == 1)
+        return;
+
+    ftpData->drainIsActive = 1;
+    ftpData->drainDeadline = 0;
+
+    if (ftpData->ftpParameters.drainTimeout > 0)
+        ftpData->drainDeadline = (int)time(NULL) + ftpData->ftpParameters.drainTimeout;
+
+    /* after an upgrade the sockets are already released */
+    if (ftpData->listenSocketsReleased == 0)
+        releaseListenSockets(ftpData, 1);
+
+    LOGF_INFO("Drain: stopped accepting, %d sessions left, deadline %d seconds", ftpData->connectedClients, ftpData->ftpParameters.drainTimeout);
+}
+
+/*
+ * Called on every pass while draining: idle sessions are closed first, a session
+ * with a transfer running is closed once its transfer completes. At the deadline
+ * every session left is closed, the running transfers included.
+ */
+static void drainSessions(ftpDataType *ftpData)
+{
+    int deadlineReached = ftpData->drainDeadline != 0 && (int)time(NULL) >= ftpData->drainDeadline;
+
+    if (deadlineReached == 1 && ftpData->connectedClients > 0)
+        LOGF_INFO("Drain: deadline reached, closing %d sessions", ftpData->connectedClients);
+
+    for (int processingSock = 0; processingSock < ftpData->ftpParameters.maxClients; processingSock++)
+    {
+        if (isClientConnected(ftpData, processingSock) == 0 ||
+            ftpData->clients[processingSock].closeTheClient == 1)
+            continue;
+
+        if (deadlineReached == 0 &&
+            (isTransferRunning(ftpData, processingSock) == 1 ||
+             ftpData->clients[processingSock].authIsPending == 1 ||
+             ftpData->clients[processingSock].tlsHandshakeIsPending == 1))
+            continue;
+
+        closeDrainedSession(ftpData, processingSock);
+    }
+
+    if (deadlineReached == 1)
+    {
+        LOG_INFO("Drain: deadline reached, the process exits");
+        deallocateMemory();
+        exit(SERVER_STOPPED_EXIT_STATUS);
+    }
+}
+
+static void closeDrainedSession(ftpDataType *ftpData, int processingSock)
+{
+    closeSessionWithReply(ftpData, processingSock, "421 Server shutting down, closing control connection.\r\n");
+}
+
+/* The data thread has a RETR, STOR, APPE or list command to complete */
+static int isTransferRunning(ftpDataType *ftpData, int processingSock)
 {
-	my_printf("\nUsed memory : %lld", DYNMEM_GetTotalMemory());
-	for (int memCount = 0; memCount < ftpData->ftpParameters.maxClients; memCount++)
-	{
-		if (ftpData->clients[memCount].memoryTable != NULL)
-		{
-			my_printf("\nftpData->clients[%d].memoryTable = %s", memCount, ftpData->clients[memCount].memoryTable->theName);
-		}
-		if (ftpData->clients[memCount].workerData.memoryTable != NULL)
-		{
-			my_printf("\nftpData->clients[%d].workerData.memoryTable = %s", memCount, ftpData->clients[memCount].workerData.memoryTable->theName);
-		}
-
-		if (ftpData->clients[memCount].workerData.directoryInfo.memoryTable != NULL)
-		{
-			my_printf("\nftpData->clients[%d].workerData.directoryInfo.memoryTable = %s", memCount, ftpData->clients[memCount].workerData.directoryInfo.memoryTable->theName);
-		}
-	}
+    return ftpData->clients[processingSock].workerData.threadIsAlive == 1 &&
+           ftpData->clients[processingSock].workerData.commandReceived == 1;
+}
+
+/*
+ * A socket activated server exits once no session has been connected for
+ * IDLE_EXIT_TIMEOUT seconds, systemd keeps the listening sockets and starts it
+ * again on the next connection. It only exits after a select timeout, so no
+ * connection is waiting in the listen queue.
+ */
+static void checkIdleExit(ftpDataType *ftpData, int selectTimedOut)
+{
+    int now;
+
+    if (ftpData->ftpParameters.idleExitTimeout <= 0 ||
+        ftpData->listenSocketsReleased == 1 ||
+        isSocketActivated() == 0)
+        return;
+
+    now = (int)time(NULL);
+
+    /* the sessions of every worker process count */
+    if (SHST_ConnectedClients() > 0)
+    {
+        ftpData->idleSince = now;
+        return;
+    }
+
+    if (selectTimedOut == 0 || now - ftpData->idleSince < ftpData->ftpParameters.idleExitTimeout)
+        return;
+
+    LOGF_INFO("Idle for %d seconds, the socket activated server exits", now - ftpData->idleSince);
+    deallocateMemory();
+    exit(SERVER_STOPPED_EXIT_STATUS);
+}
+
+/* Worker 0 starts the new binary, the other workers follow the shared upgrade state */
+static void startServerUpgrade(ftpDataType *ftpData)
+{
+    if (ftpData->workerProcessIndex != 0 ||
+        ftpData->upgradeReadyDescriptor != -1 ||
+        ftpData->listenSocketsReleased == 1)
+        return;
+
+    ftpData->upgradeReadyDescriptor = startUpgradedProcess(ftpData->connectionData.theMainSocket, ftpData->connectionData.theImplicitTlsSocket);
+    if (ftpData->upgradeReadyDescriptor == -1)
+    {
+        LOG_ERROR("Upgrade: the new process can't be started");
+        return;
+    }
+
+    ftpData->upgradeStartTime = (int)time(NULL);
+    SHST_SetUpgradeState(SHST_UPGRADE_RUNNING);
+    fdAddServiceSocket(ftpData, ftpData->upgradeReadyDescriptor);
+    LOG_INFO("Upgrade: new process started");
+}
+
+static void checkServerUpgrade(ftpDataType *ftpData)
+{
+    char readyByte;
+
+    if (FD_ISSET(ftpData->upgradeReadyDescriptor, &ftpData->connectionData.rset))
+    {
+        if (read(ftpData->upgradeReadyDescriptor, &readyByte, 1) == 1)
+        {
+            SHST_SetUpgradeState(SHST_UPGRADE_READY);
+        }
+        else
+        {
+            LOG_ERROR("Upgrade: the new process exited before serving");
+            SHST_SetUpgradeState(SHST_UPGRADE_NONE);
+        }
+    }
+    else if ((int)time(NULL) - ftpData->upgradeStartTime > UPGRADE_READY_TIMEOUT)
+    {
+        LOG_ERROR("Upgrade: the new process is not serving, the upgrade is abandoned");
+        SHST_SetUpgradeState(SHST_UPGRADE_NONE);
+    }
+    else
+    {
+        return;
+    }
+
+    fdRemoveServiceSocket(ftpData, ftpData->upgradeReadyDescriptor);
+    close(ftpData->upgradeReadyDescriptor);
+    ftpData->upgradeReadyDescriptor = -1;
 }
 
 static int isTransferCommand(int processingElement, ftpDataType *ftpData)
@@ -252,64 +784,36 @@ static int isTransferCommand(int processingElement, ftpDataType *ftpData)
     return 0;
 }
 
-static int processCommand(int processingElement, ftpDataType *ftpData)
+/* Names of the dispatch table, used to label the command latency histograms */
+int controlChannelCommandNames(const char **names, int maxNames)
 {
-    //command handler structure
-     static CommandMapEntry commandMap[] = {
-        {"USER", parseCommandUser},
-        {"PASS", parseCommandPass},
-        {"SITE", parseCommandSite},
-        {"AUTH TLS", parseCommandAuth},
-        {"PROT", parseCommandProt},
-        {"PBSZ", parseCommandPbsz},
-        {"CCC", parseCommandCcc},
-        {"PWD", parseCommandPwd},
-        {"XPWD", parseCommandPwd},
-        {"SYST", parseCommandSyst},
-        {"FEAT", parseCommandFeat},
-        {"TYPE I", parseCommandTypeI},
-        {"TYPE A", parseCommandTypeI},
-        {"STRU F", parseCommandStruF},
-        {"MODE S", parseCommandModeS},
-        {"EPSV", parseCommandEpsv},
-        {"PASV", parseCommandPasv},
-        {"PORT", parseCommandPort},
-        {"EPRT", parseCommandEprt},
-        {"LIST", parseCommandList},
-        {"STAT", parseCommandStat},
-        {"CDUP", parseCommandCdup},
-        {"XCUP", parseCommandCdup},
-        {"CWD ..", parseCommandCdup},
-        {"CWD", parseCommandCwd},
-        {"REST", parseCommandRest},
-        {"RETR", parseCommandRetr},
-        {"STOR", parseCommandStor},
-        {"MKD", parseCommandMkd},
-        {"XMKD", parseCommandMkd},
-        {"ABOR", parseCommandAbor},
-        {"DELE", parseCommandDele},
-        {"OPTS", parseCommandOpts},
-        {"MDTM", parseCommandMdtm},
-        {"NLST", parseCommandNlst},
-        {"QUIT", parseCommandQuit},
-        {"RMD", parseCommandRmd},
-        {"XRMD", parseCommandRmd},
-        {"RNFR", parseCommandRnfr},
-        {"RNTO", parseCommandRnto},
-        {"SIZE", parseCommandSize},
-        {"APPE", parseCommandAppe},
-        {"NOOP", parseCommandNoop},
-        {"ACCT", parseCommandAcct}
-    };
-
-    #define COMMAND_MAP_SIZE (sizeof(commandMap) / sizeof(CommandMapEntry))
+    int count = 0;
+
+    for (int i = 0; i < COMMAND_MAP_SIZE && count < maxNames; i++)
+        names[count++] = commandMap[i].command;
 
+    return count;
+}
+
+static int processCommand(int processingElement, ftpDataType *ftpData)
+{
     int toReturn = 0;
     int commandIndex = -1;
+    unsigned long long int handlerStart;
 
     //printTimeStamp();
     my_printf("\nCommand received from (%d): %s", processingElement, ftpData->clients[processingElement].theCommandReceived);
 
+    /* while draining only a session with a transfer running is still served */
+    if (ftpData->drainIsActive == 1 &&
+        isTransferRunning(ftpData, processingElement) == 0)
+    {
+        closeDrainedSession(ftpData, processingElement);
+        ftpData->clients[processingElement].commandIndex = 0;
+        memset(ftpData->clients[processingElement].theCommandReceived, 0, CLIENT_COMMAND_STRING_SIZE+1);
+        return FTP_COMMAND_PROCESSED;
+    }
+
     for (int i = 0; i < COMMAND_MAP_SIZE; ++i)
     {
         if (IS_CMD(ftpData->clients[processingElement].theCommandReceived, (char *)commandMap[i].command))
@@ -352,7 +856,16 @@ static int processCommand(int processingElement, ftpDataType *ftpData)
     }
 
     my_printf("\n%s COMMAND RECEIVED", commandMap[commandIndex].command);
+
+    /* shown on the admin socket, the password is left out */
+    if (IS_CMD(ftpData->clients[processingElement].theCommandReceived, "PASS"))
+        snprintf(ftpData->clients[processingElement].lastCommand, CLIENT_COMMAND_STRING_SIZE+1, "PASS");
+    else
+        snprintf(ftpData->clients[processingElement].lastCommand, CLIENT_COMMAND_STRING_SIZE+1, "%s", ftpData->clients[processingElement].theCommandReceived);
+
+    handlerStart = HIST_Now();
     toReturn = ((int (*)(ftpDataType *, int))commandMap[commandIndex].handler)(ftpData, processingElement);
+    METRICS_RecordCommand(commandIndex, handlerStart - ftpData->loopWakeTime, HIST_Now() - handlerStart);
 
     ftpData->clients[processingElement].commandIndex = 0;
     memset(ftpData->clients[processingElement].theCommandReceived, 0, CLIENT_COMMAND_STRING_SIZE+1);
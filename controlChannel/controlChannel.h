@@ -11,6 +11,7 @@ typedef struct {
 } CommandMapEntry;
 
 void evaluateControlChannel(ftpDataType *ftpData);
+int controlChannelCommandNames(const char **names, int maxNames);
 
 #endif /* DATA_CHANNEL_H */
 
@@ -23,6 +23,8 @@
  * THE SOFTWARE.
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_DATA
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -46,6 +48,9 @@
 #include "library/errorHandling.h"
 #include "library/daemon.h"
 #include "library/log.h"
+#include "library/cpuAffinity.h"
+#include "library/metrics.h"
+#include "library/serverHelpers.h"
 
 #include "ftpServer.h"
 #include "ftpData.h"
@@ -57,6 +62,101 @@ static int acceptConnection(cleanUpWorkerArgs *args);
 static int processStorAppe(cleanUpWorkerArgs *args);
 static int processListNlst(cleanUpWorkerArgs *args);
 static int processRetr(cleanUpWorkerArgs *args);
+static void formatTransferPhases(workerDataType *worker, char *phases, int phasesSize, char *offsets, int offsetsSize);
+static void traceTransfer(ftpDataType *ftpData, int theSocketId);
+
+/* Builds the per phase text of a transfer trace */
+static void formatTransferPhases(workerDataType *worker, char *phases, int phasesSize, char *offsets, int offsetsSize)
+{
+    unsigned long long int start = worker->phaseTime[METRICS_PHASE_START], previous = start, interval;
+    int phase, phasesLength = 0, offsetsLength = 0;
+
+    phases[0] = '\0';
+    offsets[0] = '\0';
+    for (phase = METRICS_PHASE_START + 1; phase < METRICS_PHASE_COUNT; phase++)
+    {
+        if (worker->phaseTime[phase] == 0)
+            continue;
+
+        interval = worker->phaseTime[phase] - previous;
+        previous = worker->phaseTime[phase];
+
+        if (phasesLength < phasesSize)
+            phasesLength += snprintf(phases + phasesLength, phasesSize - phasesLength, " %s=%lluus", METRICS_TransferPhaseName(phase), interval / 1000);
+        if (offsetsLength < offsetsSize)
+            offsetsLength += snprintf(offsets + offsetsLength, offsetsSize - offsetsLength, " %s at %.3fms (+%.3fms)",
+                                      METRICS_TransferPhaseName(phase), (previous - start) / 1e6, interval / 1e6);
+    }
+}
+
+/* Records the phase intervals of the transfer, a slow transfer is traced in detail */
+static void traceTransfer(ftpDataType *ftpData, int theSocketId)
+{
+    static time_t lastSlowTrace = 0;
+    static int slowNotTraced = 0;
+    workerDataType *worker = &ftpData->clients[theSocketId].workerData;
+    unsigned long long int start = worker->phaseTime[METRICS_PHASE_START], previous = start, duration, transferTime;
+    char phases[384], offsets[384];
+    int phase, commandLength, notTraced, isComplete;
+    long long int threshold;
+    time_t now, last;
+
+    if (start == 0)
+        return;
+
+    for (phase = METRICS_PHASE_START + 1; phase < METRICS_PHASE_COUNT; phase++)
+    {
+        if (worker->phaseTime[phase] == 0)
+            continue;
+
+        METRICS_RecordTransferPhase(phase, worker->phaseTime[phase] - previous);
+        previous = worker->phaseTime[phase];
+    }
+
+    /* a PASV the client never used, the histograms are enough */
+    if (worker->phaseTime[METRICS_PHASE_COMMAND] == 0)
+        return;
+
+    /* a transfer cancelled or failed before its last byte lasts until now */
+    isComplete = worker->phaseTime[METRICS_PHASE_LAST_BYTE] != 0;
+    duration = (isComplete ? previous : HIST_Now()) - start;
+
+    commandLength = (int) strcspn(worker->theCommandReceived, "\r\n");
+    if (LOG_IS_ENABLED(LOG_LEVEL_DEBUG, LOG_SUBSYSTEM))
+    {
+        formatTransferPhases(worker, phases, sizeof(phases), offsets, sizeof(offsets));
+        LOGF_DEBUG("Transfer %.*s from %s, %lld bytes in %llu us%s:%s", commandLength, worker->theCommandReceived,
+                   ftpData->clients[theSocketId].clientIpAddress, worker->transferredBytes, duration / 1000,
+                   isComplete ? "" : " (interrupted)", phases);
+    }
+
+    threshold = ftpData->ftpParameters.transferTraceThreshold;
+    if (threshold <= 0 || duration < (unsigned long long int) threshold * 1000000ULL)
+        return;
+
+    /* sampled, a burst of slow transfers gives one detailed trace per second */
+    now = time(NULL);
+    last = __atomic_load_n(&lastSlowTrace, __ATOMIC_RELAXED);
+    if (now == last || !__atomic_compare_exchange_n(&lastSlowTrace, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&slowNotTraced, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    notTraced = __atomic_exchange_n(&slowNotTraced, 0, __ATOMIC_RELAXED);
+
+    transferTime = 0;
+    if (worker->phaseTime[METRICS_PHASE_FIRST_BYTE] != 0)
+        transferTime = start + duration - worker->phaseTime[METRICS_PHASE_FIRST_BYTE];
+
+    formatTransferPhases(worker, phases, sizeof(phases), offsets, sizeof(offsets));
+    LOGF_INFO("Slow transfer %.*s, user %s from %s, %s%s data port %d after %d port tries, %lld bytes in %.3fms%s, %.1f KB/s after the first byte:%s; %d slow transfers not traced since the last trace",
+              commandLength, worker->theCommandReceived,
+              ftpData->clients[theSocketId].login.name.text != NULL ? ftpData->clients[theSocketId].login.name.text : "-",
+              ftpData->clients[theSocketId].clientIpAddress,
+              worker->passiveModeOn == 1 ? "passive" : "active", ftpData->clients[theSocketId].dataChannelIsTls == 1 ? " TLS" : "",
+              worker->connectionPort, worker->portSearchTries, worker->transferredBytes, duration / 1e6, isComplete ? "" : " (interrupted)",
+              transferTime > 0 ? worker->transferredBytes / 1024.0 / (transferTime / 1e9) : 0.0, offsets, notTraced);
+}
 
 void workerCleanup(cleanUpWorkerArgs *args)
 {
@@ -71,7 +171,8 @@ void workerCleanup(cleanUpWorkerArgs *args)
 
 	if (ftpData->clients[theSocketId].dataChannelIsTls == 1)
 	{
-		if(ftpData->clients[theSocketId].workerData.passiveModeOn == 1)
+		if(ftpData->clients[theSocketId].workerData.passiveModeOn == 1 &&
+		   ftpData->clients[theSocketId].workerData.serverSsl != NULL)
 		{
 			//my_printf("\nSSL worker Shutdown 1");
 			returnCode = SSL_shutdown(ftpData->clients[theSocketId].workerData.serverSsl);
@@ -88,7 +189,8 @@ void workerCleanup(cleanUpWorkerArgs *args)
 			}
 		}
 
-		if(ftpData->clients[theSocketId].workerData.activeModeOn == 1)
+		if(ftpData->clients[theSocketId].workerData.activeModeOn == 1 &&
+		   ftpData->clients[theSocketId].workerData.clientSsl != NULL)
 		{
 			returnCode = SSL_shutdown(ftpData->clients[theSocketId].workerData.clientSsl);
 
@@ -109,6 +211,14 @@ void workerCleanup(cleanUpWorkerArgs *args)
     returnCode = close(ftpData->clients[theSocketId].workerData.socketConnection);
     returnCode = close(ftpData->clients[theSocketId].workerData.passiveListeningSocket);
 
+    if (args->passivePortIsCounted == 1)
+        METRICS_Add(METRICS_PASSIVE_PORTS, -1);
+
+    if (args->transferIsCounted == 1)
+        METRICS_Add(METRICS_ACTIVE_TRANSFERS, -1);
+
+    traceTransfer(ftpData, theSocketId);
+
     if (ftpData->clients[theSocketId].workerData.commandProcessed)
     {
         returnCode = socketPrintf(ftpData, theSocketId, "s", ftpData->clients[theSocketId].workerData.theCommandResponse);
@@ -137,6 +247,9 @@ static int processStorAppe(cleanUpWorkerArgs *args)
     off_t restartPos = ftpData->clients[theSocketId].workerData.retrRestartAtByte;
     FILE *file = NULL;
 
+    /* on the transfer thread stack, first touched on its own CPU */
+    char buffer[FTP_DATA_TRANSFER_BUFFER];
+
     const char *filePath = ftpData->clients[theSocketId].fileToStor.text;
     const char *command = ftpData->clients[theSocketId].workerData.theCommandReceived;
 
@@ -173,6 +286,8 @@ static int processStorAppe(cleanUpWorkerArgs *args)
         return -1;
     }
 
+    ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_FILE_OPEN] = HIST_Now();
+
     if (!isAppe && restartPos > 0) {
         fseeko(file, restartPos, SEEK_SET);
         ftpData->clients[theSocketId].workerData.retrRestartAtByte = 0;
@@ -183,16 +298,16 @@ static int processStorAppe(cleanUpWorkerArgs *args)
 
         if (ftpData->clients[theSocketId].dataChannelIsTls != 1) {
             bytesRead = read(ftpData->clients[theSocketId].workerData.socketConnection,
-                             ftpData->clients[theSocketId].workerData.buffer, CLIENT_BUFFER_STRING_SIZE);
+                             buffer, FTP_DATA_TRANSFER_BUFFER);
         }
     #ifdef OPENSSL_ENABLED
         else {
             if (ftpData->clients[theSocketId].workerData.passiveModeOn == 1) {
                 bytesRead = SSL_read(ftpData->clients[theSocketId].workerData.serverSsl,
-                                     ftpData->clients[theSocketId].workerData.buffer, CLIENT_BUFFER_STRING_SIZE);
+                                     buffer, FTP_DATA_TRANSFER_BUFFER);
             } else if (ftpData->clients[theSocketId].workerData.activeModeOn == 1) {
                 bytesRead = SSL_read(ftpData->clients[theSocketId].workerData.clientSsl,
-                                     ftpData->clients[theSocketId].workerData.buffer, CLIENT_BUFFER_STRING_SIZE);
+                                     buffer, FTP_DATA_TRANSFER_BUFFER);
             }
         }
     #endif
@@ -200,14 +315,22 @@ static int processStorAppe(cleanUpWorkerArgs *args)
         if (bytesRead == 0) {
             break;
         } else if (bytesRead > 0) {
-            fwrite(ftpData->clients[theSocketId].workerData.buffer, bytesRead, 1, file);
+            if (ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_FIRST_BYTE] == 0)
+                ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_FIRST_BYTE] = HIST_Now();
+
+            fwrite(buffer, bytesRead, 1, file);
+            __atomic_store_n(&ftpData->clients[theSocketId].workerData.transferredBytes, ftpData->clients[theSocketId].workerData.transferredBytes + bytesRead, __ATOMIC_RELAXED);
+            METRICS_Add(METRICS_BYTES_IN, bytesRead);
             usleep(100);
             ftpData->clients[theSocketId].lastActivityTimeStamp = (int)time(NULL);
+            throttleTransfer(ftpData, theSocketId);
         } else {
             break;
         }
     }
 
+    ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_LAST_BYTE] = HIST_Now();
+
     fclose(file);
     ftpData->clients[theSocketId].workerData.theStorFile = NULL;
 
@@ -235,11 +358,15 @@ static int acceptConnection(cleanUpWorkerArgs *args)
 
         while (tries > 0)
         {
+            ftpData->clients[theSocketId].workerData.portSearchTries++;
             setRandomicPort(ftpData, theSocketId);
             ftpData->clients[theSocketId].workerData.passiveListeningSocket = createPassiveSocket(ftpData->clients[theSocketId].workerData.connectionPort);
 
             if (ftpData->clients[theSocketId].workerData.passiveListeningSocket != -1)
             {
+                METRICS_Add(METRICS_PASSIVE_PORTS, 1);
+                args->passivePortIsCounted = 1;
+                ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_PORT_SEARCH] = HIST_Now();
                 break;
             }
             tries--;
@@ -292,14 +419,17 @@ static int acceptConnection(cleanUpWorkerArgs *args)
             if ((ftpData->clients[theSocketId].workerData.socketConnection = accept(ftpData->clients[theSocketId].workerData.passiveListeningSocket, 0, 0))!=-1)
             {
                 ftpData->clients[theSocketId].workerData.socketIsConnected = 1;
+                ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_CONNECT] = HIST_Now();
                 #ifdef OPENSSL_ENABLED
                 if (ftpData->clients[theSocketId].dataChannelIsTls == 1)
                 {
                     if (acceptSSLConnection(theSocketId, ftpData) < 0)
                     {
+                        METRICS_Add(METRICS_TLS_HANDSHAKES_FAILED, 1);
                         my_printf("\nSSL_Accept failed");
                         return -1;
                     }
+                    ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_TLS_HANDSHAKE] = HIST_Now();
                 }
                 #endif
             }
@@ -324,9 +454,27 @@ static int acceptConnection(cleanUpWorkerArgs *args)
         ftpData->clients[theSocketId].workerData.socketConnection = createActiveSocketV6(ftpData->clients[theSocketId].workerData.connectionPort, ftpData->clients[theSocketId].workerData.activeIpAddress);    
     #endif
 
+    if (ftpData->clients[theSocketId].workerData.socketConnection >= 0)
+    {
+        ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_CONNECT] = HIST_Now();
+    }
+
 	#ifdef OPENSSL_ENABLED
 	if (ftpData->clients[theSocketId].dataChannelIsTls == 1)
 	{
+		if (ftpData->clients[theSocketId].workerData.clientSsl == NULL)
+			ftpData->clients[theSocketId].workerData.clientSsl = tlsAcquireSsl(0);
+
+		if (ftpData->clients[theSocketId].workerData.clientSsl == NULL)
+		{
+			ftpData->clients[theSocketId].closeTheClient = 1;
+			LOG_ERROR("Data channel SSL object allocation failed");
+			return -1;
+		}
+
+		tlsStartRecordSizing(ftpData->clients[theSocketId].workerData.clientSsl, &ftpData->clients[theSocketId].workerData.tlsRecordSizing,
+							 ftpData->ftpParameters.tlsDataRecordSize, ftpData->ftpParameters.tlsDataSmallRecordBytes);
+
 		returnCode = SSL_set_fd(ftpData->clients[theSocketId].workerData.clientSsl, ftpData->clients[theSocketId].workerData.socketConnection);
 
 		if (returnCode == 0)
@@ -346,6 +494,7 @@ static int acceptConnection(cleanUpWorkerArgs *args)
 		else
 		{
 			//my_printf("\nSSL ACCEPTED ON WORKER");
+			ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_TLS_HANDSHAKE] = HIST_Now();
 		}
 	}
 	#endif
@@ -421,6 +570,7 @@ static int processListNlst(cleanUpWorkerArgs *args)
         theCommandType = COMMAND_TYPE_NLST;
 
     returnCode = writeListDataInfoToSocket(ftpData, theSocketId, &theFiles, theCommandType, &ftpData->clients[theSocketId].workerData.memoryTable);
+    ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_LAST_BYTE] = HIST_Now();
     if (returnCode <= 0)
     {
         ftpData->clients[theSocketId].closeTheClient = 1;
@@ -444,6 +594,19 @@ void *connectionWorkerHandle(cleanUpWorkerArgs *args)
   pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
   pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 
+  /* off the control CPUs before the transfer buffers are touched */
+  CPUAFF_PinTransferThread();
+
+  args->passivePortIsCounted = 0;
+  args->transferIsCounted = 0;
+
+  memset(ftpData->clients[theSocketId].workerData.phaseTime, 0, sizeof(ftpData->clients[theSocketId].workerData.phaseTime));
+  ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_START] = HIST_Now();
+  ftpData->clients[theSocketId].workerData.portSearchTries = 0;
+  ftpData->clients[theSocketId].workerData.transferredBytes = 0;
+  ftpData->clients[theSocketId].workerData.transferSize = 0;
+  ftpData->clients[theSocketId].workerData.throttleLimit = -1;
+
   pthread_cleanup_push((void (*)(void *))workerCleanup,  args);
   ftpData->clients[theSocketId].workerData.threadIsAlive = 1;
   ftpData->clients[theSocketId].workerData.threadHasBeenCreated = 1;
@@ -457,6 +620,8 @@ void *connectionWorkerHandle(cleanUpWorkerArgs *args)
     goto data_channel_exit;
   }
 
+  CPUAFF_FollowIncomingCpu(ftpData->clients[theSocketId].workerData.socketConnection);
+
  //Endless loop ftp process
 
   while (1)
@@ -473,6 +638,12 @@ void *connectionWorkerHandle(cleanUpWorkerArgs *args)
         }
         pthread_mutex_unlock(&ftpData->clients[theSocketId].conditionMutex);
 
+        ftpData->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_COMMAND] = HIST_Now();
+
+        /* lowered by workerCleanup, also when the transfer is cancelled */
+        METRICS_Add(METRICS_ACTIVE_TRANSFERS, 1);
+        args->transferIsCounted = 1;
+
         if (ftpData->clients[theSocketId].workerData.commandReceived == 1 &&
             (compareStringCaseInsensitive(ftpData->clients[theSocketId].workerData.theCommandReceived, "STOR", strlen("STOR")) == 1 || 
             compareStringCaseInsensitive(ftpData->clients[theSocketId].workerData.theCommandReceived, "APPE", strlen("APPE")) == 1) &&
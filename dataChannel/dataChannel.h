@@ -6,6 +6,10 @@
 typedef struct {
     ftpDataType *ftpData;
     int socketId;
+
+    /* gauges raised by the transfer thread, lowered by workerCleanup */
+    int passivePortIsCounted;
+    int transferIsCounted;
 } cleanUpWorkerArgs;
 
 void workerCleanup(cleanUpWorkerArgs *args);
@@ -22,6 +22,8 @@
  * THE SOFTWARE.
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_CONTROL
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -46,6 +48,8 @@
 #include "library/dynamicMemory.h"
 #include "library/auth.h"
 #include "library/serverHelpers.h"
+#include "library/sharedState.h"
+#include "library/metrics.h"
 #include "dataChannel/dataChannel.h"
 #include "ftpCommandsElaborate.h"
 
@@ -54,6 +58,7 @@
 
 static int parse_eprt(const char *eprt_str, int *address_type, char *address, int *port);
 static int ftpReplyOrError(ftpDataType *ftpData, int clientId, const char *formatSpecifier, const char *message);
+static int submitAuthJob(ftpDataType *data, int socketId, char *thePass, char *passwordHash);
 
 /* Elaborate the User login command */
 int parseCommandUser(ftpDataType * data, int socketId)
@@ -70,19 +75,8 @@ int parseCommandUser(ftpDataType * data, int socketId)
 	{
 		if (strnlen(theUserName, 1) >= 1)
 		{
-            int userIsBlocked = 0;
-
             // check if the user is blocked
-            for(int i = 0; i < data->ftpParameters.blockedUsersVector.Size; i++)
-            {
-                if(strncmp(theUserName, data->ftpParameters.blockedUsersVector.Data[i], CLIENT_COMMAND_STRING_SIZE-6) == 0)
-                {
-                    userIsBlocked = 1;
-                    break;
-                }
-            }
-
-            if (userIsBlocked == 0)
+            if (searchBlockedUser(theUserName, &data->ftpParameters) == -1)
             {
                 setDynamicStringDataType(&data->clients[socketId].login.name, theUserName, strlen(theUserName), &data->clients[socketId].memoryTable);
                 returnCode = socketPrintf(data, socketId, "s", "331 User ok, Waiting for the password.\r\n");
@@ -110,6 +104,33 @@ int parseCommandUser(ftpDataType * data, int socketId)
 	return FTP_COMMAND_PROCESSED;
 }
 
+/* SITE LATENCY, the command latency histograms of every worker in microseconds */
+static int siteLatencyReport(ftpDataType *data, int socketId)
+{
+    HIST_Histogram_DataType handler, queue;
+    char line[256];
+    int returnCode;
+
+    returnCode = socketPrintf(data, socketId, "s", "211-Command latency (us): count p50 p99 max queue-p99\r\n");
+
+    for (int command = 0; command < METRICS_CommandCount() && returnCode > 0; command++)
+    {
+        METRICS_MergeCommandLatency(command, &handler, &queue);
+        if (handler.count == 0)
+            continue;
+
+        snprintf(line, sizeof(line), " %-8s %llu %llu %llu %llu %llu\r\n", METRICS_CommandName(command), handler.count,
+                 HIST_ValueAtQuantile(&handler, 0.5) / 1000, HIST_ValueAtQuantile(&handler, 0.99) / 1000,
+                 handler.max / 1000, HIST_ValueAtQuantile(&queue, 0.99) / 1000);
+        returnCode = socketPrintf(data, socketId, "s", line);
+    }
+
+    if (returnCode > 0)
+        returnCode = socketPrintf(data, socketId, "s", "211 End\r\n");
+
+    return returnCode;
+}
+
 /* Elaborate the User login command */
 int parseCommandSite(ftpDataType *data, int socketId)
 {
@@ -146,6 +167,10 @@ int parseCommandSite(ftpDataType *data, int socketId)
                 return FTP_COMMAND_PROCESSED_WRITE_ERROR;
         }
     }
+    else if (compareStringCaseInsensitive(theCommand, "LATENCY", strlen("LATENCY")) == 1)
+    {
+        returnCode = siteLatencyReport(data, socketId);
+    }
     else
     {
         returnCode = socketPrintf(data, socketId, "s", "500 unknown extension\r\n");
@@ -161,146 +186,299 @@ int parseCommandSite(ftpDataType *data, int socketId)
     return FTP_COMMAND_PROCESSED;
 }
 
-int parseCommandPass(ftpDataType *data, int socketId)
+/* Map a user database record on the configuration user structure, strings point into the record */
+static usersParameters_DataType *userFromDatabaseRecord(USERDB_User_DataType *record, usersParameters_DataType *user)
 {
-    int returnCode;
-    char *thePass;
-    loginFailsDataType element;
-    int searchPosition = -1;
+    user->name = record->name;
+    user->password = record->password;
+    user->homePath = record->homePath;
+    user->ownerShip.ownerShipSet = 0;
+    user->ownerShip.uid = 0;
+    user->ownerShip.gid = 0;
+    user->ownerShip.userOwnerString = NULL;
+    user->ownerShip.groupOwnerString = NULL;
 
-    if (data->clients[socketId].login.name.textLen <= 0)
+    if (record->userOwner[0] != '\0' &&
+        record->groupOwner[0] != '\0')
     {
-        returnCode = socketPrintf(data, socketId, "s", "503 Login with USER first.\r\n");
+        gid_t gid = FILE_getGID(record->groupOwner);
+        uid_t uid = FILE_getUID(record->userOwner);
 
-        if (returnCode <= 0) 
+        if (gid != -1 &&
+            uid != -1)
         {
-            LOG_ERROR("socketPrintfError");
-            return FTP_COMMAND_PROCESSED_WRITE_ERROR;
+            user->ownerShip.ownerShipSet = 1;
+            user->ownerShip.gid = gid;
+            user->ownerShip.uid = uid;
+            user->ownerShip.userOwnerString = record->userOwner;
+            user->ownerShip.groupOwnerString = record->groupOwner;
         }
+    }
 
-        return FTP_COMMAND_PROCESSED;
+    return user;
+}
+
+/* Failures are shared by every worker process */
+static void recordLoginFail(ftpDataType *data, int socketId)
+{
+    METRICS_Add(METRICS_LOGINS_FAILED, 1);
+
+    /* a failure that can't be counted can't lead to a ban, the connection gets no further attempt */
+    if (data->ftpParameters.maximumUserAndPassowrdLoginTries != 0 &&
+        SHST_RecordLoginFail(data->clients[socketId].clientIpAddress, time(NULL)) == -1)
+    {
+        LOGF_AT(LOG_SUBSYSTEM_AUTH, LOG_LEVEL_SECURITY, LOG_SECURITY_PREFIX, "Login failure table full, closing the connection from ip %s", data->clients[socketId].clientIpAddress);
+        data->clients[socketId].closeTheClient = 1;
     }
+}
 
-    thePass = getFtpCommandArg("PASS", data->clients[socketId].theCommandReceived, 0);
+/* Configuration users first, then the user database */
+static usersParameters_DataType *findLoginUser(ftpDataType *data, int socketId, usersParameters_DataType *databaseUser, USERDB_User_DataType *databaseRecord)
+{
+    int searchUserNameIndex;
 
-    strncpy(element.ipAddress, data->clients[socketId].clientIpAddress, INET_ADDRSTRLEN);
-    element.failTimeStamp = time(NULL);
-    element.failureNumbers = 1;
+    searchUserNameIndex = searchUser(data->clients[socketId].login.name.text, &data->ftpParameters);
 
-    searchPosition = data->loginFailsVector.SearchElement(&data->loginFailsVector, &element);
+    if (searchUserNameIndex >= 0)
+    {
+        return (usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex];
+    }
 
-    if (searchPosition != -1)
+    if (data->ftpParameters.userDatabasePath[0] != '\0' &&
+        USERDB_Lookup(&data->userDatabase, data->clients[socketId].login.name.text, databaseRecord) == 1)
     {
-        if (element.failTimeStamp - ((loginFailsDataType *)data->loginFailsVector.Data[searchPosition])->failTimeStamp < WRONG_PASSWORD_ALLOWED_RETRY_TIME)
-        {
-            if (((loginFailsDataType *)data->loginFailsVector.Data[searchPosition])->failureNumbers >= data->ftpParameters.maximumUserAndPassowrdLoginTries)
-            {
-                data->clients[socketId].closeTheClient = 1;
-                returnCode = socketPrintf(data, socketId, "s", "430 Too many login failure detected, your ip will be blacklisted for 5 minutes\r\n");
+        return userFromDatabaseRecord(databaseRecord, databaseUser);
+    }
+
+    return NULL;
+}
 
-                LOGF("%sIp %s blocked due too many password errors. Trying to login as user: %s ", LOG_SECURITY_PREFIX, data->clients[socketId].clientIpAddress, data->clients[socketId].login.name.text);
+static int rejectLogin(ftpDataType *data, int socketId)
+{
+    int returnCode;
 
-                if (returnCode <= 0) 
-                {
-                    LOG_ERROR("socketPrintfError");
-                    return FTP_COMMAND_PROCESSED_WRITE_ERROR;
-                }
-                return FTP_COMMAND_PROCESSED;
-            }
-        }
+    recordLoginFail(data, socketId);
+    returnCode = socketPrintf(data, socketId, "s", "430 Invalid username or password\r\n");
+    if (returnCode <= 0) 
+    {
+        LOG_ERROR("socketPrintfError");
+        return FTP_COMMAND_PROCESSED_WRITE_ERROR;
     }
 
-    if (strnlen(thePass, 1) >= 1)
+    return FTP_COMMAND_PROCESSED;
+}
+
+static int acceptUserLogin(ftpDataType *data, int socketId, usersParameters_DataType *theUser, char *thePass)
+{
+    int returnCode;
+
+    setDynamicStringDataType(&data->clients[socketId].login.password, thePass, strlen(thePass), &data->clients[socketId].memoryTable);
+    setDynamicStringDataType(&data->clients[socketId].login.absolutePath, theUser->homePath, strlen(theUser->homePath), &data->clients[socketId].memoryTable);
+    setDynamicStringDataType(&data->clients[socketId].login.homePath, theUser->homePath, strlen(theUser->homePath), &data->clients[socketId].memoryTable);
+    setDynamicStringDataType(&data->clients[socketId].login.ftpPath, "/", strlen("/"), &data->clients[socketId].memoryTable);
+
+    data->clients[socketId].login.ownerShip.ownerShipSet = theUser->ownerShip.ownerShipSet;
+    data->clients[socketId].login.ownerShip.gid = theUser->ownerShip.gid;
+    data->clients[socketId].login.ownerShip.uid = theUser->ownerShip.uid;
+    data->clients[socketId].login.userLoggedIn = 1;
+    METRICS_Add(METRICS_LOGINS_OK, 1);
+
+    my_printf("\ndata->clients[socketId].login.ownerShip.ownerShipSet = %d", data->clients[socketId].login.ownerShip.ownerShipSet);
+    my_printf("\ndata->clients[socketId].login.ownerShip.gid = %d", data->clients[socketId].login.ownerShip.gid);
+    my_printf("\ndata->clients[socketId].login.ownerShip.uid = %d", data->clients[socketId].login.ownerShip.uid);
+
+    returnCode = socketPrintf(data, socketId, "s", "230 Login Ok.\r\n");
+
+    if (returnCode <= 0) 
     {
+        LOG_ERROR("socketPrintfError");
+        return FTP_COMMAND_PROCESSED_WRITE_ERROR;
+    }
 
-        // my_printf("\nLogin try with user %s, password %s", data->clients[socketId].login.name.text, thePass);
+    return FTP_COMMAND_PROCESSED;
+}
 
-        // PAM AUTH METHOD IF ENABLED
-#ifdef PAM_SUPPORT_ENABLED
-        if (data->ftpParameters.pamAuthEnabled == 1)
-        {
-            loginCheck(data->clients[socketId].login.name.text, thePass, &data->clients[socketId].login, &data->clients[socketId].memoryTable);
-            if (data->clients[socketId].login.userLoggedIn == 1)
-            {
-                // my_printf("\n User logged with PAM ok!");
-                returnCode = socketPrintf(data, socketId, "s", "230 Login Ok.\r\n");
-                if (returnCode <= 0) 
-                {
-                    LOG_ERROR("socketPrintfError");
-                    return FTP_COMMAND_PROCESSED_WRITE_ERROR;
-                }
+/* Checks the configuration users and the user database, replies 230 or 430 */
+static int localUserLogin(ftpDataType *data, int socketId, char *thePass)
+{
+    usersParameters_DataType *theUser, databaseUser;
+    USERDB_User_DataType databaseRecord;
 
-                return 1;
-            }
-        }
-#endif
+    theUser = findLoginUser(data, socketId, &databaseUser, &databaseRecord);
 
-        int searchUserNameIndex;
-        searchUserNameIndex = searchUser(data->clients[socketId].login.name.text, &data->ftpParameters.usersVector);
+    if (theUser == NULL)
+        return rejectLogin(data, socketId);
 
-        if (searchUserNameIndex < 0 ||
-            (strcmp(((usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex])->password, thePass) != 0))
-        {
+    if (PWHASH_IsHash(theUser->password))
+    {
+        /* the reply is sent when the auth worker has verified the hash */
+        if (data->authWorkersOn == 1 &&
+            strlen(theUser->password) < PWHASH_MAXIMUM_SIZE)
+            return submitAuthJob(data, socketId, thePass, theUser->password);
 
-            // Record the login fail!
-            if (searchPosition == -1)
-            {
-                if (data->ftpParameters.maximumUserAndPassowrdLoginTries != 0)
-                    data->loginFailsVector.PushBack(&data->loginFailsVector, &element, sizeof(loginFailsDataType));
-            }
-            else
-            {
-                ((loginFailsDataType *)data->loginFailsVector.Data[searchPosition])->failureNumbers++;
-                ((loginFailsDataType *)data->loginFailsVector.Data[searchPosition])->failTimeStamp = time(NULL);
-            }
-            returnCode = socketPrintf(data, socketId, "s", "430 Invalid username or password\r\n");
-            if (returnCode <= 0) 
-            {
-                LOG_ERROR("socketPrintfError");
-                return FTP_COMMAND_PROCESSED_WRITE_ERROR;
-            }
+        if (PWHASH_Verify(thePass, theUser->password) != 1)
+            return rejectLogin(data, socketId);
+    }
+    else if (PWHASH_Compare(theUser->password, thePass) != 1)
+    {
+        return rejectLogin(data, socketId);
+    }
+
+    return acceptUserLogin(data, socketId, theUser, thePass);
+}
+
+static int systemUserLogin(ftpDataType *data, int socketId, authJob_DataType *job)
+{
+    int returnCode;
+
+    authApplySystemLogin(job, &data->clients[socketId].login, &data->clients[socketId].memoryTable);
+    METRICS_Add(METRICS_LOGINS_OK, 1);
+
+    returnCode = socketPrintf(data, socketId, "s", "230 Login Ok.\r\n");
+    if (returnCode <= 0) 
+    {
+        LOG_ERROR("socketPrintfError");
+        return FTP_COMMAND_PROCESSED_WRITE_ERROR;
+    }
+
+    return FTP_COMMAND_PROCESSED;
+}
+
+/*
+ * Queues a PAM login (passwordHash NULL) or a password hash verification on the auth workers,
+ * the client is not served until completeCommandPass
+ */
+static int submitAuthJob(ftpDataType *data, int socketId, char *thePass, char *passwordHash)
+{
+    int returnCode;
+    int pendingFromIp = 0;
+    authJob_DataType *job, cachedLogin;
+
+    if (data->clients[socketId].login.name.textLen >= AUTH_FIELD_SIZE ||
+        strlen(thePass) >= AUTH_FIELD_SIZE)
+        return passwordHash == NULL ? localUserLogin(data, socketId, thePass) : rejectLogin(data, socketId);
+
+    if (passwordHash == NULL &&
+        ACACHE_Lookup(&data->authCache, data->clients[socketId].login.name.text, thePass, cachedLogin.homePath, sizeof(cachedLogin.homePath), &cachedLogin.uid, &cachedLogin.gid) == 1)
+    {
+        strcpy(cachedLogin.name, data->clients[socketId].login.name.text);
+        cachedLogin.authenticated = 1;
+        LOGF_AT(LOG_SUBSYSTEM_AUTH, LOG_LEVEL_DEBUG, LOG_DEBUG_PREFIX, "Cached system login for user %s", cachedLogin.name);
+        return systemUserLogin(data, socketId, &cachedLogin);
+    }
+
+    for (int i = 0; i < data->ftpParameters.maxClients; i++)
+    {
+        if (i != socketId &&
+            data->clients[i].socketIsConnected == 1 &&
+            data->clients[i].authIsPending == 1 &&
+            strcmp(data->clients[i].clientIpAddress, data->clients[socketId].clientIpAddress) == 0)
+            pendingFromIp++;
+    }
+
+    if (data->ftpParameters.maximumPendingAuthPerIp > 0 &&
+        pendingFromIp >= data->ftpParameters.maximumPendingAuthPerIp)
+    {
+        LOGF_AT(LOG_SUBSYSTEM_AUTH, LOG_LEVEL_SECURITY, LOG_SECURITY_PREFIX, "Too many logins in progress from ip %s", data->clients[socketId].clientIpAddress);
+        returnCode = socketPrintf(data, socketId, "s", "430 Too many logins in progress from your ip address\r\n");
+        if (returnCode <= 0) 
+        {
+            LOG_ERROR("socketPrintfError");
+            return FTP_COMMAND_PROCESSED_WRITE_ERROR;
         }
-        else
+
+        return FTP_COMMAND_PROCESSED;
+    }
+
+    job = DYNMEM_malloc(sizeof(authJob_DataType), &data->authJobsMemoryTable, "authJob");
+    if (job == NULL)
+        return passwordHash == NULL ? localUserLogin(data, socketId, thePass) : rejectLogin(data, socketId);
+
+    memset(job, 0, sizeof(authJob_DataType));
+    job->type = passwordHash == NULL ? AUTH_JOB_SYSTEM_LOGIN : AUTH_JOB_PASSWORD_HASH;
+    job->clientId = socketId;
+    job->serial = ++data->clients[socketId].authSerial;
+    strcpy(job->name, data->clients[socketId].login.name.text);
+    strcpy(job->password, thePass);
+
+    if (passwordHash != NULL)
+        strcpy(job->passwordHash, passwordHash);
+
+    if (WPOOL_Submit(&data->authWorkers, job) != 1)
+    {
+        memset(job->password, 0, sizeof(job->password));
+        DYNMEM_free(job, &data->authJobsMemoryTable);
+
+        LOG_AT(LOG_SUBSYSTEM_AUTH, LOG_LEVEL_ERROR, LOG_ERROR_PREFIX, "Authentication queue is full");
+        returnCode = socketPrintf(data, socketId, "s", "430 Server busy, try again later\r\n");
+        if (returnCode <= 0) 
         {
-            setDynamicStringDataType(&data->clients[socketId].login.password, thePass, strlen(thePass), &data->clients[socketId].memoryTable);
-            setDynamicStringDataType(&data->clients[socketId].login.absolutePath, ((usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex])->homePath, strlen(((usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex])->homePath), &data->clients[socketId].memoryTable);
-            setDynamicStringDataType(&data->clients[socketId].login.homePath, ((usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex])->homePath, strlen(((usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex])->homePath), &data->clients[socketId].memoryTable);
-            setDynamicStringDataType(&data->clients[socketId].login.ftpPath, "/", strlen("/"), &data->clients[socketId].memoryTable);
+            LOG_ERROR("socketPrintfError");
+            return FTP_COMMAND_PROCESSED_WRITE_ERROR;
+        }
 
-            data->clients[socketId].login.ownerShip.ownerShipSet = ((usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex])->ownerShip.ownerShipSet;
-            data->clients[socketId].login.ownerShip.gid = ((usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex])->ownerShip.gid;
-            data->clients[socketId].login.ownerShip.uid = ((usersParameters_DataType *)data->ftpParameters.usersVector.Data[searchUserNameIndex])->ownerShip.uid;
-            data->clients[socketId].login.userLoggedIn = 1;
+        return FTP_COMMAND_PROCESSED;
+    }
 
-            my_printf("\ndata->clients[socketId].login.ownerShip.ownerShipSet = %d", data->clients[socketId].login.ownerShip.ownerShipSet);
-            my_printf("\ndata->clients[socketId].login.ownerShip.gid = %d", data->clients[socketId].login.ownerShip.gid);
-            my_printf("\ndata->clients[socketId].login.ownerShip.uid = %d", data->clients[socketId].login.ownerShip.uid);
+    data->clients[socketId].authIsPending = 1;
+    data->clients[socketId].authStartTimeStamp = time(NULL);
+    fdRemove(data, socketId);
 
-            returnCode = socketPrintf(data, socketId, "s", "230 Login Ok.\r\n");
-    
-            if (returnCode <= 0) 
-            {
-                LOG_ERROR("socketPrintfError");
-                return FTP_COMMAND_PROCESSED_WRITE_ERROR;
-            }
+    return FTP_COMMAND_PROCESSED;
+}
+
+int parseCommandPass(ftpDataType *data, int socketId)
+{
+    int returnCode;
+    char *thePass;
+
+    if (data->clients[socketId].login.name.textLen <= 0)
+    {
+        returnCode = socketPrintf(data, socketId, "s", "503 Login with USER first.\r\n");
+
+        if (returnCode <= 0) 
+        {
+            LOG_ERROR("socketPrintfError");
+            return FTP_COMMAND_PROCESSED_WRITE_ERROR;
         }
 
         return FTP_COMMAND_PROCESSED;
     }
-    else
+
+    thePass = getFtpCommandArg("PASS", data->clients[socketId].theCommandReceived, 0);
+
+    if (SHST_IsLoginBlocked(data->clients[socketId].clientIpAddress, time(NULL), data->ftpParameters.maximumUserAndPassowrdLoginTries))
     {
+        data->clients[socketId].closeTheClient = 1;
+        METRICS_Add(METRICS_LOGINS_FAILED, 1);
+        returnCode = socketPrintf(data, socketId, "s", "430 Too many login failure detected, your ip will be blacklisted for 5 minutes\r\n");
+
+        LOGF_AT(LOG_SUBSYSTEM_AUTH, LOG_LEVEL_SECURITY, LOG_SECURITY_PREFIX, "Ip %s blocked due too many password errors. Trying to login as user: %s ", data->clients[socketId].clientIpAddress, data->clients[socketId].login.name.text);
 
-        // Record the login fail!
-        if (searchPosition == -1)
+        if (returnCode <= 0) 
         {
-            if (data->ftpParameters.maximumUserAndPassowrdLoginTries != 0)
-                data->loginFailsVector.PushBack(&data->loginFailsVector, &element, sizeof(loginFailsDataType));
+            LOG_ERROR("socketPrintfError");
+            return FTP_COMMAND_PROCESSED_WRITE_ERROR;
         }
-        else
+        return FTP_COMMAND_PROCESSED;
+    }
+
+    if (strnlen(thePass, 1) >= 1)
+    {
+        // PAM AUTH METHOD IF ENABLED, the reply is sent when the auth worker completes
+#ifdef PAM_SUPPORT_ENABLED
+        if (data->ftpParameters.pamAuthEnabled == 1 &&
+            data->authWorkersOn == 1)
         {
-            ((loginFailsDataType *)data->loginFailsVector.Data[searchPosition])->failureNumbers++;
-            ((loginFailsDataType *)data->loginFailsVector.Data[searchPosition])->failTimeStamp = time(NULL);
+            return submitAuthJob(data, socketId, thePass, NULL);
         }
+#endif
+
+        return localUserLogin(data, socketId, thePass);
+    }
+    else
+    {
+        recordLoginFail(data, socketId);
 
         returnCode = socketPrintf(data, socketId, "s", "430 Invalid username or password\r\n");
 
@@ -313,6 +491,36 @@ int parseCommandPass(ftpDataType *data, int socketId)
     }
 }
 
+/* Called by the control loop with the result of a login queued by parseCommandPass */
+int completeCommandPass(ftpDataType *data, int socketId, authJob_DataType *job)
+{
+    if (job->type == AUTH_JOB_PASSWORD_HASH)
+    {
+        usersParameters_DataType *theUser, databaseUser;
+        USERDB_User_DataType databaseRecord;
+
+        /* the user may have been changed while the hash was verified */
+        theUser = findLoginUser(data, socketId, &databaseUser, &databaseRecord);
+
+        if (job->authenticated == 1 &&
+            theUser != NULL &&
+            strcmp(theUser->password, job->passwordHash) == 0)
+            return acceptUserLogin(data, socketId, theUser, job->password);
+
+        return rejectLogin(data, socketId);
+    }
+
+    if (job->authenticated == 1)
+    {
+        ACACHE_Store(&data->authCache, job->name, job->password, job->homePath, job->uid, job->gid);
+        LOGF_AT(LOG_SUBSYSTEM_AUTH, LOG_LEVEL_DEBUG, LOG_DEBUG_PREFIX, "System login ok for user %s", job->name);
+        return systemUserLogin(data, socketId, job);
+    }
+
+    ACACHE_Invalidate(&data->authCache, job->name);
+    return localUserLogin(data, socketId, job->password);
+}
+
 int parseCommandAuth(ftpDataType *data, int socketId)
 {
     int returnCode;
@@ -330,8 +538,42 @@ int parseCommandAuth(ftpDataType *data, int socketId)
 
 #ifdef OPENSSL_ENABLED
 
+    /* the implicit FTPS session is already protected */
+    if (data->clients[socketId].implicitTls == 1)
+    {
+        returnCode = socketPrintf(data, socketId, "s", "503 TLS is already active on this connection\r\n");
+
+        if (returnCode <= 0) 
+        {
+            LOG_ERROR("socketPrintfError");
+            return FTP_COMMAND_PROCESSED_WRITE_ERROR;
+        }
+
+        return FTP_COMMAND_PROCESSED;
+    }
+
+    /* the SSL object is only created now, also a new one after CCC */
+    SSL *ssl = tlsAcquireSsl(1);
+
+    if (ssl == NULL)
+    {
+        LOG_AT(LOG_SUBSYSTEM_TLS, LOG_LEVEL_ERROR, LOG_ERROR_PREFIX, "SSL object allocation failed");
+        returnCode = socketPrintf(data, socketId, "s", "431 Unable to accept security mechanism\r\n");
+
+        if (returnCode <= 0) 
+        {
+            LOG_ERROR("socketPrintfError");
+            return FTP_COMMAND_PROCESSED_WRITE_ERROR;
+        }
+
+        return FTP_COMMAND_PROCESSED;
+    }
+
     returnCode = socketPrintf(data, socketId, "s", "234 AUTH TLS OK..\r\n");
 
+    tlsReleaseSsl(data->clients[socketId].ssl);
+    data->clients[socketId].ssl = ssl;
+
     if (returnCode <= 0) 
     {
         LOG_ERROR("socketPrintfError");
@@ -348,21 +590,10 @@ int parseCommandAuth(ftpDataType *data, int socketId)
         return FTP_COMMAND_PROCESSED_WRITE_ERROR;
     }
 
-    int returnCodeTls = SSL_accept(data->clients[socketId].ssl);
+    /* the control loop drives the handshake when the ClientHello arrives */
     data->clients[socketId].tlsNegotiatingTimeStart = (int)time(NULL);
-
-    if (returnCodeTls <= 0)
-    {
-        // my_printf("\nSSL NOT YET ACCEPTED: %d", returnCodeTls);
-        data->clients[socketId].tlsIsEnabled = 0;
-        data->clients[socketId].tlsIsNegotiating = 1;
-    }
-    else
-    {
-        // my_printf("\nSSL ACCEPTED");
-        data->clients[socketId].tlsIsEnabled = 1;
-        data->clients[socketId].tlsIsNegotiating = 0;
-    }
+    data->clients[socketId].tlsIsEnabled = 0;
+    data->clients[socketId].tlsIsNegotiating = 1;
 #endif
 
     return FTP_COMMAND_PROCESSED;
@@ -580,7 +811,7 @@ int parseCommandPasv(ftpDataType *data, int socketId)
     if (returnCode != 0)
     {
         my_printfError("\nError in pthread_create %d", returnCode);
-        LOGF("%sPthead create error(code=%d): %s restarting the server", LOG_ERROR_PREFIX, returnCode, strerror(errno));
+        LOGF_ERROR("Pthead create error(code=%d): %s restarting the server", returnCode, strerror(errno));
         exit(0);
         return FTP_COMMAND_PROCESSED_WRITE_ERROR;
     }
@@ -616,7 +847,7 @@ int parseCommandEpsv(ftpDataType *data, int socketId)
     if (returnCode != 0)
     {
         my_printfError("\nError in pthread_create %d", returnCode);
-        LOGF("%sPthead create error(code=%d): %s restarting the server", LOG_ERROR_PREFIX, returnCode, strerror(errno));
+        LOGF_ERROR("Pthead create error(code=%d): %s restarting the server", returnCode, strerror(errno));
         exit(0);
         return FTP_COMMAND_PROCESSED_WRITE_ERROR;
     }
@@ -661,7 +892,7 @@ int parseCommandPort(ftpDataType *data, int socketId)
     if (returnCode != 0)
     {
         my_printfError("\nError in pthread_create %d", returnCode);
-        LOGF("%sPthead create error(code=%d): %s restarting the server", LOG_ERROR_PREFIX, returnCode, strerror(errno));
+        LOGF_ERROR("Pthead create error(code=%d): %s restarting the server", returnCode, strerror(errno));
         exit(0);
         return FTP_COMMAND_PROCESSED_WRITE_ERROR;
     }
@@ -763,7 +994,7 @@ int parseCommandList(ftpDataType *data, int socketId)
 
     if(FILE_IsDirectory(data->clients[socketId].listPath.text, 0) == 0 && FILE_IsFile(data->clients[socketId].listPath.text, 0) == 0)
     {
-        LOGF("%sLIST not a file or directory: %s", LOG_DEBUG_PREFIX, data->clients[socketId].listPath.text);
+        LOGF_DEBUG("LIST not a file or directory: %s", data->clients[socketId].listPath.text);
         my_printf("\nLIST path not file or directoy: %s ", data->clients[socketId].listPath.text);
 
         cleanDynamicStringDataType(&data->clients[socketId].listPath, 0, &data->clients[socketId].memoryTable);
@@ -784,7 +1015,7 @@ int parseCommandList(ftpDataType *data, int socketId)
         cleanDynamicStringDataType(&data->clients[socketId].listPath, 0, &data->clients[socketId].memoryTable);
         setDynamicStringDataType(&data->clients[socketId].listPath, data->clients[socketId].login.absolutePath.text, data->clients[socketId].login.absolutePath.textLen, &data->clients[socketId].memoryTable);
 
-        LOGF("%sLIST no file permissions: %s", LOG_DEBUG_PREFIX, data->clients[socketId].listPath.text);
+        LOGF_DEBUG("LIST no file permissions: %s", data->clients[socketId].listPath.text);
 
         returnCode = socketPrintf(data, socketId, "s", "550 no permissions.\r\n");
 
@@ -879,7 +1110,7 @@ int parseCommandStat(ftpDataType *data, int socketId)
 
     if(FILE_IsDirectory(data->clients[socketId].listPath.text, 0) == 0 && FILE_IsFile(data->clients[socketId].listPath.text, 0) == 0)
     {
-        LOGF("%sSTAT not a file or directory: %s", LOG_DEBUG_PREFIX, data->clients[socketId].listPath.text);
+        LOGF_DEBUG("STAT not a file or directory: %s", data->clients[socketId].listPath.text);
         my_printf("\nSTAT path not file or directoy: %s ", data->clients[socketId].listPath.text);
 
         cleanDynamicStringDataType(&data->clients[socketId].listPath, 0, &data->clients[socketId].memoryTable);
@@ -897,7 +1128,7 @@ int parseCommandStat(ftpDataType *data, int socketId)
 
     if ((checkUserFilePermissions(data->clients[socketId].listPath.text, data->clients[socketId].login.ownerShip.uid, data->clients[socketId].login.ownerShip.gid) & FILE_PERMISSION_R) != FILE_PERMISSION_R)
     {
-        LOGF("%sSTAT no permissions: %s", LOG_SECURITY_PREFIX, data->clients[socketId].listPath.text);
+        LOGF_SECURITY("STAT no permissions: %s", data->clients[socketId].listPath.text);
 
         cleanDynamicStringDataType(&data->clients[socketId].listPath, 0, &data->clients[socketId].memoryTable);
         setDynamicStringDataType(&data->clients[socketId].listPath, data->clients[socketId].login.absolutePath.text, data->clients[socketId].login.absolutePath.textLen, &data->clients[socketId].memoryTable);
@@ -979,7 +1210,7 @@ int parseCommandNlst(ftpDataType *data, int socketId)
 
     if(FILE_IsDirectory(data->clients[socketId].listPath.text, 0) == 0 && FILE_IsFile(data->clients[socketId].listPath.text, 0) == 0)
     {
-        LOGF("%sNLST not a file or directory: %s", LOG_DEBUG_PREFIX, data->clients[socketId].listPath.text);
+        LOGF_DEBUG("NLST not a file or directory: %s", data->clients[socketId].listPath.text);
 
         cleanDynamicStringDataType(&data->clients[socketId].listPath, 0, &data->clients[socketId].memoryTable);
         setDynamicStringDataType(&data->clients[socketId].listPath, data->clients[socketId].login.absolutePath.text, data->clients[socketId].login.absolutePath.textLen, &data->clients[socketId].memoryTable);
@@ -996,7 +1227,7 @@ int parseCommandNlst(ftpDataType *data, int socketId)
 
     if ((checkUserFilePermissions(data->clients[socketId].listPath.text, data->clients[socketId].login.ownerShip.uid, data->clients[socketId].login.ownerShip.gid) & FILE_PERMISSION_R) != FILE_PERMISSION_R)
     {
-        LOGF("%sNLST no permissions: %s", LOG_DEBUG_PREFIX, data->clients[socketId].listPath.text);
+        LOGF_DEBUG("NLST no permissions: %s", data->clients[socketId].listPath.text);
         cleanDynamicStringDataType(&data->clients[socketId].listPath, 0, &data->clients[socketId].memoryTable);
         setDynamicStringDataType(&data->clients[socketId].listPath, data->clients[socketId].login.absolutePath.text, data->clients[socketId].login.absolutePath.textLen, &data->clients[socketId].memoryTable);        
         returnCode = socketPrintf(data, socketId, "s", "550 no permissions.\r\n");
@@ -1063,7 +1294,7 @@ int parseCommandRetr(ftpDataType *data, int socketId)
 
         if ((checkUserFilePermissions(data->clients[socketId].fileToRetr.text, data->clients[socketId].login.ownerShip.uid, data->clients[socketId].login.ownerShip.gid) & FILE_PERMISSION_R) != FILE_PERMISSION_R)
         {
-            LOGF("%sRETR no permissions file: %s", LOG_DEBUG_PREFIX, data->clients[socketId].fileToRetr.text);
+            LOGF_DEBUG("RETR no permissions file: %s", data->clients[socketId].fileToRetr.text);
             socketPrintf(data, socketId, "s", "550 no reading permission on the file\r\n");
 
             if (returnCode <= 0) 
@@ -1095,7 +1326,7 @@ int parseCommandRetr(ftpDataType *data, int socketId)
     }
     else
     {
-        LOGF("%sRETR not a file: %s", LOG_DEBUG_PREFIX, data->clients[socketId].fileToRetr.text);
+        LOGF_DEBUG("RETR not a file: %s", data->clients[socketId].fileToRetr.text);
 
         returnCode = socketPrintf(data, socketId, "s", "550 Failed to open file.\r\n");
 
@@ -1158,7 +1389,7 @@ int parseCommandStor(ftpDataType *data, int socketId)
 
         if ((checkParentDirectoryPermissions(data->clients[socketId].fileToStor.text, data->clients[socketId].login.ownerShip.uid, data->clients[socketId].login.ownerShip.gid) & FILE_PERMISSION_W) != FILE_PERMISSION_W)
         {
-            LOGF("%sSTOR no permissions file: %s", LOG_DEBUG_PREFIX, data->clients[socketId].fileToStor.text);
+            LOGF_DEBUG("STOR no permissions file: %s", data->clients[socketId].fileToStor.text);
 
             returnCode = socketPrintf(data, socketId, "s", "550 No permissions to write the file\r\n");
             cleanDynamicStringDataType(&data->clients[socketId].fileToStor, 0, &data->clients[socketId].memoryTable);
@@ -1189,7 +1420,7 @@ int parseCommandStor(ftpDataType *data, int socketId)
     }
     else
     {
-        LOGF("%sSTOR wrong path file: %s", LOG_DEBUG_PREFIX, data->clients[socketId].fileToStor.text);
+        LOGF_DEBUG("STOR wrong path file: %s", data->clients[socketId].fileToStor.text);
 
         returnCode = socketPrintf(data, socketId, "s", "550 Wrong path.\r\n");
         cleanDynamicStringDataType(&data->clients[socketId].fileToStor, 0, &data->clients[socketId].memoryTable);
@@ -1256,7 +1487,7 @@ int parseCommandAppe(ftpDataType *data, int socketId)
         if ((checkParentDirectoryPermissions(data->clients[socketId].fileToStor.text, data->clients[socketId].login.ownerShip.uid, data->clients[socketId].login.ownerShip.gid) & FILE_PERMISSION_W) != FILE_PERMISSION_W)
         {
 
-            LOGF("%sAPPE no permission path: %s", LOG_DEBUG_PREFIX, data->clients[socketId].fileToStor.text);
+            LOGF_DEBUG("APPE no permission path: %s", data->clients[socketId].fileToStor.text);
 
             returnCode = socketPrintf(data, socketId, "s", "550 No permissions to write the file\r\n");
 
@@ -1286,7 +1517,7 @@ int parseCommandAppe(ftpDataType *data, int socketId)
     }
     else
     {
-        LOGF("%sAPPE wrong path: %s", LOG_DEBUG_PREFIX, data->clients[socketId].fileToStor.text);
+        LOGF_DEBUG("APPE wrong path: %s", data->clients[socketId].fileToStor.text);
 
         returnCode = socketPrintf(data, socketId, "s", "550 Wrong path.\r\n");
 
@@ -1372,7 +1603,7 @@ int parseCommandCwd(ftpDataType *data, int socketId)
             }
             else
             {
-                LOGF("%sCWD no permissions: %s", LOG_DEBUG_PREFIX, data->clients[socketId].login.absolutePath.text);
+                LOGF_DEBUG("CWD no permissions: %s", data->clients[socketId].login.absolutePath.text);
                 my_printfError("no permission to cwd: %s", data->clients[socketId].login.absolutePath.text);
                 returnCode = socketPrintf(data, socketId, "sss", "550 Can't change directory to ", data->clients[socketId].login.absolutePath.text, ": no permissions\r\n");
 
@@ -1389,7 +1620,7 @@ int parseCommandCwd(ftpDataType *data, int socketId)
         else
         {
             my_printfError("CWD not a directory: %s", data->clients[socketId].login.absolutePath.text);
-            LOGF("%sCWD not a directory: %s", LOG_DEBUG_PREFIX, data->clients[socketId].login.absolutePath.text);
+            LOGF_DEBUG("CWD not a directory: %s", data->clients[socketId].login.absolutePath.text);
 
             returnCode = socketPrintf(data, socketId, "sss", "550 Can't change directory to ", data->clients[socketId].login.absolutePath.text, ": No such file or directory\r\n");
 
@@ -1423,7 +1654,7 @@ int parseCommandCwd(ftpDataType *data, int socketId)
         cleanDynamicStringDataType(&theSafePath, 0, &data->clients[socketId].memoryTable);
         returnCode = socketPrintf(data, socketId, "s", "550 Wrong path.\r\n");
 
-        LOGF("%sCWD wrong path: %s", LOG_DEBUG_PREFIX, data->clients[socketId].login.absolutePath.text);
+        LOGF_DEBUG("CWD wrong path: %s", data->clients[socketId].login.absolutePath.text);
 
         if (returnCode <= 0) 
         {
@@ -1541,7 +1772,7 @@ int parseCommandMkd(ftpDataType *data, int socketId)
         }
         else
         {
-            LOGF("%sMKD no permissions to create: %s ", LOG_DEBUG_PREFIX, theDirectoryFilename);
+            LOGF_DEBUG("MKD no permissions to create: %s ", theDirectoryFilename);
 
             returnCode = socketPrintf(data, socketId, "sss", "550 no permition to create directory ", theDirectoryFilename, "\r\n");
             if (returnCode <= 0)
@@ -1557,7 +1788,7 @@ int parseCommandMkd(ftpDataType *data, int socketId)
     }
     else
     {
-        LOGF("MKD wrong path: %s", LOG_DEBUG_PREFIX, theDirectoryFilename);
+        LOGF_DEBUG("MKD wrong path: %s", theDirectoryFilename);
 
         cleanDynamicStringDataType(&mkdFileName, 0, &data->clients[socketId].memoryTable);
         returnCode = socketPrintf(data, socketId, "s", "550 Wrong path.\r\n");
@@ -1657,7 +1888,7 @@ int parseCommandDele(ftpDataType *data, int socketId)
             }
             else
             {
-                LOGF("%sDELE no permissions on: %s ", LOG_DEBUG_PREFIX, deleFileName.text);
+                LOGF_DEBUG("DELE no permissions on: %s ", deleFileName.text);
 
                 returnCode = socketPrintf(data, socketId, "sss", "550 Could not delete the file: ", theFileToDelete, " no permissions\r\n");
 
@@ -1694,7 +1925,7 @@ int parseCommandDele(ftpDataType *data, int socketId)
         }
         else
         {
-            LOGF("%sDELE no file found: %s", LOG_DEBUG_PREFIX, deleFileName.text);
+            LOGF_DEBUG("DELE no file found: %s", deleFileName.text);
             returnCode = socketPrintf(data, socketId, "s", "550 Could not delete the file: No such file or file is a directory\r\n");
             functionReturnCode = FTP_COMMAND_PROCESSED;
 
@@ -1759,7 +1990,7 @@ int parseCommandMdtm(ftpDataType *data, int socketId)
         }
         else
         {
-            LOGF("%sMDTM error can't check for file existence: %s", LOG_DEBUG_PREFIX, mdtmFileName.text);
+            LOGF_DEBUG("MDTM error can't check for file existence: %s", mdtmFileName.text);
             returnCode = socketPrintf(data, socketId, "s", "550 Can't check for file existence\r\n");
             functionReturnCode = FTP_COMMAND_PROCESSED;
 
@@ -1772,7 +2003,7 @@ int parseCommandMdtm(ftpDataType *data, int socketId)
     }
     else
     {
-        LOGF("%sMDTM invalid path: %s ",LOG_DEBUG_PREFIX, mdtmFileName.text);
+        LOGF_DEBUG("MDTM invalid path: %s ", mdtmFileName.text);
         functionReturnCode = FTP_COMMAND_NOT_RECONIZED;
     }
 
@@ -1870,7 +2101,7 @@ int parseCommandRmd(ftpDataType *data, int socketId)
                 if (returnStatus == -1)
                 {
 
-                    LOGF("%sRMD failed: %s - %s (errno=%d)", LOG_DEBUG_PREFIX, rmdFileName.text, strerror(errno), errno);
+                    LOGF_DEBUG("RMD failed: %s - %s (errno=%d)", rmdFileName.text, strerror(errno), errno);
 
                     returnCode = socketPrintf(data, socketId, "sss", "550 Could not remove the directory: ", strerror(errno)," \r\n");
                 }
@@ -1889,7 +2120,7 @@ int parseCommandRmd(ftpDataType *data, int socketId)
             }
             else
             {
-                LOGF("%sRMD error dir no permissions: %s", LOG_DEBUG_PREFIX, rmdFileName.text);
+                LOGF_DEBUG("RMD error dir no permissions: %s", rmdFileName.text);
                 returnCode = socketPrintf(data, socketId, "s", "550 Could not delete the directory: No permissions\r\n");
                 functionReturnCode = FTP_COMMAND_PROCESSED;
 
@@ -1902,7 +2133,7 @@ int parseCommandRmd(ftpDataType *data, int socketId)
         }
         else
         {
-            LOGF("%sRMD error dir not exist: %s ", LOG_DEBUG_PREFIX, rmdFileName.text);
+            LOGF_DEBUG("RMD error dir not exist: %s ", rmdFileName.text);
 
             returnCode = socketPrintf(data, socketId, "s", "550 Could not delete the directory:No such directory\r\n");
             functionReturnCode = FTP_COMMAND_PROCESSED;
@@ -1950,14 +2181,14 @@ int parseCommandSize(ftpDataType *data, int socketId)
         }
         else
         {
-            LOGF("%sSIZE error file not exist: %s", LOG_DEBUG_PREFIX, getSizeFromFileName.text);
+            LOGF_DEBUG("SIZE error file not exist: %s", getSizeFromFileName.text);
 
             returnCode = socketPrintf(data, socketId, "s", "550 Can't check for file existence\r\n");
         }
     }
     else
     {
-        LOGF("%sSIZE error file wrong path: %s", LOG_DEBUG_PREFIX, getSizeFromFileName.text);
+        LOGF_DEBUG("SIZE error file wrong path: %s", getSizeFromFileName.text);
         returnCode = socketPrintf(data, socketId, "s", "550 Can't check for file existence\r\n");
     }
     cleanDynamicStringDataType(&getSizeFromFileName, 0, &data->clients[socketId].memoryTable);
@@ -2013,7 +2244,7 @@ int parseCommandRnfr(ftpDataType *data, int socketId)
     }
     else
     {
-        LOGF("%sRNFR error renaming the file: %s", LOG_DEBUG_PREFIX, data->clients[socketId].renameFromFile.text);
+        LOGF_DEBUG("RNFR error renaming the file: %s", data->clients[socketId].renameFromFile.text);
         cleanDynamicStringDataType(&data->clients[socketId].renameFromFile, 0, &data->clients[socketId].memoryTable);
         returnCode = socketPrintf(data, socketId, "s", "550 Sorry, but that file doesn't exist\r\n");
     }
@@ -2073,13 +2304,13 @@ int parseCommandRnto(ftpDataType *data, int socketId)
                 }
                 else
                 {
-                    LOGF("%sRNTO error renaming the file: %s --> %s (%d)", LOG_DEBUG_PREFIX, data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text, returnCode);
+                    LOGF_DEBUG("RNTO error renaming the file: %s --> %s (%d)", data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text, returnCode);
                     returnCode = socketPrintf(data, socketId, "s", "503 Error Renaming the file\r\n");
                 }
             }
             else
             {
-                LOGF("%sRNTO error renaming the file: %s --> %s", LOG_DEBUG_PREFIX, data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text);
+                LOGF_DEBUG("RNTO error renaming the file: %s --> %s", data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text);
                 returnCode = socketPrintf(data, socketId, "s", "550 No permissions to rename the file\r\n");
             }
         }
@@ -2094,19 +2325,19 @@ int parseCommandRnto(ftpDataType *data, int socketId)
                 }
                 else
                 {
-                    LOGF("%sRNTO error renaming the file: %s --> %s (%d)", LOG_DEBUG_PREFIX, data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text, returnCode);
+                    LOGF_DEBUG("RNTO error renaming the file: %s --> %s (%d)", data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text, returnCode);
                     returnCode = socketPrintf(data, socketId, "s", "503 Error Renaming the file\r\n");
                 }
             }
             else
             {
-                LOGF("%dRNTO error renaming the file: %s --> %s", LOG_DEBUG_PREFIX, data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text);
+                LOGF_DEBUG("RNTO error renaming the file: %s --> %s", data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text);
                 returnCode = socketPrintf(data, socketId, "s", "550 No permissions to rename the file\r\n");
             }            
         }
         else
         {
-            LOGF("%sRNTO error renaming the file: %s --> %s", LOG_DEBUG_PREFIX, data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text);
+            LOGF_DEBUG("RNTO error renaming the file: %s --> %s", data->clients[socketId].renameFromFile.text, data->clients[socketId].renameFromFile.text);
             returnCode = socketPrintf(data, socketId, "s", "503 Need RNFR before RNTO\r\n");
         }
     }
@@ -2187,8 +2418,8 @@ long long int writeRetrFile(ftpDataType *data, int theSocketId, long long int st
     long long int readen = 0;
     long long int toReturn = 0, writtenSize = 0;
 
-    char buffer[FTP_COMMAND_ELABORATE_CHAR_BUFFER];
-    memset(buffer, 0, FTP_COMMAND_ELABORATE_CHAR_BUFFER);
+    char buffer[FTP_DATA_TRANSFER_BUFFER];
+    memset(buffer, 0, FTP_DATA_TRANSFER_BUFFER);
 
 #ifdef LARGE_FILE_SUPPORT_ENABLED
     retrFP = fopen64(data->clients[theSocketId].fileToRetr.text, "rb");
@@ -2201,7 +2432,10 @@ long long int writeRetrFile(ftpDataType *data, int theSocketId, long long int st
         return -1;
     }
 
-    // File size check removed as it's not used
+    data->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_FILE_OPEN] = HIST_Now();
+
+    /* shown by the admin sessions command */
+    __atomic_store_n(&data->clients[theSocketId].workerData.transferSize, FILE_GetFileSize(retrFP), __ATOMIC_RELAXED);
 
     if (startFrom > 0)
     {
@@ -2221,7 +2455,7 @@ long long int writeRetrFile(ftpDataType *data, int theSocketId, long long int st
         my_printf("\ncurrentPosition %lld", startFrom);
     }
 
-    while ((readen = (long long int)fread(buffer, sizeof(char), FTP_COMMAND_ELABORATE_CHAR_BUFFER, retrFP)) > 0)
+    while ((readen = (long long int)fread(buffer, sizeof(char), FTP_DATA_TRANSFER_BUFFER, retrFP)) > 0)
     {
         my_printf("\nTRANSFER read %lld bytes: %.*s", readen, (int)readen, buffer);
 
@@ -2233,9 +2467,9 @@ long long int writeRetrFile(ftpDataType *data, int theSocketId, long long int st
         {
 #ifdef OPENSSL_ENABLED
             if (data->clients[theSocketId].workerData.passiveModeOn == 1)
-                writtenSize = SSL_write(data->clients[theSocketId].workerData.serverSsl, buffer, readen);
+                writtenSize = tlsWriteData(data->clients[theSocketId].workerData.serverSsl, buffer, readen, &data->clients[theSocketId].workerData.tlsRecordSizing);
             else if (data->clients[theSocketId].workerData.activeModeOn == 1)
-                writtenSize = SSL_write(data->clients[theSocketId].workerData.clientSsl, buffer, readen);
+                writtenSize = tlsWriteData(data->clients[theSocketId].workerData.clientSsl, buffer, readen, &data->clients[theSocketId].workerData.tlsRecordSizing);
 #endif
         }
 
@@ -2248,10 +2482,17 @@ long long int writeRetrFile(ftpDataType *data, int theSocketId, long long int st
         }
         else
         {
+            if (data->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_FIRST_BYTE] == 0)
+                data->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_FIRST_BYTE] = HIST_Now();
+
             toReturn += writtenSize;
+            __atomic_store_n(&data->clients[theSocketId].workerData.transferredBytes, data->clients[theSocketId].workerData.transferredBytes + writtenSize, __ATOMIC_RELAXED);
+            METRICS_Add(METRICS_BYTES_OUT, writtenSize);
             data->clients[theSocketId].lastActivityTimeStamp = (int)time(NULL);
+            throttleTransfer(data, theSocketId);
         }
     }
+    data->clients[theSocketId].workerData.phaseTime[METRICS_PHASE_LAST_BYTE] = HIST_Now();
     fclose(retrFP);
     retrFP = NULL;
     return toReturn;
@@ -2451,7 +2692,7 @@ int setPermissions(char *permissionsCommand, char *basePath, ownerShip_DataType
     if (FILE_IsFile(theFinalFilename, 0) != 1 &&
         FILE_IsDirectory(theFinalFilename, 0) != 1)
     {
-        LOGF("%sCHMOD not a file or directory: %s", LOG_DEBUG_PREFIX, theFinalFilename);
+        LOGF_DEBUG("CHMOD not a file or directory: %s", theFinalFilename);
 
         return FTP_CHMODE_COMMAND_RETURN_CODE_NO_FILE;
     }
@@ -2535,7 +2776,7 @@ int parseCommandEprt(ftpDataType *data, int socketId)
     if (returnCode != 0)
     {
         my_printfError("\nError in pthread_create %d", returnCode);
-        LOGF("%sPthead create error(code=%d): %s restarting the server", LOG_ERROR_PREFIX, returnCode, strerror(errno));
+        LOGF_ERROR("Pthead create error(code=%d): %s restarting the server", returnCode, strerror(errno));
         exit(0);
         return FTP_COMMAND_PROCESSED_WRITE_ERROR;
     }
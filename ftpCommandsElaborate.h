@@ -28,6 +28,9 @@
 
 #define FTP_COMMAND_ELABORATE_CHAR_BUFFER       1024
 #define FTP_COMMAND_ELABORATE_CHAR_BUFFER_BIG   4096
+
+/* RETR reads, one full TLS record per write */
+#define FTP_DATA_TRANSFER_BUFFER                16384
 #define FTP_COMMAND_NOT_RECONIZED               0
 #define FTP_COMMAND_PROCESSED                   1
 #define FTP_COMMAND_PROCESSED_WRITE_ERROR       2
@@ -44,6 +47,7 @@
 #endif
 
 #include "ftpData.h"
+#include "library/auth.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -54,6 +58,7 @@ extern "C" {
 int parseCommandUser(ftpDataType * data, int socketId);
 int parseCommandSite(ftpDataType * data, int socketId);
 int parseCommandPass(ftpDataType * data, int socketId);
+int completeCommandPass(ftpDataType *data, int socketId, authJob_DataType *job);
 int parseCommandAuth(ftpDataType * data, int socketId);
 int parseCommandPwd(ftpDataType * data, int socketId);
 int parseCommandSyst(ftpDataType * data, int socketId);
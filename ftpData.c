@@ -22,6 +22,8 @@
  * THE SOFTWARE.
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_CONTROL
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -230,13 +232,13 @@ int getSafePath(dynamicStringDataType *safePath, char *theDirectoryName, loginDa
         else
         {
             my_printfError("\nPath check error: %s check if is in: %s",loginData->homePath.text, real_path);
-            LOGF("%sPath check error: %s check if is in: %s", LOG_DEBUG_PREFIX, loginData->homePath.text, real_path);
+            LOGF_DEBUG("Path check error: %s check if is in: %s", loginData->homePath.text, real_path);
             return 0;
         }
     }
     else 
     {
-        LOGF("%sRealpath error: %s", LOG_DEBUG_PREFIX, theDirectoryName);
+        LOGF_DEBUG("Realpath error: %s", theDirectoryName);
         my_printfError("\nRealpath error input %s", theDirectoryName);
         my_printfError("\ntheDirectoryToCheck error input %s", theDirectoryToCheck);
         return 0;
@@ -262,15 +264,36 @@ void appendToDynamicStringDataType(dynamicStringDataType *dynamicString, char *t
 void setRandomicPort(ftpDataType *data, int socketPosition)
 {
     unsigned short int randomicPort;
-    int maxAttempts = data->ftpParameters.connectionPortMax - data->ftpParameters.connectionPortMin +1;
+    /* read the range once, a configuration reload can change it meanwhile */
+    int portMin = data->ftpParameters.connectionPortMin;
+    int portMax = data->ftpParameters.connectionPortMax;
+    int maxAttempts = portMax - portMin + 1;
     int attempt = 0;
     int conflict;
 
+    if (maxAttempts <= 0)
+    {
+        LOG_ERROR("Invalid passive port range");
+        data->clients[socketPosition].workerData.connectionPort = 0;
+        return;
+    }
+
+    /* passive sockets use SO_REUSEPORT, every worker process draws from its own share of the range */
+    int portStride = data->workerProcessCount;
+    int portOffset = data->workerProcessIndex;
+    int portSlots = (maxAttempts - portOffset + portStride - 1) / portStride;
+
+    if (portSlots <= 0)
+    {
+        portStride = 1;
+        portOffset = 0;
+        portSlots = maxAttempts;
+    }
+
     while (attempt++ < maxAttempts)
     {
         // Generate a random port in range
-        randomicPort = data->ftpParameters.connectionPortMin + 
-                       (rand() % (data->ftpParameters.connectionPortMax - data->ftpParameters.connectionPortMin + 1));
+        randomicPort = portMin + portOffset + (rand() % portSlots) * portStride;
 
         // Check against other clients
         conflict = 0;
@@ -531,28 +554,6 @@ int writeListDataInfoToSocket(ftpDataType *ftpData, int clientId, int *filesNumb
         return 1;
     }
 
-int searchInLoginFailsVector(void * loginFailsVector, void *element)
-{
-    int i = 0;
-    //my_printf("((DYNV_VectorGenericDataType *)loginFailsVector)->Size = %d", ((DYNV_VectorGenericDataType *)loginFailsVector)->Size);
-
-    for (i = 0; i < ((DYNV_VectorGenericDataType *)loginFailsVector)->Size; i++)
-    {
-        if (strcmp( ((loginFailsDataType *) element)->ipAddress, (((loginFailsDataType *) ((DYNV_VectorGenericDataType *)loginFailsVector)->Data[i])->ipAddress)) == 0)
-        {
-            //my_printf("\n\n***IP address found: %s in %d", ((loginFailsDataType *) element)->ipAddress, i);
-            return i;
-        }
-    }
-
-    return -1;
-}
-
-void deleteLoginFailsData(void *element)
-{
-    ; //NOP
-}
-
 void getListDataInfo(char * thePath, DYNV_VectorGenericDataType *directoryInfo, DYNMEM_MemoryTable_DataType **memoryTable)
 {
     int i;
@@ -732,17 +733,8 @@ void resetWorkerData(ftpDataType *data, int clientId, int isInitialization)
 
 			#ifdef OPENSSL_ENABLED
 
-        	if (data->clients[clientId].workerData.serverSsl != NULL)
-        	{
-        		SSL_free(data->clients[clientId].workerData.serverSsl);
-        		data->clients[clientId].workerData.serverSsl = NULL;
-        	}
-
-        	if (data->clients[clientId].workerData.clientSsl != NULL)
-        	{
-        		SSL_free(data->clients[clientId].workerData.clientSsl);
-        		data->clients[clientId].workerData.clientSsl = NULL;
-        	}
+        	tlsReleaseSsl(data->clients[clientId].workerData.serverSsl);
+        	tlsReleaseSsl(data->clients[clientId].workerData.clientSsl);
 
 			#endif
       }
@@ -764,9 +756,10 @@ void resetWorkerData(ftpDataType *data, int clientId, int isInitialization)
         DYNMEM_free(lastToDestroy, &data->clients[clientId].workerData.memoryTable);
     }
 
+    /* created by the data connection when PROT P is in use */
     #ifdef OPENSSL_ENABLED
-    data->clients[clientId].workerData.serverSsl = SSL_new(data->serverCtx);
-    data->clients[clientId].workerData.clientSsl = SSL_new(data->serverCtx);
+    data->clients[clientId].workerData.serverSsl = NULL;
+    data->clients[clientId].workerData.clientSsl = NULL;
     #endif
 }
 
@@ -782,11 +775,7 @@ void resetClientData(ftpDataType *data, int clientId, int isInitialization)
         pthread_mutex_destroy(&data->clients[clientId].writeMutex);
 
         #ifdef OPENSSL_ENABLED
-        if (data->clients[clientId].ssl != NULL)
-        {
-            SSL_free(data->clients[clientId].ssl);
-            data->clients[clientId].ssl = NULL;
-        }
+        tlsReleaseSsl(data->clients[clientId].ssl);
         #endif
     }
 
@@ -821,6 +810,12 @@ void resetClientData(ftpDataType *data, int clientId, int isInitialization)
     data->clients[clientId].sockaddr_in_size = sizeof(struct sockaddr_in);
     data->clients[clientId].sockaddr_in_server_size = sizeof(struct sockaddr_in);
     data->clients[clientId].pbszIsSet = 0;
+    data->clients[clientId].authIsPending = 0;
+    data->clients[clientId].authStartTimeStamp = 0;
+    data->clients[clientId].bufferOffset = 0;
+
+    /* Completions of logins started by the previous client are discarded */
+    data->clients[clientId].authSerial++;
     
     memset(&data->clients[clientId].client_sockaddr_in, 0, data->clients[clientId].sockaddr_in_size);
     memset(&data->clients[clientId].server_sockaddr_in, 0, data->clients[clientId].sockaddr_in_server_size);
@@ -842,10 +837,20 @@ void resetClientData(ftpDataType *data, int clientId, int isInitialization)
 
     data->clients[clientId].connectionTimeStamp = 0;
     data->clients[clientId].tlsNegotiatingTimeStart = 0;
+    data->clients[clientId].tlsWantsWrite = 0;
+    __atomic_store_n(&data->clients[clientId].pendingOutputSize, 0, __ATOMIC_RELAXED);
+    data->clients[clientId].tlsHandshakeIsPending = 0;
+    data->clients[clientId].tlsHandshakeStartTime = 0;
+    data->clients[clientId].implicitTls = 0;
+    data->clients[clientId].connectionIsCounted = 0;
+    data->clients[clientId].connectionEntryIndex = -1;
     data->clients[clientId].lastActivityTimeStamp = 0;
+    data->clients[clientId].transferRateLimit = -1;
+    memset(data->clients[clientId].lastCommand, 0, CLIENT_COMMAND_STRING_SIZE+1);
 
+	/* created by AUTH TLS or the implicit TLS listener */
 	#ifdef OPENSSL_ENABLED
-	data->clients[clientId].ssl = SSL_new(data->serverCtx);
+	data->clients[clientId].ssl = NULL;
 	#endif
 
 	//my_printf("\nclient memory table :%lld", data->clients[clientId].memoryTable);
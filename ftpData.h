@@ -34,10 +34,17 @@
 #ifdef OPENSSL_ENABLED
 	#include <openssl/ssl.h>
 	#include <openssl/err.h>
+	#include "library/openSsl.h"
 #endif
 
 #include "library/dynamicVectors.h"
 #include "library/dynamicMemory.h"
+#include "library/log.h"
+#include "library/hashTable.h"
+#include "library/userDatabase.h"
+#include "library/workerPool.h"
+#include "library/authCache.h"
+#include "library/metrics.h"
 
 
 #define STRING_SZ_SMALL                             100
@@ -46,6 +53,7 @@
 #define CLIENT_COMMAND_STRING_SIZE                  4096
 #define CLIENT_BUFFER_STRING_SIZE                   4096
 #define MAXIMUM_INODE_NAME							4096
+#define CONTROL_OUTPUT_BUFFER_SIZE                  16384
 
 #define LIST_DATA_TYPE_MODIFIED_DATA_STR_SIZE       1024
 
@@ -98,15 +106,67 @@ struct ftpParameters
     int singleInstanceModeOn;
     DYNV_VectorGenericDataType usersVector;
     DYNV_VectorString_DataType blockedUsersVector;
+    HASH_Table_DataType usersIndex;
+    HASH_Table_DataType blockedUsersIndex;
+
+    /* Optional mmapped user database, searched after the configuration users */
+    char userDatabasePath[MAXIMUM_INODE_NAME];
     int maximumIdleInactivity;
+    int drainTimeout;
+    int idleExitTimeout;
+    int transferTraceThreshold;
+
+    /* Kilobytes per second of every transfer of a session, 0 is unlimited */
+    int transferRateLimit;
     int maximumConnectionsPerIp;
+    int workerProcesses;
+
+    /* CPU lists of the control loops and of the transfer threads, empty leaves them to the scheduler */
+    char controlCpuList[STRING_SZ_SMALL];
+    char transferCpuList[STRING_SZ_SMALL];
+    int followIncomingCpu;
+
+    /* Prometheus endpoint, "ip:port" or a unix socket path, empty disables it */
+    char metricsAddress[MAXIMUM_INODE_NAME];
+
+    /* Unix socket of the admin commands, worker N > 0 appends ".N", empty disables it */
+    char adminSocketPath[MAXIMUM_INODE_NAME];
+
     int maximumUserAndPassowrdLoginTries;
     char certificatePath[MAXIMUM_INODE_NAME];
     char privateCertificatePath[MAXIMUM_INODE_NAME];
     char logFolder[MAXIMUM_INODE_NAME];
     int maximumLogFileCount;
+    int logLevels[LOG_SUBSYSTEM_COUNT];
     int pamAuthEnabled;
+    int authWorkerThreads;
+    int authTimeout;
+    int maximumPendingAuthPerIp;
+    int authCacheTimeToLive;
+    int authCacheSize;
     int forceTLS;
+    int implicitTlsPort;
+
+    /* TLS session resumption */
+    int tlsSessionCacheSize;
+    int tlsSessionTimeout;
+    int tlsSessionTickets;
+    int tlsTicketKeyRotation;
+    int tlsHandshakeThreads;
+    int tlsSslPoolSize;
+
+    /* TLS profile, empty strings keep the OpenSSL defaults */
+    int tlsMinimumVersion;
+    int tlsPreferServerCiphers;
+    int tlsPrioritizeChaCha;
+    char tlsCiphers[STRING_SZ_LARGE];
+    char tlsCipherSuites[STRING_SZ_LARGE];
+    char tlsGroups[STRING_SZ_LARGE];
+
+    /* Data channel TLS records */
+    int tlsDataRecordSize;
+    int tlsDataSmallRecordBytes;
+    int tlsReleaseBuffers;
 
     /* If specified, use a port range for pasv connections */
     int connectionPortMin;
@@ -149,6 +209,7 @@ struct workerData
 	#ifdef OPENSSL_ENABLED
 	SSL *serverSsl;
 	SSL *clientSsl;
+	tlsRecordSizing_DataType tlsRecordSizing;
 	#endif
 
     int threadIsAlive;
@@ -179,6 +240,19 @@ struct workerData
 
     long long int retrRestartAtByte;
 
+    /* Monotonic timestamps of the data channel phases, 0 for a phase not reached */
+    unsigned long long int phaseTime[METRICS_PHASE_COUNT];
+    int portSearchTries;
+    long long int transferredBytes;
+
+    /* Size of the file sent by RETR, 0 while unknown */
+    long long int transferSize;
+
+    /* Pace of the rate limit, restarted when the limit changes */
+    long long int throttleLimit;
+    long long int throttleBytes;
+    unsigned long long int throttleStart;
+
     /* The PASV thread will wait the signal before start */
     ftpCommandDataType    ftpCommand;
     DYNV_VectorGenericDataType directoryInfo;
@@ -197,8 +271,16 @@ struct clientData
     int tlsIsNegotiating;
     int pbszIsSet;
     unsigned long long int tlsNegotiatingTimeStart;
+    int tlsWantsWrite;
+    int tlsHandshakeIsPending;
+    unsigned long long int tlsHandshakeStartTime;
+    int implicitTls;
     int dataChannelIsTls;
     pthread_mutex_t writeMutex;
+
+    /* Replies the non blocking control socket could not take yet, guarded by writeMutex */
+    int pendingOutputSize;
+    char pendingOutput[CONTROL_OUTPUT_BUFFER_SIZE];
     
     int clientProgressiveNumber;
     int socketDescriptor;
@@ -211,6 +293,12 @@ struct clientData
     
     int commandIndex;
     char theCommandReceived[CLIENT_COMMAND_STRING_SIZE+1];
+
+    /* Login running on the auth workers, buffer[bufferOffset..bufferIndex) is processed after it */
+    int authIsPending;
+    unsigned long long int authSerial;
+    unsigned long long int authStartTimeStamp;
+    int bufferOffset;
     
     dynamicStringDataType renameFromFile;
     dynamicStringDataType renameFromFileWd;
@@ -236,6 +324,10 @@ struct clientData
     int clientPort;
     char clientIpAddress[INET6_ADDRSTRLEN];
 
+    /* Counted in the shared connection limits, entry of the address or -1 */
+    int connectionIsCounted;
+    int connectionEntryIndex;
+
     int serverPort;
     char serverIpAddress[INET6_ADDRSTRLEN];
     int serverIpV4AddressInteger[4];
@@ -245,39 +337,68 @@ struct clientData
     unsigned long long int connectionTimeStamp;
     unsigned long long int lastActivityTimeStamp;
 
+    /* Last command dispatched, shown on the admin socket without the PASS argument */
+    char lastCommand[CLIENT_COMMAND_STRING_SIZE+1];
+
+    /* Bytes per second set on the admin socket, -1 follows TRANSFER_RATE_LIMIT */
+    long long int transferRateLimit;
+
     pthread_mutex_t conditionMutex;
     pthread_cond_t conditionVariable;
 
     DYNMEM_MemoryTable_DataType *memoryTable;
 } typedef clientDataType;
 
-struct loginFails
-{
-    char ipAddress[INET_ADDRSTRLEN];
-    unsigned long long int failTimeStamp;
-    int failureNumbers;
-} typedef loginFailsDataType;
-
 struct ConnectionParameters
 {
-    int theMainSocket, maxSocketFD;
+    int theMainSocket, maxSocketFD, maxServiceSocketFD;
+    int theImplicitTlsSocket;
     fd_set rset, wset, eset, rsetAll, wsetAll, esetAll;
 } typedef ConnectionData_DataType;
 
 struct ftpData
 {
 	#ifdef OPENSSL_ENABLED
-	SSL_CTX *serverCtx;
+    /* Control channel handshakes can run on this pool, one job slot per client */
+    int tlsHandshakeWorkersOn;
+    WPOOL_Pool_DataType tlsHandshakeWorkers;
+    tlsHandshakeJob_DataType *tlsHandshakeJobs;
 	#endif
 
     int connectedClients;
+
+    /* Pre-fork mode, each worker process listens on its own SO_REUSEPORT socket */
+    int workerProcessIndex;
+    int workerProcessCount;
+
+    /* Binary upgrade (SIGUSR2), the new process reports on this pipe once it serves */
+    int upgradeReadyDescriptor;
+    int upgradeStartTime;
+    int listenSocketsReleased;
+
+    /* Drain requested, no new command is accepted once a session has no transfer running */
+    int drainIsActive;
+    int drainDeadline;
+
+    /* Last time a session was connected, a socket activated server exits after IDLE_EXIT_TIMEOUT */
+    int idleSince;
+
+    /* Monotonic time the control loop woke up, the command queue time starts here */
+    unsigned long long int loopWakeTime;
+
     char welcomeMessage[1024];
     ConnectionData_DataType connectionData;
     clientDataType *clients;
     ipDataType serverIp;
     ftpParameters_DataType ftpParameters;
-    DYNV_VectorGenericDataType loginFailsVector;
     DYNMEM_MemoryTable_DataType *generalDynamicMemoryTable;
+    USERDB_Database_DataType userDatabase;
+
+    /* Blocking authentication backends run on this pool */
+    int authWorkersOn;
+    WPOOL_Pool_DataType authWorkers;
+    DYNMEM_MemoryTable_DataType *authJobsMemoryTable;
+    ACACHE_Cache_DataType authCache;
 } typedef ftpDataType;
 
 struct ftpListData
@@ -312,8 +433,6 @@ void setRandomicPort(ftpDataType *data, int socketPosition);
 void getListDataInfo(char * thePath, DYNV_VectorGenericDataType *directoryInfo, DYNMEM_MemoryTable_DataType **memoryTable);
 int writeListDataInfoToSocket(ftpDataType *data, int clientId, int *filesNumber, int commandType, DYNMEM_MemoryTable_DataType **memoryTable);
 
-int searchInLoginFailsVector(void *loginFailsVector, void *element);
-void deleteLoginFailsData(void *element);
 void deleteListDataInfoVector(DYNV_VectorGenericDataType *theVector);
 void resetWorkerData(ftpDataType *data, int clientId, int isInitialization);
 void resetClientData(ftpDataType *data, int clientId, int isInitialization);
@@ -34,6 +34,8 @@
 #include <pthread.h>
 #include <netdb.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 /* FTP LIBS */
 #include "library/fileManagement.h"
@@ -45,12 +47,16 @@
 #include "library/errorHandling.h"
 #include "library/daemon.h"
 #include "library/log.h"
+#include "library/sharedState.h"
+#include "library/cpuAffinity.h"
+#include "library/metrics.h"
 
 #include "ftpServer.h"
 #include "ftpData.h"
 #include "ftpCommandsElaborate.h"
 #include "debugHelper.h"
 #include "controlChannel/controlChannel.h"
+#include "adminChannel/adminChannel.h"
 
 ftpDataType ftpData;
 pthread_t watchDogThread;
@@ -58,9 +64,16 @@ pthread_t watchDogThread;
 void initFtpServer(void)
 {
     int returnCode = 0;
+    int authWorkersNeeded;
+    int cpuAffinityResult;
+    const char *commandNames[METRICS_MAX_COMMANDS];
+    int commandNameCount;
 
     printf("\nHello uFTP server %s starting..\n", UFTP_SERVER_VERSION);
 
+    /* LISTEN_PID names this process, it must be checked before any fork */
+    socketActivationInit();
+
     /* Handle signals */
     signalHandlerInstall();
 
@@ -70,19 +83,114 @@ void initFtpServer(void)
     /* apply the reden configuration */
     applyConfiguration(&ftpData.ftpParameters);
 
+    /* daemonize() ignores SIGHUP, from here on it requests a reload */
+    signal(SIGHUP, onReloadRequest);
+
     /* initialize the ftp data structure */
     initFtpData(&ftpData);
 
+    /* an upgraded binary takes over the listening sockets of the previous one */
+    ftpData.connectionData.theMainSocket = takeInheritedListenSocket(UPGRADE_LISTEN_FD_VARIABLE, ftpData.ftpParameters.port);
+    ftpData.connectionData.theImplicitTlsSocket = takeInheritedListenSocket(UPGRADE_IMPLICIT_TLS_FD_VARIABLE, ftpData.ftpParameters.implicitTlsPort);
+
+    /* started by a systemd socket unit, its sockets are served instead of new ones */
+    if (ftpData.connectionData.theMainSocket == -1)
+        ftpData.connectionData.theMainSocket = takeActivatedListenSocket(0);
+
+#ifdef OPENSSL_ENABLED
+    if (ftpData.ftpParameters.implicitTlsPort > 0 && ftpData.connectionData.theImplicitTlsSocket == -1)
+        ftpData.connectionData.theImplicitTlsSocket = takeActivatedListenSocket(1);
+#endif
+
+    ftpData.upgradeReadyDescriptor = -1;
+    ftpData.listenSocketsReleased = 0;
+    ftpData.drainIsActive = 0;
+    ftpData.drainDeadline = 0;
+    ftpData.idleSince = (int)time(NULL);
+    ftpData.loopWakeTime = HIST_Now();
+
     my_printf("\nRespawn routine okay\n");
 
     //Fork the process
     respawnProcess();
 
+    /* the supervisor only relays signals, the served process handles them */
+    signalHandlerInstall();
+
+    /* connection limits and login failures are shared with every worker process */
+    if (SHST_Init(WRONG_PASSWORD_ALLOWED_RETRY_TIME) != 1)
+    {
+        my_printfError("Shared state segment can't be created");
+        exit(EXIT_FAILURE);
+    }
+
+    if (METRICS_Init() != 1)
+        my_printfError("Metrics segment can't be created");
+
+    ftpData.workerProcessIndex = 0;
+    ftpData.workerProcessCount = 1;
+    if (ftpData.ftpParameters.workerProcesses > 1)
+        ftpData.workerProcessCount = ftpData.ftpParameters.workerProcesses > SHST_MAX_WORKERS ? SHST_MAX_WORKERS : ftpData.ftpParameters.workerProcesses;
+
+    commandNameCount = controlChannelCommandNames(commandNames, METRICS_MAX_COMMANDS);
+    if (METRICS_InitCommandLatency(commandNames, commandNameCount, ftpData.workerProcessCount) != 1)
+        my_printfError("Command latency histograms can't be created");
+
+    if (METRICS_InitTransferPhases(ftpData.workerProcessCount) != 1)
+        my_printfError("Transfer phase histograms can't be created");
+
+    if (ftpData.workerProcessCount > 1)
+    {
+        ftpData.workerProcessIndex = preforkWorkers(ftpData.workerProcessCount);
+        SHST_SetWorker(ftpData.workerProcessIndex);
+        METRICS_SetWorker(ftpData.workerProcessIndex);
+        signalHandlerInstall();
+    }
+
+    /* pinned before any thread is started, the log and watchdog threads inherit the control CPUs */
+    cpuAffinityResult = CPUAFF_Configure(ftpData.ftpParameters.controlCpuList, ftpData.ftpParameters.transferCpuList, ftpData.ftpParameters.followIncomingCpu);
+    if (cpuAffinityResult == 1)
+        CPUAFF_PinControlThread(ftpData.workerProcessIndex, ftpData.workerProcessCount);
+
     //Init log
+    logSetLevels(ftpData.ftpParameters.logLevels);
     logInit(ftpData.ftpParameters.logFolder, ftpData.ftpParameters.maximumLogFileCount);
 
+    if (cpuAffinityResult != 1)
+        LOG_ERROR("CPU_AFFINITY_CONTROL or CPU_AFFINITY_TRANSFER has no usable CPU, the threads are not pinned");
+
+    /* one endpoint for the whole server, the workers share the counters */
+    if (ftpData.workerProcessIndex == 0 &&
+        METRICS_StartServer(ftpData.ftpParameters.metricsAddress) == -1)
+        LOG_ERROR("Metrics endpoint not started");
+
+    /* the other workers join the port with their own SO_REUSEPORT sockets, or all accept on the activated ones */
+    if (ftpData.workerProcessIndex != 0 && isSocketActivated() == 0)
+    {
+        if (ftpData.connectionData.theMainSocket != -1)
+            close(ftpData.connectionData.theMainSocket);
+
+        if (ftpData.connectionData.theImplicitTlsSocket != -1)
+            close(ftpData.connectionData.theImplicitTlsSocket);
+
+        ftpData.connectionData.theMainSocket = -1;
+        ftpData.connectionData.theImplicitTlsSocket = -1;
+    }
+
     //Socket main creator
-    ftpData.connectionData.theMainSocket = createSocket(&ftpData);
+    if (ftpData.connectionData.theMainSocket == -1)
+        ftpData.connectionData.theMainSocket = createSocket(&ftpData);
+
+    if (ftpData.ftpParameters.implicitTlsPort > 0 && ftpData.connectionData.theImplicitTlsSocket == -1)
+    {
+#ifdef OPENSSL_ENABLED
+        ftpData.connectionData.theImplicitTlsSocket = createListenSocket(&ftpData, ftpData.ftpParameters.implicitTlsPort);
+        if (ftpData.connectionData.theImplicitTlsSocket == -1)
+            LOGF_ERROR("Implicit TLS listener on port %d can't be created", ftpData.ftpParameters.implicitTlsPort);
+#else
+        LOG_ERROR("IMPLICIT_TLS_PORT requires a build with OPENSSL_ENABLED");
+#endif
+    }
 
     printf("\nuFTP server starting..");
 
@@ -91,6 +199,62 @@ void initFtpServer(void)
 
     /* the maximum socket fd is now the main socket descriptor */
     ftpData.connectionData.maxSocketFD = ftpData.connectionData.theMainSocket+1;
+
+    if (ftpData.connectionData.theImplicitTlsSocket != -1)
+        fdAddServiceSocket(&ftpData, ftpData.connectionData.theImplicitTlsSocket);
+
+    /* PAM logins and password hashes are verified off the control thread */
+    authWorkersNeeded = authUsesPasswordHashes(&ftpData.ftpParameters);
+#ifdef PAM_SUPPORT_ENABLED
+    if (ftpData.ftpParameters.pamAuthEnabled == 1)
+        authWorkersNeeded = 1;
+#endif
+
+    if (authWorkersNeeded == 1)
+    {
+        if (WPOOL_Init(&ftpData.authWorkers, ftpData.ftpParameters.authWorkerThreads, ftpData.ftpParameters.maxClients, authExecuteJob) != 1)
+        {
+            LOG_ERROR("Auth worker pool init error restarting the server");
+            exit(0);
+        }
+
+        ftpData.authWorkersOn = 1;
+        fdAddServiceSocket(&ftpData, WPOOL_NotifySocket(&ftpData.authWorkers));
+        CPUAFF_PinTransferThreads(ftpData.authWorkers.threads, ftpData.authWorkers.threadCount);
+    }
+
+#ifdef OPENSSL_ENABLED
+    /* handshake crypto for new control sessions stays out of the main loop */
+    if (ftpData.ftpParameters.tlsHandshakeThreads > 0)
+    {
+        ftpData.tlsHandshakeJobs = DYNMEM_malloc(sizeof(tlsHandshakeJob_DataType) * ftpData.ftpParameters.maxClients, &ftpData.generalDynamicMemoryTable, "tlsHandshakeJobs");
+
+        if (ftpData.tlsHandshakeJobs == NULL ||
+            WPOOL_Init(&ftpData.tlsHandshakeWorkers, ftpData.ftpParameters.tlsHandshakeThreads, ftpData.ftpParameters.maxClients, tlsExecuteHandshakeJob) != 1)
+        {
+            LOG_ERROR("TLS handshake pool init error restarting the server");
+            exit(0);
+        }
+
+        ftpData.tlsHandshakeWorkersOn = 1;
+        fdAddServiceSocket(&ftpData, WPOOL_NotifySocket(&ftpData.tlsHandshakeWorkers));
+        CPUAFF_PinTransferThreads(ftpData.tlsHandshakeWorkers.threads, ftpData.tlsHandshakeWorkers.threadCount);
+    }
+#endif
+
+    /* served by the control loop, which owns the sessions it lists */
+    if (adminChannelInit(&ftpData) == -1)
+        LOG_ERROR("Admin socket can't be created");
+
+#ifdef PAM_SUPPORT_ENABLED
+    if (ftpData.ftpParameters.pamAuthEnabled == 1 &&
+        ftpData.ftpParameters.authCacheTimeToLive > 0 &&
+        ACACHE_Init(&ftpData.authCache, ftpData.ftpParameters.authCacheSize, ftpData.ftpParameters.authCacheTimeToLive) != 1)
+    {
+        LOG_ERROR("Auth cache init error, logins will not be cached");
+    }
+#endif
+
     returnCode = pthread_create(&watchDogThread, NULL, watchDog, NULL);
 
 	if(returnCode != 0)
@@ -99,6 +263,27 @@ void initFtpServer(void)
         LOG_ERROR("Pthead create error restarting the server");
         exit(0);
 	}
+
+    /* the previous binary, if any, can stop accepting */
+    notifyUpgradeReady();
+}
+
+/* Measures the TLS ciphers with the configured certificate and profile, the server is not started */
+int runTlsBenchmark(double seconds)
+{
+#ifdef OPENSSL_ENABLED
+    configurationRead(&ftpData.ftpParameters, &ftpData.generalDynamicMemoryTable);
+    initOpenssl();
+
+    SSL_CTX *serverCtx = createConfiguredServerContext(&ftpData.ftpParameters);
+    if (serverCtx == NULL)
+        return -1;
+
+    return tlsBenchmarkCiphers(serverCtx, seconds);
+#else
+    printf("\nuFTP has been built without OPENSSL_ENABLED\n");
+    return -1;
+#endif
 }
 
 void runFtpServer(void)
@@ -114,6 +299,9 @@ void runFtpServer(void)
     //Server Close
     shutdown(ftpData.connectionData.theMainSocket, SHUT_RDWR);
     close(ftpData.connectionData.theMainSocket);
+
+    if (ftpData.connectionData.theImplicitTlsSocket != -1)
+        close(ftpData.connectionData.theImplicitTlsSocket);
     return;
 }
 
@@ -133,15 +321,20 @@ void deallocateMemory(void)
         DYNMEM_freeAll(&ftpData.clients[i].workerData.memoryTable);
     }
 
-    DYNMEM_freeAll(&ftpData.loginFailsVector.memoryTable);
     DYNMEM_freeAll(&ftpData.ftpParameters.usersVector.memoryTable);
+    HASH_Destroy(&ftpData.ftpParameters.usersIndex);
+    ACACHE_Destroy(&ftpData.authCache);
+    HASH_Destroy(&ftpData.ftpParameters.blockedUsersIndex);
+
+    if (ftpData.ftpParameters.userDatabasePath[0] != '\0')
+        USERDB_Close(&ftpData.userDatabase);
     DYNMEM_freeAll(&ftpData.generalDynamicMemoryTable);
 
     my_printf("\n\nUsed memory at end: %lld", DYNMEM_GetTotalMemory());
     my_printf("\n ftpData.generalDynamicMemoryTable = %p", ftpData.generalDynamicMemoryTable);
 
     #ifdef OPENSSL_ENABLED
-    SSL_CTX_free(ftpData.serverCtx);
+    tlsSetServerContext(NULL);
     cleanupOpenssl();
     #endif
 }
@@ -31,6 +31,7 @@
 
 void initFtpServer(void);
 void runFtpServer(void);
+int runTlsBenchmark(double seconds);
 void signal_callback_handler(int signum);
 void deallocateMemory(void);
 
@@ -5,33 +5,59 @@
  *      Author: ugo
  */
 
-#ifdef PAM_SUPPORT_ENABLED
-
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <stdlib.h>
 
 #include <pwd.h>
+
+#ifdef PAM_SUPPORT_ENABLED
 #include <security/pam_appl.h>
+#endif
 
 #include "auth.h"
 #include "ftpData.h"
 #include "../debugHelper.h"
 
-struct pam_response *reply;
+#ifdef PAM_SUPPORT_ENABLED
 
-// //function used to get user input
-int function_conversation(int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr)
+/* Answers every prompt with the password passed in appdata_ptr, reentrant */
+static int function_conversation(int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr)
 {
-    *resp = reply;
-        return PAM_SUCCESS;
+    struct pam_response *responses;
+
+    if (num_msg <= 0 || num_msg > PAM_MAX_NUM_MSG)
+        return PAM_CONV_ERR;
+
+    responses = calloc(num_msg, sizeof(struct pam_response));
+    if (responses == NULL)
+        return PAM_BUF_ERR;
+
+    for (int i = 0; i < num_msg; i++)
+    {
+        if (msg[i]->msg_style != PAM_PROMPT_ECHO_OFF &&
+            msg[i]->msg_style != PAM_PROMPT_ECHO_ON)
+            continue;
+
+        responses[i].resp = strdup((const char *) appdata_ptr);
+        if (responses[i].resp == NULL)
+        {
+            for (int j = 0; j < i; j++)
+                free(responses[j].resp);
+            free(responses);
+            return PAM_BUF_ERR;
+        }
+    }
+
+    *resp = responses;
+    return PAM_SUCCESS;
 }
 
+/* Safe to call from several threads at once */
 int authenticateSystem(const char *username, const char *password)
 {
-    const struct pam_conv local_conversation = { function_conversation, NULL };
+    const struct pam_conv local_conversation = { function_conversation, (void *) password };
     pam_handle_t *local_auth_handle = NULL; // this gets set by pam_start
 
     int retval;
@@ -43,9 +69,6 @@ int authenticateSystem(const char *username, const char *password)
 		return 0;
     }
 
-    reply = (struct pam_response *)malloc(sizeof(struct pam_response));
-    reply[0].resp = strdup(password);
-    reply[0].resp_retcode = 0;
     retval = pam_authenticate(local_auth_handle, 0);
 
     if (retval != PAM_SUCCESS)
@@ -58,73 +81,90 @@ int authenticateSystem(const char *username, const char *password)
 		{
 			my_printf("pam_authenticate returned %d\n", retval);
 		}
-		return 0;
     }
 
-    retval = pam_end(local_auth_handle, retval);
-
-    if (retval != PAM_SUCCESS)
+    if (pam_end(local_auth_handle, retval) != PAM_SUCCESS)
     {
 		my_printf("pam_end returned\n");
 		return 0;
     }
 
-    return 1;
+    return retval == PAM_SUCCESS ? 1 : 0;
 }
 
+#endif
 
-void loginCheck(char *name, char *password, loginDataType *login, DYNMEM_MemoryTable_DataType **memoryTable)
+/* Runs on an auth worker thread, the password is kept for the local users fallback */
+void authExecuteJob(void *theJob)
 {
-    if (authenticateSystem(name, password) == 1)
+    authJob_DataType *job = theJob;
+
+    job->authenticated = 0;
+
+    if (job->type == AUTH_JOB_PASSWORD_HASH)
     {
-    	struct passwd *pass;
-    	pass = getpwnam(name);
-
-    	if (pass == NULL)
-    	{
-    		login->userLoggedIn = 0;
-    		return;
-    	}
-    	else
-    	{
-			//my_printf("Authenticate with %s - %s through system\n", login, password);
-			setDynamicStringDataType(&login->name, name, strlen(name), &*memoryTable);
-			setDynamicStringDataType(&login->homePath, pass->pw_dir, strlen(pass->pw_dir), &*memoryTable);
-			//setDynamicStringDataType(&login->homePath, "/", 1, &*memoryTable);
-			setDynamicStringDataType(&login->absolutePath, pass->pw_dir, strlen(pass->pw_dir), &*memoryTable);
-            setDynamicStringDataType(&login->ftpPath, "/", strlen("/"), &*memoryTable);
-
-			if (login->homePath.text[login->homePath.textLen-1] != '/')
-			{
-				appendToDynamicStringDataType(&login->homePath, "/", 1, &*memoryTable);
-			}
-
-			if (login->absolutePath.text[login->absolutePath.textLen-1] != '/')
-			{
-				appendToDynamicStringDataType(&login->absolutePath, "/", 1, &*memoryTable);
-			}
-
-			//setDynamicStringDataType(&login->ftpPath, "/", strlen("/"), &*memoryTable);
-
-			login->ownerShip.uid = pass->pw_gid;
-			login->ownerShip.gid = pass->pw_uid;
-			login->ownerShip.ownerShipSet = 1;
-			login->userLoggedIn = 1;
-
-//			my_printf("\nLogin as: %s", pass->pw_name);
-//			my_printf("\nPasswd: %s", pass->pw_passwd);
-//			my_printf("\nDir: %s", pass->pw_dir);
-//			my_printf("\nGid: %d", pass->pw_gid);
-//			my_printf("\nUid: %d", pass->pw_uid);
-//			my_printf("\nlogin->homePath.text: %s", login->homePath.text);
-//			my_printf("\nlogin->absolutePath.text: %s", login->absolutePath.text);
-    	}
+        job->authenticated = PWHASH_Verify(job->password, job->passwordHash);
+        return;
     }
 
+#ifdef PAM_SUPPORT_ENABLED
+    if (authenticateSystem(job->name, job->password) == 1)
+    {
+        struct passwd pass, *result = NULL;
+        char passBuffer[4096];
+
+        if (getpwnam_r(job->name, &pass, passBuffer, sizeof(passBuffer), &result) == 0 &&
+            result != NULL &&
+            pass.pw_dir[0] != '\0' &&
+            strlen(pass.pw_dir) < sizeof(job->homePath))
+        {
+            strcpy(job->homePath, pass.pw_dir);
+            job->uid = pass.pw_uid;
+            job->gid = pass.pw_gid;
+            job->authenticated = 1;
+        }
+    }
+#endif
 }
 
+/* Main thread, fills the session login data of a system user */
+void authApplySystemLogin(authJob_DataType *job, loginDataType *login, DYNMEM_MemoryTable_DataType **memoryTable)
+{
+    setDynamicStringDataType(&login->name, job->name, strlen(job->name), &*memoryTable);
+    setDynamicStringDataType(&login->homePath, job->homePath, strlen(job->homePath), &*memoryTable);
+    setDynamicStringDataType(&login->absolutePath, job->homePath, strlen(job->homePath), &*memoryTable);
+    setDynamicStringDataType(&login->ftpPath, "/", strlen("/"), &*memoryTable);
 
-#endif
+    if (login->homePath.text[login->homePath.textLen-1] != '/')
+    {
+        appendToDynamicStringDataType(&login->homePath, "/", 1, &*memoryTable);
+    }
+
+    if (login->absolutePath.text[login->absolutePath.textLen-1] != '/')
+    {
+        appendToDynamicStringDataType(&login->absolutePath, "/", 1, &*memoryTable);
+    }
 
+    login->ownerShip.uid = job->uid;
+    login->ownerShip.gid = job->gid;
+    login->ownerShip.ownerShipSet = 1;
+    login->userLoggedIn = 1;
+}
+
+/* The auth workers are needed to verify hashed passwords, the user database may hold some too */
+int authUsesPasswordHashes(ftpParameters_DataType *ftpParameters)
+{
+    if (PWHASH_IsSupported() == 0)
+        return 0;
 
+    if (ftpParameters->userDatabasePath[0] != '\0')
+        return 1;
 
+    for (int i = 0; i < ftpParameters->usersVector.Size; i++)
+    {
+        if (PWHASH_IsHash(((usersParameters_DataType *) ftpParameters->usersVector.Data[i])->password))
+            return 1;
+    }
+
+    return 0;
+}
@@ -8,11 +8,38 @@
 #ifndef LIBRARY_AUTH_H_
 #define LIBRARY_AUTH_H_
 
-#ifdef PAM_SUPPORT_ENABLED
+#include <limits.h>
+#include <sys/types.h>
 
 #include "ftpData.h"
+#include "passwordHash.h"
+
+#define AUTH_FIELD_SIZE     256
+
+#define AUTH_JOB_SYSTEM_LOGIN       0
+#define AUTH_JOB_PASSWORD_HASH      1
+
+/* Login handed to the auth workers, result fields are filled by authExecuteJob */
+struct authJob
+{
+    int type;
+    int clientId;
+    unsigned long long int serial;
+    char name[AUTH_FIELD_SIZE];
+    char password[AUTH_FIELD_SIZE];
+    char passwordHash[PWHASH_MAXIMUM_SIZE];
 
-void loginCheck(char *name, char *password, loginDataType *login, DYNMEM_MemoryTable_DataType **memoryTable);
+    int authenticated;
+    char homePath[PATH_MAX];
+    uid_t uid;
+    gid_t gid;
+} typedef authJob_DataType;
+
+void authExecuteJob(void *job);
+int authUsesPasswordHashes(ftpParameters_DataType *ftpParameters);
+void authApplySystemLogin(authJob_DataType *job, loginDataType *login, DYNMEM_MemoryTable_DataType **memoryTable);
+
+#ifdef PAM_SUPPORT_ENABLED
 int authenticateSystem(const char *username, const char *password);
 #endif
 
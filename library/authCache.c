@@ -0,0 +1,254 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "authCache.h"
+#include "dynamicMemory.h"
+
+#define ROTATE_LEFT(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = ROTATE_LEFT(v1, 13); v1 ^= v0; v0 = ROTATE_LEFT(v0, 32); \
+        v2 += v3; v3 = ROTATE_LEFT(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTATE_LEFT(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTATE_LEFT(v1, 17); v1 ^= v2; v2 = ROTATE_LEFT(v2, 32); \
+    } while (0)
+
+static uint64_t sipHash(const uint64_t key[2], const unsigned char *data, size_t length);
+static uint64_t credentialsHash(ACACHE_Cache_DataType *cache, const char *name, const char *password);
+static ACACHE_Entry_DataType *entryFor(ACACHE_Cache_DataType *cache, const char *name);
+static void clearEntry(ACACHE_Cache_DataType *cache, ACACHE_Entry_DataType *entry);
+
+/* SipHash-2-4 */
+static uint64_t sipHash(const uint64_t key[2], const unsigned char *data, size_t length)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+    uint64_t last = (uint64_t) length << 56;
+    size_t blocks = length / 8;
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        uint64_t m = 0;
+
+        for (int b = 0; b < 8; b++)
+            m |= (uint64_t) data[i * 8 + b] << (8 * b);
+
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    for (size_t b = 0; b < length % 8; b++)
+        last |= (uint64_t) data[blocks * 8 + b] << (8 * b);
+
+    v3 ^= last;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* name and password separated by a NUL, so "ab"+"c" and "a"+"bc" differ */
+static uint64_t credentialsHash(ACACHE_Cache_DataType *cache, const char *name, const char *password)
+{
+    size_t nameLength = strlen(name);
+    size_t passwordLength = strlen(password);
+    size_t length = nameLength + 1 + passwordLength;
+    unsigned char *buffer = malloc(length);
+    uint64_t hash;
+
+    if (buffer == NULL)
+        return 0;
+
+    memcpy(buffer, name, nameLength + 1);
+    memcpy(buffer + nameLength + 1, password, passwordLength);
+    hash = sipHash(cache->key, buffer, length);
+
+    memset(buffer, 0, length);
+    free(buffer);
+    return hash;
+}
+
+static ACACHE_Entry_DataType *entryFor(ACACHE_Cache_DataType *cache, const char *name)
+{
+    uint64_t slot = sipHash(cache->key, (const unsigned char *) name, strlen(name));
+    return &cache->entries[slot & (cache->size - 1)];
+}
+
+static void clearEntry(ACACHE_Cache_DataType *cache, ACACHE_Entry_DataType *entry)
+{
+    if (entry->name != NULL)
+        DYNMEM_free(entry->name, &cache->memoryTable);
+
+    if (entry->homePath != NULL)
+        DYNMEM_free(entry->homePath, &cache->memoryTable);
+
+    memset(entry, 0, sizeof(ACACHE_Entry_DataType));
+}
+
+/* size is rounded up to a power of two, returns 1 on success */
+int ACACHE_Init(ACACHE_Cache_DataType *cache, int size, int timeToLive)
+{
+    int randomFd;
+    int capacity = 1;
+
+    memset(cache, 0, sizeof(ACACHE_Cache_DataType));
+
+    while (capacity < size)
+        capacity <<= 1;
+
+    randomFd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (randomFd < 0)
+        return -1;
+
+    if (read(randomFd, cache->key, sizeof(cache->key)) != sizeof(cache->key))
+    {
+        close(randomFd);
+        return -1;
+    }
+    close(randomFd);
+
+    cache->entries = DYNMEM_malloc(capacity * sizeof(ACACHE_Entry_DataType), &cache->memoryTable, "authCache");
+    if (cache->entries == NULL)
+        return -1;
+
+    memset(cache->entries, 0, capacity * sizeof(ACACHE_Entry_DataType));
+    cache->size = capacity;
+    cache->timeToLive = timeToLive;
+
+    return 1;
+}
+
+/* Returns 1 and the login data if the same credentials succeeded less than timeToLive seconds ago */
+int ACACHE_Lookup(ACACHE_Cache_DataType *cache, const char *name, const char *password, char *homePath, int homePathSize, uid_t *uid, gid_t *gid)
+{
+    ACACHE_Entry_DataType *entry;
+
+    if (cache->entries == NULL)
+        return 0;
+
+    entry = entryFor(cache, name);
+
+    if (entry->name == NULL ||
+        strcmp(entry->name, name) != 0)
+    {
+        cache->misses++;
+        return 0;
+    }
+
+    if (entry->expireTime <= time(NULL) ||
+        strlen(entry->homePath) >= homePathSize)
+    {
+        clearEntry(cache, entry);
+        cache->misses++;
+        return 0;
+    }
+
+    if (entry->passwordHash != credentialsHash(cache, name, password))
+    {
+        cache->misses++;
+        return 0;
+    }
+
+    strcpy(homePath, entry->homePath);
+    *uid = entry->uid;
+    *gid = entry->gid;
+    cache->hits++;
+
+    return 1;
+}
+
+void ACACHE_Store(ACACHE_Cache_DataType *cache, const char *name, const char *password, const char *homePath, uid_t uid, gid_t gid)
+{
+    ACACHE_Entry_DataType *entry;
+
+    if (cache->entries == NULL)
+        return;
+
+    entry = entryFor(cache, name);
+    clearEntry(cache, entry);
+
+    entry->name = DYNMEM_malloc(strlen(name) + 1, &cache->memoryTable, "authCacheName");
+    entry->homePath = DYNMEM_malloc(strlen(homePath) + 1, &cache->memoryTable, "authCacheHome");
+
+    if (entry->name == NULL ||
+        entry->homePath == NULL)
+    {
+        clearEntry(cache, entry);
+        return;
+    }
+
+    strcpy(entry->name, name);
+    strcpy(entry->homePath, homePath);
+    entry->passwordHash = credentialsHash(cache, name, password);
+    entry->uid = uid;
+    entry->gid = gid;
+    entry->expireTime = time(NULL) + cache->timeToLive;
+}
+
+void ACACHE_Invalidate(ACACHE_Cache_DataType *cache, const char *name)
+{
+    ACACHE_Entry_DataType *entry;
+
+    if (cache->entries == NULL)
+        return;
+
+    entry = entryFor(cache, name);
+
+    if (entry->name != NULL &&
+        strcmp(entry->name, name) == 0)
+        clearEntry(cache, entry);
+}
+
+void ACACHE_Flush(ACACHE_Cache_DataType *cache)
+{
+    if (cache->entries == NULL)
+        return;
+
+    for (int i = 0; i < cache->size; i++)
+        clearEntry(cache, &cache->entries[i]);
+}
+
+void ACACHE_Destroy(ACACHE_Cache_DataType *cache)
+{
+    DYNMEM_freeAll(&cache->memoryTable);
+    memset(cache, 0, sizeof(ACACHE_Cache_DataType));
+}
@@ -0,0 +1,74 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef AUTH_CACHE_H
+#define AUTH_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "dynamicMemory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Short lived cache of successful system logins, used only by the control thread.
+ * Direct mapped by user name, the password is kept as a SipHash keyed with a
+ * random per process secret so the cache never holds it in clear.
+ */
+struct ACACHE_Entry
+{
+    char *name;
+    char *homePath;
+    uint64_t passwordHash;
+    uid_t uid;
+    gid_t gid;
+    time_t expireTime;
+} typedef ACACHE_Entry_DataType;
+
+struct ACACHE_Cache
+{
+    ACACHE_Entry_DataType *entries;
+    int size;
+    int timeToLive;
+    uint64_t key[2];
+    unsigned long long int hits;
+    unsigned long long int misses;
+    DYNMEM_MemoryTable_DataType *memoryTable;
+} typedef ACACHE_Cache_DataType;
+
+int ACACHE_Init(ACACHE_Cache_DataType *cache, int size, int timeToLive);
+int ACACHE_Lookup(ACACHE_Cache_DataType *cache, const char *name, const char *password, char *homePath, int homePathSize, uid_t *uid, gid_t *gid);
+void ACACHE_Store(ACACHE_Cache_DataType *cache, const char *name, const char *password, const char *homePath, uid_t uid, gid_t gid);
+void ACACHE_Invalidate(ACACHE_Cache_DataType *cache, const char *name);
+void ACACHE_Flush(ACACHE_Cache_DataType *cache);
+void ACACHE_Destroy(ACACHE_Cache_DataType *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AUTH_CACHE_H */
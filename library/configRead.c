@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "configRead.h"
 #include "../ftpData.h"
@@ -39,6 +40,9 @@
 #include "fileManagement.h"
 #include "daemon.h"
 #include "dynamicMemory.h"
+#include "hashTable.h"
+#include "log.h"
+#include "auth.h"
 
 #define PARAMETER_SIZE_LIMIT        1024
 
@@ -46,6 +50,22 @@
 static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_VectorGenericDataType *parametersVector);
 static int searchParameter(char *name, DYNV_VectorGenericDataType *parametersVector);
 static int readConfigurationFile(char *path, DYNV_VectorGenericDataType *parametersVector, DYNMEM_MemoryTable_DataType ** memoryTable);
+static int readConfiguration(ftpParameters_DataType *ftpParameters, DYNMEM_MemoryTable_DataType **memoryTable);
+static void releaseUsers(ftpParameters_DataType *ftpParameters);
+static int validateReloadedConfiguration(ftpParameters_DataType *ftpParameters, int parametersCount);
+static void reportRestartRequired(const char *name, int changed);
+static void *reloadConfigurationThread(void *arg);
+
+/* Name -> parametersVector index, valid while the configuration is being parsed */
+static HASH_Table_DataType parametersIndex;
+
+/* SIGHUP reload, the file is parsed on a thread and applied by the control loop */
+#define CONFIGURATION_RELOAD_IDLE       0
+#define CONFIGURATION_RELOAD_RUNNING    1
+#define CONFIGURATION_RELOAD_READY      2
+
+static int configurationReloadState = CONFIGURATION_RELOAD_IDLE;
+static ftpParameters_DataType reloadedParameters;
 
 void destroyConfigurationVectorElement(DYNV_VectorGenericDataType *theVector)
 {
@@ -61,61 +81,50 @@ void destroyConfigurationVectorElement(DYNV_VectorGenericDataType *theVector)
 }
 
 /* Public Functions */
-int searchUser(char *name, DYNV_VectorGenericDataType *usersVector)
+/* Returns the index of the user in usersVector or -1 */
+int searchUser(char *name, ftpParameters_DataType *ftpParameters)
 {
-    int returnCode = -1;
-    int i = 0;
-
-    for (i = 0; i <usersVector->Size; i++)
-    {
-        if (strcmp(name, ((usersParameters_DataType *) usersVector->Data[i])->name) == 0)
-        {
-            return i;
-        }
-    }
-
-    return returnCode;
+    return HASH_Search(&ftpParameters->usersIndex, name);
+}
 
+/* Returns the index of the user in blockedUsersVector or -1 */
+int searchBlockedUser(char *name, ftpParameters_DataType *ftpParameters)
+{
+    return HASH_Search(&ftpParameters->blockedUsersIndex, name);
 }
 
-void configurationRead(ftpParameters_DataType *ftpParameters, DYNMEM_MemoryTable_DataType **memoryTable)
+/* (Re)build the lookup tables, must be called every time the users vectors change */
+void buildUsersIndex(ftpParameters_DataType *ftpParameters)
 {
-    int returnCode = 0;
-    DYNV_VectorGenericDataType configParameters;
-    DYNV_VectorGeneric_Init(&configParameters);
-    memset(ftpParameters, 0, sizeof(ftpParameters_DataType));
+    HASH_Destroy(&ftpParameters->usersIndex);
+    HASH_Destroy(&ftpParameters->blockedUsersIndex);
 
-    if (FILE_IsFile(LOCAL_CONFIGURATION_FILENAME, 1) == 1)
-    {
-        my_printf("\nReading configuration from \n -> %s \n", LOCAL_CONFIGURATION_FILENAME);
-        returnCode = readConfigurationFile(LOCAL_CONFIGURATION_FILENAME, &configParameters, memoryTable);
-    }
-    else if (FILE_IsFile(DEFAULT_CONFIGURATION_FILENAME, 1) == 1)
+    HASH_Init(&ftpParameters->usersIndex, ftpParameters->usersVector.Size);
+    for (int i = 0; i < ftpParameters->usersVector.Size; i++)
     {
-        my_printf("\nReading configuration from \n -> %s\n", DEFAULT_CONFIGURATION_FILENAME);
-        returnCode = readConfigurationFile(DEFAULT_CONFIGURATION_FILENAME, &configParameters, memoryTable);
+        HASH_Insert(&ftpParameters->usersIndex, ((usersParameters_DataType *) ftpParameters->usersVector.Data[i])->name, i);
     }
 
-    if (returnCode == 1)
+    HASH_Init(&ftpParameters->blockedUsersIndex, ftpParameters->blockedUsersVector.Size);
+    for (int i = 0; i < ftpParameters->blockedUsersVector.Size; i++)
     {
-        parseConfigurationFile(ftpParameters, &configParameters);
+        HASH_Insert(&ftpParameters->blockedUsersIndex, ftpParameters->blockedUsersVector.Data[i], i);
     }
-    else
+}
+
+void configurationRead(ftpParameters_DataType *ftpParameters, DYNMEM_MemoryTable_DataType **memoryTable)
+{
+    if (readConfiguration(ftpParameters, memoryTable) == -1)
     {
         my_printf("\nError: could not read the configuration file located at: \n -> %s or at \n -> %s", DEFAULT_CONFIGURATION_FILENAME, LOCAL_CONFIGURATION_FILENAME);
         exit(1);
     }
-
-    DYNV_VectorGeneric_Destroy(&configParameters, destroyConfigurationVectorElement);
-    //my_printf("\n\nconfigParameters.memoryTable = %d ***", configParameters.memoryTable);
-
-    return;
 }
 
 void applyConfiguration(ftpParameters_DataType *ftpParameters)
 {
-    /* Fork the process daemon mode */
-    if (ftpParameters->daemonModeOn == 1)
+    /* Fork the process daemon mode, an upgraded binary is already detached and systemd supervises an activated one */
+    if (ftpParameters->daemonModeOn == 1 && isUpgradedProcess() == 0 && isSocketActivated() == 0)
     {
         daemonize("uFTP");
     }
@@ -142,11 +151,17 @@ void initFtpData(ftpDataType *ftpData)
 
 	#ifdef OPENSSL_ENABLED
 	initOpenssl();
-	ftpData->serverCtx = createServerContext();
-	configureContext(ftpData->serverCtx, ftpData->ftpParameters.certificatePath, ftpData->ftpParameters.privateCertificatePath);
+	SSL_CTX *serverCtx = createConfiguredServerContext(&ftpData->ftpParameters);
+	if (serverCtx == NULL)
+		exit(EXIT_FAILURE);
+
+	tlsSetServerContext(serverCtx);
+	tlsInitSslPool(ftpData->ftpParameters.tlsSslPoolSize);
 	#endif
 
     ftpData->connectedClients = 0;
+    ftpData->workerProcessIndex = 0;
+    ftpData->workerProcessCount = 1;
     ftpData->clients = (clientDataType *) DYNMEM_malloc((sizeof(clientDataType) * ftpData->ftpParameters.maxClients), &ftpData->generalDynamicMemoryTable, "ClientData");
 
 	//my_printf("\nDYNMEM_malloc called");
@@ -165,7 +180,20 @@ void initFtpData(ftpDataType *ftpData)
     memset(ftpData->welcomeMessage, 0, 1024);
     strcpy(ftpData->welcomeMessage, "220 Hello\r\n");
 
-    DYNV_VectorGeneric_InitWithSearchFunction(&ftpData->loginFailsVector, searchInLoginFailsVector);
+
+    ftpData->authWorkersOn = 0;
+    ftpData->authJobsMemoryTable = NULL;
+
+	#ifdef OPENSSL_ENABLED
+    ftpData->tlsHandshakeWorkersOn = 0;
+    ftpData->tlsHandshakeJobs = NULL;
+	#endif
+
+    if (ftpData->ftpParameters.userDatabasePath[0] != '\0' &&
+        USERDB_Open(&ftpData->userDatabase, ftpData->ftpParameters.userDatabasePath) != 1)
+    {
+        my_printf("\nWarning: user database %s not loaded, it will be retried on login", ftpData->ftpParameters.userDatabasePath);
+    }
 
     //Client data reset to zero
     for (i = 0; i < ftpData->ftpParameters.maxClients; i++)
@@ -178,7 +206,275 @@ void initFtpData(ftpDataType *ftpData)
     return;
 }
 
+#ifdef OPENSSL_ENABLED
+/* Certificate, TLS profile and session resumption from the configuration, NULL if any of them is invalid */
+SSL_CTX *createConfiguredServerContext(ftpParameters_DataType *ftpParameters)
+{
+    SSL_CTX *ctx = createServerContext();
+
+    if (configureContext(ctx, ftpParameters->certificatePath, ftpParameters->privateCertificatePath) != 1 ||
+        configureTlsProfile(ctx, ftpParameters->tlsMinimumVersion, ftpParameters->tlsCiphers, ftpParameters->tlsCipherSuites,
+                            ftpParameters->tlsGroups, ftpParameters->tlsPreferServerCiphers, ftpParameters->tlsPrioritizeChaCha) != 1)
+    {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    /* idle sessions give their read and write buffers back */
+    if (ftpParameters->tlsReleaseBuffers == 1)
+        SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+    configureSessionResumption(ctx, ftpParameters->tlsSessionCacheSize, ftpParameters->tlsSessionTimeout,
+                               ftpParameters->tlsSessionTickets, ftpParameters->tlsTicketKeyRotation);
+    return ctx;
+}
+#endif
+
+/*
+ * Starts a SIGHUP reload: the file is parsed into a new parameter set and
+ * validated off the control thread, the TLS context is rebuilt from it.
+ * The control loop publishes it with applyReloadedConfiguration.
+ */
+int reloadConfiguration(void)
+{
+    pthread_t reloadThread;
+    int expected = CONFIGURATION_RELOAD_IDLE;
+
+    if (__atomic_compare_exchange_n(&configurationReloadState, &expected, CONFIGURATION_RELOAD_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    if (pthread_create(&reloadThread, NULL, reloadConfigurationThread, NULL) != 0)
+    {
+        __atomic_store_n(&configurationReloadState, CONFIGURATION_RELOAD_IDLE, __ATOMIC_RELEASE);
+        LOG_ERROR("Configuration reload thread can't be created");
+        return -1;
+    }
+
+    pthread_detach(reloadThread);
+    return 1;
+}
+
+int isConfigurationReloadRunning(void)
+{
+    return __atomic_load_n(&configurationReloadState, __ATOMIC_ACQUIRE) != CONFIGURATION_RELOAD_IDLE;
+}
+
+/*
+ * Called by the control loop on every pass, the new settings are published
+ * between two passes so a command never sees a mix of both sets.
+ * Returns 1 when a reloaded configuration has been applied.
+ */
+int applyReloadedConfiguration(ftpDataType *ftpData)
+{
+    ftpParameters_DataType *current = &ftpData->ftpParameters;
+    ftpParameters_DataType *reloaded = &reloadedParameters;
+
+    if (__atomic_load_n(&configurationReloadState, __ATOMIC_ACQUIRE) != CONFIGURATION_RELOAD_READY)
+        return 0;
+
+    reportRestartRequired("MAXIMUM_ALLOWED_FTP_CONNECTION", current->maxClients != reloaded->maxClients);
+    reportRestartRequired("FTP_PORT", current->port != reloaded->port);
+    reportRestartRequired("IMPLICIT_TLS_PORT", current->implicitTlsPort != reloaded->implicitTlsPort);
+    reportRestartRequired("FTP_SERVER_IP", memcmp(current->ftpIpAddressV4, reloaded->ftpIpAddressV4, sizeof(current->ftpIpAddressV4)) != 0);
+    reportRestartRequired("SERVER_IP", strcmp(current->natIpAddress, reloaded->natIpAddress) != 0);
+    reportRestartRequired("DAEMON_MODE", current->daemonModeOn != reloaded->daemonModeOn);
+    reportRestartRequired("SINGLE_INSTANCE", current->singleInstanceModeOn != reloaded->singleInstanceModeOn);
+    reportRestartRequired("WORKER_PROCESSES", current->workerProcesses != reloaded->workerProcesses);
+    reportRestartRequired("CPU_AFFINITY_CONTROL", strcmp(current->controlCpuList, reloaded->controlCpuList) != 0);
+    reportRestartRequired("CPU_AFFINITY_TRANSFER", strcmp(current->transferCpuList, reloaded->transferCpuList) != 0);
+    reportRestartRequired("CPU_AFFINITY_FOLLOW_RX", current->followIncomingCpu != reloaded->followIncomingCpu);
+    reportRestartRequired("METRICS_ADDRESS", strcmp(current->metricsAddress, reloaded->metricsAddress) != 0);
+    reportRestartRequired("ADMIN_SOCKET", strcmp(current->adminSocketPath, reloaded->adminSocketPath) != 0);
+    reportRestartRequired("LOG_FOLDER", strcmp(current->logFolder, reloaded->logFolder) != 0);
+    reportRestartRequired("MAXIMUM_LOG_FILES", current->maximumLogFileCount != reloaded->maximumLogFileCount);
+    reportRestartRequired("ENABLE_PAM_AUTH", current->pamAuthEnabled != reloaded->pamAuthEnabled);
+    reportRestartRequired("AUTH_WORKER_THREADS", current->authWorkerThreads != reloaded->authWorkerThreads);
+    reportRestartRequired("AUTH_CACHE_TTL", current->authCacheTimeToLive != reloaded->authCacheTimeToLive);
+    reportRestartRequired("AUTH_CACHE_SIZE", current->authCacheSize != reloaded->authCacheSize);
+    reportRestartRequired("TLS_HANDSHAKE_THREADS", current->tlsHandshakeThreads != reloaded->tlsHandshakeThreads);
+    reportRestartRequired("TLS_SSL_POOL_SIZE", current->tlsSslPoolSize != reloaded->tlsSslPoolSize);
+
+    if (ftpData->authWorkersOn == 0 && authUsesPasswordHashes(reloaded) == 1)
+        LOG_INFO("Configuration reload: password hashes are verified on the control thread until uFTP is restarted");
+
+    /* sessions copied what they need at login, the previous users can go */
+    releaseUsers(current);
+    current->usersVector = reloaded->usersVector;
+    current->blockedUsersVector = reloaded->blockedUsersVector;
+    current->usersIndex = reloaded->usersIndex;
+    current->blockedUsersIndex = reloaded->blockedUsersIndex;
+
+    if (strcmp(current->userDatabasePath, reloaded->userDatabasePath) != 0)
+    {
+        if (current->userDatabasePath[0] != '\0')
+            USERDB_Close(&ftpData->userDatabase);
+
+        memcpy(current->userDatabasePath, reloaded->userDatabasePath, sizeof(current->userDatabasePath));
+
+        if (current->userDatabasePath[0] != '\0' &&
+            USERDB_Open(&ftpData->userDatabase, current->userDatabasePath) != 1)
+            LOGF_ERROR("Configuration reload: user database %s not loaded, it will be retried on login", current->userDatabasePath);
+    }
+    else if (current->userDatabasePath[0] != '\0')
+    {
+        USERDB_Reload(&ftpData->userDatabase);
+    }
+
+    /* limits and timeouts */
+    current->maximumIdleInactivity = reloaded->maximumIdleInactivity;
+    current->drainTimeout = reloaded->drainTimeout;
+    current->idleExitTimeout = reloaded->idleExitTimeout;
+    current->transferTraceThreshold = reloaded->transferTraceThreshold;
+    current->transferRateLimit = reloaded->transferRateLimit;
+    current->maximumConnectionsPerIp = reloaded->maximumConnectionsPerIp;
+    current->maximumUserAndPassowrdLoginTries = reloaded->maximumUserAndPassowrdLoginTries;
+    current->authTimeout = reloaded->authTimeout;
+    current->maximumPendingAuthPerIp = reloaded->maximumPendingAuthPerIp;
+    current->forceTLS = reloaded->forceTLS;
+    current->connectionPortMin = reloaded->connectionPortMin;
+    current->connectionPortMax = reloaded->connectionPortMax;
+
+    memcpy(current->logLevels, reloaded->logLevels, sizeof(current->logLevels));
+    logSetLevels(current->logLevels);
+
+    /* already in the TLS context built by the reload thread */
+    memcpy(current->certificatePath, reloaded->certificatePath, sizeof(current->certificatePath));
+    memcpy(current->privateCertificatePath, reloaded->privateCertificatePath, sizeof(current->privateCertificatePath));
+    current->tlsSessionCacheSize = reloaded->tlsSessionCacheSize;
+    current->tlsSessionTimeout = reloaded->tlsSessionTimeout;
+    current->tlsSessionTickets = reloaded->tlsSessionTickets;
+    current->tlsTicketKeyRotation = reloaded->tlsTicketKeyRotation;
+    current->tlsMinimumVersion = reloaded->tlsMinimumVersion;
+    current->tlsPreferServerCiphers = reloaded->tlsPreferServerCiphers;
+    current->tlsPrioritizeChaCha = reloaded->tlsPrioritizeChaCha;
+    memcpy(current->tlsCiphers, reloaded->tlsCiphers, sizeof(current->tlsCiphers));
+    memcpy(current->tlsCipherSuites, reloaded->tlsCipherSuites, sizeof(current->tlsCipherSuites));
+    memcpy(current->tlsGroups, reloaded->tlsGroups, sizeof(current->tlsGroups));
+    current->tlsDataRecordSize = reloaded->tlsDataRecordSize;
+    current->tlsDataSmallRecordBytes = reloaded->tlsDataSmallRecordBytes;
+    current->tlsReleaseBuffers = reloaded->tlsReleaseBuffers;
+
+    /* cached logins may belong to users that are gone */
+    ACACHE_Flush(&ftpData->authCache);
+
+    memset(reloaded, 0, sizeof(ftpParameters_DataType));
+    __atomic_store_n(&configurationReloadState, CONFIGURATION_RELOAD_IDLE, __ATOMIC_RELEASE);
+
+    LOGF_INFO("Configuration reloaded, %d users", current->usersVector.Size);
+    return 1;
+}
+
 /*Private functions*/
+static void *reloadConfigurationThread(void *arg)
+{
+    DYNMEM_MemoryTable_DataType *memoryTable = NULL;
+    int parametersCount = readConfiguration(&reloadedParameters, &memoryTable);
+
+    if (validateReloadedConfiguration(&reloadedParameters, parametersCount) != 1)
+    {
+        releaseUsers(&reloadedParameters);
+        memset(&reloadedParameters, 0, sizeof(ftpParameters_DataType));
+        __atomic_store_n(&configurationReloadState, CONFIGURATION_RELOAD_IDLE, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+#ifdef OPENSSL_ENABLED
+    SSL_CTX *ctx = createConfiguredServerContext(&reloadedParameters);
+
+    if (ctx == NULL)
+    {
+        LOGF_ERROR("TLS reload of %s failed, new connections keep using the current certificate", reloadedParameters.certificatePath);
+    }
+    else
+    {
+        tlsSetServerContext(ctx);
+        LOGF_INFO("TLS certificate %s reloaded", reloadedParameters.certificatePath);
+    }
+#endif
+
+    __atomic_store_n(&configurationReloadState, CONFIGURATION_RELOAD_READY, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* A broken file must not replace a working configuration */
+static int validateReloadedConfiguration(ftpParameters_DataType *ftpParameters, int parametersCount)
+{
+    if (parametersCount <= 0)
+    {
+        LOG_ERROR("Configuration reload: the configuration file can't be read or is empty, nothing changed");
+        return -1;
+    }
+
+    if (ftpParameters->maxClients <= 0)
+    {
+        LOGF_ERROR("Configuration reload: invalid MAXIMUM_ALLOWED_FTP_CONNECTION %d, nothing changed", ftpParameters->maxClients);
+        return -1;
+    }
+
+    if (ftpParameters->connectionPortMin <= 0 ||
+        ftpParameters->connectionPortMax > 65535 ||
+        ftpParameters->connectionPortMin > ftpParameters->connectionPortMax)
+    {
+        LOGF_ERROR("Configuration reload: invalid passive port range %d-%d, nothing changed", ftpParameters->connectionPortMin, ftpParameters->connectionPortMax);
+        return -1;
+    }
+
+    return 1;
+}
+
+static void reportRestartRequired(const char *name, int changed)
+{
+    if (changed)
+        LOGF_INFO("Configuration reload: %s changed, restart uFTP to apply it", name);
+}
+
+static void releaseUsers(ftpParameters_DataType *ftpParameters)
+{
+    DYNMEM_freeAll(&ftpParameters->usersVector.memoryTable);
+    DYNV_VectorString_Destroy(&ftpParameters->blockedUsersVector);
+    HASH_Destroy(&ftpParameters->usersIndex);
+    HASH_Destroy(&ftpParameters->blockedUsersIndex);
+}
+
+/* Reads and parses the configuration file, returns the number of parameters or -1 if no file can be read */
+static int readConfiguration(ftpParameters_DataType *ftpParameters, DYNMEM_MemoryTable_DataType **memoryTable)
+{
+    int returnCode = 0, parametersCount = -1;
+    DYNV_VectorGenericDataType configParameters;
+    DYNV_VectorGeneric_Init(&configParameters);
+    memset(ftpParameters, 0, sizeof(ftpParameters_DataType));
+
+    if (FILE_IsFile(LOCAL_CONFIGURATION_FILENAME, 1) == 1)
+    {
+        my_printf("\nReading configuration from \n -> %s \n", LOCAL_CONFIGURATION_FILENAME);
+        returnCode = readConfigurationFile(LOCAL_CONFIGURATION_FILENAME, &configParameters, memoryTable);
+    }
+    else if (FILE_IsFile(DEFAULT_CONFIGURATION_FILENAME, 1) == 1)
+    {
+        my_printf("\nReading configuration from \n -> %s\n", DEFAULT_CONFIGURATION_FILENAME);
+        returnCode = readConfigurationFile(DEFAULT_CONFIGURATION_FILENAME, &configParameters, memoryTable);
+    }
+
+    if (returnCode == 1)
+    {
+        /* Index the parameters once, the first occurrence of a name wins */
+        HASH_Init(&parametersIndex, configParameters.Size);
+        for (int i = 0; i < configParameters.Size; i++)
+        {
+            HASH_Insert(&parametersIndex, ((parameter_DataType *) configParameters.Data[i])->name, i);
+        }
+
+        parseConfigurationFile(ftpParameters, &configParameters);
+        HASH_Destroy(&parametersIndex);
+        parametersCount = configParameters.Size;
+    }
+
+    /* Every parameter lives in the vector memory table, release them in one pass */
+    DYNMEM_freeAll(&configParameters.memoryTable);
+
+    return parametersCount;
+}
+
 static int readConfigurationFile(char *path, DYNV_VectorGenericDataType *parametersVector, DYNMEM_MemoryTable_DataType ** memoryTable)
 {
     #define STATE_START              0
@@ -379,22 +675,12 @@ static int readConfigurationFile(char *path, DYNV_VectorGenericDataType *paramet
 
 static int searchParameter(char *name, DYNV_VectorGenericDataType *parametersVector)
 {
-    int returnCode = -1;
-    int i = 0;
-    
-    for (i = 0; i <parametersVector->Size; i++)
-    {
-        if (strcmp(name, ((parameter_DataType *) parametersVector->Data[i])->name) == 0)
-        {
-            return i;
-        }
-    }
-    return returnCode;
+    return HASH_Search(&parametersIndex, name);
 }
 
 static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_VectorGenericDataType *parametersVector)
 {
-    int searchIndex, userIndex;
+    int searchIndex, userIndex, subsystemIndex, logLevel;
 
     char    userX[PARAMETER_SIZE_LIMIT], 
             passwordX[PARAMETER_SIZE_LIMIT], 
@@ -428,6 +714,49 @@ static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_Ve
         //my_printf("\nMAX_CONNECTION_NUMBER_PER_IP parameter not found in the configuration file, using the default value: %d", ftpParameters->maximumConnectionsPerIp);
     }
 
+    ftpParameters->workerProcesses = 1;
+    searchIndex = searchParameter("WORKER_PROCESSES", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->workerProcesses = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
+
+    searchIndex = searchParameter("CPU_AFFINITY_CONTROL", parametersVector);
+    if (searchIndex != -1)
+    {
+        strncpy(ftpParameters->controlCpuList, ((parameter_DataType *) parametersVector->Data[searchIndex])->value, STRING_SZ_SMALL - 1);
+    }
+
+    searchIndex = searchParameter("CPU_AFFINITY_TRANSFER", parametersVector);
+    if (searchIndex != -1)
+    {
+        strncpy(ftpParameters->transferCpuList, ((parameter_DataType *) parametersVector->Data[searchIndex])->value, STRING_SZ_SMALL - 1);
+    }
+
+    ftpParameters->followIncomingCpu = 0;
+    searchIndex = searchParameter("CPU_AFFINITY_FOLLOW_RX", parametersVector);
+    if (searchIndex != -1)
+    {
+        if (compareStringCaseInsensitive(((parameter_DataType *) parametersVector->Data[searchIndex])->value, "true", strlen("true")) == 1)
+            ftpParameters->followIncomingCpu = 1;
+    }
+
+    ftpParameters->metricsAddress[0] = '\0';
+    searchIndex = searchParameter("METRICS_ADDRESS", parametersVector);
+    if (searchIndex != -1)
+    {
+        strncpy(ftpParameters->metricsAddress, ((parameter_DataType *) parametersVector->Data[searchIndex])->value, MAXIMUM_INODE_NAME - 1);
+        ftpParameters->metricsAddress[MAXIMUM_INODE_NAME - 1] = '\0';
+    }
+
+    ftpParameters->adminSocketPath[0] = '\0';
+    searchIndex = searchParameter("ADMIN_SOCKET", parametersVector);
+    if (searchIndex != -1)
+    {
+        strncpy(ftpParameters->adminSocketPath, ((parameter_DataType *) parametersVector->Data[searchIndex])->value, MAXIMUM_INODE_NAME - 1);
+        ftpParameters->adminSocketPath[MAXIMUM_INODE_NAME - 1] = '\0';
+    }
+
     searchIndex = searchParameter("MAX_CONNECTION_TRY_PER_IP", parametersVector);
     if (searchIndex != -1)
     {
@@ -458,6 +787,39 @@ static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_Ve
         my_printf("\n ftpParameters->logFolder %s", ftpParameters->logFolder);
     }
 
+    searchIndex = searchParameter("LOG_LEVEL", parametersVector);
+    if (searchIndex != -1)
+    {
+        logLevel = logParseLevel(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (logLevel == -1)
+        {
+            my_printf("\nLOG_LEVEL invalid value: %s, using the default value: debug", ((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+            logLevel = LOG_LEVEL_DEBUG;
+        }
+    }
+    else
+    {
+        logLevel = LOG_LEVEL_DEBUG;
+    }
+
+    /* LOG_LEVEL_<SUBSYSTEM> overrides the global level for a single subsystem */
+    for (subsystemIndex = 0; subsystemIndex < LOG_SUBSYSTEM_COUNT; subsystemIndex++)
+    {
+        char logLevelX[PARAMETER_SIZE_LIMIT];
+
+        ftpParameters->logLevels[subsystemIndex] = logLevel;
+        snprintf(logLevelX, PARAMETER_SIZE_LIMIT, "LOG_LEVEL_%s", logSubsystemName(subsystemIndex));
+        searchIndex = searchParameter(logLevelX, parametersVector);
+        if (searchIndex != -1)
+        {
+            int subsystemLevel = logParseLevel(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+            if (subsystemLevel != -1)
+                ftpParameters->logLevels[subsystemIndex] = subsystemLevel;
+            else
+                my_printf("\n%s invalid value: %s", logLevelX, ((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        }
+    }
+
     searchIndex = searchParameter("FTP_PORT", parametersVector);
     if (searchIndex != -1)
     {
@@ -510,6 +872,171 @@ static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_Ve
        // my_printf("\nENABLE_PAM_AUTH parameter not found in the configuration file, using the default value: %d", ftpParameters->pamAuthEnabled);
     }
 
+    ftpParameters->authWorkerThreads = 4;
+    searchIndex = searchParameter("AUTH_WORKER_THREADS", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->authWorkerThreads = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (ftpParameters->authWorkerThreads < 1)
+            ftpParameters->authWorkerThreads = 1;
+    }
+
+    ftpParameters->authTimeout = 30;
+    searchIndex = searchParameter("AUTH_TIMEOUT", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->authTimeout = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (ftpParameters->authTimeout < 1)
+            ftpParameters->authTimeout = 1;
+    }
+
+    ftpParameters->maximumPendingAuthPerIp = 2;
+    searchIndex = searchParameter("MAX_PENDING_AUTH_PER_IP", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->maximumPendingAuthPerIp = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
+
+    ftpParameters->authCacheTimeToLive = 0;
+    searchIndex = searchParameter("AUTH_CACHE_TTL", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->authCacheTimeToLive = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
+
+    ftpParameters->authCacheSize = 1024;
+    searchIndex = searchParameter("AUTH_CACHE_SIZE", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->authCacheSize = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (ftpParameters->authCacheSize < 1)
+            ftpParameters->authCacheSize = 1;
+    }
+
+
+    ftpParameters->tlsSessionCacheSize = 20480;
+    searchIndex = searchParameter("TLS_SESSION_CACHE_SIZE", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->tlsSessionCacheSize = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
+
+    ftpParameters->tlsSessionTimeout = 300;
+    searchIndex = searchParameter("TLS_SESSION_TIMEOUT", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->tlsSessionTimeout = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
+
+    ftpParameters->tlsSessionTickets = 1;
+    searchIndex = searchParameter("TLS_SESSION_TICKETS", parametersVector);
+    if (searchIndex != -1)
+    {
+        if(compareStringCaseInsensitive(((parameter_DataType *) parametersVector->Data[searchIndex])->value, "false", strlen("false")) == 1)
+            ftpParameters->tlsSessionTickets = 0;
+    }
+
+    ftpParameters->tlsTicketKeyRotation = 3600;
+    searchIndex = searchParameter("TLS_TICKET_KEY_ROTATION", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->tlsTicketKeyRotation = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
+
+    ftpParameters->tlsSslPoolSize = 32;
+    searchIndex = searchParameter("TLS_SSL_POOL_SIZE", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->tlsSslPoolSize = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
+
+    ftpParameters->tlsMinimumVersion = 12;
+    searchIndex = searchParameter("TLS_MIN_VERSION", parametersVector);
+    if (searchIndex != -1)
+    {
+        /* configureTlsProfile refuses the 0, the TLS context can't be built as with an invalid cipher list */
+        if (strcmp(((parameter_DataType *) parametersVector->Data[searchIndex])->value, "1.3") == 0)
+        {
+            ftpParameters->tlsMinimumVersion = 13;
+        }
+        else if (strcmp(((parameter_DataType *) parametersVector->Data[searchIndex])->value, "1.2") != 0)
+        {
+            ftpParameters->tlsMinimumVersion = 0;
+            LOGF_ERROR("Invalid TLS_MIN_VERSION %s, use 1.2 or 1.3", ((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        }
+    }
+
+    strcpy(ftpParameters->tlsCiphers, "HIGH:!aNULL:!MD5");
+    searchIndex = searchParameter("TLS_CIPHERS", parametersVector);
+    if (searchIndex != -1)
+    {
+        strncpy(ftpParameters->tlsCiphers, ((parameter_DataType *) parametersVector->Data[searchIndex])->value, STRING_SZ_LARGE - 1);
+    }
+
+    searchIndex = searchParameter("TLS_CIPHERSUITES", parametersVector);
+    if (searchIndex != -1)
+    {
+        strncpy(ftpParameters->tlsCipherSuites, ((parameter_DataType *) parametersVector->Data[searchIndex])->value, STRING_SZ_LARGE - 1);
+    }
+
+    searchIndex = searchParameter("TLS_GROUPS", parametersVector);
+    if (searchIndex != -1)
+    {
+        strncpy(ftpParameters->tlsGroups, ((parameter_DataType *) parametersVector->Data[searchIndex])->value, STRING_SZ_LARGE - 1);
+    }
+
+    ftpParameters->tlsPreferServerCiphers = 0;
+    searchIndex = searchParameter("TLS_PREFER_SERVER_CIPHERS", parametersVector);
+    if (searchIndex != -1)
+    {
+        if(compareStringCaseInsensitive(((parameter_DataType *) parametersVector->Data[searchIndex])->value, "true", strlen("true")) == 1)
+            ftpParameters->tlsPreferServerCiphers = 1;
+    }
+
+    ftpParameters->tlsPrioritizeChaCha = 0;
+    searchIndex = searchParameter("TLS_PRIORITIZE_CHACHA", parametersVector);
+    if (searchIndex != -1)
+    {
+        if(compareStringCaseInsensitive(((parameter_DataType *) parametersVector->Data[searchIndex])->value, "true", strlen("true")) == 1)
+            ftpParameters->tlsPrioritizeChaCha = 1;
+    }
+
+    ftpParameters->tlsDataRecordSize = 16384;
+    searchIndex = searchParameter("TLS_DATA_RECORD_SIZE", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->tlsDataRecordSize = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+
+        /* limits accepted by SSL_set_max_send_fragment */
+        if (ftpParameters->tlsDataRecordSize < 512)
+            ftpParameters->tlsDataRecordSize = 512;
+        if (ftpParameters->tlsDataRecordSize > 16384)
+            ftpParameters->tlsDataRecordSize = 16384;
+    }
+
+    ftpParameters->tlsDataSmallRecordBytes = 16384;
+    searchIndex = searchParameter("TLS_DATA_SMALL_RECORD_BYTES", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->tlsDataSmallRecordBytes = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (ftpParameters->tlsDataSmallRecordBytes < 0)
+            ftpParameters->tlsDataSmallRecordBytes = 0;
+    }
+
+    ftpParameters->tlsReleaseBuffers = 0;
+    searchIndex = searchParameter("TLS_RELEASE_BUFFERS", parametersVector);
+    if (searchIndex != -1)
+    {
+        if(compareStringCaseInsensitive(((parameter_DataType *) parametersVector->Data[searchIndex])->value, "true", strlen("true")) == 1)
+            ftpParameters->tlsReleaseBuffers = 1;
+    }
+
+    ftpParameters->tlsHandshakeThreads = 0;
+    searchIndex = searchParameter("TLS_HANDSHAKE_THREADS", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->tlsHandshakeThreads = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
 
     ftpParameters->forceTLS = 0;
     searchIndex = searchParameter("FORCE_TLS", parametersVector);
@@ -523,6 +1050,13 @@ static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_Ve
         // my_printf("\FORCE_TLS parameter not found in the configuration file, using the default value: %d", ftpParameters->forceTLS);
     }
 
+    ftpParameters->implicitTlsPort = 0;
+    searchIndex = searchParameter("IMPLICIT_TLS_PORT", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->implicitTlsPort = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+    }
+
     searchIndex = searchParameter("SERVER_IP", parametersVector);
     if (searchIndex != -1)
     {
@@ -547,6 +1081,42 @@ static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_Ve
         //my_printf("\nIDLE_MAX_TIMEOUT parameter not found in the configuration file, using the default value: %d", ftpParameters->maximumIdleInactivity);
     }
 
+    ftpParameters->drainTimeout = 300;
+    searchIndex = searchParameter("DRAIN_TIMEOUT", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->drainTimeout = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (ftpParameters->drainTimeout < 0)
+            ftpParameters->drainTimeout = 0;
+    }
+
+    ftpParameters->idleExitTimeout = 0;
+    searchIndex = searchParameter("IDLE_EXIT_TIMEOUT", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->idleExitTimeout = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (ftpParameters->idleExitTimeout < 0)
+            ftpParameters->idleExitTimeout = 0;
+    }
+
+    ftpParameters->transferTraceThreshold = 0;
+    searchIndex = searchParameter("TRANSFER_TRACE_THRESHOLD", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->transferTraceThreshold = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (ftpParameters->transferTraceThreshold < 0)
+            ftpParameters->transferTraceThreshold = 0;
+    }
+
+    ftpParameters->transferRateLimit = 0;
+    searchIndex = searchParameter("TRANSFER_RATE_LIMIT", parametersVector);
+    if (searchIndex != -1)
+    {
+        ftpParameters->transferRateLimit = atoi(((parameter_DataType *) parametersVector->Data[searchIndex])->value);
+        if (ftpParameters->transferRateLimit < 0)
+            ftpParameters->transferRateLimit = 0;
+    }
+
     searchIndex = searchParameter("FTP_SERVER_IP", parametersVector);
     if (searchIndex != -1)
     {
@@ -594,6 +1164,13 @@ static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_Ve
     }
 
 
+    searchIndex = searchParameter("USER_DATABASE_PATH", parametersVector);
+    if (searchIndex != -1)
+    {
+        strncpy(ftpParameters->userDatabasePath, ((parameter_DataType *) parametersVector->Data[searchIndex])->value, MAXIMUM_INODE_NAME - 1);
+        my_printf("\n USER_DATABASE_PATH: %s", ftpParameters->userDatabasePath);
+    }
+
     searchIndex = searchParameter("RANDOM_PORT_START", parametersVector);
     if (searchIndex != -1)
     {
@@ -751,5 +1328,7 @@ static int parseConfigurationFile(ftpParameters_DataType *ftpParameters, DYNV_Ve
         my_printf("\n User %s is blocked", ftpParameters->blockedUsersVector.Data[i]);
     }
 
+    buildUsersIndex(ftpParameters);
+
     return 1;
 }
@@ -39,9 +39,18 @@ extern "C" {
 
 /*Public functions */
 void initFtpData(ftpDataType *ftpData);
-int searchUser(char *name, DYNV_VectorGenericDataType *usersVector);
+int searchUser(char *name, ftpParameters_DataType *ftpParameters);
+int searchBlockedUser(char *name, ftpParameters_DataType *ftpParameters);
+void buildUsersIndex(ftpParameters_DataType *ftpParameters);
 void configurationRead(ftpParameters_DataType *ftpParameters, DYNMEM_MemoryTable_DataType **memoryTable);
 void applyConfiguration(ftpParameters_DataType *ftpParameters);
+int reloadConfiguration(void);
+int isConfigurationReloadRunning(void);
+int applyReloadedConfiguration(ftpDataType *ftpData);
+
+#ifdef OPENSSL_ENABLED
+SSL_CTX *createConfiguredServerContext(ftpParameters_DataType *ftpParameters);
+#endif
 
 
 #ifdef __cplusplus
@@ -36,17 +36,22 @@
 #define _REENTRANT
 #include <pthread.h>
 #include <stdarg.h>
+#include <poll.h>
+#include <time.h>
 
 #include "../debugHelper.h"
 #include "../ftpData.h"
 #include "connection.h"
+#include "openSsl.h"
 #include "log.h"
+#include "sharedState.h"
+#include "metrics.h"
+#include "daemon.h"
+#include "configRead.h"
 
 #include "debug_defines.h"
 
 #ifdef IPV6_ENABLED
-static int is_ipv4_mapped_ipv6(const char *ip);
-
 int is_ipv4_mapped_ipv6(const char *ip) {
   size_t prefix_len = strlen("::ffff:");
 
@@ -60,6 +65,188 @@ int is_ipv4_mapped_ipv6(const char *ip) {
 }
 #endif
 
+#ifdef OPENSSL_ENABLED
+static int waitSocketReady(int sockfd, int wantWrite, struct timespec *deadline);
+#endif
+static int writeControlOutput(ftpDataType * ftpData, int clientId, int *waitForRead);
+static int writeControlReply(ftpDataType * ftpData, int clientId, char *buffer, int size);
+static int acceptClientConnection(ftpDataType * ftpData, int listenSocket, int implicitTls);
+static int startImplicitTls(ftpDataType * ftpData, int clientId);
+static void admitClient(ftpDataType * ftpData, int clientId, int implicitTls);
+static void acceptPendingConnections(ftpDataType * ftpData, int listenSocket, int implicitTls);
+
+#ifdef OPENSSL_ENABLED
+/* Waits until sockfd is readable (or writable), returns 1 when ready, 0 on deadline, -1 on error */
+static int waitSocketReady(int sockfd, int wantWrite, struct timespec *deadline)
+{
+    struct pollfd pollDescriptor;
+    struct timespec now;
+    long long int timeoutMs;
+    int rc;
+
+    pollDescriptor.fd = sockfd;
+    pollDescriptor.events = wantWrite ? POLLOUT : POLLIN;
+    pollDescriptor.revents = 0;
+
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeoutMs = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000LL;
+
+        if (timeoutMs <= 0)
+            return 0;
+
+        rc = poll(&pollDescriptor, 1, (int) timeoutMs);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0)
+        return -1;
+
+    if (rc == 0)
+        return 0;
+
+    /* errors and hang ups are reported by the next read or write */
+    return 1;
+}
+#endif
+
+/*
+ * Writes the queued replies with writeMutex held, returns the bytes left in the queue
+ * or -1 when the connection failed. waitForRead is set when TLS needs the socket readable.
+ */
+static int writeControlOutput(ftpDataType * ftpData, int clientId, int *waitForRead)
+{
+    clientDataType *client = &ftpData->clients[clientId];
+    int pendingSize = client->pendingOutputSize;
+    ssize_t rc;
+
+    *waitForRead = 0;
+
+    while (pendingSize > 0)
+    {
+        if (client->tlsIsEnabled != 1)
+        {
+            rc = write(client->socketDescriptor, client->pendingOutput, pendingSize);
+
+            if (rc > 0)
+            {
+                pendingSize -= rc;
+                memmove(client->pendingOutput, client->pendingOutput + rc, pendingSize);
+                continue;
+            }
+
+            if (rc < 0 && errno == EINTR)
+                continue;
+
+            if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+
+            return -1;
+        }
+        else
+        {
+            #ifdef OPENSSL_ENABLED
+            /*
+             * Without SSL_MODE_ENABLE_PARTIAL_WRITE the queue is written entirely or not at all,
+             * the retry passes the same buffer, replies queued meanwhile only make it longer.
+             */
+            rc = SSL_write(client->ssl, client->pendingOutput, pendingSize);
+
+            if (rc > 0)
+            {
+                pendingSize = 0;
+                break;
+            }
+
+            switch (SSL_get_error(client->ssl, rc))
+            {
+                case SSL_ERROR_WANT_WRITE:
+                    break;
+                case SSL_ERROR_WANT_READ:
+                    *waitForRead = 1;
+                    break;
+                default:
+                    return -1;
+            }
+
+            break;
+            #else
+            return -1;
+            #endif
+        }
+    }
+
+    __atomic_store_n(&client->pendingOutputSize, pendingSize, __ATOMIC_RELAXED);
+    return pendingSize;
+}
+
+/*
+ * The control socket is non blocking and the loop never waits on a client that
+ * stops reading: what the socket can't take is queued and flushed by
+ * flushControlOutput, a client that lets the queue fill up is closed.
+ */
+static int writeControlReply(ftpDataType * ftpData, int clientId, char *buffer, int size)
+{
+    clientDataType *client = &ftpData->clients[clientId];
+    int waitForRead;
+    int returnCode;
+
+    pthread_mutex_lock(&client->writeMutex);
+
+    if (client->pendingOutputSize + size > CONTROL_OUTPUT_BUFFER_SIZE)
+    {
+        pthread_mutex_unlock(&client->writeMutex);
+
+        if (client->closeTheClient == 0)
+            LOGF_AT(LOG_SUBSYSTEM_CONTROL, LOG_LEVEL_ERROR, LOG_ERROR_PREFIX, "Control channel of client %d is not reading its replies, closing it", clientId);
+
+        client->closeTheClient = 1;
+        return -1;
+    }
+
+    memcpy(client->pendingOutput + client->pendingOutputSize, buffer, size);
+    __atomic_store_n(&client->pendingOutputSize, client->pendingOutputSize + size, __ATOMIC_RELAXED);
+    returnCode = writeControlOutput(ftpData, clientId, &waitForRead);
+
+    pthread_mutex_unlock(&client->writeMutex);
+
+    return returnCode < 0 ? -1 : size;
+}
+
+/*
+ * Runs at the end of every pass of the control loop: replies left in a queue by
+ * this pass get the write interest before the next select, the ones queued by a
+ * transfer thread are picked up at the latest when select times out.
+ */
+void flushControlOutput(ftpDataType * ftpData)
+{
+    int clientId, pendingSize, waitForRead;
+
+    for (clientId = 0; clientId < ftpData->ftpParameters.maxClients; clientId++)
+    {
+        clientDataType *client = &ftpData->clients[clientId];
+
+        /* sockets out of the select sets must not get the write interest */
+        if (client->socketIsConnected != 1 ||
+            client->authIsPending == 1 ||
+            client->tlsHandshakeIsPending == 1 ||
+            __atomic_load_n(&client->pendingOutputSize, __ATOMIC_RELAXED) == 0)
+            continue;
+
+        pthread_mutex_lock(&client->writeMutex);
+        pendingSize = writeControlOutput(ftpData, clientId, &waitForRead);
+        pthread_mutex_unlock(&client->writeMutex);
+
+        if (pendingSize < 0)
+        {
+            client->closeTheClient = 1;
+            continue;
+        }
+
+        fdSetWriteInterest(ftpData, clientId, client->tlsWantsWrite || (pendingSize > 0 && waitForRead == 0));
+    }
+}
+
 int socketPrintf(ftpDataType * ftpData, int clientId, const char *__restrict __fmt, ...)
 {
 	#define COMMAND_BUFFER								9600
@@ -153,18 +340,8 @@ int socketPrintf(ftpDataType * ftpData, int clientId, const char *__restrict __f
 		return -1;
 	}
 
-	if (ftpData->clients[clientId].tlsIsEnabled != 1)
-	{
-		//my_printf("\nwriting[%d] %s",theCommandSize, commandBuffer);
-		//fflush(0);
-		bytesWritten = write(ftpData->clients[clientId].socketDescriptor, commandBuffer, theCommandSize);
-	}
-	else if (ftpData->clients[clientId].tlsIsEnabled == 1)
-	{
-		#ifdef OPENSSL_ENABLED
-		bytesWritten = SSL_write(ftpData->clients[clientId].ssl, commandBuffer, theCommandSize);
-		#endif
-	}
+	//my_printf("\nwriting[%d] %s",theCommandSize, commandBuffer);
+	bytesWritten = writeControlReply(ftpData, clientId, commandBuffer, theCommandSize);
 
 	//my_printf("\n%s", commandBuffer);
 
@@ -175,16 +352,16 @@ int socketPrintf(ftpDataType * ftpData, int clientId, const char *__restrict __f
 
 int socketWorkerPrintf(ftpDataType * ftpData, int clientId, const char *__restrict __fmt, ...)
 {
-	#define COMMAND_BUFFER								9600
+	#define WORKER_WRITE_BUFFER							16384
 	#define SOCKET_PRINTF_BUFFER2						4096
 
 	int bytesWritten = 0, i = 0, theStringToWriteSize = 0;
 	char theBuffer[SOCKET_PRINTF_BUFFER2+1];
-	char writeBuffer[COMMAND_BUFFER+1];
+	char writeBuffer[WORKER_WRITE_BUFFER+1];
 	int theStringSize = 0;
 
 	memset(&theBuffer, 0, SOCKET_PRINTF_BUFFER2+1);
-	memset(&writeBuffer, 0, COMMAND_BUFFER+1);
+	memset(&writeBuffer, 0, WORKER_WRITE_BUFFER+1);
 
 	va_list args;
 	va_start(args, __fmt);
@@ -251,7 +428,7 @@ int socketWorkerPrintf(ftpDataType * ftpData, int clientId, const char *__restri
 		for (i = 0; i <theStringSize; i++)
 		{
 			//Write the buffer
-			if (theStringToWriteSize >= COMMAND_BUFFER)
+			if (theStringToWriteSize >= WORKER_WRITE_BUFFER)
 			{
 				my_printf("\nwriting:\n%s", writeBuffer);
 
@@ -264,11 +441,11 @@ int socketWorkerPrintf(ftpDataType * ftpData, int clientId, const char *__restri
 				{
 					#ifdef OPENSSL_ENABLED
 					if (ftpData->clients[clientId].workerData.passiveModeOn == 1){
-						theReturnCode = SSL_write(ftpData->clients[clientId].workerData.serverSsl, writeBuffer, theStringToWriteSize);
+						theReturnCode = tlsWriteData(ftpData->clients[clientId].workerData.serverSsl, writeBuffer, theStringToWriteSize, &ftpData->clients[clientId].workerData.tlsRecordSizing);
 						//my_printf("%s", writeBuffer);
 					}
 					else if (ftpData->clients[clientId].workerData.activeModeOn == 1){
-						theReturnCode = SSL_write(ftpData->clients[clientId].workerData.clientSsl, writeBuffer, theStringToWriteSize);
+						theReturnCode = tlsWriteData(ftpData->clients[clientId].workerData.clientSsl, writeBuffer, theStringToWriteSize, &ftpData->clients[clientId].workerData.tlsRecordSizing);
 						//my_printf("%s", writeBuffer);
 					}
 					#endif
@@ -286,11 +463,11 @@ int socketWorkerPrintf(ftpDataType * ftpData, int clientId, const char *__restri
 					return theReturnCode;
 				}
 
-				memset(&writeBuffer, 0, COMMAND_BUFFER+1);
+				memset(&writeBuffer, 0, WORKER_WRITE_BUFFER+1);
 				theStringToWriteSize = 0;
 			}
 
-			if (theStringToWriteSize < COMMAND_BUFFER)
+			if (theStringToWriteSize < WORKER_WRITE_BUFFER)
 			{
 				writeBuffer[theStringToWriteSize++] = theBuffer[i];
 			}
@@ -316,11 +493,11 @@ int socketWorkerPrintf(ftpDataType * ftpData, int clientId, const char *__restri
 		{
 			#ifdef OPENSSL_ENABLED
 			if (ftpData->clients[clientId].workerData.passiveModeOn == 1){
-				theReturnCode = SSL_write(ftpData->clients[clientId].workerData.serverSsl, writeBuffer, theStringToWriteSize);
+				theReturnCode = tlsWriteData(ftpData->clients[clientId].workerData.serverSsl, writeBuffer, theStringToWriteSize, &ftpData->clients[clientId].workerData.tlsRecordSizing);
 				//my_printf("%s", writeBuffer);
 			}
 			else if (ftpData->clients[clientId].workerData.activeModeOn == 1){
-				theReturnCode = SSL_write(ftpData->clients[clientId].workerData.clientSsl, writeBuffer, theStringToWriteSize);
+				theReturnCode = tlsWriteData(ftpData->clients[clientId].workerData.clientSsl, writeBuffer, theStringToWriteSize, &ftpData->clients[clientId].workerData.tlsRecordSizing);
 				//my_printf("%s", writeBuffer);
 			}
 			#endif
@@ -336,7 +513,7 @@ int socketWorkerPrintf(ftpDataType * ftpData, int clientId, const char *__restri
 			return theReturnCode;
 		}
 
-		memset(&writeBuffer, 0, COMMAND_BUFFER+1);
+		memset(&writeBuffer, 0, WORKER_WRITE_BUFFER+1);
 		theStringToWriteSize = 0;
 	}
 
@@ -351,6 +528,11 @@ int getMaximumSocketFd(int mainSocket, ftpDataType * ftpData)
     int toReturn = mainSocket;
     int i = 0;
 
+    if (ftpData->connectionData.maxServiceSocketFD > toReturn)
+    {
+        toReturn = ftpData->connectionData.maxServiceSocketFD;
+    }
+
     for (i = 0; i < ftpData->ftpParameters.maxClients; i++)
     {
         if (ftpData->clients[i].socketDescriptor > toReturn) {
@@ -396,9 +578,9 @@ int isPortInUse(int port) {
 }
 
 
-int createSocket(ftpDataType * ftpData)
+int createListenSocket(ftpDataType * ftpData, int port)
 {
-  //my_printf("\nCreating main socket on port %d", ftpData->ftpParameters.port);
+  //my_printf("\nCreating main socket on port %d", port);
   int sock = -1, errorCode = -1;
   struct sockaddr_in6 serveraddr;
 
@@ -437,7 +619,7 @@ reuse = 1;
 
 	memset(&serveraddr, 0, sizeof(serveraddr));
 	serveraddr.sin6_family = AF_INET6;
-	serveraddr.sin6_port   = htons(ftpData->ftpParameters.port);
+	serveraddr.sin6_port   = htons(port);
 	serveraddr.sin6_addr   = in6addr_any;
 
 	if (bind(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0)
@@ -530,7 +712,7 @@ int createPassiveSocket(int port)
     if (returnCode != 0)
     {
         my_printf("Bind failed after %d retries, errno=%d\n", max_retries, errno);
-		LOGF("%sBind failed after %d retries, errno=%d\n", LOG_ERROR_PREFIX, max_retries, errno);
+		LOGF_ERROR("Bind failed after %d retries, errno=%d\n", max_retries, errno);
         close(sock);
         return -1;
     }
@@ -582,9 +764,9 @@ int isPortInUse(int port) {
     }
 }
 
-int createSocket(ftpDataType * ftpData)
+int createListenSocket(ftpDataType * ftpData, int port)
 {
-  //my_printf("\nCreating main socket on port %d", ftpData->ftpParameters.port);
+  //my_printf("\nCreating main socket on port %d", port);
   int sock, errorCode;
   struct sockaddr_in temp;
 
@@ -596,7 +778,7 @@ int createSocket(ftpDataType * ftpData)
   }
   temp.sin_family = AF_INET;
   temp.sin_addr.s_addr = INADDR_ANY;
-  temp.sin_port = htons(ftpData->ftpParameters.port);
+  temp.sin_port = htons(port);
 
   //No blocking socket
   errorCode = fcntl(sock, F_SETFL, O_NONBLOCK);
@@ -712,7 +894,7 @@ int createPassiveSocket(int port)
     if (returnCode != 0)
     {
         my_printf("bind failed after %d retries, errno=%d\n", max_retries, errno);
-        LOGF("%sbind failed after %d retries, errno=%d\n", LOG_ERROR_PREFIX, max_retries, errno);
+        LOGF_ERROR("bind failed after %d retries, errno=%d\n", max_retries, errno);
         close(sock);
         return -1;
     }
@@ -732,6 +914,74 @@ int createPassiveSocket(int port)
 
 #endif
 
+int createSocket(ftpDataType * ftpData)
+{
+    return createListenSocket(ftpData, ftpData->ftpParameters.port);
+}
+
+/* Port of a listening socket of the address family of this build, -1 otherwise */
+static int listeningSocketPort(int sock)
+{
+    struct sockaddr_storage address;
+    socklen_t addressSize = sizeof(address);
+    int listening = 0, boundPort = -1;
+    socklen_t optionSize = sizeof(listening);
+
+    if (getsockname(sock, (struct sockaddr *)&address, &addressSize) == 0)
+    {
+#ifdef IPV6_ENABLED
+        if (address.ss_family == AF_INET6)
+            boundPort = ntohs(((struct sockaddr_in6 *)&address)->sin6_port);
+#else
+        if (address.ss_family == AF_INET)
+            boundPort = ntohs(((struct sockaddr_in *)&address)->sin_port);
+#endif
+    }
+
+    if (getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optionSize) == -1 || listening == 0)
+        return -1;
+
+    return boundPort;
+}
+
+/* A listening socket handed over by the previous binary, kept only if it still matches the configuration */
+int takeInheritedListenSocket(const char *variable, int port)
+{
+    int sock = inheritedDescriptor(variable);
+
+    if (sock == -1)
+        return -1;
+
+    if (port <= 0 || listeningSocketPort(sock) != port)
+    {
+        LOGF_INFO("The inherited listening socket %d doesn't match port %d, a new one is created", sock, port);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* A socket passed by systemd, its unit decides the port so only the socket type is checked */
+int takeActivatedListenSocket(int index)
+{
+    int sock = activatedDescriptor(index);
+
+    if (sock == -1)
+        return -1;
+
+    if (listeningSocketPort(sock) == -1)
+    {
+        LOGF_ERROR("The activated socket %d is not a listening socket of this build, a new one is created", sock);
+        close(sock);
+        return -1;
+    }
+
+    /* systemd creates blocking sockets, the prefork workers share this one */
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
 #ifdef IPV6_ENABLED
 int createActiveSocketV6(int port, char *ipAddress)
 {
@@ -865,18 +1115,83 @@ void fdInit(ftpDataType * ftpData)
     FD_ZERO(&ftpData->connectionData.esetAll);    
 
     FD_SET(ftpData->connectionData.theMainSocket, &ftpData->connectionData.rsetAll);    
-    FD_SET(ftpData->connectionData.theMainSocket, &ftpData->connectionData.wsetAll);
     FD_SET(ftpData->connectionData.theMainSocket, &ftpData->connectionData.esetAll);
 }
 
+/* wsetAll only holds the sockets waiting to write, see fdSetWriteInterest */
 void fdAdd(ftpDataType * ftpData, int index)
 {
     FD_SET(ftpData->clients[index].socketDescriptor, &ftpData->connectionData.rsetAll);    
-    FD_SET(ftpData->clients[index].socketDescriptor, &ftpData->connectionData.wsetAll);
     FD_SET(ftpData->clients[index].socketDescriptor, &ftpData->connectionData.esetAll);
     ftpData->connectionData.maxSocketFD = getMaximumSocketFd(ftpData->connectionData.theMainSocket, ftpData) + 1;
 }
 
+/* Internal descriptors (worker notifications, extra listeners..) watched by select */
+void fdAddServiceSocket(ftpDataType * ftpData, int serviceSocket)
+{
+    FD_SET(serviceSocket, &ftpData->connectionData.rsetAll);
+
+    if (serviceSocket > ftpData->connectionData.maxServiceSocketFD)
+    {
+        ftpData->connectionData.maxServiceSocketFD = serviceSocket;
+    }
+
+    ftpData->connectionData.maxSocketFD = getMaximumSocketFd(ftpData->connectionData.theMainSocket, ftpData) + 1;
+}
+
+void fdRemoveServiceSocket(ftpDataType * ftpData, int serviceSocket)
+{
+    FD_CLR(serviceSocket, &ftpData->connectionData.rsetAll);
+}
+
+void fdSetServiceWriteInterest(ftpDataType * ftpData, int serviceSocket, int enabled)
+{
+    if (enabled)
+        FD_SET(serviceSocket, &ftpData->connectionData.wsetAll);
+    else
+        FD_CLR(serviceSocket, &ftpData->connectionData.wsetAll);
+}
+
+/*
+ * Stops accepting after an upgrade or on a drain. On an upgrade the socket handed
+ * to the new binary stays open so its queue is never reset, the SO_REUSEPORT sockets
+ * of the other workers are closed and the kernel moves new connections to the
+ * remaining ones. A drain closes them all, nobody takes over.
+ */
+void releaseListenSockets(ftpDataType * ftpData, int closeSockets)
+{
+    FD_CLR(ftpData->connectionData.theMainSocket, &ftpData->connectionData.rsetAll);
+    FD_CLR(ftpData->connectionData.theMainSocket, &ftpData->connectionData.esetAll);
+
+    if (ftpData->connectionData.theImplicitTlsSocket != -1)
+        FD_CLR(ftpData->connectionData.theImplicitTlsSocket, &ftpData->connectionData.rsetAll);
+
+    if (closeSockets == 1)
+    {
+        /* the queued connections would be reset by the close */
+        acceptPendingConnections(ftpData, ftpData->connectionData.theMainSocket, 0);
+        close(ftpData->connectionData.theMainSocket);
+
+        if (ftpData->connectionData.theImplicitTlsSocket != -1)
+        {
+            acceptPendingConnections(ftpData, ftpData->connectionData.theImplicitTlsSocket, 1);
+            close(ftpData->connectionData.theImplicitTlsSocket);
+        }
+
+        ftpData->connectionData.theImplicitTlsSocket = -1;
+    }
+
+    ftpData->listenSocketsReleased = 1;
+}
+
+void fdSetWriteInterest(ftpDataType * ftpData, int index, int enabled)
+{
+    if (enabled)
+        FD_SET(ftpData->clients[index].socketDescriptor, &ftpData->connectionData.wsetAll);
+    else
+        FD_CLR(ftpData->clients[index].socketDescriptor, &ftpData->connectionData.wsetAll);
+}
+
 void fdRemove(ftpDataType * ftpData, int index)
 {
     FD_CLR(ftpData->clients[index].socketDescriptor, &ftpData->connectionData.rsetAll);    
@@ -886,10 +1201,20 @@ void fdRemove(ftpDataType * ftpData, int index)
 
 void closeSocket(ftpDataType * ftpData, int processingSocket)
 {
+    int waitForRead;
+
+    /* a reply queued right before the close, like the 421 of a drain, gets a last chance */
+    if (__atomic_load_n(&ftpData->clients[processingSocket].pendingOutputSize, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&ftpData->clients[processingSocket].writeMutex);
+        writeControlOutput(ftpData, processingSocket, &waitForRead);
+        pthread_mutex_unlock(&ftpData->clients[processingSocket].writeMutex);
+    }
 
 #ifdef OPENSSL_ENABLED
 
-	if (ftpData->clients[processingSocket].dataChannelIsTls == 1)
+	if (ftpData->clients[processingSocket].dataChannelIsTls == 1 &&
+	    ftpData->clients[processingSocket].ssl != NULL)
 	{
 		if(ftpData->clients[processingSocket].workerData.passiveModeOn == 1)
 		{
@@ -920,6 +1245,9 @@ void closeSocket(ftpDataType * ftpData, int processingSocket)
     shutdown(ftpData->clients[processingSocket].socketDescriptor, SHUT_RDWR);
     close(ftpData->clients[processingSocket].socketDescriptor);
 
+    if (ftpData->clients[processingSocket].connectionIsCounted == 1)
+        SHST_ReleaseConnection(ftpData->clients[processingSocket].connectionEntryIndex);
+
     resetClientData(ftpData, processingSocket, 0);
     //resetWorkerData(ftpData, processingSocket, 0);
     
@@ -939,6 +1267,13 @@ void closeClient(ftpDataType * ftpData, int processingSocket)
 {
    // my_printf("\nQUIT FLAG SET!\n");
 
+    /* the SSL object belongs to a handshake worker, the client is closed when the job comes back */
+    if (ftpData->clients[processingSocket].tlsHandshakeIsPending == 1)
+    {
+        ftpData->clients[processingSocket].closeTheClient = 1;
+        return;
+    }
+
     if (ftpData->clients[processingSocket].workerData.threadIsAlive == 1)
     {
     	handleThreadReuse(ftpData, processingSocket);
@@ -955,6 +1290,35 @@ void closeClient(ftpDataType * ftpData, int processingSocket)
     return;
 }
 
+/* The login running on the auth workers is abandoned, a late result will not match the serial anymore */
+void cancelPendingAuth(ftpDataType * ftpData, int clientId)
+{
+    if (ftpData->clients[clientId].authIsPending == 0)
+        return;
+
+    ftpData->clients[clientId].authSerial++;
+    ftpData->clients[clientId].authIsPending = 0;
+    ftpData->clients[clientId].bufferOffset = 0;
+    memset(ftpData->clients[clientId].buffer, 0, CLIENT_BUFFER_STRING_SIZE+1);
+}
+
+/* Drain and admin kill: the client gets the reply and the main loop closes it on the next pass */
+void closeSessionWithReply(ftpDataType * ftpData, int clientId, const char *reply)
+{
+    /* pipelined commands get a single reply */
+    if (ftpData->clients[clientId].closeTheClient == 1)
+        return;
+
+    cancelPendingAuth(ftpData, clientId);
+
+    /* nothing can be written in the middle of a TLS handshake */
+    if (ftpData->clients[clientId].tlsIsNegotiating == 0 &&
+        ftpData->clients[clientId].tlsHandshakeIsPending == 0)
+        socketPrintf(ftpData, clientId, "s", reply);
+
+    ftpData->clients[clientId].closeTheClient = 1;
+}
+
 void checkClientConnectionTimeout(ftpDataType * ftpData)
 {
     int processingSock;
@@ -977,32 +1341,35 @@ void checkClientConnectionTimeout(ftpDataType * ftpData)
     }
 }
 
-void flushLoginWrongTriesData(ftpDataType * ftpData)
-{
-    int i;
-    //my_printf("\n flushLoginWrongTriesData size of the vector : %d", ftpData->loginFailsVector.Size);
-    
-    for (i = (ftpData->loginFailsVector.Size-1); i >= 0; i--)
-    {
-        //my_printf("\n last login fail attempt : %d", ((loginFailsDataType *) ftpData->loginFailsVector.Data[i])->failTimeStamp);
-        
-        if ( (time(NULL) - ((loginFailsDataType *) ftpData->loginFailsVector.Data[i])->failTimeStamp) > WRONG_PASSWORD_ALLOWED_RETRY_TIME)
-        {
-            //my_printf("\n Deleting element : %d", i);
-            ftpData->loginFailsVector.DeleteAt(&ftpData->loginFailsVector, i, deleteLoginFailsData);
-        }
-    }
-}
-
 int selectWait(ftpDataType * ftpData)
 {
     struct timeval selectMaximumLockTime;
     selectMaximumLockTime.tv_sec = 10;
     selectMaximumLockTime.tv_usec = 0;
+
+    /* wake up every second to enforce the login timeout while auths are running */
+    if (ftpData->authWorkersOn == 1 &&
+        WPOOL_OutstandingJobs(&ftpData->authWorkers) > 0)
+        selectMaximumLockTime.tv_sec = 1;
+
+    /* the process exits as soon as its last session is closed */
+    if (ftpData->listenSocketsReleased == 1 || isConfigurationReloadRunning())
+        selectMaximumLockTime.tv_sec = 1;
+
     ftpData->connectionData.rset = ftpData->connectionData.rsetAll;
     ftpData->connectionData.wset = ftpData->connectionData.wsetAll;
     ftpData->connectionData.eset = ftpData->connectionData.esetAll;
-    return select(ftpData->connectionData.maxSocketFD, &ftpData->connectionData.rset, NULL, &ftpData->connectionData.eset, &selectMaximumLockTime);
+    int returnCode = select(ftpData->connectionData.maxSocketFD, &ftpData->connectionData.rset, &ftpData->connectionData.wset, &ftpData->connectionData.eset, &selectMaximumLockTime);
+
+    /* Interrupted by a signal (e.g. SIGUSR1), the returned sets are not valid */
+    if (returnCode < 0)
+    {
+        FD_ZERO(&ftpData->connectionData.rset);
+        FD_ZERO(&ftpData->connectionData.wset);
+        FD_ZERO(&ftpData->connectionData.eset);
+    }
+
+    return returnCode;
 }
 
 int isClientConnected(ftpDataType * ftpData, int cliendId)
@@ -1031,21 +1398,73 @@ int getAvailableClientSocketIndex(ftpDataType * ftpData)
     return -1;
 }
 
+/* Server and per address limits are counted in the shared state, so they hold across worker processes */
+static void admitClient(ftpDataType * ftpData, int clientId, int implicitTls)
+{
+    int returnCode;
+
+    returnCode = SHST_AcquireConnection(ftpData->clients[clientId].clientIpAddress, ftpData->ftpParameters.maxClients,
+                                        ftpData->ftpParameters.maximumConnectionsPerIp, &ftpData->clients[clientId].connectionEntryIndex);
+
+    /* an implicit TLS client can't read a plain text reply */
+    if (returnCode == SHST_CONNECTION_SERVER_FULL)
+    {
+        METRICS_Add(METRICS_CONNECTIONS_REJECTED, 1);
+        if (implicitTls == 0)
+            socketPrintf(ftpData, clientId, "s", "10068 Server reached the maximum number of connection, please try later.\r\n");
+        ftpData->clients[clientId].closeTheClient = 1;
+        LOGF_SECURITY("Maximum number of connections reached, %s refused", ftpData->clients[clientId].clientIpAddress);
+        return;
+    }
+
+    if (returnCode == SHST_CONNECTION_IP_FULL)
+    {
+        METRICS_Add(METRICS_CONNECTIONS_REJECTED, 1);
+        if (implicitTls == 0)
+            socketPrintf(ftpData, clientId, "sss", "530 too many connection from your ip address ", ftpData->clients[clientId].clientIpAddress, " \r\n");
+        ftpData->clients[clientId].closeTheClient = 1;
+        LOGF_SECURITY("Too many connection from %s max per ip is %d", ftpData->clients[clientId].clientIpAddress, ftpData->ftpParameters.maximumConnectionsPerIp);
+        return;
+    }
+
+    /* the per address limit could not be enforced, the client is refused instead of admitted unchecked */
+    if (returnCode == SHST_CONNECTION_TABLE_FULL)
+    {
+        METRICS_Add(METRICS_CONNECTIONS_REJECTED, 1);
+        if (implicitTls == 0)
+            socketPrintf(ftpData, clientId, "s", "421 Service not available, please try later.\r\n");
+        ftpData->clients[clientId].closeTheClient = 1;
+        LOGF_SECURITY("Connection table full, %s refused", ftpData->clients[clientId].clientIpAddress);
+        return;
+    }
+
+    ftpData->clients[clientId].connectionIsCounted = 1;
+    METRICS_Add(METRICS_CONNECTIONS_ACCEPTED, 1);
+
+    if (implicitTls == 1)
+        returnCode = startImplicitTls(ftpData, clientId);
+    else
+        returnCode = socketPrintf(ftpData, clientId, "s", ftpData->welcomeMessage);
+
+    if (returnCode <= 0)
+    {
+        ftpData->clients[clientId].closeTheClient = 1;
+        LOG_ERROR("socketPrintf");
+    }
+}
 
 #ifdef IPV6_ENABLED
 
-int evaluateClientSocketConnection(ftpDataType * ftpData)
+static int acceptClientConnection(ftpDataType * ftpData, int listenSocket, int implicitTls)
 {
 
-    if (FD_ISSET(ftpData->connectionData.theMainSocket, &ftpData->connectionData.rset))
+    if (FD_ISSET(listenSocket, &ftpData->connectionData.rset))
     {
         int availableSocketIndex;
         if ((availableSocketIndex = getAvailableClientSocketIndex(ftpData)) != -1) //get available socket  
         {
-            if ((ftpData->clients[availableSocketIndex].socketDescriptor = accept(ftpData->connectionData.theMainSocket, (struct sockaddr *)&ftpData->clients[availableSocketIndex].client_sockaddr_in, (socklen_t*)&ftpData->clients[availableSocketIndex].sockaddr_in_size)) !=- 1)
+            if ((ftpData->clients[availableSocketIndex].socketDescriptor = accept(listenSocket, (struct sockaddr *)&ftpData->clients[availableSocketIndex].client_sockaddr_in, (socklen_t*)&ftpData->clients[availableSocketIndex].sockaddr_in_size)) !=- 1)
             {
-                int numberOfConnectionFromSameIp, i;
-                numberOfConnectionFromSameIp = 0;
                 ftpData->connectedClients++;
                 ftpData->clients[availableSocketIndex].socketIsConnected = 1;
 
@@ -1096,34 +1515,8 @@ int evaluateClientSocketConnection(ftpDataType * ftpData)
 
                 ftpData->clients[availableSocketIndex].connectionTimeStamp = (int)time(NULL);
                 ftpData->clients[availableSocketIndex].lastActivityTimeStamp = (int)time(NULL);
-                
-                for (i = 0; i <ftpData->ftpParameters.maxClients; i++)
-                {
-                    if (i == availableSocketIndex)
-                    {
-                        continue;
-                    }
-                    
-                    if (strcmp(ftpData->clients[availableSocketIndex].clientIpAddress, ftpData->clients[i].clientIpAddress) == 0) {
-                        numberOfConnectionFromSameIp++;
-                    }
-                }
-                if (ftpData->ftpParameters.maximumConnectionsPerIp > 0 &&
-                    numberOfConnectionFromSameIp >= ftpData->ftpParameters.maximumConnectionsPerIp)
-                {
-                	socketPrintf(ftpData, availableSocketIndex, "sss", "530 too many connection from your ip address ", ftpData->clients[availableSocketIndex].clientIpAddress, " \r\n");
-                    ftpData->clients[availableSocketIndex].closeTheClient = 1;
-					LOGF("%stoo many connection from ip address: %s maximum allowed: %d", LOG_SECURITY_PREFIX, ftpData->clients[availableSocketIndex].clientIpAddress, ftpData->ftpParameters.maximumConnectionsPerIp); 
-                }
-                else
-                {
-                	int returnCode = socketPrintf(ftpData, availableSocketIndex, "s", ftpData->welcomeMessage);
-                	if (returnCode <= 0)
-                	{
-                		ftpData->clients[availableSocketIndex].closeTheClient = 1;
-						LOG_ERROR("socketPrintf"); 
-                	}
-                }
+
+                admitClient(ftpData, availableSocketIndex, implicitTls);
                 
                 return 1;
             }
@@ -1141,10 +1534,12 @@ int evaluateClientSocketConnection(ftpDataType * ftpData)
             int socketRefuseFd;
             struct sockaddr_in6 socketRefuse_sockaddr_in;
 			socklen_t socketRefuse_in_size = sizeof(socketRefuse_sockaddr_in);
-            if ((socketRefuseFd = accept(ftpData->connectionData.theMainSocket, (struct sockaddr *)&socketRefuse_sockaddr_in, &socketRefuse_in_size))!=-1)
+            if ((socketRefuseFd = accept(listenSocket, (struct sockaddr *)&socketRefuse_sockaddr_in, &socketRefuse_in_size))!=-1)
             {
                 char *messageToWrite = "10068 Server reached the maximum number of connection, please try later.\r\n";
-                write(socketRefuseFd, messageToWrite, strlen(messageToWrite));
+                METRICS_Add(METRICS_CONNECTIONS_REJECTED, 1);
+                if (implicitTls == 0)
+                    write(socketRefuseFd, messageToWrite, strlen(messageToWrite));
                 shutdown(socketRefuseFd, SHUT_RDWR);
                 close(socketRefuseFd);
             }
@@ -1161,17 +1556,15 @@ int evaluateClientSocketConnection(ftpDataType * ftpData)
 
 #else
 
-int evaluateClientSocketConnection(ftpDataType * ftpData)
+static int acceptClientConnection(ftpDataType * ftpData, int listenSocket, int implicitTls)
 {
-    if (FD_ISSET(ftpData->connectionData.theMainSocket, &ftpData->connectionData.rset))
+    if (FD_ISSET(listenSocket, &ftpData->connectionData.rset))
     {
         int availableSocketIndex;
         if ((availableSocketIndex = getAvailableClientSocketIndex(ftpData)) != -1) //get available socket  
         {
-            if ((ftpData->clients[availableSocketIndex].socketDescriptor = accept(ftpData->connectionData.theMainSocket, (struct sockaddr *)&ftpData->clients[availableSocketIndex].client_sockaddr_in, (socklen_t*)&ftpData->clients[availableSocketIndex].sockaddr_in_size))!=-1)
+            if ((ftpData->clients[availableSocketIndex].socketDescriptor = accept(listenSocket, (struct sockaddr *)&ftpData->clients[availableSocketIndex].client_sockaddr_in, (socklen_t*)&ftpData->clients[availableSocketIndex].sockaddr_in_size))!=-1)
             {
-                int numberOfConnectionFromSameIp, i;
-                numberOfConnectionFromSameIp = 0;
                 ftpData->connectedClients++;
                 ftpData->clients[availableSocketIndex].socketIsConnected = 1;
 
@@ -1202,34 +1595,8 @@ int evaluateClientSocketConnection(ftpDataType * ftpData)
 
                 ftpData->clients[availableSocketIndex].connectionTimeStamp = (int)time(NULL);
                 ftpData->clients[availableSocketIndex].lastActivityTimeStamp = (int)time(NULL);
-                
-                for (i = 0; i <ftpData->ftpParameters.maxClients; i++)
-                {
-                    if (i == availableSocketIndex)
-                    {
-                        continue;
-                    }
-                    
-                    if (strcmp(ftpData->clients[availableSocketIndex].clientIpAddress, ftpData->clients[i].clientIpAddress) == 0) {
-                        numberOfConnectionFromSameIp++;
-                    }
-                }
-                if (ftpData->ftpParameters.maximumConnectionsPerIp > 0 &&
-                    numberOfConnectionFromSameIp >= ftpData->ftpParameters.maximumConnectionsPerIp)
-                {
-                	socketPrintf(ftpData, availableSocketIndex, "sss", "530 too many connection from your ip address ", ftpData->clients[availableSocketIndex].clientIpAddress, " \r\n");
-                    ftpData->clients[availableSocketIndex].closeTheClient = 1;
-					LOGF("%sToo many connection from %s max per ip is %d", LOG_SECURITY_PREFIX, ftpData->clients[availableSocketIndex].clientIpAddress, ftpData->ftpParameters.maximumConnectionsPerIp); 
-                }
-                else
-                {
-                	int returnCode = socketPrintf(ftpData, availableSocketIndex, "s", ftpData->welcomeMessage);
-                	if (returnCode <= 0)
-                	{
-                		ftpData->clients[availableSocketIndex].closeTheClient = 1;
-						LOG_ERROR("socketPrintf"); 
-                	}
-                }
+
+                admitClient(ftpData, availableSocketIndex, implicitTls);
                 
                 return 1;
             }
@@ -1247,10 +1614,12 @@ int evaluateClientSocketConnection(ftpDataType * ftpData)
             int socketRefuseFd, socketRefuse_in_size;
             socketRefuse_in_size = sizeof(struct sockaddr_in);
             struct sockaddr_in socketRefuse_sockaddr_in;
-            if ((socketRefuseFd = accept(ftpData->connectionData.theMainSocket, (struct sockaddr *)&socketRefuse_sockaddr_in, (socklen_t*)&socketRefuse_in_size))!=-1)
+            if ((socketRefuseFd = accept(listenSocket, (struct sockaddr *)&socketRefuse_sockaddr_in, (socklen_t*)&socketRefuse_in_size))!=-1)
             {
                 char *messageToWrite = "10068 Server reached the maximum number of connection, please try later.\r\n";
-                write(socketRefuseFd, messageToWrite, strlen(messageToWrite));
+                METRICS_Add(METRICS_CONNECTIONS_REJECTED, 1);
+                if (implicitTls == 0)
+                    write(socketRefuseFd, messageToWrite, strlen(messageToWrite));
                 shutdown(socketRefuseFd, SHUT_RDWR);
                 close(socketRefuseFd);
             }
@@ -1267,12 +1636,79 @@ int evaluateClientSocketConnection(ftpDataType * ftpData)
 
 #endif
 
+/* Implicit FTPS sessions start with the handshake, the welcome message is sent once it completes */
+static int startImplicitTls(ftpDataType * ftpData, int clientId)
+{
+#ifdef OPENSSL_ENABLED
+    ftpData->clients[clientId].ssl = tlsAcquireSsl(1);
+
+    if (ftpData->clients[clientId].ssl == NULL ||
+        SSL_set_fd(ftpData->clients[clientId].ssl, ftpData->clients[clientId].socketDescriptor) != 1)
+        return -1;
+
+    ftpData->clients[clientId].implicitTls = 1;
+    ftpData->clients[clientId].tlsNegotiatingTimeStart = (int)time(NULL);
+    ftpData->clients[clientId].tlsIsNegotiating = 1;
+
+    /* the data connections are protected unless the client asks for PROT C */
+    ftpData->clients[clientId].pbszIsSet = 1;
+    ftpData->clients[clientId].dataChannelIsTls = 1;
+    return 1;
+#else
+    return -1;
+#endif
+}
+
+static void acceptPendingConnections(ftpDataType * ftpData, int listenSocket, int implicitTls)
+{
+    struct pollfd pending = {listenSocket, POLLIN, 0};
+
+    /* the backlog holds at most maxClients + 1 connections */
+    for (int i = 0; i <= ftpData->ftpParameters.maxClients; i++)
+    {
+        if (poll(&pending, 1, 0) <= 0 || (pending.revents & POLLIN) == 0)
+            break;
+
+        FD_SET(listenSocket, &ftpData->connectionData.rset);
+        acceptClientConnection(ftpData, listenSocket, implicitTls);
+    }
+}
+
+int evaluateClientSocketConnection(ftpDataType * ftpData)
+{
+    /* the descriptors may be closed and reused by client sockets */
+    if (ftpData->listenSocketsReleased == 1)
+        return 0;
+
+    if (acceptClientConnection(ftpData, ftpData->connectionData.theMainSocket, 0) == 1)
+        return 1;
+
+    if (ftpData->connectionData.theImplicitTlsSocket != -1)
+        return acceptClientConnection(ftpData, ftpData->connectionData.theImplicitTlsSocket, 1);
+
+    return 0;
+}
+
 #ifdef OPENSSL_ENABLED
 int acceptSSLConnection(int theSocketId, ftpDataType * ftpData)
 {
-    SSL *ssl = ftpData->clients[theSocketId].workerData.serverSsl;
     int sockfd = ftpData->clients[theSocketId].workerData.socketConnection;
 
+    if (ftpData->clients[theSocketId].workerData.serverSsl == NULL)
+        ftpData->clients[theSocketId].workerData.serverSsl = tlsAcquireSsl(1);
+
+    SSL *ssl = ftpData->clients[theSocketId].workerData.serverSsl;
+
+    if (ssl == NULL)
+    {
+        ftpData->clients[theSocketId].closeTheClient = 1;
+        LOG_ERROR("Data channel SSL object allocation failed");
+        return -1;
+    }
+
+    tlsStartRecordSizing(ssl, &ftpData->clients[theSocketId].workerData.tlsRecordSizing,
+                         ftpData->ftpParameters.tlsDataRecordSize, ftpData->ftpParameters.tlsDataSmallRecordBytes);
+
     my_printf("\nSSL SSL_set_fd start");
     
     int rc = SSL_set_fd(ssl, sockfd);
@@ -1329,8 +1765,11 @@ int acceptSSLConnection(int theSocketId, ftpDataType * ftpData)
 
     SSL_set_accept_state(ssl);
 
-    int max_attempts = 500; // 500*10ms = 5 sec timeout
-    while (max_attempts--)
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += DATA_TLS_HANDSHAKE_TIMEOUT;
+
+    while (1)
     {
         rc = SSL_accept(ssl);
 
@@ -1345,8 +1784,24 @@ int acceptSSLConnection(int theSocketId, ftpDataType * ftpData)
 
         if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
         {
-            usleep(10000); // 10 ms
-            //my_printf("\nSSL_accept waiting ...");
+            /* sleep until the socket can make progress, the handshake resumes as soon as the bytes arrive */
+            rc = waitSocketReady(sockfd, err == SSL_ERROR_WANT_WRITE, &deadline);
+
+            if (rc == 0)
+            {
+                my_printf("\nSSL_accept timeout");
+                LOG_AT(LOG_SUBSYSTEM_TLS, LOG_LEVEL_ERROR, LOG_ERROR_PREFIX, "Data channel TLS handshake timeout");
+                ftpData->clients[theSocketId].closeTheClient = 1;
+                return -1;
+            }
+
+            if (rc < 0)
+            {
+                ftpData->clients[theSocketId].closeTheClient = 1;
+                LOG_AT(LOG_SUBSYSTEM_TLS, LOG_LEVEL_ERROR, LOG_ERROR_PREFIX, "Data channel poll error");
+                return -1;
+            }
+
             continue;
         }
         else
@@ -1357,15 +1812,9 @@ int acceptSSLConnection(int theSocketId, ftpDataType * ftpData)
             LOG_ERROR("Closing client SSL_accept");
             return -1;
         }
-
     }
 
-    if (max_attempts <= 0)
-    {
-        my_printf("\nSSL_accept timeout");
-        ftpData->clients[theSocketId].closeTheClient = 1;
-        return -1;
-    }
+    tlsRecordHandshake(ssl, 1);
 
     if (SSL_session_reused(ssl)) {
         my_printf("\n**** FTPS data connection reused control TLS session.\n");
@@ -34,25 +34,39 @@ extern "C" {
 
 int getMaximumSocketFd(int mainSocket, ftpDataType * data);
 int createSocket(ftpDataType * ftpData);
+int createListenSocket(ftpDataType * ftpData, int port);
+int takeInheritedListenSocket(const char *variable, int port);
+int takeActivatedListenSocket(int index);
 int createPassiveSocket(int port);
 int createActiveSocket(int port, char *ipAddress);
 
 #ifdef IPV6_ENABLED
 int createActiveSocketV6(int port, char *ipAddress);
+int is_ipv4_mapped_ipv6(const char *ip);
 #endif
 
 #ifdef OPENSSL_ENABLED
+/* Seconds allowed to complete the TLS handshake on a passive data connection */
+#define DATA_TLS_HANDSHAKE_TIMEOUT  5
+
 int acceptSSLConnection(int theSocketId, ftpDataType * ftpData);
 #endif
 
 void fdInit(ftpDataType * ftpData);
 void fdAdd(ftpDataType * ftpData, int index);
 void fdRemove(ftpDataType * ftpData, int index);
+void fdSetWriteInterest(ftpDataType * ftpData, int index, int enabled);
+void flushControlOutput(ftpDataType * ftpData);
+void fdAddServiceSocket(ftpDataType * ftpData, int serviceSocket);
+void fdRemoveServiceSocket(ftpDataType * ftpData, int serviceSocket);
+void fdSetServiceWriteInterest(ftpDataType * ftpData, int serviceSocket, int enabled);
+void releaseListenSockets(ftpDataType * ftpData, int closeSockets);
 
 void checkClientConnectionTimeout(ftpDataType * ftpData);
-void flushLoginWrongTriesData(ftpDataType * ftpData);
 void closeSocket(ftpDataType * ftpData, int processingSocket);
 void closeClient(ftpDataType * ftpData, int processingSocket);
+void cancelPendingAuth(ftpDataType * ftpData, int clientId);
+void closeSessionWithReply(ftpDataType * ftpData, int clientId, const char *reply);
 int selectWait(ftpDataType * ftpData);
 int isClientConnected(ftpDataType * ftpData, int cliendId);
 int getAvailableClientSocketIndex(ftpDataType * ftpData);
@@ -0,0 +1,230 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "cpuAffinity.h"
+
+/* CPUs the process may run on, the transfer threads fall back to them */
+static cpu_set_t allowedCpus;
+static cpu_set_t controlCpus;
+static cpu_set_t transferCpus;
+static int controlCpuCount = 0;
+static int transferCpuCount = 0;
+static int followIncoming = 0;
+
+/* Parses "0-3,8,10-11" keeping only the allowed CPUs, returns their number or -1 on a syntax error */
+static int parseCpuList(const char *cpuList, cpu_set_t *cpus)
+{
+    const char *cursor = cpuList;
+    char *end;
+
+    CPU_ZERO(cpus);
+
+    while (*cursor != '\0')
+    {
+        long first, last;
+
+        while (*cursor == ' ' || *cursor == ',')
+            cursor++;
+
+        if (*cursor == '\0')
+            break;
+
+        if (!isdigit((unsigned char) *cursor))
+            return -1;
+
+        first = last = strtol(cursor, &end, 10);
+        cursor = end;
+
+        if (*cursor == '-')
+        {
+            cursor++;
+            if (!isdigit((unsigned char) *cursor))
+                return -1;
+
+            last = strtol(cursor, &end, 10);
+            cursor = end;
+        }
+
+        if (last < first || last >= CPU_SETSIZE)
+            return -1;
+
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+
+        while (*cursor == ' ')
+            cursor++;
+
+        if (*cursor != '\0' && *cursor != ',')
+            return -1;
+    }
+
+    CPU_AND(cpus, cpus, &allowedCpus);
+    return CPU_COUNT(cpus);
+}
+
+/* The n-th CPU of the set, n wraps around */
+static int nthCpu(cpu_set_t *cpus, int n)
+{
+    int count = CPU_COUNT(cpus);
+
+    if (count == 0)
+        return -1;
+
+    n %= count;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, cpus) && n-- == 0)
+            return cpu;
+    }
+
+    return -1;
+}
+
+/* Returns 1, or -1 when a list can't be used and the threads are left unpinned */
+int CPUAFF_Configure(const char *controlCpuList, const char *transferCpuList, int followIncomingCpu)
+{
+    controlCpuCount = 0;
+    transferCpuCount = 0;
+    followIncoming = followIncomingCpu;
+
+    if (sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) != 0)
+        return -1;
+
+    if (controlCpuList != NULL && controlCpuList[0] != '\0' &&
+        (controlCpuCount = parseCpuList(controlCpuList, &controlCpus)) <= 0)
+    {
+        controlCpuCount = 0;
+        return -1;
+    }
+
+    if (transferCpuList != NULL && transferCpuList[0] != '\0' &&
+        (transferCpuCount = parseCpuList(transferCpuList, &transferCpus)) <= 0)
+    {
+        controlCpuCount = 0;
+        transferCpuCount = 0;
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * Pins the calling control loop, the threads it starts later inherit its CPUs.
+ * Worker processes get one CPU each, taken in turn from the control set.
+ */
+int CPUAFF_PinControlThread(int workerIndex, int workerCount)
+{
+    cpu_set_t cpus;
+
+    if (controlCpuCount == 0)
+        return 0;
+
+    cpus = controlCpus;
+
+    if (workerCount > 1)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(nthCpu(&controlCpus, workerIndex), &cpus);
+    }
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0 ? 1 : -1;
+}
+
+/* Transfer threads are created by the control loop, they must leave its CPUs */
+static cpu_set_t *transferThreadCpus(void)
+{
+    if (transferCpuCount > 0)
+        return &transferCpus;
+
+    if (controlCpuCount > 0)
+        return &allowedCpus;
+
+    return NULL;
+}
+
+int CPUAFF_PinTransferThread(void)
+{
+    cpu_set_t *cpus = transferThreadCpus();
+
+    if (cpus == NULL)
+        return 0;
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus) == 0 ? 1 : -1;
+}
+
+/* Worker pool threads (auth, TLS handshakes) share the transfer CPUs */
+int CPUAFF_PinTransferThreads(pthread_t *threads, int threadCount)
+{
+    cpu_set_t *cpus = transferThreadCpus();
+
+    if (cpus == NULL)
+        return 0;
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        if (pthread_setaffinity_np(threads[i], sizeof(cpu_set_t), cpus) != 0)
+            return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * Moves the calling transfer thread to the CPU that received the last packet
+ * of the socket, where the NIC queue interrupts are already served.
+ */
+int CPUAFF_FollowIncomingCpu(int socket)
+{
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t length = sizeof(cpu);
+    cpu_set_t cpus;
+
+    if (followIncoming == 0 ||
+        getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) != 0 ||
+        cpu < 0 || cpu >= CPU_SETSIZE)
+        return 0;
+
+    /* the received CPU is used only within the transfer set */
+    if (!CPU_ISSET(cpu, transferCpuCount > 0 ? &transferCpus : &allowedCpus))
+        return 0;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0 ? 1 : -1;
+#else
+    return 0;
+#endif
+}
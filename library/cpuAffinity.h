@@ -0,0 +1,50 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * CPU placement of the control loops and of the transfer threads.
+ * The sets are CPU lists like "0-3,8", an empty list leaves the threads
+ * to the scheduler. Memory is placed by first touch, so a thread that is
+ * pinned before it touches its buffers gets them on its own NUMA node.
+ */
+int CPUAFF_Configure(const char *controlCpuList, const char *transferCpuList, int followIncomingCpu);
+int CPUAFF_PinControlThread(int workerIndex, int workerCount);
+int CPUAFF_PinTransferThread(void);
+int CPUAFF_PinTransferThreads(pthread_t *threads, int threadCount);
+int CPUAFF_FollowIncomingCpu(int socket);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CPU_AFFINITY_H */
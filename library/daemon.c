@@ -35,8 +35,15 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #include "fileManagement.h"
+#include "sharedState.h"
+#include "metrics.h"
+#include "daemon.h"
 #include "../debugHelper.h"
 
 #define LOCKFILE "/var/run/uFTP.pid"
@@ -44,6 +51,48 @@
 #define MAXIMUM_IDLE_TIME			60
 
 static int WatchDogTime = 0, WatchDogTimerTimeOut = MAXIMUM_IDLE_TIME;
+static volatile pid_t respawnedProcessPid = 0;
+static volatile sig_atomic_t respawnStopRequested = 0;
+
+/* Pre-fork master state */
+static volatile pid_t workerPids[SHST_MAX_WORKERS];
+static volatile int preforkWorkerCount = 0;
+static volatile sig_atomic_t preforkStopRequested = 0;
+
+/* Needed to start the binary again on an upgrade */
+static char serverExecutablePath[PATH_MAX] = {0};
+static char **serverArguments = NULL;
+static int processLockDescriptor = -1;
+
+/* Listening sockets passed by systemd, see socketActivationInit() */
+static int activatedDescriptorCount = 0;
+
+/* The pid file holds the supervisor pid, runtime signals are relayed to the served process */
+static void forwardSignalToChild(int sig)
+{
+    if (respawnedProcessPid > 0)
+        kill(respawnedProcessPid, sig);
+}
+
+/* SIGTERM drains the served process, it is not started again once it exits */
+static void forwardStopToChild(int sig)
+{
+    respawnStopRequested = 1;
+    forwardSignalToChild(sig);
+}
+
+/* The master relays runtime signals to every worker, SIGINT and SIGTERM also stop it */
+static void forwardSignalToWorkers(int sig)
+{
+    for (int i = 0; i < preforkWorkerCount; i++)
+    {
+        if (workerPids[i] > 0)
+            kill(workerPids[i], sig);
+    }
+
+    if (sig == SIGINT || sig == SIGTERM)
+        preforkStopRequested = 1;
+}
 
 int isProcessAlreadyRunning(void)
 {
@@ -51,6 +100,17 @@ int isProcessAlreadyRunning(void)
     int returnCode;
     char buf[101];
     memset(buf, 0,101);
+
+    /* an upgraded binary already holds the lock of the previous one */
+    if ((fd = inheritedDescriptor(UPGRADE_LOCK_FD_VARIABLE)) != -1)
+    {
+        processLockDescriptor = fd;
+        ftruncate(fd, 0);
+        returnCode = snprintf(buf, 100, "%ld", (long)getpid());
+        returnCode = pwrite(fd, buf, strnlen(buf, 100)+1, 0);
+        return 0;
+    }
+
     fd = open(LOCKFILE, O_RDWR|O_CREAT, LOCKMODE);
     if (fd < 0) 
     {
@@ -71,6 +131,7 @@ int isProcessAlreadyRunning(void)
     }
     
     //my_printf("\nFILE_LockFile returnCode = %d", returnCode);    
+    processLockDescriptor = fd;
     ftruncate(fd, 0);
     returnCode = snprintf(buf, 100, "%ld", (long)getpid());
     returnCode = write(fd, buf, strnlen(buf, 100)+1);
@@ -158,9 +219,21 @@ void respawnProcess(void)
 			else
 				{
 				int returnStatus;
+				respawnedProcessPid = spawnedProcess;
+				signal(SIGUSR1, forwardSignalToChild);
+				signal(SIGHUP, forwardSignalToChild);
+				signal(SIGUSR2, forwardSignalToChild);
+				signal(SIGTERM, forwardStopToChild);
 				waitpid(spawnedProcess, &returnStatus, 0);
 				my_printf("\nwaitpid done with status: %d", returnStatus);
 
+				if (respawnStopRequested == 1 ||
+					(WIFEXITED(returnStatus) && WEXITSTATUS(returnStatus) == SERVER_STOPPED_EXIT_STATUS))
+					{
+					my_printf("\nThe server has been stopped, the respawn is disabled.");
+					exit(0);
+					}
+
 				if (WIFEXITED(returnStatus))
 					{
 					if (WEXITSTATUS(returnStatus) == 99)
@@ -175,6 +248,292 @@ void respawnProcess(void)
 		return;
 	}
 
+/*
+ * Forks workerCount workers and supervises them, a worker that exits is forked
+ * again and its connections are dropped from the shared counters.
+ * Returns the worker index in the worker processes, the master never returns.
+ */
+int preforkWorkers(int workerCount)
+{
+    int workerIndex;
+
+    if (workerCount > SHST_MAX_WORKERS)
+        workerCount = SHST_MAX_WORKERS;
+
+    for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
+        workerPids[workerIndex] = 0;
+
+    preforkWorkerCount = workerCount;
+    signal(SIGUSR1, forwardSignalToWorkers);
+    signal(SIGHUP, forwardSignalToWorkers);
+    signal(SIGUSR2, forwardSignalToWorkers);
+    signal(SIGINT, forwardSignalToWorkers);
+    signal(SIGTERM, forwardSignalToWorkers);
+
+    while (1)
+    {
+        int returnStatus, aliveWorkers = 0;
+        pid_t exitedPid;
+
+        int upgradeIsReady = SHST_UpgradeState() == SHST_UPGRADE_READY;
+
+        /* after an upgrade the workers only complete their sessions, none is started again */
+        for (workerIndex = 0; workerIndex < workerCount && preforkStopRequested == 0 && upgradeIsReady == 0; workerIndex++)
+        {
+            pid_t workerPid;
+
+            if (workerPids[workerIndex] > 0)
+                continue;
+
+            workerPid = fork();
+
+            if (workerPid == 0)
+            {
+                /* the worker installs its own handlers, nothing is relayed from here on */
+                preforkWorkerCount = 0;
+                signal(SIGUSR1, SIG_DFL);
+                signal(SIGHUP, SIG_DFL);
+                signal(SIGUSR2, SIG_IGN);
+                signal(SIGINT, SIG_DFL);
+                signal(SIGTERM, SIG_DFL);
+#ifdef PR_SET_PDEATHSIG
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+                my_printf("\nWorker process %d started", workerIndex);
+                return workerIndex;
+            }
+
+            if (workerPid > 0)
+                workerPids[workerIndex] = workerPid;
+        }
+
+        for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
+        {
+            if (workerPids[workerIndex] > 0)
+                aliveWorkers++;
+        }
+
+        /* the respawn supervisor must not start the master again either */
+        if (preforkStopRequested == 1 && aliveWorkers == 0)
+            exit(SERVER_STOPPED_EXIT_STATUS);
+
+        /* the respawn supervisor must not start this generation again */
+        if (upgradeIsReady == 1 && aliveWorkers == 0)
+            exit(99);
+
+        exitedPid = waitpid(-1, &returnStatus, 0);
+        if (exitedPid == -1)
+        {
+            if (errno != EINTR)
+                sleep(1);
+            continue;
+        }
+
+        for (workerIndex = 0; workerIndex < workerCount; workerIndex++)
+        {
+            if (workerPids[workerIndex] != exitedPid)
+                continue;
+
+            workerPids[workerIndex] = 0;
+            SHST_ReleaseWorker(workerIndex);
+            METRICS_ReleaseWorker(workerIndex);
+            my_printf("\nWorker process %d exited with status: %d", workerIndex, returnStatus);
+        }
+
+        /* same meaning as for the respawn supervisor, the configuration can't run */
+        if (WIFEXITED(returnStatus) && WEXITSTATUS(returnStatus) == 99 &&
+            SHST_UpgradeState() != SHST_UPGRADE_READY)
+        {
+            forwardSignalToWorkers(SIGINT);
+            exit(99);
+        }
+
+        /* a worker drained on its own, the whole server follows */
+        if (WIFEXITED(returnStatus) && WEXITSTATUS(returnStatus) == SERVER_STOPPED_EXIT_STATUS &&
+            preforkStopRequested == 0)
+        {
+            forwardSignalToWorkers(SIGTERM);
+        }
+
+        if (preforkStopRequested == 0)
+            sleep(1);
+    }
+}
+
+void setServerArguments(char **argv)
+{
+    ssize_t pathLength = readlink("/proc/self/exe", serverExecutablePath, sizeof(serverExecutablePath) - 1);
+
+    /* resolved now, the current directory changes once daemonized */
+    if (pathLength <= 0)
+        serverExecutablePath[0] = '\0';
+    else
+        serverExecutablePath[pathLength] = '\0';
+
+    serverArguments = argv;
+}
+
+/* Returns the descriptor named by the environment variable if it's open, -1 otherwise */
+int inheritedDescriptor(const char *variable)
+{
+    char *value = getenv(variable), *end;
+    long descriptor;
+
+    if (value == NULL || value[0] == '\0')
+        return -1;
+
+    descriptor = strtol(value, &end, 10);
+    if (*end != '\0' || descriptor < 0 || descriptor > INT_MAX ||
+        fcntl((int) descriptor, F_GETFD) == -1)
+        return -1;
+
+    return (int) descriptor;
+}
+
+/*
+ * Takes the sockets of a systemd socket activation (LISTEN_PID and LISTEN_FDS),
+ * they start at descriptor 3. Must run before any fork, the variables are
+ * removed so that no child process takes them again.
+ * Returns the number of sockets received.
+ */
+int socketActivationInit(void)
+{
+    char *listenPid = getenv(SOCKET_ACTIVATION_PID_VARIABLE), *listenFds = getenv(SOCKET_ACTIVATION_FDS_VARIABLE), *end;
+    long pid, count;
+
+    activatedDescriptorCount = 0;
+
+    if (listenPid != NULL && listenFds != NULL)
+    {
+        pid = strtol(listenPid, &end, 10);
+        if (*end == '\0' && pid == (long) getpid())
+        {
+            count = strtol(listenFds, &end, 10);
+            if (*end == '\0' && count > 0 && count < 64)
+                activatedDescriptorCount = (int) count;
+        }
+    }
+
+    unsetenv(SOCKET_ACTIVATION_PID_VARIABLE);
+    unsetenv(SOCKET_ACTIVATION_FDS_VARIABLE);
+    unsetenv(SOCKET_ACTIVATION_NAMES_VARIABLE);
+
+    return activatedDescriptorCount;
+}
+
+int isSocketActivated(void)
+{
+    return activatedDescriptorCount > 0;
+}
+
+/* The index-th activated socket, -1 if systemd passed fewer sockets */
+int activatedDescriptor(int index)
+{
+    if (index < 0 || index >= activatedDescriptorCount)
+        return -1;
+
+    return SOCKET_ACTIVATION_FIRST_FD + index;
+}
+
+int isUpgradedProcess(void)
+{
+    return inheritedDescriptor(UPGRADE_READY_FD_VARIABLE) != -1;
+}
+
+/* Tells the previous binary that it can stop accepting */
+void notifyUpgradeReady(void)
+{
+    int readyDescriptor = inheritedDescriptor(UPGRADE_READY_FD_VARIABLE);
+
+    if (readyDescriptor == -1)
+        return;
+
+    if (write(readyDescriptor, "R", 1) != 1)
+        my_printf("\nUpgrade ready notification failed");
+
+    close(readyDescriptor);
+}
+
+/*
+ * Starts the binary again, it inherits the listening sockets, the pid file lock
+ * and the write end of a pipe where it writes once it serves.
+ * Returns the read end of the pipe, -1 if the process can't be started.
+ */
+int startUpgradedProcess(int listenSocket, int implicitTlsSocket)
+{
+    extern char **environ;
+    char variables[4][64];
+    char **environment;
+    int readyPipe[2], environmentSize, i, j = 0;
+    int maxDescriptor = 1024;
+    struct rlimit rl;
+    pid_t pid;
+
+    if (serverExecutablePath[0] == '\0' || serverArguments == NULL)
+        return -1;
+
+    if (pipe(readyPipe) == -1)
+        return -1;
+
+    /* everything is prepared here, the forked child may only use async signal safe calls */
+    snprintf(variables[0], sizeof(variables[0]), "%s=%d", UPGRADE_LISTEN_FD_VARIABLE, listenSocket);
+    snprintf(variables[1], sizeof(variables[1]), "%s=%d", UPGRADE_IMPLICIT_TLS_FD_VARIABLE, implicitTlsSocket);
+    snprintf(variables[2], sizeof(variables[2]), "%s=%d", UPGRADE_READY_FD_VARIABLE, readyPipe[1]);
+    snprintf(variables[3], sizeof(variables[3]), "%s=%d", UPGRADE_LOCK_FD_VARIABLE, processLockDescriptor);
+
+    for (environmentSize = 0; environ[environmentSize] != NULL; environmentSize++);
+
+    environment = malloc(sizeof(char *) * (environmentSize + 5));
+    if (environment == NULL)
+    {
+        close(readyPipe[0]);
+        close(readyPipe[1]);
+        return -1;
+    }
+
+    for (i = 0; i < environmentSize; i++)
+    {
+        if (strncmp(environ[i], "UFTP_", 5) != 0)
+            environment[j++] = environ[i];
+    }
+
+    for (i = 0; i < 4; i++)
+        environment[j++] = variables[i];
+    environment[j] = NULL;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        maxDescriptor = (int) rl.rlim_cur;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        /* the new process is adopted by init, it doesn't belong to this generation */
+        if (fork() != 0)
+            _exit(0);
+
+        for (i = 3; i < maxDescriptor; i++)
+        {
+            if (i != listenSocket && i != implicitTlsSocket && i != readyPipe[1] && i != processLockDescriptor)
+                close(i);
+        }
+
+        execve(serverExecutablePath, serverArguments, environment);
+        _exit(EXIT_FAILURE);
+    }
+
+    free(environment);
+    close(readyPipe[1]);
+
+    if (pid == -1)
+    {
+        close(readyPipe[0]);
+        return -1;
+    }
+
+    waitpid(pid, NULL, 0);
+    return readyPipe[0];
+}
+
 void *watchDog(void * arg)
 {
 	WatchDogTime = (int)time(NULL);
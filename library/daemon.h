@@ -29,11 +29,38 @@
 extern "C" {
 #endif
 
+/* Environment of an upgraded binary, the descriptors it inherits from the previous one */
+#define UPGRADE_LISTEN_FD_VARIABLE          "UFTP_LISTEN_FD"
+#define UPGRADE_IMPLICIT_TLS_FD_VARIABLE    "UFTP_IMPLICIT_TLS_FD"
+#define UPGRADE_READY_FD_VARIABLE           "UFTP_READY_FD"
+#define UPGRADE_LOCK_FD_VARIABLE            "UFTP_LOCK_FD"
+
+/* systemd socket activation, the received sockets start at descriptor 3 */
+#define SOCKET_ACTIVATION_PID_VARIABLE      "LISTEN_PID"
+#define SOCKET_ACTIVATION_FDS_VARIABLE      "LISTEN_FDS"
+#define SOCKET_ACTIVATION_NAMES_VARIABLE    "LISTEN_FDNAMES"
+#define SOCKET_ACTIVATION_FIRST_FD          3
+
+/* Seconds the new binary has to start serving before the upgrade is abandoned */
+#define UPGRADE_READY_TIMEOUT               30
+
+/* Exit status of a drained process, the supervisors stop instead of starting it again */
+#define SERVER_STOPPED_EXIT_STATUS          97
+
 int isProcessAlreadyRunning(void);
 void daemonize(const char *cmd);
 void respawnProcess(void);
+int preforkWorkers(int workerCount);
 void *watchDog(void * arg);
 void updateWatchDogTime(int theTime);
+void setServerArguments(char **argv);
+int inheritedDescriptor(const char *variable);
+int socketActivationInit(void);
+int isSocketActivated(void);
+int activatedDescriptor(int index);
+int isUpgradedProcess(void);
+void notifyUpgradeReady(void);
+int startUpgradedProcess(int listenSocket, int implicitTlsSocket);
 
 #ifdef __cplusplus
 }
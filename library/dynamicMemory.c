@@ -168,6 +168,20 @@ void *DYNMEM_realloc(void *theMemoryAddress, size_t bytes, DYNMEM_MemoryTable_Da
         // Update node
         found->address = newMemory;
         found->size = bytes;
+
+        // Move to front: growing blocks (vector storage) are reallocated
+        // repeatedly, keep them close to the head of the search
+        if (found != *memoryListHead)
+        {
+            found->previousElement->nextElement = found->nextElement;
+            if (found->nextElement)
+                found->nextElement->previousElement = found->previousElement;
+
+            found->previousElement = NULL;
+            found->nextElement = *memoryListHead;
+            (*memoryListHead)->previousElement = found;
+            *memoryListHead = found;
+        }
         
         pthread_mutex_unlock(&memoryListMutex);
 
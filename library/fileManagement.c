@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <pwd.h>
 #include <grp.h>
 #include <stdio.h>
@@ -818,7 +819,13 @@ int FILE_LockFile(int fd)
     fl.l_start = 0;
     fl.l_whence = SEEK_SET;
     fl.l_len = 0;
+#ifdef F_OFD_SETLK
+    /* bound to the open file, the lock follows the descriptor across fork and exec */
+    fl.l_pid = 0;
+    return(fcntl(fd, F_OFD_SETLK, &fl));
+#else
     return(fcntl(fd, F_SETLK, &fl));
+#endif
 }
 
 int FILE_doChownFromUidGid(const char *file_path, uid_t uid, gid_t gid)
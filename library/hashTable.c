@@ -0,0 +1,179 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashTable.h"
+#include "dynamicMemory.h"
+
+#define HASH_MINIMUM_CAPACITY   16
+
+static int tableCapacityFor(int expectedSize);
+static int tableResize(HASH_Table_DataType *table, int newCapacity);
+
+/* FNV-1a */
+unsigned int HASH_String(const char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*key)
+    {
+        hash ^= (unsigned char) *key++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Power of two sized, kept at most half full */
+static int tableCapacityFor(int expectedSize)
+{
+    int capacity = HASH_MINIMUM_CAPACITY;
+
+    while (capacity < expectedSize * 2)
+    {
+        capacity <<= 1;
+    }
+
+    return capacity;
+}
+
+static int tableResize(HASH_Table_DataType *table, int newCapacity)
+{
+    HASH_Entry_DataType *newEntries;
+
+    newEntries = DYNMEM_malloc(sizeof(HASH_Entry_DataType) * newCapacity, &table->memoryTable, "hashTable");
+    if (newEntries == NULL)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < table->capacity; i++)
+    {
+        unsigned int slot;
+
+        if (table->entries[i].key == NULL)
+        {
+            continue;
+        }
+
+        slot = table->entries[i].hash & (newCapacity - 1);
+        while (newEntries[slot].key != NULL)
+        {
+            slot = (slot + 1) & (newCapacity - 1);
+        }
+
+        newEntries[slot] = table->entries[i];
+    }
+
+    if (table->entries != NULL)
+    {
+        DYNMEM_free(table->entries, &table->memoryTable);
+    }
+
+    table->entries = newEntries;
+    table->capacity = newCapacity;
+    return 1;
+}
+
+void HASH_Init(HASH_Table_DataType *table, int expectedSize)
+{
+    table->memoryTable = NULL;
+    table->entries = NULL;
+    table->capacity = 0;
+    table->size = 0;
+
+    tableResize(table, tableCapacityFor(expectedSize));
+}
+
+/* Returns 1 when the key is added, 0 when it is already present (the first value is kept), -1 on error */
+int HASH_Insert(HASH_Table_DataType *table, const char *key, int value)
+{
+    unsigned int hash, slot;
+
+    if (table->entries == NULL || (table->size + 1) * 2 > table->capacity)
+    {
+        if (tableResize(table, tableCapacityFor(table->size + 1)) < 0)
+        {
+            return -1;
+        }
+    }
+
+    hash = HASH_String(key);
+    slot = hash & (table->capacity - 1);
+
+    while (table->entries[slot].key != NULL)
+    {
+        if (table->entries[slot].hash == hash &&
+            strcmp(table->entries[slot].key, key) == 0)
+        {
+            return 0;
+        }
+
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    table->entries[slot].key = key;
+    table->entries[slot].hash = hash;
+    table->entries[slot].value = value;
+    table->size++;
+    return 1;
+}
+
+/* Returns the value stored for the key or -1 */
+int HASH_Search(HASH_Table_DataType *table, const char *key)
+{
+    unsigned int hash, slot;
+
+    if (table->entries == NULL || key == NULL)
+    {
+        return -1;
+    }
+
+    hash = HASH_String(key);
+    slot = hash & (table->capacity - 1);
+
+    while (table->entries[slot].key != NULL)
+    {
+        if (table->entries[slot].hash == hash &&
+            strcmp(table->entries[slot].key, key) == 0)
+        {
+            return table->entries[slot].value;
+        }
+
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    return -1;
+}
+
+void HASH_Destroy(HASH_Table_DataType *table)
+{
+    DYNMEM_freeAll(&table->memoryTable);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->size = 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include "dynamicMemory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* String keyed index, keys are borrowed and must outlive the table */
+struct HASH_Entry
+{
+    const char *key;
+    unsigned int hash;
+    int value;
+} typedef HASH_Entry_DataType;
+
+struct HASH_Table
+{
+    DYNMEM_MemoryTable_DataType *memoryTable;
+    HASH_Entry_DataType *entries;
+    int capacity;
+    int size;
+} typedef HASH_Table_DataType;
+
+unsigned int HASH_String(const char *key);
+void HASH_Init(HASH_Table_DataType *table, int expectedSize);
+int HASH_Insert(HASH_Table_DataType *table, const char *key, int value);
+int HASH_Search(HASH_Table_DataType *table, const char *key);
+void HASH_Destroy(HASH_Table_DataType *table);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HASH_TABLE_H */
@@ -0,0 +1,138 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "histogram.h"
+
+static int bucketIndex(unsigned long long int value);
+static unsigned long long int bucketHighestValue(int index);
+
+static int bucketIndex(unsigned long long int value)
+{
+    int msb;
+
+    if (value < HIST_SUB_BUCKET_COUNT)
+        return (int) value;
+
+    msb = 63 - __builtin_clzll(value);
+    if (msb > HIST_MAX_MSB)
+        return HIST_BUCKET_COUNT - 1;
+
+    return (msb - HIST_SUB_BUCKET_BITS + 1) * HIST_SUB_BUCKET_COUNT +
+           (int) ((value >> (msb - HIST_SUB_BUCKET_BITS)) & (HIST_SUB_BUCKET_COUNT - 1));
+}
+
+/* Largest value counted in the bucket, quantiles are reported on the safe side */
+static unsigned long long int bucketHighestValue(int index)
+{
+    int shift;
+
+    if (index < HIST_SUB_BUCKET_COUNT)
+        return (unsigned long long int) index;
+
+    shift = index / HIST_SUB_BUCKET_COUNT - 1;
+    return (((unsigned long long int) (HIST_SUB_BUCKET_COUNT + index % HIST_SUB_BUCKET_COUNT) + 1) << shift) - 1;
+}
+
+unsigned long long int HIST_Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long int) now.tv_sec * 1000000000ULL + (unsigned long long int) now.tv_nsec;
+}
+
+void HIST_Record(HIST_Histogram_DataType *histogram, unsigned long long int value)
+{
+    int index = bucketIndex(value);
+
+    /* one writer, the relaxed accesses only keep concurrent readers well defined */
+    __atomic_store_n(&histogram->buckets[index], __atomic_load_n(&histogram->buckets[index], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, __atomic_load_n(&histogram->count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+
+    if (value > __atomic_load_n(&histogram->max, __ATOMIC_RELAXED))
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+void HIST_RecordAtomic(HIST_Histogram_DataType *histogram, unsigned long long int value)
+{
+    unsigned long long int max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->buckets[bucketIndex(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+    while (value > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void HIST_Merge(HIST_Histogram_DataType *destination, HIST_Histogram_DataType *source)
+{
+    unsigned long long int max = __atomic_load_n(&source->max, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < HIST_BUCKET_COUNT; i++)
+        destination->buckets[i] += __atomic_load_n(&source->buckets[i], __ATOMIC_RELAXED);
+
+    destination->count += __atomic_load_n(&source->count, __ATOMIC_RELAXED);
+    destination->sum += __atomic_load_n(&source->sum, __ATOMIC_RELAXED);
+
+    if (max > destination->max)
+        destination->max = max;
+}
+
+/* The buckets are summed again, count may already include a value still being recorded */
+unsigned long long int HIST_ValueAtQuantile(HIST_Histogram_DataType *histogram, double quantile)
+{
+    unsigned long long int total = 0, target, seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKET_COUNT; i++)
+        total += histogram->buckets[i];
+
+    if (total == 0)
+        return 0;
+
+    target = (unsigned long long int) (quantile * (double) total);
+    if ((double) target < quantile * (double) total)
+        target++;
+    if (target < 1)
+        target = 1;
+    if (target > total)
+        target = total;
+
+    for (i = 0; i < HIST_BUCKET_COUNT; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= target)
+            break;
+    }
+
+    /* the last bucket also holds the values out of range */
+    if (i >= HIST_BUCKET_COUNT - 1)
+        return histogram->max;
+
+    return bucketHighestValue(i) < histogram->max ? bucketHighestValue(i) : histogram->max;
+}
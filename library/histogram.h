@@ -0,0 +1,63 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Log-linear latency histograms in nanoseconds, HDR style: every power of two
+ * is split in HIST_SUB_BUCKET_COUNT linear buckets, so a bucket is at most
+ * 12.5% wide whatever the magnitude. Values above 2^40 ns share the last bucket.
+ * HIST_Record is for histograms with a single writer, it compiles to plain
+ * increments; HIST_RecordAtomic is for histograms shared by several threads.
+ * Readers merge with relaxed loads while the writers run.
+ */
+#define HIST_SUB_BUCKET_BITS        3
+#define HIST_SUB_BUCKET_COUNT       (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_MAX_MSB                39
+#define HIST_BUCKET_COUNT           ((HIST_MAX_MSB - HIST_SUB_BUCKET_BITS + 2) * HIST_SUB_BUCKET_COUNT)
+
+struct HIST_Histogram
+{
+    unsigned long long int count;
+    unsigned long long int sum;
+    unsigned long long int max;
+    unsigned long long int buckets[HIST_BUCKET_COUNT];
+} typedef HIST_Histogram_DataType;
+
+unsigned long long int HIST_Now(void);
+void HIST_Record(HIST_Histogram_DataType *histogram, unsigned long long int value);
+void HIST_RecordAtomic(HIST_Histogram_DataType *histogram, unsigned long long int value);
+void HIST_Merge(HIST_Histogram_DataType *destination, HIST_Histogram_DataType *source);
+unsigned long long int HIST_ValueAtQuantile(HIST_Histogram_DataType *histogram, double quantile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTOGRAM_H */
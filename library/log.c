@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <pthread.h>
 #include <time.h>
 #include <semaphore.h>
@@ -34,6 +35,15 @@ static pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;
 static int maxLogFiles = 0;
 static char logFolder[PATH_MAX] = {0};
 
+volatile sig_atomic_t logLevels[LOG_SUBSYSTEM_COUNT] = {0};
+static int configuredLogLevels[LOG_SUBSYSTEM_COUNT] = {LOG_LEVEL_DEBUG, LOG_LEVEL_DEBUG, LOG_LEVEL_DEBUG, LOG_LEVEL_DEBUG, LOG_LEVEL_DEBUG};
+static volatile sig_atomic_t debugOverride = 0;
+
+static const char* logLevelNames[] = {"none", "error", "security", "info", "debug"};
+static const char* logSubsystemNames[LOG_SUBSYSTEM_COUNT] = {"SERVER", "CONTROL", "DATA", "AUTH", "TLS"};
+
+static void logApplyLevels(void);
+
 // Convert YYYY-MM-DD to comparable numeric
 static long long getDateNumeric(const char* str) {
     if (strlen(str) != 10 || str[4] != '-' || str[7] != '-') return 0;
@@ -124,6 +134,7 @@ int logInit(const char* folder, int numberOfLogFiles) {
 
     maxLogFiles = numberOfLogFiles;
     snprintf(logFolder, sizeof(logFolder), "%s", folder);
+    logApplyLevels();
 
     DYNV_VectorString_Init(&logQueue);
     DYNV_VectorString_Init(&workerQueue);
@@ -144,11 +155,13 @@ int logInit(const char* folder, int numberOfLogFiles) {
 void logMessage(const char* message, const char* file, int line, const char* function) {
     if (maxLogFiles <= 0 || !message) return;
 
-    char logEntry[LOG_LINE_SIZE] = {0};
+    char logEntry[LOG_LINE_SIZE];
+    struct tm tm_now;
     time_t now = time(NULL);
-    struct tm* tm_now = localtime(&now);
+    localtime_r(&now, &tm_now);
 
-    strftime(logEntry, sizeof(logEntry), "%Y-%m-%d_%H:%M:%S: ", tm_now);
+    logEntry[0] = '\0';
+    strftime(logEntry, sizeof(logEntry), "%Y-%m-%d_%H:%M:%S: ", &tm_now);
     strncat(logEntry, message, LOG_LINE_SIZE - strlen(logEntry) - 1);
 
     char metaInfo[256];
@@ -165,7 +178,7 @@ void logMessage(const char* message, const char* file, int line, const char* fun
 void logMessagef(const char* file, int line, const char* function, const char* fmt, ...) {
     if (maxLogFiles <= 0 || !fmt) return;
 
-    char messageBuffer[LOG_LINE_SIZE] = {0};
+    char messageBuffer[LOG_LINE_SIZE];
     va_list args;
     va_start(args, fmt);
     vsnprintf(messageBuffer, sizeof(messageBuffer), fmt, args);
@@ -173,3 +186,76 @@ void logMessagef(const char* file, int line, const char* function, const char* f
 
     logMessage(messageBuffer, file, line, function);
 }
+
+// Lines queued and not yet taken by the log thread
+int logQueueDepth(void) {
+    int depth;
+
+    pthread_mutex_lock(&logMutex);
+    depth = logQueue.Size;
+    pthread_mutex_unlock(&logMutex);
+
+    return depth;
+}
+
+// Recompute the effective levels, everything is off while logging is disabled
+static void logApplyLevels(void) {
+    for (int i = 0; i < LOG_SUBSYSTEM_COUNT; ++i) {
+        if (maxLogFiles <= 0)
+            logLevels[i] = LOG_LEVEL_NONE;
+        else if (debugOverride)
+            logLevels[i] = LOG_LEVEL_DEBUG;
+        else
+            logLevels[i] = configuredLogLevels[i];
+    }
+}
+
+// Accepts a level name (none, error, security, info, debug) or its number
+int logParseLevel(const char* name) {
+    if (!name) return -1;
+
+    if (isdigit((unsigned char) name[0])) {
+        int level = atoi(name);
+        return (level >= LOG_LEVEL_NONE && level <= LOG_LEVEL_DEBUG) ? level : -1;
+    }
+
+    for (int i = LOG_LEVEL_NONE; i <= LOG_LEVEL_DEBUG; ++i) {
+        if (strcasecmp(name, logLevelNames[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+const char* logLevelName(int level) {
+    if (level < LOG_LEVEL_NONE || level > LOG_LEVEL_DEBUG) return "unknown";
+    return logLevelNames[level];
+}
+
+const char* logSubsystemName(int subsystem) {
+    if (subsystem < 0 || subsystem >= LOG_SUBSYSTEM_COUNT) return "UNKNOWN";
+    return logSubsystemNames[subsystem];
+}
+
+void logSetLevels(const int* levels) {
+    for (int i = 0; i < LOG_SUBSYSTEM_COUNT; ++i) {
+        if (levels[i] >= LOG_LEVEL_NONE && levels[i] <= LOG_LEVEL_DEBUG)
+            configuredLogLevels[i] = levels[i];
+    }
+    logApplyLevels();
+}
+
+int logSetSubsystemLevel(int subsystem, int level) {
+    if (subsystem < 0 || subsystem >= LOG_SUBSYSTEM_COUNT) return -1;
+    if (level < LOG_LEVEL_NONE || level > LOG_LEVEL_DEBUG) return -1;
+
+    configuredLogLevels[subsystem] = level;
+    logApplyLevels();
+    return 1;
+}
+
+// Switch between full debug and the configured levels, safe to call from a signal handler
+void logToggleDebug(void) {
+    debugOverride = !debugOverride;
+    logApplyLevels();
+}
@@ -25,20 +25,67 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <signal.h>
+
 #define LOG_INFO_PREFIX "[INFO] "
 #define LOG_DEBUG_PREFIX "[DEBUG] "
 #define LOG_ERROR_PREFIX "[ERROR] "
 #define LOG_SECURITY_PREFIX "[SECURITY] "
 
-#define LOG(msg) logMessage(msg, __FILE__, __LINE__, __func__)
-#define LOG_INFO(msg) logMessage(LOG_INFO_PREFIX msg, __FILE__, __LINE__, __func__)
-#define LOG_DEBUG(msg) logMessage(LOG_DEBUG_PREFIX msg, __FILE__, __LINE__, __func__)
-#define LOG_ERROR(msg) logMessage(LOG_ERROR_PREFIX msg, __FILE__, __LINE__, __func__)
-#define LOG_SECURITY(msg) logMessage(LOG_SECURITY_PREFIX msg, __FILE__, __LINE__, __func__)
-#define LOGF(fmt, ...) logMessagef(__FILE__, __LINE__, __func__, fmt, ##__VA_ARGS__)
+/* Log levels, a message is written when its level is <= the subsystem level */
+#define LOG_LEVEL_NONE      0
+#define LOG_LEVEL_ERROR     1
+#define LOG_LEVEL_SECURITY  2
+#define LOG_LEVEL_INFO      3
+#define LOG_LEVEL_DEBUG     4
+
+/* Subsystems that can be filtered independently */
+#define LOG_SUBSYSTEM_SERVER    0
+#define LOG_SUBSYSTEM_CONTROL   1
+#define LOG_SUBSYSTEM_DATA      2
+#define LOG_SUBSYSTEM_AUTH      3
+#define LOG_SUBSYSTEM_TLS       4
+#define LOG_SUBSYSTEM_COUNT     5
+
+/* Define LOG_SUBSYSTEM before the includes to tag every message of a source file */
+#ifndef LOG_SUBSYSTEM
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_SERVER
+#endif
+
+/* Effective levels, all LOG_LEVEL_NONE while logging is disabled */
+extern volatile sig_atomic_t logLevels[LOG_SUBSYSTEM_COUNT];
+
+#define LOG_IS_ENABLED(level, subsystem) ((level) <= logLevels[(subsystem)])
+
+/* The level is checked before any formatting takes place */
+#define LOG_AT(subsystem, level, prefix, msg) \
+    do { if (LOG_IS_ENABLED(level, subsystem)) logMessage(prefix msg, __FILE__, __LINE__, __func__); } while (0)
+#define LOGF_AT(subsystem, level, prefix, fmt, ...) \
+    do { if (LOG_IS_ENABLED(level, subsystem)) logMessagef(__FILE__, __LINE__, __func__, prefix fmt, ##__VA_ARGS__); } while (0)
+
+#define LOG(msg) LOG_AT(LOG_SUBSYSTEM, LOG_LEVEL_INFO, "", msg)
+#define LOG_INFO(msg) LOG_AT(LOG_SUBSYSTEM, LOG_LEVEL_INFO, LOG_INFO_PREFIX, msg)
+#define LOG_DEBUG(msg) LOG_AT(LOG_SUBSYSTEM, LOG_LEVEL_DEBUG, LOG_DEBUG_PREFIX, msg)
+#define LOG_ERROR(msg) LOG_AT(LOG_SUBSYSTEM, LOG_LEVEL_ERROR, LOG_ERROR_PREFIX, msg)
+#define LOG_SECURITY(msg) LOG_AT(LOG_SUBSYSTEM, LOG_LEVEL_SECURITY, LOG_SECURITY_PREFIX, msg)
+
+#define LOGF(fmt, ...) LOGF_AT(LOG_SUBSYSTEM, LOG_LEVEL_INFO, "", fmt, ##__VA_ARGS__)
+#define LOGF_INFO(fmt, ...) LOGF_AT(LOG_SUBSYSTEM, LOG_LEVEL_INFO, LOG_INFO_PREFIX, fmt, ##__VA_ARGS__)
+#define LOGF_DEBUG(fmt, ...) LOGF_AT(LOG_SUBSYSTEM, LOG_LEVEL_DEBUG, LOG_DEBUG_PREFIX, fmt, ##__VA_ARGS__)
+#define LOGF_ERROR(fmt, ...) LOGF_AT(LOG_SUBSYSTEM, LOG_LEVEL_ERROR, LOG_ERROR_PREFIX, fmt, ##__VA_ARGS__)
+#define LOGF_SECURITY(fmt, ...) LOGF_AT(LOG_SUBSYSTEM, LOG_LEVEL_SECURITY, LOG_SECURITY_PREFIX, fmt, ##__VA_ARGS__)
 
 int logInit(const char* folder, int numberOfLogFiles);
 void logMessage(const char* message, const char* file, int line, const char* function);
 void logMessagef(const char* file, int line, const char* function, const char* fmt, ...);
+int logQueueDepth(void);
+
+/* Runtime level control */
+int logParseLevel(const char* name);
+const char* logLevelName(int level);
+const char* logSubsystemName(int subsystem);
+void logSetLevels(const int* levels);
+int logSetSubsystemLevel(int subsystem, int level);
+void logToggleDebug(void);
 
-#endif
\ No newline at end of file
+#endif
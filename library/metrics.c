@@ -0,0 +1,628 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "sharedState.h"
+#include "dynamicMemory.h"
+#include "log.h"
+#include "../debugHelper.h"
+
+/* Seconds a scraper has to send its request and read the reply */
+#define METRICS_CLIENT_TIMEOUT      1
+
+struct METRICS_Descriptor
+{
+    const char *name;
+    const char *labels;
+    const char *type;
+    const char *help;
+} typedef METRICS_Descriptor_DataType;
+
+/* Indexed by the METRICS_ values, the samples of a family are adjacent */
+static const METRICS_Descriptor_DataType descriptors[METRICS_VALUE_COUNT] =
+{
+    {"uftp_connections_total", "result=\"accepted\"", "counter", "Control connections accepted or refused"},
+    {"uftp_connections_total", "result=\"rejected\"", "counter", "Control connections accepted or refused"},
+    {"uftp_logins_total", "result=\"ok\"", "counter", "Login attempts by result"},
+    {"uftp_logins_total", "result=\"failed\"", "counter", "Login attempts by result"},
+    {"uftp_transfer_bytes_total", "direction=\"in\"", "counter", "File bytes received and sent on the data channels"},
+    {"uftp_transfer_bytes_total", "direction=\"out\"", "counter", "File bytes received and sent on the data channels"},
+    {"uftp_tls_handshakes_total", "result=\"ok\"", "counter", "TLS handshakes of the control and data channels"},
+    {"uftp_tls_handshakes_total", "result=\"failed\"", "counter", "TLS handshakes of the control and data channels"},
+    {"uftp_active_transfers", NULL, "gauge", "Data transfers in progress"},
+    {"uftp_passive_ports_in_use", NULL, "gauge", "Passive mode listening sockets open"},
+    {"uftp_dynmem_live_bytes", NULL, "gauge", "Bytes allocated through DYNMEM, sampled every second"},
+    {"uftp_log_queue_depth", NULL, "gauge", "Log lines waiting for the log thread, sampled every second"}
+};
+
+static METRICS_Segment_DataType *segment = NULL;
+static int workerIndex = 0;
+static time_t lastPublish = 0;
+
+/* Command latency histograms, [worker][command] */
+static METRICS_CommandLatency_DataType *commandLatency = NULL;
+static const char *commandNames[METRICS_MAX_COMMANDS];
+static int commandCount = 0, commandLatencyWorkers = 0;
+
+/* Transfer phase histograms, [worker] */
+static METRICS_TransferPhases_DataType *transferPhases = NULL;
+static int transferPhaseWorkers = 0;
+
+static const char *transferPhaseNames[METRICS_PHASE_COUNT] =
+    {"start", "port_search", "connect", "tls_handshake", "command", "file_open", "first_byte", "last_byte"};
+
+static const double renderedQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char *renderedQuantileLabels[] = {"0.5", "0.9", "0.99", "0.999"};
+
+static pthread_t serverThread;
+static char serverAddress[256];
+
+static int append(char *buffer, int size, int *length, const char *format, ...);
+static int renderCommandSummaries(char *buffer, int size, int *length, const char *name, const char *help, int isQueue);
+static int renderTransferPhases(char *buffer, int size, int *length);
+static int parseServerAddress(const char *address, struct sockaddr_storage *local, socklen_t *localSize);
+static int openServerSocket(const char *address);
+static void serveScrape(int client);
+static void *serverHandle(void *arg);
+
+int METRICS_Init(void)
+{
+    if (segment != NULL)
+        return 1;
+
+    segment = mmap(NULL, sizeof(METRICS_Segment_DataType), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED)
+    {
+        segment = NULL;
+        return -1;
+    }
+
+    memset(segment, 0, sizeof(METRICS_Segment_DataType));
+    return 1;
+}
+
+/* Column used by this process, set in every worker after the fork */
+void METRICS_SetWorker(int index)
+{
+    if (index >= 0 && index < METRICS_MAX_WORKERS)
+        workerIndex = index;
+}
+
+/* The counters of an exited worker are kept, its gauges no longer hold */
+void METRICS_ReleaseWorker(int index)
+{
+    if (segment == NULL || index < 0 || index >= METRICS_MAX_WORKERS)
+        return;
+
+    for (int metric = METRICS_ACTIVE_TRANSFERS; metric < METRICS_VALUE_COUNT; metric++)
+        __atomic_store_n(&segment->workers[index].values[metric], 0, __ATOMIC_RELAXED);
+}
+
+void METRICS_Add(int metric, long long int value)
+{
+    if (segment != NULL)
+        __atomic_fetch_add(&segment->workers[workerIndex].values[metric], value, __ATOMIC_RELAXED);
+}
+
+void METRICS_Set(int metric, long long int value)
+{
+    if (segment != NULL)
+        __atomic_store_n(&segment->workers[workerIndex].values[metric], value, __ATOMIC_RELAXED);
+}
+
+/* Process local values, sampled by the control loop at most once per second */
+void METRICS_PublishProcessGauges(time_t now)
+{
+    if (segment == NULL || now == lastPublish)
+        return;
+
+    lastPublish = now;
+    METRICS_Set(METRICS_MEMORY_LIVE_BYTES, (long long int) DYNMEM_GetTotalMemory());
+    METRICS_Set(METRICS_LOG_QUEUE_DEPTH, logQueueDepth());
+}
+
+/* Appends to the exposition text, -1 once the buffer is full */
+static int append(char *buffer, int size, int *length, const char *format, ...)
+{
+    va_list arguments;
+    int written;
+
+    va_start(arguments, format);
+    written = vsnprintf(buffer + *length, size - *length, format, arguments);
+    va_end(arguments);
+
+    if (written < 0 || written >= size - *length)
+        return -1;
+
+    *length += written;
+    return 1;
+}
+
+/* A summary family over the command histograms, the commands never run are left out */
+static int renderCommandSummaries(char *buffer, int size, int *length, const char *name, const char *help, int isQueue)
+{
+    HIST_Histogram_DataType handler, queue, *histogram = isQueue == 1 ? &queue : &handler;
+
+    if (append(buffer, size, length, "# HELP %s %s\n# TYPE %s summary\n", name, help, name) == -1)
+        return -1;
+
+    for (int command = 0; command < commandCount; command++)
+    {
+        unsigned long long int count = 0;
+
+        for (int worker = 0; worker < commandLatencyWorkers; worker++)
+            count += __atomic_load_n(&commandLatency[worker * commandCount + command].handler.count, __ATOMIC_RELAXED);
+
+        if (count == 0)
+            continue;
+
+        METRICS_MergeCommandLatency(command, &handler, &queue);
+
+        for (int i = 0; i < (int) (sizeof(renderedQuantiles) / sizeof(renderedQuantiles[0])); i++)
+        {
+            if (append(buffer, size, length, "%s{command=\"%s\",quantile=\"%s\"} %.9f\n", name, commandNames[command], renderedQuantileLabels[i],
+                       HIST_ValueAtQuantile(histogram, renderedQuantiles[i]) / 1e9) == -1)
+                return -1;
+        }
+
+        if (append(buffer, size, length, "%s_sum{command=\"%s\"} %.9f\n%s_count{command=\"%s\"} %llu\n",
+                   name, commandNames[command], histogram->sum / 1e9, name, commandNames[command], histogram->count) == -1)
+            return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * Maps the command histograms before the workers are forked, the names are
+ * the dispatch table strings and must stay valid.
+ */
+int METRICS_InitCommandLatency(const char **names, int count, int workerCount)
+{
+    size_t size;
+
+    if (commandLatency != NULL)
+        return 1;
+
+    if (count > METRICS_MAX_COMMANDS)
+        count = METRICS_MAX_COMMANDS;
+    if (workerCount > METRICS_MAX_WORKERS)
+        workerCount = METRICS_MAX_WORKERS;
+
+    /* untouched pages of the mapping cost no memory, most commands are never used */
+    size = sizeof(METRICS_CommandLatency_DataType) * count * workerCount;
+    commandLatency = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (commandLatency == MAP_FAILED)
+    {
+        commandLatency = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+        commandNames[i] = names[i];
+
+    commandCount = count;
+    commandLatencyWorkers = workerCount;
+    return 1;
+}
+
+/* Called by the control loop only, the histograms of a worker have one writer */
+void METRICS_RecordCommand(int command, unsigned long long int queueTime, unsigned long long int handlerTime)
+{
+    METRICS_CommandLatency_DataType *latency;
+
+    if (commandLatency == NULL || command < 0 || command >= commandCount || workerIndex >= commandLatencyWorkers)
+        return;
+
+    latency = &commandLatency[workerIndex * commandCount + command];
+    HIST_Record(&latency->handler, handlerTime);
+    HIST_Record(&latency->queue, queueTime);
+}
+
+int METRICS_CommandCount(void)
+{
+    return commandLatency != NULL ? commandCount : 0;
+}
+
+const char *METRICS_CommandName(int command)
+{
+    return command >= 0 && command < commandCount ? commandNames[command] : "";
+}
+
+/* Sums the histograms of every worker for the command */
+void METRICS_MergeCommandLatency(int command, HIST_Histogram_DataType *handler, HIST_Histogram_DataType *queue)
+{
+    memset(handler, 0, sizeof(HIST_Histogram_DataType));
+    memset(queue, 0, sizeof(HIST_Histogram_DataType));
+
+    if (commandLatency == NULL || command < 0 || command >= commandCount)
+        return;
+
+    for (int worker = 0; worker < commandLatencyWorkers; worker++)
+    {
+        HIST_Merge(handler, &commandLatency[worker * commandCount + command].handler);
+        HIST_Merge(queue, &commandLatency[worker * commandCount + command].queue);
+    }
+}
+
+/* Maps the transfer phase histograms before the workers are forked */
+int METRICS_InitTransferPhases(int workerCount)
+{
+    if (transferPhases != NULL)
+        return 1;
+
+    if (workerCount > METRICS_MAX_WORKERS)
+        workerCount = METRICS_MAX_WORKERS;
+
+    transferPhases = mmap(NULL, sizeof(METRICS_TransferPhases_DataType) * workerCount, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (transferPhases == MAP_FAILED)
+    {
+        transferPhases = NULL;
+        return -1;
+    }
+
+    transferPhaseWorkers = workerCount;
+    return 1;
+}
+
+/* Called by the transfer threads, several of them share the histograms of a worker */
+void METRICS_RecordTransferPhase(int phase, unsigned long long int duration)
+{
+    if (transferPhases == NULL || phase <= METRICS_PHASE_START || phase >= METRICS_PHASE_COUNT || workerIndex >= transferPhaseWorkers)
+        return;
+
+    HIST_RecordAtomic(&transferPhases[workerIndex].phases[phase], duration);
+}
+
+const char *METRICS_TransferPhaseName(int phase)
+{
+    return phase >= 0 && phase < METRICS_PHASE_COUNT ? transferPhaseNames[phase] : "";
+}
+
+static int renderTransferPhases(char *buffer, int size, int *length)
+{
+    const char *name = "uftp_transfer_phase_seconds";
+    HIST_Histogram_DataType histogram;
+
+    if (append(buffer, size, length, "# HELP %s Data channel phase durations\n# TYPE %s summary\n", name, name) == -1)
+        return -1;
+
+    for (int phase = METRICS_PHASE_START + 1; phase < METRICS_PHASE_COUNT; phase++)
+    {
+        memset(&histogram, 0, sizeof(histogram));
+        for (int worker = 0; worker < transferPhaseWorkers; worker++)
+            HIST_Merge(&histogram, &transferPhases[worker].phases[phase]);
+
+        if (histogram.count == 0)
+            continue;
+
+        for (int i = 0; i < (int) (sizeof(renderedQuantiles) / sizeof(renderedQuantiles[0])); i++)
+        {
+            if (append(buffer, size, length, "%s{phase=\"%s\",quantile=\"%s\"} %.9f\n", name, transferPhaseNames[phase], renderedQuantileLabels[i],
+                       HIST_ValueAtQuantile(&histogram, renderedQuantiles[i]) / 1e9) == -1)
+                return -1;
+        }
+
+        if (append(buffer, size, length, "%s_sum{phase=\"%s\"} %.9f\n%s_count{phase=\"%s\"} %llu\n",
+                   name, transferPhaseNames[phase], histogram.sum / 1e9, name, transferPhaseNames[phase], histogram.count) == -1)
+            return -1;
+    }
+
+    return 1;
+}
+
+/* Writes the exposition text, returns its length or -1 if the buffer is too small */
+int METRICS_Render(char *buffer, int size)
+{
+    int length = 0, metric, worker;
+    long long int value;
+
+    if (segment == NULL)
+        return -1;
+
+    if (append(buffer, size, &length,
+               "# HELP uftp_connected_sessions Control sessions connected\n"
+               "# TYPE uftp_connected_sessions gauge\n"
+               "uftp_connected_sessions %d\n", SHST_ConnectedClients()) == -1)
+        return -1;
+
+    for (metric = 0; metric < METRICS_VALUE_COUNT; metric++)
+    {
+        value = 0;
+        for (worker = 0; worker < METRICS_MAX_WORKERS; worker++)
+            value += __atomic_load_n(&segment->workers[worker].values[metric], __ATOMIC_RELAXED);
+
+        if ((metric == 0 || strcmp(descriptors[metric].name, descriptors[metric - 1].name) != 0) &&
+            append(buffer, size, &length, "# HELP %s %s\n# TYPE %s %s\n",
+                   descriptors[metric].name, descriptors[metric].help,
+                   descriptors[metric].name, descriptors[metric].type) == -1)
+            return -1;
+
+        if (descriptors[metric].labels != NULL)
+        {
+            if (append(buffer, size, &length, "%s{%s} %lld\n", descriptors[metric].name, descriptors[metric].labels, value) == -1)
+                return -1;
+        }
+        else if (append(buffer, size, &length, "%s %lld\n", descriptors[metric].name, value) == -1)
+            return -1;
+    }
+
+    if (commandLatency != NULL &&
+        (renderCommandSummaries(buffer, size, &length, "uftp_command_duration_seconds", "Time spent in the command handlers", 0) == -1 ||
+         renderCommandSummaries(buffer, size, &length, "uftp_command_queue_seconds", "Time from the control loop wake up to the command handler start", 1) == -1))
+        return -1;
+
+    if (transferPhases != NULL && renderTransferPhases(buffer, size, &length) == -1)
+        return -1;
+
+    return length;
+}
+
+/*
+ * METRICS_ADDRESS is "ip:port" or "[ipv6]:port" for a TCP endpoint or an
+ * absolute path for a unix socket. Returns -1 for a malformed address.
+ */
+static int parseServerAddress(const char *address, struct sockaddr_storage *local, socklen_t *localSize)
+{
+    char host[INET6_ADDRSTRLEN];
+    const char *hostStart = address, *separator = strrchr(address, ':');
+    char *end;
+    long port;
+
+    memset(local, 0, sizeof(struct sockaddr_storage));
+
+    if (address[0] == '/')
+    {
+        struct sockaddr_un *unixAddress = (struct sockaddr_un *) local;
+
+        if (strlen(address) >= sizeof(unixAddress->sun_path))
+            return -1;
+
+        unixAddress->sun_family = AF_UNIX;
+        strcpy(unixAddress->sun_path, address);
+        *localSize = sizeof(struct sockaddr_un);
+        return 1;
+    }
+
+    if (separator == NULL)
+        return -1;
+
+    port = strtol(separator + 1, &end, 10);
+    if (separator[1] == '\0' || *end != '\0' || port <= 0 || port > 65535)
+        return -1;
+
+    /* an IPv6 address is bracketed, its own colons would be taken for the port separator */
+    if (address[0] == '[')
+    {
+        if (separator == address || separator[-1] != ']')
+            return -1;
+        hostStart = address + 1;
+        separator--;
+    }
+
+    if (separator - hostStart <= 0 || separator - hostStart >= (long) sizeof(host))
+        return -1;
+
+    memcpy(host, hostStart, separator - hostStart);
+    host[separator - hostStart] = '\0';
+
+    if (address[0] == '[')
+    {
+        struct sockaddr_in6 *ipv6Address = (struct sockaddr_in6 *) local;
+
+        ipv6Address->sin6_family = AF_INET6;
+        ipv6Address->sin6_port = htons((unsigned short) port);
+        *localSize = sizeof(struct sockaddr_in6);
+        return inet_pton(AF_INET6, host, &ipv6Address->sin6_addr) == 1 ? 1 : -1;
+    }
+    else
+    {
+        struct sockaddr_in *ipv4Address = (struct sockaddr_in *) local;
+
+        ipv4Address->sin_family = AF_INET;
+        ipv4Address->sin_port = htons((unsigned short) port);
+        *localSize = sizeof(struct sockaddr_in);
+        return inet_pton(AF_INET, host, &ipv4Address->sin_addr) == 1 ? 1 : -1;
+    }
+}
+
+/* Returns the listening socket, -1 if it can't be bound yet, the address was checked by METRICS_StartServer */
+static int openServerSocket(const char *address)
+{
+    struct sockaddr_storage local;
+    socklen_t localSize;
+    int sock, reuse = 1;
+
+    if (parseServerAddress(address, &local, &localSize) != 1)
+        return -1;
+
+    sock = socket(local.ss_family, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+
+    if (local.ss_family == AF_UNIX)
+    {
+        /* a socket file left by a previous run */
+        unlink(address);
+    }
+    else
+    {
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+
+    /* only the owner can connect to the unix socket, as on the admin socket */
+    if (bind(sock, (struct sockaddr *) &local, localSize) == -1 ||
+        (local.ss_family == AF_UNIX && chmod(address, S_IRUSR | S_IWUSR) == -1) ||
+        listen(sock, 8) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * An HTTP GET gets an HTTP reply, any other client (nc, socat on the unix
+ * socket) gets the bare text once it has sent its request or closed its side.
+ */
+static void serveScrape(int client)
+{
+    /* one scrape at a time, too large for the thread stack */
+    static char response[METRICS_RESPONSE_SIZE];
+    char request[1024], header[256];
+    struct timeval timeout = {METRICS_CLIENT_TIMEOUT, 0};
+    int requestSize = 0, bodySize, headerSize = 0, isHttp;
+    ssize_t bytes;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    while (requestSize < (int) sizeof(request) - 1)
+    {
+        bytes = read(client, request + requestSize, sizeof(request) - 1 - requestSize);
+        if (bytes <= 0)
+            break;
+
+        requestSize += bytes;
+        request[requestSize] = '\0';
+
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            break;
+    }
+    request[requestSize] = '\0';
+
+    isHttp = strncmp(request, "GET ", 4) == 0;
+
+    if (isHttp &&
+        strncmp(request + 4, "/ ", 2) != 0 &&
+        strncmp(request + 4, "/metrics", 8) != 0)
+    {
+        const char *notFound = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        if (write(client, notFound, strlen(notFound)) != (ssize_t) strlen(notFound))
+            my_printf("\nMetrics reply not completed");
+        return;
+    }
+
+    bodySize = METRICS_Render(response, sizeof(response));
+
+    /* an empty body would be recorded as a successful scrape */
+    if (bodySize < 0)
+    {
+        const char *serverError = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+        LOGF_ERROR("Metrics don't fit in the %d bytes scrape buffer", METRICS_RESPONSE_SIZE);
+        if (isHttp && write(client, serverError, strlen(serverError)) != (ssize_t) strlen(serverError))
+            my_printf("\nMetrics reply not completed");
+        return;
+    }
+
+    if (isHttp)
+        headerSize = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", bodySize);
+
+    if ((headerSize > 0 && write(client, header, headerSize) != headerSize) ||
+        write(client, response, bodySize) != bodySize)
+        my_printf("\nMetrics reply not completed");
+}
+
+/* Scrapes are served one at a time, the socket is opened again if it can't be bound yet */
+static void *serverHandle(void *arg)
+{
+    int listenSocket = -1, client, bindErrorLogged = 0;
+
+    while (1)
+    {
+        if (listenSocket == -1)
+        {
+            listenSocket = openServerSocket(serverAddress);
+
+            if (listenSocket == -1)
+            {
+                /* held by the previous binary during an upgrade */
+                if (bindErrorLogged == 0)
+                    LOGF_ERROR("Metrics endpoint %s can't be opened, errno=%d, retrying", serverAddress, errno);
+                bindErrorLogged = 1;
+                sleep(1);
+                continue;
+            }
+
+            LOGF_INFO("Metrics endpoint listening on %s", serverAddress);
+        }
+
+        client = accept(listenSocket, NULL, NULL);
+        if (client == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                sleep(1);
+            continue;
+        }
+
+        serveScrape(client);
+        close(client);
+    }
+
+    return NULL;
+}
+
+/* Starts the endpoint thread, an empty address disables it */
+int METRICS_StartServer(const char *address)
+{
+    struct sockaddr_storage local;
+    socklen_t localSize;
+
+    if (address == NULL || address[0] == '\0' || segment == NULL)
+        return 0;
+
+    /* a malformed address is reported once, only a bind failure is retried */
+    if (parseServerAddress(address, &local, &localSize) != 1)
+    {
+        LOGF_ERROR("Invalid METRICS_ADDRESS %s, use ip:port, [ipv6]:port or an absolute path", address);
+        return -1;
+    }
+
+    snprintf(serverAddress, sizeof(serverAddress), "%s", address);
+
+    if (pthread_create(&serverThread, NULL, serverHandle, NULL) != 0)
+        return -1;
+
+    pthread_detach(serverThread);
+    return 1;
+}
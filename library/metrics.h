@@ -0,0 +1,136 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+
+#include "histogram.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Server counters and gauges in the Prometheus text format.
+ * The values live in an anonymous shared mapping created before the workers
+ * are forked, every process updates its own cache line aligned column with
+ * relaxed atomic operations and a scrape sums the columns.
+ * The endpoint is served by a thread of worker 0, the control loops never
+ * wait for a scrape.
+ */
+#define METRICS_MAX_WORKERS                 32
+
+/* Counters */
+#define METRICS_CONNECTIONS_ACCEPTED        0
+#define METRICS_CONNECTIONS_REJECTED        1
+#define METRICS_LOGINS_OK                   2
+#define METRICS_LOGINS_FAILED               3
+#define METRICS_BYTES_IN                    4
+#define METRICS_BYTES_OUT                   5
+#define METRICS_TLS_HANDSHAKES_OK           6
+#define METRICS_TLS_HANDSHAKES_FAILED       7
+
+/* Gauges */
+#define METRICS_ACTIVE_TRANSFERS            8
+#define METRICS_PASSIVE_PORTS               9
+#define METRICS_MEMORY_LIVE_BYTES           10
+#define METRICS_LOG_QUEUE_DEPTH             11
+
+#define METRICS_VALUE_COUNT                 12
+
+/* Size of a scrape, the text is built in a buffer of the serving thread */
+#define METRICS_RESPONSE_SIZE               131072
+
+/* Commands of the control channel dispatch table that get latency histograms */
+#define METRICS_MAX_COMMANDS                64
+
+/*
+ * Data channel phases in order. A transfer thread takes a monotonic timestamp
+ * at each phase it goes through, the interval from the previous timestamp is
+ * recorded under the phase that ends it: the PASV port search, the wait for
+ * the client connect, the TLS handshake, the wait for the transfer command,
+ * the file open, the first and the last byte.
+ */
+#define METRICS_PHASE_START                 0
+#define METRICS_PHASE_PORT_SEARCH           1
+#define METRICS_PHASE_CONNECT               2
+#define METRICS_PHASE_TLS_HANDSHAKE         3
+#define METRICS_PHASE_COMMAND               4
+#define METRICS_PHASE_FILE_OPEN             5
+#define METRICS_PHASE_FIRST_BYTE            6
+#define METRICS_PHASE_LAST_BYTE             7
+#define METRICS_PHASE_COUNT                 8
+
+struct METRICS_Column
+{
+    long long int values[METRICS_VALUE_COUNT];
+} __attribute__((aligned(64))) typedef METRICS_Column_DataType;
+
+struct METRICS_Segment
+{
+    METRICS_Column_DataType workers[METRICS_MAX_WORKERS];
+} typedef METRICS_Segment_DataType;
+
+/*
+ * Per command latencies, one histogram pair per worker and command written
+ * only by the control loop of that worker. handler is the time spent in the
+ * command handler, queue the time from the select wake up that delivered the
+ * command to the handler start.
+ */
+struct METRICS_CommandLatency
+{
+    HIST_Histogram_DataType handler;
+    HIST_Histogram_DataType queue;
+} typedef METRICS_CommandLatency_DataType;
+
+/* Per worker, written by every transfer thread of the worker with atomic operations */
+struct METRICS_TransferPhases
+{
+    HIST_Histogram_DataType phases[METRICS_PHASE_COUNT];
+} typedef METRICS_TransferPhases_DataType;
+
+int METRICS_Init(void);
+void METRICS_SetWorker(int index);
+void METRICS_ReleaseWorker(int index);
+void METRICS_Add(int metric, long long int value);
+void METRICS_Set(int metric, long long int value);
+void METRICS_PublishProcessGauges(time_t now);
+int METRICS_InitCommandLatency(const char **commandNames, int commandCount, int workerCount);
+void METRICS_RecordCommand(int command, unsigned long long int queueTime, unsigned long long int handlerTime);
+int METRICS_CommandCount(void);
+const char *METRICS_CommandName(int command);
+void METRICS_MergeCommandLatency(int command, HIST_Histogram_DataType *handler, HIST_Histogram_DataType *queue);
+int METRICS_InitTransferPhases(int workerCount);
+void METRICS_RecordTransferPhase(int phase, unsigned long long int duration);
+const char *METRICS_TransferPhaseName(int phase);
+int METRICS_Render(char *buffer, int size);
+int METRICS_StartServer(const char *address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H */
@@ -27,6 +27,8 @@
  * [license text unchanged...]
  */
 
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_TLS
+
 #ifdef OPENSSL_ENABLED
 #include <stdio.h>
 #include <unistd.h>
@@ -37,11 +39,23 @@
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/conf.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #include "openSsl.h"
 #include "fileManagement.h"
+#include "dynamicMemory.h"
 #include "../debugHelper.h"
 #include "log.h"
+#include "metrics.h"
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #define NEED_OPENSSL_THREADING 1
@@ -59,6 +73,54 @@
 static MUTEX_TYPE *mutex_buf = NULL;
 #endif
 
+#define TICKET_KEY_NAME_SIZE    16
+#define TICKET_KEY_SIZE         32
+#define TLS_STATISTICS_LOG_INTERVAL 600
+#define TLS_BENCHMARK_RECORD_SIZE   16384
+
+struct ticketKey
+{
+    unsigned char name[TICKET_KEY_NAME_SIZE];
+    unsigned char aesKey[TICKET_KEY_SIZE];
+    unsigned char hmacKey[TICKET_KEY_SIZE];
+    time_t created;
+} typedef ticketKey_DataType;
+
+/* Lives in a shared mapping, processes forked after setup issue and accept the same tickets */
+struct ticketKeyRing
+{
+    pthread_mutex_t mutex;
+    int rotationInterval;
+    ticketKey_DataType current;
+    ticketKey_DataType previous;
+} typedef ticketKeyRing_DataType;
+
+static ticketKeyRing_DataType *ticketKeys = NULL;
+
+static unsigned long long int controlHandshakes, controlResumed, dataHandshakes, dataResumed;
+static unsigned long long int offloadedHandshakes, offloadedSteps, handshakeQueueDepth, handshakeQueueWaitTime, handshakeTotalTime;
+static time_t lastStatisticsLog = 0;
+
+/* Idle SSL objects kept for reuse, shared by the control loop and the data threads */
+static SSL **sslPool = NULL;
+static int sslPoolSize = 0, sslPoolCount = 0;
+static pthread_mutex_t sslPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Context for new connections, guarded by sslPoolMutex */
+static SSL_CTX *currentServerCtx = NULL;
+static DYNMEM_MemoryTable_DataType *sslPoolMemoryTable = NULL;
+static unsigned long long int sslObjectsCreated, sslObjectsReused;
+
+static int generateTicketKey(ticketKey_DataType *key);
+static void lockTicketKeys(void);
+static void rotateTicketKeys(time_t now);
+static int setupTicketKeys(int rotationInterval);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticketKeyCallback(SSL *ssl, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherCtx, EVP_MAC_CTX *macCtx, int encrypt);
+#else
+static int ticketKeyCallback(SSL *ssl, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherCtx, HMAC_CTX *macCtx, int encrypt);
+#endif
+
 void initOpenssl()
 {
 #if NEED_OPENSSL_THREADING
@@ -94,34 +156,617 @@ SSL_CTX *createServerContext()
 }
 
 
-void configureContext(SSL_CTX *ctx, const char *certPath, const char *keyPath)
+int configureContext(SSL_CTX *ctx, const char *certPath, const char *keyPath)
 {
     if (!FILE_IsFile(certPath, 1)) {
         my_printf("\nCertificate file not found: %s", certPath);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     if (!FILE_IsFile(keyPath, 1)) {
         my_printf("\nPrivate key file not found: %s", keyPath);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Removed SSL_CTX_set_ecdh_auto (no-op since OpenSSL 1.1.0)
-    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
-    SSL_CTX_set_cipher_list(ctx, "HIGH:!aNULL:!MD5");
+    // Protocol versions and ciphers are set by configureTlsProfile
 
     if (SSL_CTX_use_certificate_file(ctx, certPath, SSL_FILETYPE_PEM) <= 0) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     if (SSL_CTX_use_PrivateKey_file(ctx, keyPath, SSL_FILETYPE_PEM) <= 0) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+
+    // A rotated certificate must match its key before it replaces the running one
+    if (SSL_CTX_check_private_key(ctx) != 1) {
+        my_printf("\nPrivate key %s does not match the certificate %s", keyPath, certPath);
+        return -1;
     }
 
     // Enable session cache on server side
     SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    return 1;
+}
+
+static int generateTicketKey(ticketKey_DataType *key)
+{
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+        RAND_bytes(key->aesKey, sizeof(key->aesKey)) != 1 ||
+        RAND_bytes(key->hmacKey, sizeof(key->hmacKey)) != 1)
+        return -1;
+
+    key->created = time(NULL);
+    return 1;
+}
+
+static void lockTicketKeys(void)
+{
+    /* a process that died holding the lock left the keys consistent, they are written under it in one go */
+    if (pthread_mutex_lock(&ticketKeys->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&ticketKeys->mutex);
+}
+
+/* Called with the lock held, the previous key keeps decrypting tickets issued before the rotation */
+static void rotateTicketKeys(time_t now)
+{
+    ticketKey_DataType newKey;
+
+    if (ticketKeys->rotationInterval <= 0 ||
+        now - ticketKeys->current.created < ticketKeys->rotationInterval)
+        return;
+
+    if (generateTicketKey(&newKey) != 1)
+        return;
+
+    ticketKeys->previous = ticketKeys->current;
+    ticketKeys->current = newKey;
+    LOG_AT(LOG_SUBSYSTEM_TLS, LOG_LEVEL_DEBUG, LOG_DEBUG_PREFIX, "Session ticket key rotated");
+}
+
+static int setupTicketKeys(int rotationInterval)
+{
+    pthread_mutexattr_t mutexAttributes;
+
+    if (ticketKeys != NULL)
+        return 1;
+
+    ticketKeys = mmap(NULL, sizeof(ticketKeyRing_DataType), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ticketKeys == MAP_FAILED)
+    {
+        ticketKeys = NULL;
+        return -1;
+    }
+
+    memset(ticketKeys, 0, sizeof(ticketKeyRing_DataType));
+    pthread_mutexattr_init(&mutexAttributes);
+    pthread_mutexattr_setpshared(&mutexAttributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutexAttributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&ticketKeys->mutex, &mutexAttributes);
+    pthread_mutexattr_destroy(&mutexAttributes);
+
+    ticketKeys->rotationInterval = rotationInterval;
+
+    if (generateTicketKey(&ticketKeys->current) != 1)
+    {
+        munmap(ticketKeys, sizeof(ticketKeyRing_DataType));
+        ticketKeys = NULL;
+        return -1;
+    }
+
+    /* nothing was issued with it, it only avoids an empty slot */
+    ticketKeys->previous = ticketKeys->current;
+    return 1;
+}
+
+/* Encrypts new tickets with the current key, accepts the current and the previous one */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticketKeyCallback(SSL *ssl, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherCtx, EVP_MAC_CTX *macCtx, int encrypt)
+#else
+static int ticketKeyCallback(SSL *ssl, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherCtx, HMAC_CTX *macCtx, int encrypt)
+#endif
+{
+    ticketKey_DataType key;
+    int isCurrent = 1;
+
+    lockTicketKeys();
+    rotateTicketKeys(time(NULL));
+
+    if (encrypt)
+    {
+        key = ticketKeys->current;
+    }
+    else if (memcmp(keyName, ticketKeys->current.name, TICKET_KEY_NAME_SIZE) == 0)
+    {
+        key = ticketKeys->current;
+    }
+    else if (memcmp(keyName, ticketKeys->previous.name, TICKET_KEY_NAME_SIZE) == 0)
+    {
+        key = ticketKeys->previous;
+        isCurrent = 0;
+    }
+    else
+    {
+        pthread_mutex_unlock(&ticketKeys->mutex);
+        /* unknown or expired key, fall back to a full handshake */
+        return 0;
+    }
+
+    pthread_mutex_unlock(&ticketKeys->mutex);
+
+    if (encrypt)
+    {
+        memcpy(keyName, key.name, TICKET_KEY_NAME_SIZE);
+
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+            EVP_EncryptInit_ex(cipherCtx, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1)
+            return -1;
+    }
+    else if (EVP_DecryptInit_ex(cipherCtx, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1)
+    {
+        return -1;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM macParameters[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+
+    if (EVP_MAC_init(macCtx, key.hmacKey, sizeof(key.hmacKey), macParameters) != 1)
+        return -1;
+#else
+    if (HMAC_Init_ex(macCtx, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), NULL) != 1)
+        return -1;
+#endif
+
+    memset(&key, 0, sizeof(key));
+
+    /* 2 asks OpenSSL to issue a fresh ticket with the current key */
+    return isCurrent ? 1 : 2;
+}
+
+/*
+ * Session cache size and lifetime, stateless tickets with keys rotated every
+ * keyRotation seconds (0 never rotates). Returns 1 on success
+ */
+int configureSessionResumption(SSL_CTX *ctx, long cacheSize, long sessionTimeout, int ticketsEnabled, int keyRotation)
+{
+    static const unsigned char sessionContext[] = "uFTP";
+
+    SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext) - 1);
+    SSL_CTX_sess_set_cache_size(ctx, cacheSize);
+    SSL_CTX_set_timeout(ctx, sessionTimeout);
+
+    if (!ticketsEnabled)
+    {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        return 1;
+    }
+
+    if (setupTicketKeys(keyRotation) != 1)
+    {
+        LOG_ERROR("Session ticket keys setup failed, using the OpenSSL default keys");
+        return -1;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticketKeyCallback);
+#endif
+
+    return 1;
+}
+
+/* Minimum version (12 or 13), cipher preference and key exchange groups, empty strings keep the defaults */
+int configureTlsProfile(SSL_CTX *ctx, int minimumVersion, const char *ciphers, const char *cipherSuites, const char *groups, int preferServerCiphers, int prioritizeChaCha)
+{
+    int returnCode = 1;
+
+    if (minimumVersion == 12 || minimumVersion == 13)
+    {
+        SSL_CTX_set_min_proto_version(ctx, minimumVersion == 13 ? TLS1_3_VERSION : TLS1_2_VERSION);
+    }
+    else
+    {
+        fprintf(stderr, "\nInvalid TLS_MIN_VERSION, use 1.2 or 1.3\n");
+        returnCode = -1;
+    }
+
+    if (ciphers[0] != '\0' && SSL_CTX_set_cipher_list(ctx, ciphers) != 1)
+    {
+        fprintf(stderr, "\nInvalid TLS_CIPHERS: %s\n", ciphers);
+        returnCode = -1;
+    }
+
+    if (cipherSuites[0] != '\0' && SSL_CTX_set_ciphersuites(ctx, cipherSuites) != 1)
+    {
+        fprintf(stderr, "\nInvalid TLS_CIPHERSUITES: %s\n", cipherSuites);
+        returnCode = -1;
+    }
+
+    if (groups[0] != '\0' && SSL_CTX_set1_groups_list(ctx, groups) != 1)
+    {
+        fprintf(stderr, "\nInvalid TLS_GROUPS: %s\n", groups);
+        returnCode = -1;
+    }
+
+    if (returnCode != 1)
+        ERR_print_errors_fp(stderr);
+
+    if (preferServerCiphers)
+        SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+    if (prioritizeChaCha)
+        SSL_CTX_set_options(ctx, SSL_OP_PRIORITIZE_CHACHA);
+
+    return returnCode;
+}
+
+/* Drives both ends of an in memory connection until the handshake completes */
+static int benchmarkHandshake(SSL *server, SSL *client)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        int clientCode = SSL_do_handshake(client);
+        int serverCode = SSL_do_handshake(server);
+
+        if (clientCode == 1 && serverCode == 1)
+            return 1;
+
+        if ((clientCode <= 0 && SSL_get_error(client, clientCode) != SSL_ERROR_WANT_READ) ||
+            (serverCode <= 0 && SSL_get_error(server, serverCode) != SSL_ERROR_WANT_READ))
+            return -1;
+    }
+
+    return -1;
+}
+
+/* Bulk SSL_write throughput of one cipher, records are encrypted into a memory BIO and discarded */
+static double benchmarkCipher(SSL_CTX *serverCtx, SSL_CTX *clientCtx, int version, const char *cipher, double seconds, const char **negotiated)
+{
+    static unsigned char record[TLS_BENCHMARK_RECORD_SIZE];
+    unsigned long long int bytes = 0, start, elapsed;
+    double throughput = -1;
+    BIO *serverBio = NULL, *clientBio = NULL, *sink;
+    SSL *server = SSL_new(serverCtx);
+    SSL *client = SSL_new(clientCtx);
+
+    if (server == NULL || client == NULL || BIO_new_bio_pair(&serverBio, 0, &clientBio, 0) != 1)
+        goto end;
+
+    SSL_set_bio(server, serverBio, serverBio);
+    SSL_set_bio(client, clientBio, clientBio);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+    SSL_set_min_proto_version(client, version);
+    SSL_set_max_proto_version(client, version);
+
+    if ((version == TLS1_3_VERSION ? SSL_set_ciphersuites(client, cipher) : SSL_set_cipher_list(client, cipher)) != 1 ||
+        benchmarkHandshake(server, client) != 1)
+        goto end;
+
+    *negotiated = SSL_CIPHER_get_name(SSL_get_current_cipher(server));
+
+    sink = BIO_new(BIO_s_mem());
+    if (sink == NULL)
+        goto end;
+
+    SSL_set0_wbio(server, sink);
+    RAND_bytes(record, sizeof(record));
+    start = tlsMonotonicMicroseconds();
+
+    do
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            if (SSL_write(server, record, sizeof(record)) != (int) sizeof(record))
+                goto end;
+
+            (void) BIO_reset(sink);
+        }
+
+        bytes += 64 * sizeof(record);
+        elapsed = tlsMonotonicMicroseconds() - start;
+    } while (elapsed < seconds * 1000000);
+
+    /* bytes per microsecond are MB/s */
+    throughput = (double) bytes / elapsed;
+
+end:
+    ERR_clear_error();
+    SSL_free(server);
+    SSL_free(client);
+    return throughput;
+}
+
+/* Measures each candidate cipher against the configured server context and prints a table */
+int tlsBenchmarkCiphers(SSL_CTX *serverCtx, double seconds)
+{
+    static const struct
+    {
+        int version;
+        const char *label;
+        const char *cipher;
+    } candidates[] =
+    {
+        {TLS1_3_VERSION, "TLS_AES_128_GCM_SHA256", "TLS_AES_128_GCM_SHA256"},
+        {TLS1_3_VERSION, "TLS_AES_256_GCM_SHA384", "TLS_AES_256_GCM_SHA384"},
+        {TLS1_3_VERSION, "TLS_CHACHA20_POLY1305_SHA256", "TLS_CHACHA20_POLY1305_SHA256"},
+        {TLS1_2_VERSION, "ECDHE-AES128-GCM-SHA256", "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256"},
+        {TLS1_2_VERSION, "ECDHE-AES256-GCM-SHA384", "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"},
+        {TLS1_2_VERSION, "ECDHE-CHACHA20-POLY1305", "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"},
+    };
+    SSL_CTX *clientCtx = SSL_CTX_new(TLS_client_method());
+
+    if (clientCtx == NULL)
+        return -1;
+
+    SSL_CTX_set_verify(clientCtx, SSL_VERIFY_NONE, NULL);
+
+    printf("\n%-8s %-32s %12s\n", "Version", "Cipher", "SSL_write");
+
+    for (int i = 0; i < (int) (sizeof(candidates) / sizeof(candidates[0])); i++)
+    {
+        const char *negotiated = candidates[i].label;
+        double throughput = benchmarkCipher(serverCtx, clientCtx, candidates[i].version, candidates[i].cipher, seconds, &negotiated);
+
+        if (throughput < 0)
+            printf("%-8s %-32s %12s\n", candidates[i].version == TLS1_3_VERSION ? "TLSv1.3" : "TLSv1.2", negotiated, "disabled");
+        else
+            printf("%-8s %-32s %7.1f MB/s\n", candidates[i].version == TLS1_3_VERSION ? "TLSv1.3" : "TLSv1.2", negotiated, throughput);
+
+        fflush(stdout);
+    }
+
+    SSL_CTX_free(clientCtx);
+    return 1;
+}
+
+int tlsInitSslPool(int poolSize)
+{
+    if (poolSize <= 0)
+        return 1;
+
+    sslPool = DYNMEM_malloc(sizeof(SSL *) * poolSize, &sslPoolMemoryTable, "sslPool");
+    if (sslPool == NULL)
+        return -1;
+
+    sslPoolSize = poolSize;
+    return 1;
+}
+
+/* Publishes the context used by new handshakes, established sessions keep a reference to their own */
+void tlsSetServerContext(SSL_CTX *ctx)
+{
+    SSL_CTX *previous;
+
+    pthread_mutex_lock(&sslPoolMutex);
+    previous = currentServerCtx;
+    currentServerCtx = ctx;
+    pthread_mutex_unlock(&sslPoolMutex);
+
+    if (previous != NULL)
+        SSL_CTX_free(previous);
+}
+
+/* SSL objects are only created when a connection negotiates TLS, recycled ones come from the pool */
+SSL *tlsAcquireSsl(int isServer)
+{
+    SSL *ssl = NULL;
+    SSL_CTX *ctx;
+
+    pthread_mutex_lock(&sslPoolMutex);
+    ctx = currentServerCtx;
+    while (ssl == NULL && sslPoolCount > 0)
+    {
+        ssl = sslPool[--sslPoolCount];
+
+        /* objects of a replaced context are not reused */
+        if (SSL_get_SSL_CTX(ssl) != ctx)
+        {
+            SSL_free(ssl);
+            ssl = NULL;
+        }
+    }
+
+    /* a reload may free the context before SSL_new takes its own reference */
+    if (ssl == NULL && ctx != NULL)
+        SSL_CTX_up_ref(ctx);
+    pthread_mutex_unlock(&sslPoolMutex);
+
+    if (ssl != NULL)
+    {
+        __atomic_fetch_add(&sslObjectsReused, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        if (ctx == NULL)
+            return NULL;
+
+        ssl = SSL_new(ctx);
+        SSL_CTX_free(ctx);
+
+        if (ssl == NULL)
+            return NULL;
+
+        __atomic_fetch_add(&sslObjectsCreated, 1, __ATOMIC_RELAXED);
+    }
+
+    /* a recycled object may have been used on the other side */
+    if (isServer)
+        SSL_set_accept_state(ssl);
+    else
+        SSL_set_connect_state(ssl);
+
+    return ssl;
+}
+
+void tlsReleaseSsl(SSL *ssl)
+{
+    if (ssl == NULL)
+        return;
+
+    /* nothing of the previous connection is carried over */
+    SSL_set_session(ssl, NULL);
+
+    if (SSL_clear(ssl) == 1)
+    {
+        pthread_mutex_lock(&sslPoolMutex);
+        if (sslPoolCount < sslPoolSize && SSL_get_SSL_CTX(ssl) == currentServerCtx)
+        {
+            sslPool[sslPoolCount++] = ssl;
+            ssl = NULL;
+        }
+        pthread_mutex_unlock(&sslPoolMutex);
+    }
+
+    if (ssl != NULL)
+        SSL_free(ssl);
+}
+
+/* The first bytes of a transfer leave in records that fit one segment, so the client can decrypt them before the congestion window grows */
+void tlsStartRecordSizing(SSL *ssl, tlsRecordSizing_DataType *sizing, int recordSize, long long int smallRecordBytes)
+{
+    sizing->sentBytes = 0;
+    sizing->smallRecordBytes = smallRecordBytes;
+    sizing->recordSize = recordSize;
+
+    /* set before the handshake, the write buffer is sized on this value */
+    SSL_set_max_send_fragment(ssl, recordSize);
+}
+
+/* Writes the whole buffer, every SSL_write of at most TLS_SMALL_RECORD_SIZE bytes is a record of its own */
+int tlsWriteData(SSL *ssl, const void *buffer, int size, tlsRecordSizing_DataType *sizing)
+{
+    const char *data = buffer;
+    int written = 0;
+
+    while (written < size)
+    {
+        int chunk = size - written;
+        int returnCode;
+
+        if (sizing->sentBytes < sizing->smallRecordBytes && chunk > TLS_SMALL_RECORD_SIZE)
+            chunk = TLS_SMALL_RECORD_SIZE;
+
+        returnCode = SSL_write(ssl, data + written, chunk);
+        if (returnCode <= 0)
+            return returnCode;
+
+        sizing->sentBytes += returnCode;
+        written += returnCode;
+    }
+
+    return written;
+}
+
+/* Counts completed handshakes, safe from the data channel threads */
+void tlsRecordHandshake(SSL *ssl, int isDataChannel)
+{
+    int resumed = SSL_session_reused(ssl);
+
+    METRICS_Add(METRICS_TLS_HANDSHAKES_OK, 1);
+
+    if (isDataChannel)
+    {
+        __atomic_fetch_add(&dataHandshakes, 1, __ATOMIC_RELAXED);
+        if (resumed)
+            __atomic_fetch_add(&dataResumed, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&controlHandshakes, 1, __ATOMIC_RELAXED);
+        if (resumed)
+            __atomic_fetch_add(&controlResumed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void tlsGetSessionStatistics(tlsSessionStatistics_DataType *statistics)
+{
+    statistics->controlHandshakes = __atomic_load_n(&controlHandshakes, __ATOMIC_RELAXED);
+    statistics->controlResumed = __atomic_load_n(&controlResumed, __ATOMIC_RELAXED);
+    statistics->dataHandshakes = __atomic_load_n(&dataHandshakes, __ATOMIC_RELAXED);
+    statistics->dataResumed = __atomic_load_n(&dataResumed, __ATOMIC_RELAXED);
+    statistics->offloadedHandshakes = __atomic_load_n(&offloadedHandshakes, __ATOMIC_RELAXED);
+    statistics->offloadedSteps = __atomic_load_n(&offloadedSteps, __ATOMIC_RELAXED);
+    statistics->handshakeQueueDepth = __atomic_load_n(&handshakeQueueDepth, __ATOMIC_RELAXED);
+    statistics->handshakeQueueWaitTime = __atomic_load_n(&handshakeQueueWaitTime, __ATOMIC_RELAXED);
+    statistics->handshakeTotalTime = __atomic_load_n(&handshakeTotalTime, __ATOMIC_RELAXED);
+    statistics->sslObjectsCreated = __atomic_load_n(&sslObjectsCreated, __ATOMIC_RELAXED);
+    statistics->sslObjectsReused = __atomic_load_n(&sslObjectsReused, __ATOMIC_RELAXED);
+}
+
+unsigned long long int tlsMonotonicMicroseconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long int) now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/* Main thread side, called right before the job is submitted to the handshake pool */
+void tlsQueueHandshakeJob(tlsHandshakeJob_DataType *job)
+{
+    job->queueTime = tlsMonotonicMicroseconds();
+    __atomic_fetch_add(&handshakeQueueDepth, 1, __ATOMIC_RELAXED);
+}
+
+/* Runs on the handshake pool, the socket is non-blocking so a step never waits for the peer */
+void tlsExecuteHandshakeJob(void *theJob)
+{
+    tlsHandshakeJob_DataType *job = theJob;
+
+    job->startTime = tlsMonotonicMicroseconds();
+    __atomic_fetch_sub(&handshakeQueueDepth, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&handshakeQueueWaitTime, job->startTime - job->queueTime, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&offloadedSteps, 1, __ATOMIC_RELAXED);
+
+    ERR_clear_error();
+    job->returnCode = SSL_accept(job->ssl);
+    job->sslError = job->returnCode == 1 ? SSL_ERROR_NONE : SSL_get_error(job->ssl, job->returnCode);
+}
+
+/* Time from the first step submission to the end of the handshake */
+void tlsRecordOffloadedHandshake(tlsHandshakeJob_DataType *job)
+{
+    __atomic_fetch_add(&offloadedHandshakes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&handshakeTotalTime, tlsMonotonicMicroseconds() - job->handshakeStartTime, __ATOMIC_RELAXED);
+}
+
+/* Writes the resumption hit rate to the log every TLS_STATISTICS_LOG_INTERVAL seconds */
+void tlsLogSessionStatistics(time_t now)
+{
+    tlsSessionStatistics_DataType statistics;
+
+    if (now - lastStatisticsLog < TLS_STATISTICS_LOG_INTERVAL)
+        return;
+
+    lastStatisticsLog = now;
+    tlsGetSessionStatistics(&statistics);
+
+    if (statistics.controlHandshakes == 0 &&
+        statistics.dataHandshakes == 0)
+        return;
+
+    LOGF_INFO("TLS resumption control %llu/%llu (%.1f%%), data %llu/%llu (%.1f%%)",
+              statistics.controlResumed, statistics.controlHandshakes,
+              statistics.controlHandshakes ? 100.0 * statistics.controlResumed / statistics.controlHandshakes : 0.0,
+              statistics.dataResumed, statistics.dataHandshakes,
+              statistics.dataHandshakes ? 100.0 * statistics.dataResumed / statistics.dataHandshakes : 0.0);
+
+    LOGF_INFO("TLS objects created %llu, reused from the pool %llu",
+              statistics.sslObjectsCreated, statistics.sslObjectsReused);
+
+    if (statistics.offloadedSteps > 0)
+        LOGF_INFO("TLS handshake pool queue depth %llu, average queue wait %llu us over %llu steps, average handshake %llu us",
+                  statistics.handshakeQueueDepth,
+                  statistics.handshakeQueueWaitTime / statistics.offloadedSteps, statistics.offloadedSteps,
+                  statistics.offloadedHandshakes ? statistics.handshakeTotalTime / statistics.offloadedHandshakes : 0ULL);
 }
 
 void ShowCerts(SSL *ssl)
@@ -28,8 +28,52 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include <time.h>
+
 #define TLS_NEGOTIATING_TIMEOUT	30
 
+/* Payload of the first data channel records, one record per TCP segment */
+#define TLS_SMALL_RECORD_SIZE   1360
+
+/* Data channel record sizing, small records until smallRecordBytes have been sent, then records of recordSize */
+struct tlsRecordSizing
+{
+    long long int sentBytes;
+    long long int smallRecordBytes;
+    int recordSize;
+} typedef tlsRecordSizing_DataType;
+
+struct tlsSessionStatistics
+{
+    unsigned long long int controlHandshakes;
+    unsigned long long int controlResumed;
+    unsigned long long int dataHandshakes;
+    unsigned long long int dataResumed;
+
+    /* Control channel handshakes run on the handshake pool, times in microseconds */
+    unsigned long long int offloadedHandshakes;
+    unsigned long long int offloadedSteps;
+    unsigned long long int handshakeQueueDepth;
+    unsigned long long int handshakeQueueWaitTime;
+    unsigned long long int handshakeTotalTime;
+
+    /* SSL objects allocated and recycled */
+    unsigned long long int sslObjectsCreated;
+    unsigned long long int sslObjectsReused;
+} typedef tlsSessionStatistics_DataType;
+
+/* One SSL_accept step executed on the handshake pool, the SSL object is owned by the job until it comes back */
+struct tlsHandshakeJob
+{
+    int clientId;
+    SSL *ssl;
+    int returnCode;
+    int sslError;
+    unsigned long long int handshakeStartTime;
+    unsigned long long int queueTime;
+    unsigned long long int startTime;
+} typedef tlsHandshakeJob_DataType;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -40,8 +84,24 @@ int thread_cleanup(void);
 int thread_setup(void);
 void handle_error(const char *file, int lineno, const char *msg);
 SSL_CTX *createServerContext();
-void configureContext(SSL_CTX *ctx, const char *certificatePath, const char* privateCertificatePath);
+int configureContext(SSL_CTX *ctx, const char *certificatePath, const char* privateCertificatePath);
 void ShowCerts(SSL* ssl);
+int configureTlsProfile(SSL_CTX *ctx, int minimumVersion, const char *ciphers, const char *cipherSuites, const char *groups, int preferServerCiphers, int prioritizeChaCha);
+int tlsBenchmarkCiphers(SSL_CTX *serverCtx, double seconds);
+int configureSessionResumption(SSL_CTX *ctx, long cacheSize, long sessionTimeout, int ticketsEnabled, int keyRotation);
+int tlsInitSslPool(int poolSize);
+void tlsSetServerContext(SSL_CTX *ctx);
+SSL *tlsAcquireSsl(int isServer);
+void tlsReleaseSsl(SSL *ssl);
+void tlsStartRecordSizing(SSL *ssl, tlsRecordSizing_DataType *sizing, int recordSize, long long int smallRecordBytes);
+int tlsWriteData(SSL *ssl, const void *buffer, int size, tlsRecordSizing_DataType *sizing);
+void tlsRecordHandshake(SSL *ssl, int isDataChannel);
+void tlsGetSessionStatistics(tlsSessionStatistics_DataType *statistics);
+void tlsLogSessionStatistics(time_t now);
+unsigned long long int tlsMonotonicMicroseconds(void);
+void tlsQueueHandshakeJob(tlsHandshakeJob_DataType *job);
+void tlsExecuteHandshakeJob(void *job);
+void tlsRecordOffloadedHandshake(tlsHandshakeJob_DataType *job);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,164 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CRYPT_SUPPORT_ENABLED
+#include <crypt.h>
+#endif
+
+#include "passwordHash.h"
+
+struct hashMethod
+{
+    const char *name;
+    const char *prefix;
+} typedef hashMethod_DataType;
+
+#ifdef CRYPT_SUPPORT_ENABLED
+static const hashMethod_DataType hashMethods[] = {
+    {"yescrypt", "$y$"},
+    {"bcrypt", "$2b$"},
+    {"sha512", "$6$"},
+    {"sha256", "$5$"}
+};
+
+/* Methods crypt_r can verify, any other password is compared as plaintext */
+static const char *hashPrefixes[] = {
+    "$y$", "$gy$", "$7$", "$2b$", "$2y$", "$2a$", "$6$", "$5$", "$1$"
+};
+#endif
+
+int PWHASH_IsSupported(void)
+{
+#ifdef CRYPT_SUPPORT_ENABLED
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int PWHASH_IsHash(const char *storedPassword)
+{
+#ifdef CRYPT_SUPPORT_ENABLED
+    for (int i = 0; i < sizeof(hashPrefixes) / sizeof(hashPrefixes[0]); i++)
+    {
+        size_t prefixLength = strlen(hashPrefixes[i]);
+
+        /* the prefix alone is not a hash */
+        if (strncmp(storedPassword, hashPrefixes[i], prefixLength) == 0 &&
+            storedPassword[prefixLength] != '\0')
+            return 1;
+    }
+#endif
+
+    return 0;
+}
+
+/* Runs in time independent of where the strings differ */
+int PWHASH_Compare(const char *expected, const char *given)
+{
+    size_t expectedLength = strlen(expected);
+    size_t givenLength = strlen(given);
+    unsigned char difference = expectedLength != givenLength;
+
+    for (size_t i = 0; i < givenLength; i++)
+        difference |= (unsigned char) given[i] ^ (unsigned char) expected[i % (expectedLength + 1)];
+
+    return difference == 0;
+}
+
+/* Expensive by design, call it from a worker thread. Returns 1 on match */
+int PWHASH_Verify(const char *password, const char *storedPassword)
+{
+#ifdef CRYPT_SUPPORT_ENABLED
+    struct crypt_data *cryptData;
+    char *result;
+    int matches = 0;
+
+    if (PWHASH_IsHash(storedPassword) == 0)
+        return PWHASH_Compare(storedPassword, password);
+
+    cryptData = calloc(1, sizeof(struct crypt_data));
+    if (cryptData == NULL)
+        return 0;
+
+    result = crypt_r(password, storedPassword, cryptData);
+
+    /* failures return NULL or a string starting with '*' */
+    if (result != NULL &&
+        result[0] != '*')
+        matches = PWHASH_Compare(storedPassword, result);
+
+    memset(cryptData, 0, sizeof(struct crypt_data));
+    free(cryptData);
+    return matches;
+#else
+    return PWHASH_Compare(storedPassword, password);
+#endif
+}
+
+/* method is yescrypt, bcrypt, sha512 or sha256, cost 0 selects the library default. Returns 1 on success */
+int PWHASH_Generate(const char *method, unsigned long cost, const char *password, char *output, int outputSize)
+{
+#ifdef CRYPT_SUPPORT_ENABLED
+    const char *prefix = NULL;
+    char setting[CRYPT_GENSALT_OUTPUT_SIZE];
+    struct crypt_data *cryptData;
+    char *result;
+    int returnCode = -1;
+
+    for (int i = 0; i < sizeof(hashMethods) / sizeof(hashMethod_DataType); i++)
+    {
+        if (strcmp(method, hashMethods[i].name) == 0)
+            prefix = hashMethods[i].prefix;
+    }
+
+    if (prefix == NULL ||
+        crypt_gensalt_rn(prefix, cost, NULL, 0, setting, sizeof(setting)) == NULL)
+        return -1;
+
+    cryptData = calloc(1, sizeof(struct crypt_data));
+    if (cryptData == NULL)
+        return -1;
+
+    result = crypt_r(password, setting, cryptData);
+
+    if (result != NULL &&
+        result[0] != '*' &&
+        strlen(result) < outputSize)
+    {
+        strcpy(output, result);
+        returnCode = 1;
+    }
+
+    memset(cryptData, 0, sizeof(struct crypt_data));
+    free(cryptData);
+    return returnCode;
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,51 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PASSWORD_HASH_H
+#define PASSWORD_HASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Large enough for every crypt(3) method */
+#define PWHASH_MAXIMUM_SIZE     512
+
+/*
+ * Passwords starting with a known crypt method ($y$, $2b$, $6$, $5$..) are
+ * verified with crypt_r when the server is built with CRYPT_SUPPORT_ENABLED,
+ * the cost is part of the stored hash. Anything else, $ecret included, is a
+ * plaintext password.
+ */
+int PWHASH_IsSupported(void);
+int PWHASH_IsHash(const char *storedPassword);
+int PWHASH_Verify(const char *password, const char *storedPassword);
+int PWHASH_Generate(const char *method, unsigned long cost, const char *password, char *output, int outputSize);
+int PWHASH_Compare(const char *expected, const char *given);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PASSWORD_HASH_H */
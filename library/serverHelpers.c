@@ -15,6 +15,7 @@
 
 #include <pthread.h>
 #include <limits.h>
+#include <time.h>
 
 #include "../ftpData.h"
 #include "../ftpServer.h"
@@ -47,7 +48,7 @@ void handleThreadReuse(ftpDataType *data, int socketId)
         my_printf("\njoin thread status %d", returnCode);
         if (returnCode != 0) 
         {
-            LOGF("%sJoining thread error: %d", LOG_ERROR_PREFIX, returnCode);
+            LOGF_ERROR("Joining thread error: %d", returnCode);
         }
 
         data->clients[socketId].workerData.threadHasBeenCreated = 0;
@@ -60,6 +61,42 @@ void cancelWorker(ftpDataType *data, int clientId)
 
     int returnCode = pthread_cancel(data->clients[clientId].workerData.workerThread);
     if (returnCode != 0) {
-        LOGF("%sCancel thread error: %d", LOG_ERROR_PREFIX, returnCode);
+        LOGF_ERROR("Cancel thread error: %d", returnCode);
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Paces a transfer thread to the rate limit of its session, called after every
+ * buffer. The pace restarts when the limit changes, so a limit set on the admin
+ * socket applies to the running transfer at once.
+ */
+void throttleTransfer(ftpDataType *data, int socketId)
+{
+    workerDataType *worker = &data->clients[socketId].workerData;
+    long long int limit = __atomic_load_n(&data->clients[socketId].transferRateLimit, __ATOMIC_RELAXED);
+    unsigned long long int expected, elapsed;
+    struct timespec pause;
+
+    if (limit < 0)
+        limit = (long long int) data->ftpParameters.transferRateLimit * 1024;
+
+    if (limit != worker->throttleLimit)
+    {
+        worker->throttleLimit = limit;
+        worker->throttleBytes = worker->transferredBytes;
+        worker->throttleStart = HIST_Now();
+    }
+
+    if (limit <= 0)
+        return;
+
+    expected = (unsigned long long int) ((worker->transferredBytes - worker->throttleBytes) * 1000000000.0 / limit);
+    elapsed = HIST_Now() - worker->throttleStart;
+    if (expected <= elapsed)
+        return;
+
+    /* a cancellation point, ABOR and the admin cancel still stop the thread */
+    pause.tv_sec = (expected - elapsed) / 1000000000ULL;
+    pause.tv_nsec = (expected - elapsed) % 1000000000ULL;
+    nanosleep(&pause, NULL);
+}
@@ -27,5 +27,6 @@
 
 void handleThreadReuse(ftpDataType *data, int socketId);
 void cancelWorker(ftpDataType *data, int clientId);
+void throttleTransfer(ftpDataType *data, int socketId);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,358 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sharedState.h"
+
+/* Address keys always have bit 1 set, so 0 and 1 are free for the way states */
+#define SHST_KEY_FREE           0ULL
+#define SHST_KEY_RECLAIMING     1ULL
+
+/* Attempts to count a connection on a way that keeps getting reclaimed */
+#define SHST_ACQUIRE_ATTEMPTS   4
+
+static SHST_Segment_DataType *segment = NULL;
+static int workerIndex = 0;
+
+static uint64_t addressKey(const char *ipAddress);
+static int entryConnections(SHST_IpEntry_DataType *entry);
+static int entryIsIdle(SHST_IpEntry_DataType *entry, time_t now);
+static int findEntry(uint64_t key, time_t now, int create);
+
+/* FNV-1a with a per run seed */
+static uint64_t addressKey(const char *ipAddress)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ segment->hashSeed;
+
+    for (; *ipAddress != '\0'; ipAddress++)
+    {
+        hash ^= (unsigned char) *ipAddress;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash | 2;
+}
+
+static int entryConnections(SHST_IpEntry_DataType *entry)
+{
+    int connections = 0;
+
+    for (int i = 0; i < SHST_MAX_WORKERS; i++)
+        connections += __atomic_load_n(&entry->connections[i], __ATOMIC_ACQUIRE);
+
+    return connections;
+}
+
+/* The failures count until loginFailRetryTime seconds after the last one, the ban and the counter end together */
+static int loginFailsExpired(uint64_t loginFails, time_t now)
+{
+    return now - (time_t) (loginFails >> 32) >= segment->loginFailRetryTime;
+}
+
+/* No connection and no failure inside the retry window, the way can host another address */
+static int entryIsIdle(SHST_IpEntry_DataType *entry, time_t now)
+{
+    uint64_t loginFails = __atomic_load_n(&entry->loginFails, __ATOMIC_ACQUIRE);
+
+    if (loginFails != 0 && !loginFailsExpired(loginFails, now))
+        return 0;
+
+    return entryConnections(entry) == 0;
+}
+
+/* Set associative lookup, an address lives in one of the SHST_IP_WAYS ways of its set */
+static int findEntry(uint64_t key, time_t now, int create)
+{
+    int base = (int) (key % SHST_IP_SETS) * SHST_IP_WAYS;
+    int claimed = -1;
+    int i;
+
+    for (i = 0; i < SHST_IP_WAYS; i++)
+    {
+        if (__atomic_load_n(&segment->ipEntries[base + i].key, __ATOMIC_ACQUIRE) == key)
+            return base + i;
+    }
+
+    if (create == 0)
+        return -1;
+
+    for (i = 0; i < SHST_IP_WAYS && claimed == -1; i++)
+    {
+        SHST_IpEntry_DataType *entry = &segment->ipEntries[base + i];
+        uint64_t current = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+
+        if (current == SHST_KEY_FREE)
+        {
+            if (__atomic_compare_exchange_n(&entry->key, &current, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                claimed = i;
+            else if (current == key)
+                return base + i;
+        }
+        else if (current != SHST_KEY_RECLAIMING && entryIsIdle(entry, now))
+        {
+            if (!__atomic_compare_exchange_n(&entry->key, &current, SHST_KEY_RECLAIMING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                continue;
+
+            /* a connection counted after the idle check keeps the way to its address */
+            if (entryConnections(entry) != 0)
+            {
+                __atomic_store_n(&entry->key, current, __ATOMIC_RELEASE);
+                continue;
+            }
+
+            __atomic_store_n(&entry->loginFails, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&entry->key, key, __ATOMIC_RELEASE);
+            claimed = i;
+        }
+    }
+
+    if (claimed == -1)
+        return -1;
+
+    /* two processes may claim different ways for the same address, the first way wins */
+    for (i = 0; i < claimed; i++)
+    {
+        if (__atomic_load_n(&segment->ipEntries[base + i].key, __ATOMIC_ACQUIRE) == key)
+        {
+            uint64_t expected = key;
+
+            if (entryConnections(&segment->ipEntries[base + claimed]) == 0)
+                __atomic_compare_exchange_n(&segment->ipEntries[base + claimed].key, &expected, SHST_KEY_FREE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+            return base + i;
+        }
+    }
+
+    return base + claimed;
+}
+
+int SHST_Init(int loginFailRetryTime)
+{
+    int randomFd;
+
+    if (segment != NULL)
+        return 1;
+
+    segment = mmap(NULL, sizeof(SHST_Segment_DataType), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED)
+    {
+        segment = NULL;
+        return -1;
+    }
+
+    memset(segment, 0, sizeof(SHST_Segment_DataType));
+    segment->loginFailRetryTime = loginFailRetryTime;
+    segment->hashSeed = ((uint64_t) time(NULL) << 32) ^ (uint64_t) getpid();
+
+    randomFd = open("/dev/urandom", O_RDONLY);
+    if (randomFd >= 0)
+    {
+        if (read(randomFd, &segment->hashSeed, sizeof(segment->hashSeed)) != sizeof(segment->hashSeed))
+            segment->hashSeed ^= (uint64_t) (uintptr_t) segment;
+        close(randomFd);
+    }
+
+    return 1;
+}
+
+/* Column used by this process, set in every worker after the fork */
+void SHST_SetWorker(int index)
+{
+    if (index >= 0 && index < SHST_MAX_WORKERS)
+        workerIndex = index;
+}
+
+/* Called by the master when a worker exits, its connections went away with it */
+void SHST_ReleaseWorker(int index)
+{
+    if (segment == NULL || index < 0 || index >= SHST_MAX_WORKERS)
+        return;
+
+    for (int i = 0; i < SHST_IP_SETS * SHST_IP_WAYS; i++)
+    {
+        if (__atomic_load_n(&segment->ipEntries[i].connections[index], __ATOMIC_RELAXED) != 0)
+            __atomic_store_n(&segment->ipEntries[i].connections[index], 0, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&segment->workerConnections[index], 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Counts a new connection against the server and per address limits (0 is no limit).
+ * Counters are incremented first and checked after, concurrent accepts may both be
+ * refused at the limit but never both admitted over it. An address that finds every
+ * way of its set taken can't be counted, it is refused with SHST_CONNECTION_TABLE_FULL.
+ * entryIndex must be given back to SHST_ReleaseConnection when the client closes.
+ */
+int SHST_AcquireConnection(const char *ipAddress, int maxConnections, int maxConnectionsPerIp, int *entryIndex)
+{
+    uint64_t key;
+
+    *entryIndex = -1;
+
+    if (segment == NULL)
+        return SHST_CONNECTION_ACCEPTED;
+
+    __atomic_fetch_add(&segment->workerConnections[workerIndex], 1, __ATOMIC_ACQ_REL);
+
+    if (maxConnections > 0 && SHST_ConnectedClients() > maxConnections)
+    {
+        __atomic_fetch_sub(&segment->workerConnections[workerIndex], 1, __ATOMIC_ACQ_REL);
+        return SHST_CONNECTION_SERVER_FULL;
+    }
+
+    if (maxConnectionsPerIp <= 0)
+        return SHST_CONNECTION_ACCEPTED;
+
+    key = addressKey(ipAddress);
+
+    for (int attempt = 0; attempt < SHST_ACQUIRE_ATTEMPTS; attempt++)
+    {
+        int index = findEntry(key, time(NULL), 1);
+        SHST_IpEntry_DataType *entry;
+
+        /* every way of the set holds connections or recent login failures */
+        if (index == -1)
+            break;
+
+        entry = &segment->ipEntries[index];
+        __atomic_fetch_add(&entry->connections[workerIndex], 1, __ATOMIC_ACQ_REL);
+
+        /* the way was given to another address meanwhile */
+        if (__atomic_load_n(&entry->key, __ATOMIC_ACQUIRE) != key)
+        {
+            __atomic_fetch_sub(&entry->connections[workerIndex], 1, __ATOMIC_ACQ_REL);
+            continue;
+        }
+
+        if (entryConnections(entry) > maxConnectionsPerIp)
+        {
+            __atomic_fetch_sub(&entry->connections[workerIndex], 1, __ATOMIC_ACQ_REL);
+            __atomic_fetch_sub(&segment->workerConnections[workerIndex], 1, __ATOMIC_ACQ_REL);
+            return SHST_CONNECTION_IP_FULL;
+        }
+
+        *entryIndex = index;
+        return SHST_CONNECTION_ACCEPTED;
+    }
+
+    __atomic_fetch_sub(&segment->workerConnections[workerIndex], 1, __ATOMIC_ACQ_REL);
+    return SHST_CONNECTION_TABLE_FULL;
+}
+
+void SHST_ReleaseConnection(int entryIndex)
+{
+    if (segment == NULL)
+        return;
+
+    if (__atomic_load_n(&segment->workerConnections[workerIndex], __ATOMIC_ACQUIRE) > 0)
+        __atomic_fetch_sub(&segment->workerConnections[workerIndex], 1, __ATOMIC_ACQ_REL);
+
+    if (entryIndex >= 0 && entryIndex < SHST_IP_SETS * SHST_IP_WAYS &&
+        __atomic_load_n(&segment->ipEntries[entryIndex].connections[workerIndex], __ATOMIC_ACQUIRE) > 0)
+        __atomic_fetch_sub(&segment->ipEntries[entryIndex].connections[workerIndex], 1, __ATOMIC_ACQ_REL);
+}
+
+/* Failures older than the retry window restart from one. Returns -1 when the set of the address is full */
+int SHST_RecordLoginFail(const char *ipAddress, time_t now)
+{
+    SHST_IpEntry_DataType *entry;
+    uint64_t current, next;
+    int index;
+
+    if (segment == NULL)
+        return 1;
+
+    index = findEntry(addressKey(ipAddress), now, 1);
+    if (index == -1)
+        return -1;
+
+    entry = &segment->ipEntries[index];
+    current = __atomic_load_n(&entry->loginFails, __ATOMIC_ACQUIRE);
+
+    do
+    {
+        uint32_t failures = (uint32_t) (current & 0xffffffffULL);
+
+        if (loginFailsExpired(current, now))
+            failures = 0;
+
+        next = ((uint64_t) (uint32_t) now << 32) | (uint64_t) (failures + 1);
+    }
+    while (!__atomic_compare_exchange_n(&entry->loginFails, &current, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return 1;
+}
+
+int SHST_IsLoginBlocked(const char *ipAddress, time_t now, int maxFailures)
+{
+    uint64_t loginFails;
+    int index;
+
+    if (segment == NULL || maxFailures <= 0)
+        return 0;
+
+    index = findEntry(addressKey(ipAddress), now, 0);
+    if (index == -1)
+        return 0;
+
+    loginFails = __atomic_load_n(&segment->ipEntries[index].loginFails, __ATOMIC_ACQUIRE);
+
+    return !loginFailsExpired(loginFails, now) &&
+           (int) (loginFails & 0xffffffffULL) >= maxFailures;
+}
+
+/* Connections of every worker process */
+int SHST_ConnectedClients(void)
+{
+    int connectedClients = 0;
+
+    if (segment == NULL)
+        return 0;
+
+    for (int i = 0; i < SHST_MAX_WORKERS; i++)
+        connectedClients += __atomic_load_n(&segment->workerConnections[i], __ATOMIC_ACQUIRE);
+
+    return connectedClients;
+}
+
+void SHST_SetUpgradeState(int state)
+{
+    if (segment != NULL)
+        __atomic_store_n(&segment->upgradeState, state, __ATOMIC_RELEASE);
+}
+
+int SHST_UpgradeState(void)
+{
+    if (segment == NULL)
+        return SHST_UPGRADE_NONE;
+
+    return __atomic_load_n(&segment->upgradeState, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,87 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SHARED_STATE_H
+#define SHARED_STATE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Connection counters and login failure bans shared by every uFTP process.
+ * The segment is an anonymous shared mapping created before the workers are
+ * forked, all the updates are atomic operations without locks.
+ * Every worker counts its connections in its own column, so the master can
+ * drop the counts of a crashed worker without knowing its clients.
+ */
+#define SHST_MAX_WORKERS                32
+#define SHST_IP_SETS                    2048
+#define SHST_IP_WAYS                    8
+
+#define SHST_CONNECTION_ACCEPTED        1
+#define SHST_CONNECTION_SERVER_FULL     -1
+#define SHST_CONNECTION_IP_FULL         -2
+#define SHST_CONNECTION_TABLE_FULL      -3
+
+/* Binary upgrade progress, worker 0 starts the new process and the others follow */
+#define SHST_UPGRADE_NONE               0
+#define SHST_UPGRADE_RUNNING            1
+#define SHST_UPGRADE_READY              2
+
+struct SHST_IpEntry
+{
+    uint64_t key;                                   /* keyed hash of the address, 0 when free */
+    uint64_t loginFails;                            /* last failure time << 32 | failures */
+    unsigned short connections[SHST_MAX_WORKERS];
+} typedef SHST_IpEntry_DataType;
+
+struct SHST_Segment
+{
+    uint64_t hashSeed;
+    int loginFailRetryTime;
+    int upgradeState;
+    int workerConnections[SHST_MAX_WORKERS];
+    SHST_IpEntry_DataType ipEntries[SHST_IP_SETS * SHST_IP_WAYS];
+} typedef SHST_Segment_DataType;
+
+int SHST_Init(int loginFailRetryTime);
+void SHST_SetWorker(int index);
+void SHST_ReleaseWorker(int index);
+int SHST_AcquireConnection(const char *ipAddress, int maxConnections, int maxConnectionsPerIp, int *entryIndex);
+void SHST_ReleaseConnection(int entryIndex);
+int SHST_RecordLoginFail(const char *ipAddress, time_t now);
+int SHST_IsLoginBlocked(const char *ipAddress, time_t now, int maxFailures);
+int SHST_ConnectedClients(void);
+void SHST_SetUpgradeState(int state);
+int SHST_UpgradeState(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHARED_STATE_H */
@@ -45,10 +45,70 @@ void onUftpClose(int sig)
     exit(0);
 }
 
+/* Toggle debug logging on every subsystem without restarting the server */
+void onLogLevelToggle(int sig)
+{
+    logToggleDebug();
+}
+
+static volatile sig_atomic_t reloadRequested = 0;
+
+/* Only flags the request, the control loop performs the reload */
+void onReloadRequest(int sig)
+{
+    reloadRequested = 1;
+}
+
+int signalTakeReloadRequest(void)
+{
+    if (reloadRequested == 0)
+        return 0;
+
+    reloadRequested = 0;
+    return 1;
+}
+
+static volatile sig_atomic_t upgradeRequested = 0;
+
+/* SIGUSR2, the control loop hands the listening sockets to a new binary */
+void onUpgradeRequest(int sig)
+{
+    upgradeRequested = 1;
+}
+
+int signalTakeUpgradeRequest(void)
+{
+    if (upgradeRequested == 0)
+        return 0;
+
+    upgradeRequested = 0;
+    return 1;
+}
+
+static volatile sig_atomic_t drainRequested = 0;
+
+/* SIGTERM, the control loop lets the running transfers complete before exiting */
+void onDrainRequest(int sig)
+{
+    drainRequested = 1;
+}
+
+int signalTakeDrainRequest(void)
+{
+    if (drainRequested == 0)
+        return 0;
+
+    drainRequested = 0;
+    return 1;
+}
+
 void signalHandlerInstall(void)
 {
     signal(SIGINT,onUftpClose);	
-    signal(SIGUSR2,SIG_IGN);	
+    signal(SIGTERM,onDrainRequest);
+    signal(SIGUSR1,onLogLevelToggle);
+    signal(SIGHUP,onReloadRequest);
+    signal(SIGUSR2,onUpgradeRequest);
     signal(SIGPIPE,SIG_IGN);
     signal(SIGALRM,SIG_IGN);
     signal(SIGTSTP,SIG_IGN);
@@ -60,5 +120,6 @@ void signalHandlerInstall(void)
     signal(SIGVTALRM,SIG_IGN);
     signal(SIGPROF,SIG_IGN);
     signal(SIGIO,SIG_IGN);
-    signal(SIGCHLD,SIG_IGN);
+    /* the supervisors wait for their children */
+    signal(SIGCHLD,SIG_DFL);
 }
\ No newline at end of file
@@ -32,6 +32,13 @@ extern "C" {
 void signalHandlerInstall(void);
 void signal_callback_handler(int signum);
 void onUftpClose(int sig);
+void onLogLevelToggle(int sig);
+void onReloadRequest(int sig);
+int signalTakeReloadRequest(void);
+void onUpgradeRequest(int sig);
+int signalTakeUpgradeRequest(void);
+void onDrainRequest(int sig);
+int signalTakeDrainRequest(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,287 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "userDatabase.h"
+#include "hashTable.h"
+
+static int mapDatabaseFile(const char *path, void **map, size_t *mapSize, struct stat *fileStat);
+static int readRecord(const void *map, size_t mapSize, uint32_t offset, USERDB_User_DataType *user);
+static int copyField(char *destination, size_t destinationSize, const char *source, uint16_t length);
+
+int USERDB_Validate(const void *map, size_t mapSize)
+{
+    const USERDB_Header_DataType *header = map;
+
+    if (mapSize < sizeof(USERDB_Header_DataType))
+        return -1;
+
+    if (memcmp(header->magic, USERDB_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != USERDB_VERSION ||
+        header->fileSize != mapSize)
+        return -1;
+
+    /* slotCount must be a power of two */
+    if (header->slotCount == 0 ||
+        (header->slotCount & (header->slotCount - 1)) != 0)
+        return -1;
+
+    /* the slots are read in place, the records are copied out by readRecord */
+    if (header->slotsOffset < sizeof(USERDB_Header_DataType) ||
+        header->slotsOffset % _Alignof(USERDB_Slot_DataType) != 0 ||
+        (uint64_t) header->slotsOffset + (uint64_t) header->slotCount * sizeof(USERDB_Slot_DataType) > mapSize ||
+        header->recordsOffset > mapSize)
+        return -1;
+
+    return 1;
+}
+
+static int mapDatabaseFile(const char *path, void **map, size_t *mapSize, struct stat *fileStat)
+{
+    int fd;
+    void *theMap;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, fileStat) != 0 ||
+        fileStat->st_size < (off_t) sizeof(USERDB_Header_DataType))
+    {
+        close(fd);
+        return -1;
+    }
+
+    theMap = mmap(NULL, fileStat->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (theMap == MAP_FAILED)
+        return -1;
+
+    if (USERDB_Validate(theMap, fileStat->st_size) != 1)
+    {
+        munmap(theMap, fileStat->st_size);
+        return -1;
+    }
+
+    *map = theMap;
+    *mapSize = fileStat->st_size;
+    return 1;
+}
+
+static int copyField(char *destination, size_t destinationSize, const char *source, uint16_t length)
+{
+    if (length >= destinationSize)
+        return -1;
+
+    memcpy(destination, source, length);
+    destination[length] = '\0';
+    return 1;
+}
+
+/*
+ * Bounds checked copy of the record at offset. Records are packed back to back,
+ * so the header is copied out instead of read through a misaligned pointer.
+ */
+static int readRecord(const void *map, size_t mapSize, uint32_t offset, USERDB_User_DataType *user)
+{
+    const USERDB_Header_DataType *header = map;
+    USERDB_Record_DataType record;
+    const char *field;
+    uint64_t recordEnd;
+
+    if (offset < header->recordsOffset ||
+        (uint64_t) offset + sizeof(USERDB_Record_DataType) > mapSize)
+        return -1;
+
+    memcpy(&record, (const char *) map + offset, sizeof(record));
+    recordEnd = (uint64_t) offset + sizeof(USERDB_Record_DataType) +
+                record.nameLength + record.passwordLength + record.homeLength +
+                record.userOwnerLength + record.groupOwnerLength + 5;
+
+    if (recordEnd > mapSize)
+        return -1;
+
+    field = (const char *) map + offset + sizeof(USERDB_Record_DataType);
+    if (copyField(user->name, sizeof(user->name), field, record.nameLength) < 0)
+        return -1;
+    field += record.nameLength + 1;
+
+    if (copyField(user->password, sizeof(user->password), field, record.passwordLength) < 0)
+        return -1;
+    field += record.passwordLength + 1;
+
+    if (copyField(user->homePath, sizeof(user->homePath), field, record.homeLength) < 0)
+        return -1;
+    field += record.homeLength + 1;
+
+    if (copyField(user->userOwner, sizeof(user->userOwner), field, record.userOwnerLength) < 0)
+        return -1;
+    field += record.userOwnerLength + 1;
+
+    if (copyField(user->groupOwner, sizeof(user->groupOwner), field, record.groupOwnerLength) < 0)
+        return -1;
+
+    return 1;
+}
+
+int USERDB_Open(USERDB_Database_DataType *database, const char *path)
+{
+    struct stat fileStat;
+
+    memset(database, 0, sizeof(USERDB_Database_DataType));
+    pthread_mutex_init(&database->mutex, NULL);
+    snprintf(database->path, sizeof(database->path), "%s", path);
+    database->lastCheck = time(NULL);
+
+    if (mapDatabaseFile(database->path, &database->map, &database->mapSize, &fileStat) != 1)
+        return -1;
+
+    database->device = fileStat.st_dev;
+    database->inode = fileStat.st_ino;
+    database->modificationTime = fileStat.st_mtim;
+    return 1;
+}
+
+void USERDB_Close(USERDB_Database_DataType *database)
+{
+    pthread_mutex_lock(&database->mutex);
+    if (database->map != NULL)
+    {
+        munmap(database->map, database->mapSize);
+        database->map = NULL;
+        database->mapSize = 0;
+    }
+    pthread_mutex_unlock(&database->mutex);
+    pthread_mutex_destroy(&database->mutex);
+}
+
+/*
+ * Map the file again if it has been replaced (the builder renames a new file
+ * over the old one) or modified. The new map is validated before the swap,
+ * a broken file keeps the previous database in service.
+ * Returns 1 when swapped, 0 when unchanged, -1 on error.
+ */
+int USERDB_Reload(USERDB_Database_DataType *database)
+{
+    struct stat fileStat;
+    void *newMap, *oldMap;
+    size_t newMapSize, oldMapSize;
+
+    if (stat(database->path, &fileStat) != 0)
+        return -1;
+
+    pthread_mutex_lock(&database->mutex);
+    if (database->map != NULL &&
+        fileStat.st_dev == database->device &&
+        fileStat.st_ino == database->inode &&
+        fileStat.st_mtim.tv_sec == database->modificationTime.tv_sec &&
+        fileStat.st_mtim.tv_nsec == database->modificationTime.tv_nsec)
+    {
+        pthread_mutex_unlock(&database->mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&database->mutex);
+
+    if (mapDatabaseFile(database->path, &newMap, &newMapSize, &fileStat) != 1)
+        return -1;
+
+    pthread_mutex_lock(&database->mutex);
+    oldMap = database->map;
+    oldMapSize = database->mapSize;
+    database->map = newMap;
+    database->mapSize = newMapSize;
+    database->device = fileStat.st_dev;
+    database->inode = fileStat.st_ino;
+    database->modificationTime = fileStat.st_mtim;
+    pthread_mutex_unlock(&database->mutex);
+
+    /* Lookups copy the record out under the mutex, nobody references the old map anymore */
+    if (oldMap != NULL)
+        munmap(oldMap, oldMapSize);
+
+    return 1;
+}
+
+/* Returns 1 and fills user when found, -1 otherwise */
+int USERDB_Lookup(USERDB_Database_DataType *database, const char *name, USERDB_User_DataType *user)
+{
+    const USERDB_Header_DataType *header;
+    const USERDB_Slot_DataType *slots;
+    uint32_t hash, slot, mask;
+    int returnCode = -1, checkForChanges = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&database->mutex);
+    if (now - database->lastCheck >= USERDB_RELOAD_CHECK_SECONDS)
+    {
+        database->lastCheck = now;
+        checkForChanges = 1;
+    }
+    pthread_mutex_unlock(&database->mutex);
+
+    if (checkForChanges)
+        USERDB_Reload(database);
+
+    pthread_mutex_lock(&database->mutex);
+
+    if (database->map == NULL)
+    {
+        pthread_mutex_unlock(&database->mutex);
+        return -1;
+    }
+
+    header = database->map;
+    slots = (const USERDB_Slot_DataType *) ((const char *) database->map + header->slotsOffset);
+    mask = header->slotCount - 1;
+    hash = HASH_String(name);
+    slot = hash & mask;
+
+    for (uint32_t probes = 0; probes < header->slotCount; probes++)
+    {
+        if (slots[slot].recordOffset == 0)
+            break;
+
+        if (slots[slot].hash == hash &&
+            readRecord(database->map, database->mapSize, slots[slot].recordOffset, user) == 1 &&
+            strcmp(user->name, name) == 0)
+        {
+            returnCode = 1;
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    pthread_mutex_unlock(&database->mutex);
+    return returnCode;
+}
@@ -0,0 +1,110 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef USER_DATABASE_H
+#define USER_DATABASE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary user database, built by uftpUserDb and memory mapped by the server.
+ * Native byte order, all offsets are from the start of the file.
+ *
+ *   USERDB_Header
+ *   USERDB_Slot[slotCount]      open addressing table, HASH_String(name), offset 0 = empty
+ *   records                     USERDB_Record followed by the NUL terminated strings
+ *                               name, password, home, user owner, group owner
+ */
+#define USERDB_MAGIC                "uFTPudb"
+#define USERDB_VERSION              1
+#define USERDB_FIELD_SIZE           256
+#define USERDB_RELOAD_CHECK_SECONDS 1
+
+struct USERDB_Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordCount;
+    uint32_t slotCount;
+    uint32_t slotsOffset;
+    uint32_t recordsOffset;
+    uint32_t fileSize;
+} typedef USERDB_Header_DataType;
+
+struct USERDB_Slot
+{
+    uint32_t hash;
+    uint32_t recordOffset;
+} typedef USERDB_Slot_DataType;
+
+struct USERDB_Record
+{
+    uint16_t nameLength;
+    uint16_t passwordLength;
+    uint16_t homeLength;
+    uint16_t userOwnerLength;
+    uint16_t groupOwnerLength;
+    uint16_t flags;
+} typedef USERDB_Record_DataType;
+
+/* Copy of a record, valid after the database has been swapped */
+struct USERDB_User
+{
+    char name[USERDB_FIELD_SIZE];
+    char password[USERDB_FIELD_SIZE];
+    char homePath[PATH_MAX];
+    char userOwner[USERDB_FIELD_SIZE];
+    char groupOwner[USERDB_FIELD_SIZE];
+} typedef USERDB_User_DataType;
+
+struct USERDB_Database
+{
+    pthread_mutex_t mutex;
+    char path[PATH_MAX];
+    void *map;
+    size_t mapSize;
+    dev_t device;
+    ino_t inode;
+    struct timespec modificationTime;
+    time_t lastCheck;
+} typedef USERDB_Database_DataType;
+
+int USERDB_Open(USERDB_Database_DataType *database, const char *path);
+void USERDB_Close(USERDB_Database_DataType *database);
+int USERDB_Reload(USERDB_Database_DataType *database);
+int USERDB_Lookup(USERDB_Database_DataType *database, const char *name, USERDB_User_DataType *user);
+int USERDB_Validate(const void *map, size_t mapSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USER_DATABASE_H */
@@ -0,0 +1,173 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "workerPool.h"
+#include "dynamicMemory.h"
+#include "../debugHelper.h"
+
+static void *workerPoolThread(void *arg);
+
+static void *workerPoolThread(void *arg)
+{
+    WPOOL_Pool_DataType *pool = arg;
+
+    while (1)
+    {
+        void *job;
+        char notification = 1;
+
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->pendingCount == 0)
+        {
+            pthread_cond_wait(&pool->condition, &pool->mutex);
+        }
+
+        job = pool->pendingJobs[pool->pendingHead];
+        pool->pendingHead = (pool->pendingHead + 1) % pool->queueSize;
+        pool->pendingCount--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool->execute(job);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->completedJobs[(pool->completedHead + pool->completedCount) % pool->queueSize] = job;
+        pool->completedCount++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        /* A full pipe already guarantees a wake up */
+        if (write(pool->notifyPipe[1], &notification, 1) < 0 && errno != EAGAIN)
+        {
+            my_printfError("\nWorker pool notification error");
+        }
+    }
+
+    return NULL;
+}
+
+int WPOOL_Init(WPOOL_Pool_DataType *pool, int threadCount, int queueSize, void (*execute)(void *job))
+{
+    memset(pool, 0, sizeof(WPOOL_Pool_DataType));
+
+    if (threadCount <= 0 || queueSize <= 0)
+        return -1;
+
+    pool->threadCount = threadCount;
+    pool->queueSize = queueSize;
+    pool->execute = execute;
+
+    if (pipe(pool->notifyPipe) != 0)
+        return -1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(pool->notifyPipe[i], F_SETFL, fcntl(pool->notifyPipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(pool->notifyPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->condition, NULL);
+
+    pool->pendingJobs = DYNMEM_malloc(sizeof(void *) * queueSize, &pool->memoryTable, "workerPool");
+    pool->completedJobs = DYNMEM_malloc(sizeof(void *) * queueSize, &pool->memoryTable, "workerPool");
+    pool->threads = DYNMEM_malloc(sizeof(pthread_t) * threadCount, &pool->memoryTable, "workerPool");
+
+    if (pool->pendingJobs == NULL || pool->completedJobs == NULL || pool->threads == NULL)
+        return -1;
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, workerPoolThread, pool) != 0)
+        {
+            pool->threadCount = i;
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+/* Returns -1 when queueSize jobs are already waiting or running or waiting to be collected */
+int WPOOL_Submit(WPOOL_Pool_DataType *pool, void *job)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->outstandingJobs >= pool->queueSize)
+    {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+
+    pool->pendingJobs[(pool->pendingHead + pool->pendingCount) % pool->queueSize] = job;
+    pool->pendingCount++;
+    pool->outstandingJobs++;
+    pthread_cond_signal(&pool->condition);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 1;
+}
+
+/* Main thread side, returns the next executed job or NULL */
+void *WPOOL_GetCompleted(WPOOL_Pool_DataType *pool)
+{
+    void *job = NULL;
+    char drain[64];
+
+    while (read(pool->notifyPipe[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->completedCount > 0)
+    {
+        job = pool->completedJobs[pool->completedHead];
+        pool->completedHead = (pool->completedHead + 1) % pool->queueSize;
+        pool->completedCount--;
+        pool->outstandingJobs--;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return job;
+}
+
+int WPOOL_NotifySocket(WPOOL_Pool_DataType *pool)
+{
+    return pool->notifyPipe[0];
+}
+
+/* Jobs submitted and not yet handed back by WPOOL_GetCompleted */
+int WPOOL_OutstandingJobs(WPOOL_Pool_DataType *pool)
+{
+    int outstandingJobs;
+
+    pthread_mutex_lock(&pool->mutex);
+    outstandingJobs = pool->outstandingJobs;
+    pthread_mutex_unlock(&pool->mutex);
+
+    return outstandingJobs;
+}
@@ -0,0 +1,73 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+#include "dynamicMemory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fixed size thread pool for blocking jobs (PAM, password hashing..).
+ * Jobs are executed on the pool threads and handed back to the main thread
+ * through the completed queue, a byte on notifyPipe wakes up select().
+ */
+struct WPOOL_Pool
+{
+    pthread_t *threads;
+    int threadCount;
+    int queueSize;
+    int outstandingJobs;
+
+    void **pendingJobs;
+    int pendingHead;
+    int pendingCount;
+
+    void **completedJobs;
+    int completedHead;
+    int completedCount;
+
+    int notifyPipe[2];
+    void (*execute)(void *job);
+
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    DYNMEM_MemoryTable_DataType *memoryTable;
+} typedef WPOOL_Pool_DataType;
+
+int WPOOL_Init(WPOOL_Pool_DataType *pool, int threadCount, int queueSize, void (*execute)(void *job));
+int WPOOL_Submit(WPOOL_Pool_DataType *pool, void *job);
+void *WPOOL_GetCompleted(WPOOL_Pool_DataType *pool);
+int WPOOL_NotifySocket(WPOOL_Pool_DataType *pool);
+int WPOOL_OutstandingJobs(WPOOL_Pool_DataType *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WORKER_POOL_H */
@@ -0,0 +1,768 @@
+import unittest
+import ftplib
+import os
+import re
+import shutil
+import signal
+import socket
+import ssl
+import subprocess
+import tempfile
+import threading
+import time
+
+
+# These tests start their own uFTP with a dedicated configuration, build the
+# server first and run them from any directory:
+#   python3 test/lifecycle.py
+# UFTP_BINARY selects a binary other than build/uFTP. The TLS tests need a build
+# with OPENSSL_ENABLED and the openssl command line tool, they are skipped otherwise.
+UFTP_BINARY = os.environ.get('UFTP_BINARY', os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'build', 'uFTP'))
+
+FTP_HOST = '127.0.0.1'
+FTP_USER = 'username'
+FTP_PASS = 'password'
+
+START_TIMEOUT = 10
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind((FTP_HOST, 0))
+        return s.getsockname()[1]
+
+
+def wait_for(condition, timeout=START_TIMEOUT, step=0.05):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        result = condition()
+        if result:
+            return result
+        time.sleep(step)
+    return condition()
+
+
+def listening_sockets(port):
+    # Every SO_REUSEPORT worker owns its own listening socket, count them without connecting
+    count = 0
+    for table in ('/proc/net/tcp', '/proc/net/tcp6'):
+        try:
+            with open(table) as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    if fields[3] == '0A' and int(fields[1].split(':')[1], 16) == port:
+                        count += 1
+        except FileNotFoundError:
+            pass
+    return count
+
+
+def socket_inode(local_port, remote_port):
+    for table in ('/proc/net/tcp', '/proc/net/tcp6'):
+        try:
+            with open(table) as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    if int(fields[1].split(':')[1], 16) == local_port and int(fields[2].split(':')[1], 16) == remote_port:
+                        return fields[9]
+        except FileNotFoundError:
+            pass
+    return None
+
+
+def make_certificate(directory, name):
+    certificate = os.path.join(directory, name + '-cert.pem')
+    key = os.path.join(directory, name + '-key.pem')
+    subprocess.run(['openssl', 'req', '-x509', '-newkey', 'rsa:2048', '-nodes', '-days', '1',
+                    '-subj', '/CN=' + name, '-keyout', key, '-out', certificate],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return certificate, key
+
+
+def client_context():
+    context = ssl.create_default_context()
+    context.check_hostname = False
+    context.verify_mode = ssl.CERT_NONE
+    return context
+
+
+class ImplicitFTP_TLS(ftplib.FTP_TLS):
+    # ftplib only speaks explicit FTPS, wrap the control socket as soon as it is connected
+
+    def __init__(self, *args, **kwargs):
+        super().__init__(*args, **kwargs)
+        self._sock = None
+
+    @property
+    def sock(self):
+        return self._sock
+
+    @sock.setter
+    def sock(self, value):
+        if value is not None and not isinstance(value, ssl.SSLSocket):
+            value = self.context.wrap_socket(value, server_hostname=self.host)
+        self._sock = value
+
+    def ntransfercmd(self, cmd, rest=None):
+        conn, size = ftplib.FTP.ntransfercmd(self, cmd, rest)
+        if self._prot_p:
+            conn = self.context.wrap_socket(conn, server_hostname=self.host, session=self.sock.session)
+        return conn, size
+
+
+def peer_certificate(port):
+    ftp = ftplib.FTP_TLS(context=client_context())
+    ftp.connect(FTP_HOST, port, timeout=10)
+    ftp.auth()
+    certificate = ftp.sock.getpeercert(binary_form=True)
+    ftp.close()
+    return certificate
+
+
+def certificate_der(path):
+    with open(path) as f:
+        return ssl.PEM_cert_to_DER_cert(f.read())
+
+
+class UftpServer:
+    """A uFTP started in its own directory, with uftpd.cfg, home/ and logs/ inside it."""
+
+    def __init__(self, **settings):
+        self.directory = tempfile.mkdtemp(prefix='uftp-test-')
+        self.home = os.path.join(self.directory, 'home')
+        self.logs = os.path.join(self.directory, 'logs')
+        os.mkdir(self.home)
+        os.mkdir(self.logs)
+        self.port = free_port()
+        self.workers = int(settings.get('WORKER_PROCESSES', 1))
+        self.settings = {
+            'MAXIMUM_ALLOWED_FTP_CONNECTION': 30,
+            'FTP_PORT': self.port,
+            'SINGLE_INSTANCE': 'false',
+            'DAEMON_MODE': 'false',
+            'LOG_FOLDER': self.logs + '/',
+            'MAXIMUM_LOG_FILES': 1,
+            'IDLE_MAX_TIMEOUT': 60,
+            'AUTH_CACHE_TTL': 0,
+        }
+        # An OPENSSL_ENABLED build does not start without its certificate
+        self.certificate = self.key = None
+        if shutil.which('openssl') is not None:
+            self.certificate, self.key = make_certificate(self.directory, 'first')
+            self.settings['CERTIFICATE_PATH'] = self.certificate
+            self.settings['PRIVATE_CERTIFICATE_PATH'] = self.key
+        self.settings.update(settings)
+        self.users = [(FTP_USER, FTP_PASS)]
+        self.clients = []
+        self.process = None
+
+    def write_configuration(self):
+        with open(os.path.join(self.directory, 'uftpd.cfg'), 'w') as f:
+            for name, value in self.settings.items():
+                f.write('%s = %s\n' % (name, value))
+            for i, (user, password) in enumerate(self.users):
+                f.write('USER_%d = %s\nPASSWORD_%d = %s\nHOME_%d = %s\n' % (i, user, i, password, i, self.home))
+
+    def start(self):
+        self.write_configuration()
+        self.process = subprocess.Popen([os.path.abspath(UFTP_BINARY)], cwd=self.directory,
+                                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                                        start_new_session=True)
+        wait_for(lambda: listening_sockets(self.port) >= self.workers or self.process.poll() is not None)
+        if listening_sockets(self.port) < self.workers:
+            raise RuntimeError('uFTP did not start listening on port %d' % self.port)
+        return self
+
+    def stop(self):
+        for ftp in self.clients:
+            ftp.close()
+        # Kill everything running from our directory, an upgrade leaves processes outside our tree
+        for pid in self.pids():
+            try:
+                os.kill(pid, signal.SIGKILL)
+            except ProcessLookupError:
+                pass
+        if self.process is not None:
+            self.process.wait()
+        shutil.rmtree(self.directory, ignore_errors=True)
+
+    def pids(self):
+        found = []
+        for entry in os.listdir('/proc'):
+            if not entry.isdigit():
+                continue
+            try:
+                if os.readlink('/proc/%s/cwd' % entry) == self.directory and \
+                   os.readlink('/proc/%s/exe' % entry) == os.path.realpath(UFTP_BINARY):
+                    found.append(int(entry))
+            except OSError:
+                pass
+        return found
+
+    def signal(self, number):
+        # The started process is the respawn supervisor, it forwards the signal
+        os.kill(self.process.pid, number)
+
+    def serving_pid(self, sock):
+        # Map a client socket to the uFTP process holding the other end of it
+        local = sock.getsockname()[1]
+        inode = wait_for(lambda: socket_inode(self.port, local), timeout=2)
+        for pid in self.pids():
+            try:
+                for fd in os.listdir('/proc/%d/fd' % pid):
+                    if os.readlink('/proc/%d/fd/%s' % (pid, fd)) == 'socket:[%s]' % inode:
+                        return pid
+            except OSError:
+                pass
+        return None
+
+    def log(self):
+        text = ''
+        for name in sorted(os.listdir(self.logs)):
+            with open(os.path.join(self.logs, name), errors='replace') as f:
+                text += f.read()
+        return text
+
+    def connect(self, port=None):
+        ftp = ftplib.FTP()
+        self.clients.append(ftp)
+        ftp.connect(FTP_HOST, port or self.port, timeout=10)
+        return ftp
+
+    def login(self, user=FTP_USER, password=FTP_PASS):
+        ftp = self.connect()
+        try:
+            ftp.login(user, password)
+        except ftplib.Error:
+            ftp.close()
+            raise
+        return ftp
+
+
+class UftpTestCase(unittest.TestCase):
+
+    def start_server(self, **settings):
+        server = UftpServer(**settings)
+        self.addCleanup(server.stop)
+        return server.start()
+
+    def start_tls_server(self, **settings):
+        if shutil.which('openssl') is None:
+            self.skipTest('openssl command line tool not found')
+        server = self.start_server(**settings)
+        ftp = server.connect()
+        try:
+            if not ftp.sendcmd('AUTH TLS').startswith('234'):
+                self.skipTest('uFTP built without OPENSSL_ENABLED')
+        except ftplib.Error:
+            self.skipTest('uFTP built without OPENSSL_ENABLED')
+        finally:
+            ftp.close()
+        return server
+
+
+class ImplicitTlsTests(UftpTestCase):
+
+    def setUp(self):
+        self.implicit_port = free_port()
+        self.server = self.start_tls_server(IMPLICIT_TLS_PORT=self.implicit_port)
+
+    def test_greeting_and_listing_over_implicit_tls(self):
+        ftp = ImplicitFTP_TLS(context=client_context())
+        greeting = ftp.connect(FTP_HOST, self.implicit_port, timeout=10)
+        self.assertTrue(greeting.startswith('220'), greeting)
+        self.assertIsInstance(ftp.sock, ssl.SSLSocket)
+        ftp.login(FTP_USER, FTP_PASS)
+        ftp.prot_p()
+        with open(os.path.join(self.server.home, 'implicit.txt'), 'w') as f:
+            f.write('implicit')
+        self.assertIn('implicit.txt', ftp.nlst())
+        ftp.quit()
+
+    def test_explicit_port_still_answers_in_plain_text(self):
+        ftp = self.server.login()
+        self.assertEqual(ftp.pwd(), '/')
+        ftp.quit()
+
+    def test_plain_text_client_on_implicit_port_is_dropped(self):
+        s = socket.create_connection((FTP_HOST, self.implicit_port), timeout=10)
+        s.sendall(b'USER username\r\n')
+        try:
+            reply = s.recv(1024)
+        except ConnectionResetError:
+            reply = b''
+        s.close()
+        self.assertFalse(reply.startswith(b'220'), reply)
+
+
+class CertificateReloadTests(UftpTestCase):
+
+    def setUp(self):
+        self.server = self.start_tls_server()
+
+    def test_sighup_loads_the_new_certificate(self):
+        first = certificate_der(self.server.certificate)
+        self.assertEqual(peer_certificate(self.server.port), first)
+
+        session = ftplib.FTP_TLS(context=client_context())
+        session.connect(FTP_HOST, self.server.port, timeout=10)
+        session.login(FTP_USER, FTP_PASS)
+
+        certificate, key = make_certificate(self.server.directory, 'second')
+        shutil.copy(certificate, self.server.certificate)
+        shutil.copy(key, self.server.key)
+        self.server.signal(signal.SIGHUP)
+
+        second = certificate_der(certificate)
+        self.assertTrue(wait_for(lambda: peer_certificate(self.server.port) == second),
+                        'new connections still get the old certificate')
+        # The session negotiated before the reload keeps working
+        self.assertTrue(session.voidcmd('NOOP').startswith('200'))
+        self.assertEqual(session.pwd(), '/')
+        session.quit()
+
+    def test_broken_certificate_keeps_the_current_one(self):
+        first = certificate_der(self.server.certificate)
+        with open(self.server.certificate, 'w') as f:
+            f.write('not a certificate\n')
+        self.server.signal(signal.SIGHUP)
+
+        self.assertTrue(wait_for(lambda: 'TLS reload of' in self.server.log()), self.server.log())
+        self.assertEqual(peer_certificate(self.server.port), first)
+
+
+class TlsProfileTests(UftpTestCase):
+
+    def test_minimum_version_1_3(self):
+        server = self.start_tls_server(TLS_MIN_VERSION='1.3')
+        context = client_context()
+        context.maximum_version = ssl.TLSVersion.TLSv1_2
+        ftp = ftplib.FTP_TLS(context=context)
+        ftp.connect(FTP_HOST, server.port, timeout=10)
+        with self.assertRaises(ssl.SSLError):
+            ftp.auth()
+        ftp.close()
+
+        ftp = ftplib.FTP_TLS(context=client_context())
+        ftp.connect(FTP_HOST, server.port, timeout=10)
+        ftp.auth()
+        self.assertEqual(ftp.sock.version(), 'TLSv1.3')
+        ftp.close()
+
+    def test_invalid_minimum_version_stops_the_server(self):
+        # Only a TLS build reads the value
+        self.start_tls_server()
+        for value in ('1.4', 'tls1.3'):
+            server = UftpServer(TLS_MIN_VERSION=value)
+            self.addCleanup(server.stop)
+            with self.assertRaises(RuntimeError):
+                server.start()
+            self.assertNotEqual(server.process.wait(timeout=10), 0)
+
+
+class WorkerProcessTests(UftpTestCase):
+
+    def spread_connections(self, server, count, per_worker=1):
+        # The kernel picks the worker of each connection, retry until every worker got its share
+        for attempt in range(20):
+            connections = [server.connect() for i in range(count)]
+            workers = {}
+            for ftp in connections:
+                workers.setdefault(server.serving_pid(ftp.sock), []).append(ftp)
+            if len(workers) == server.workers and min(len(c) for c in workers.values()) >= per_worker:
+                return workers
+            for ftp in connections:
+                ftp.close()
+            # Let the workers notice the closed connections before trying again
+            time.sleep(0.5)
+        self.fail('connections never spread over the %d workers' % server.workers)
+
+    def test_per_ip_limit_holds_across_workers(self):
+        server = self.start_server(WORKER_PROCESSES=2, MAX_CONNECTION_NUMBER_PER_IP=3)
+        workers = self.spread_connections(server, 3)
+        self.assertEqual(len(workers), 2)
+
+        with self.assertRaises(ftplib.error_perm) as refused:
+            server.connect()
+        self.assertTrue(str(refused.exception).startswith('530'), refused.exception)
+
+        # Closing one connection frees a slot whichever worker gets the next one
+        next(iter(workers.values()))[0].quit()
+        ftp = wait_for(lambda: self.try_connect(server))
+        self.assertIsNotNone(ftp)
+        ftp.quit()
+
+    def test_login_ban_holds_across_workers(self):
+        server = self.start_server(WORKER_PROCESSES=2, MAX_CONNECTION_NUMBER_PER_IP=10, MAX_CONNECTION_TRY_PER_IP=2)
+        workers = self.spread_connections(server, 6, per_worker=2)
+
+        # One failure on each worker reaches the limit of two
+        for connections in workers.values():
+            with self.assertRaises(ftplib.error_temp) as failed:
+                connections[0].login(FTP_USER, 'wrong')
+            self.assertIn('Invalid username or password', str(failed.exception))
+
+        # Both workers now refuse even the right password
+        for connections in workers.values():
+            with self.assertRaises(ftplib.error_temp) as blocked:
+                connections[1].login(FTP_USER, FTP_PASS)
+            self.assertIn('Too many login failure', str(blocked.exception))
+
+    def test_crashed_worker_releases_its_connections(self):
+        server = self.start_server(WORKER_PROCESSES=2, MAX_CONNECTION_NUMBER_PER_IP=3)
+        workers = self.spread_connections(server, 3)
+        processes = len(server.pids())
+        crashed, lost = next(iter(workers.items()))
+        survivors = [ftp for pid, connections in workers.items() if pid != crashed for ftp in connections]
+
+        os.kill(crashed, signal.SIGKILL)
+        self.assertTrue(wait_for(lambda: crashed not in server.pids() and len(server.pids()) == processes),
+                        'the crashed worker was not respawned')
+
+        # Without SHST_ReleaseWorker the dead worker's connections would still count against the address
+        replacements = [wait_for(lambda: self.try_connect(server)) for ftp in lost]
+        self.assertNotIn(None, replacements)
+        for ftp in survivors + replacements:
+            ftp.login(FTP_USER, FTP_PASS)
+            self.assertTrue(ftp.voidcmd('NOOP').startswith('200'))
+
+        with self.assertRaises(ftplib.error_perm):
+            server.connect()
+
+    @staticmethod
+    def try_connect(server):
+        try:
+            return server.connect()
+        except ftplib.error_perm:
+            return None
+
+
+class UpgradeTests(UftpTestCase):
+
+    def test_sigusr2_hands_the_port_to_a_new_process(self):
+        server = self.start_server()
+        old = server.pids()
+        session = server.login()
+
+        server.signal(signal.SIGUSR2)
+
+        def new_session():
+            ftp = server.login()
+            if server.serving_pid(ftp.sock) in old:
+                ftp.quit()
+                return None
+            return ftp
+        upgraded = wait_for(new_session)
+        self.assertIsNotNone(upgraded, 'no new process took over the port')
+        self.assertNotIn(server.serving_pid(upgraded.sock), old)
+
+        # The session opened before the upgrade stays with the old process
+        self.assertTrue(session.voidcmd('NOOP').startswith('200'))
+        self.assertIn(server.serving_pid(session.sock), old)
+        session.quit()
+
+        # Once its last session is gone the old generation exits
+        self.assertTrue(wait_for(lambda: server.process.poll() is not None), 'the old process is still running')
+        self.assertFalse(set(old) & set(server.pids()))
+
+        # No plain text listing here, its 226 can overtake the 150 on the control connection
+        with open(os.path.join(server.home, 'upgraded.txt'), 'w') as f:
+            f.write('upgraded')
+        self.assertEqual(upgraded.size('upgraded.txt'), 8)
+        upgraded.quit()
+
+
+class UserReloadTests(UftpTestCase):
+
+    @staticmethod
+    def try_login(server, user, password):
+        try:
+            return server.login(user, password)
+        except ftplib.Error:
+            return None
+
+    def test_sighup_reloads_the_users(self):
+        server = self.start_server()
+        session = server.login()
+
+        server.users = [('second', 'secret')]
+        server.write_configuration()
+        server.signal(signal.SIGHUP)
+
+        second = wait_for(lambda: self.try_login(server, 'second', 'secret'))
+        self.assertIsNotNone(second, 'the added user can not log in')
+        second.quit()
+        self.assertIsNone(self.try_login(server, FTP_USER, FTP_PASS))
+
+        # The session of the removed user is not dropped by the reload
+        self.assertTrue(session.voidcmd('NOOP').startswith('200'))
+        session.quit()
+
+    def test_invalid_configuration_is_not_applied(self):
+        server = self.start_server()
+
+        server.users.append(('second', 'secret'))
+        server.settings['MAXIMUM_ALLOWED_FTP_CONNECTION'] = 0
+        server.write_configuration()
+        server.signal(signal.SIGHUP)
+
+        self.assertTrue(wait_for(lambda: 'nothing changed' in server.log()), server.log())
+        self.assertIsNone(self.try_login(server, 'second', 'secret'))
+        ftp = server.login()
+        ftp.quit()
+
+
+class DrainTests(UftpTestCase):
+
+    FILE_SIZE = 16 * 1024 * 1024
+
+    def start_transfer(self, server):
+        with open(os.path.join(server.home, 'big.bin'), 'wb') as f:
+            f.write(os.urandom(self.FILE_SIZE))
+        ftp = server.login()
+        ftp.voidcmd('TYPE I')
+        data = ftp.transfercmd('RETR big.bin')
+        return ftp, data, len(data.recv(65536))
+
+    def test_sigterm_drains_sessions(self):
+        server = self.start_server(DRAIN_TIMEOUT=60)
+        idle = server.login()
+        ftp, data, received = self.start_transfer(server)
+
+        server.signal(signal.SIGTERM)
+
+        # Idle sessions are told right away, new connections are refused
+        self.assertTrue(idle.getline().startswith('421'))
+        self.assertTrue(wait_for(lambda: listening_sockets(server.port) == 0), 'still listening')
+
+        # The running transfer is allowed to finish
+        while True:
+            block = data.recv(65536)
+            if not block:
+                break
+            received += len(block)
+        data.close()
+        self.assertEqual(received, self.FILE_SIZE)
+        self.assertTrue(ftp.voidresp().startswith('226'))
+
+        self.assertTrue(wait_for(lambda: server.process.poll() is not None), 'uFTP did not exit')
+
+    def test_drain_timeout_ends_a_stuck_transfer(self):
+        server = self.start_server(DRAIN_TIMEOUT=1)
+        ftp, data, received = self.start_transfer(server)
+
+        # The client stops reading, the transfer can't finish on its own
+        started = time.time()
+        server.signal(signal.SIGTERM)
+        self.assertTrue(wait_for(lambda: server.process.poll() is not None), 'uFTP did not exit')
+        self.assertLess(time.time() - started, 8)
+        data.close()
+
+
+class MetricsTests(UftpTestCase):
+
+    @staticmethod
+    def scrape(connect, path='/metrics'):
+        s = connect()
+        s.settimeout(10)
+        s.sendall(b'GET ' + path.encode() + b' HTTP/1.0\r\nHost: localhost\r\n\r\n')
+        response = b''
+        while True:
+            block = s.recv(65536)
+            if not block:
+                break
+            response += block
+        s.close()
+        head, _, body = response.decode().partition('\r\n\r\n')
+        return head, body
+
+    def test_metrics_endpoint(self):
+        port = free_port()
+        server = self.start_server(METRICS_ADDRESS='%s:%d' % (FTP_HOST, port))
+        self.assertTrue(wait_for(lambda: listening_sockets(port) == 1), 'metrics endpoint not listening')
+        connect = lambda: socket.create_connection((FTP_HOST, port))
+
+        session = server.login()
+        with self.assertRaises(ftplib.error_temp):
+            server.login(FTP_USER, 'wrong')
+
+        def scraped():
+            head, body = self.scrape(connect)
+            if 'uftp_logins_total{result="failed"} 1' in body:
+                return head, body
+        scrape = wait_for(scraped)
+        self.assertIsNotNone(scrape, 'the failed login was not counted')
+        head, body = scrape
+        self.assertTrue(head.startswith('HTTP/1.0 200'), head)
+        self.assertIn('Content-Type: text/plain', head)
+        self.assertIn('# TYPE uftp_logins_total counter', body)
+        self.assertIn('uftp_logins_total{result="ok"} 1', body)
+        self.assertIn('uftp_connected_sessions 1', body)
+        session.quit()
+
+        head, body = self.scrape(connect, '/other')
+        self.assertTrue(head.startswith('HTTP/1.0 404'), head)
+
+    def test_metrics_endpoint_on_ipv6(self):
+        if not socket.has_ipv6:
+            self.skipTest('no IPv6 support')
+        port = free_port()
+        self.start_server(METRICS_ADDRESS='[::1]:%d' % port)
+        self.assertTrue(wait_for(lambda: listening_sockets(port) == 1), 'metrics endpoint not listening')
+        head, body = self.scrape(lambda: socket.create_connection(('::1', port)))
+        self.assertTrue(head.startswith('HTTP/1.0 200'), head)
+        self.assertIn('uftp_connections_total', body)
+
+    def test_malformed_address_is_reported_once(self):
+        server = self.start_server(METRICS_ADDRESS='::1:9100')
+        self.assertTrue(wait_for(lambda: 'Invalid METRICS_ADDRESS ::1:9100' in server.log()), server.log())
+        time.sleep(1.5)
+        self.assertEqual(server.log().count('METRICS_ADDRESS'), 1)
+        self.assertNotIn('retrying', server.log())
+
+    def test_metrics_unix_socket(self):
+        server = UftpServer()
+        self.addCleanup(server.stop)
+        path = os.path.join(server.directory, 'metrics.sock')
+        server.settings['METRICS_ADDRESS'] = path
+        server.start()
+        self.assertTrue(wait_for(lambda: os.path.exists(path)), 'metrics socket not created')
+        self.assertEqual(os.stat(path).st_mode & 0o777, 0o600)
+
+        def connect():
+            s = socket.socket(socket.AF_UNIX)
+            s.connect(path)
+            return s
+        head, body = self.scrape(connect)
+        self.assertTrue(head.startswith('HTTP/1.0 200'), head)
+        self.assertIn('uftp_connections_total', body)
+
+
+class AdminSocketTests(UftpTestCase):
+
+    def setUp(self):
+        self.server = UftpServer()
+        self.addCleanup(self.server.stop)
+        self.path = os.path.join(self.server.directory, 'admin.sock')
+        self.server.settings['ADMIN_SOCKET'] = self.path
+        self.server.start()
+        self.assertTrue(wait_for(lambda: os.path.exists(self.path)), 'admin socket not created')
+
+    def admin(self, command):
+        s = socket.socket(socket.AF_UNIX)
+        s.settimeout(10)
+        s.connect(self.path)
+        s.sendall(command.encode() + b'\n')
+        reply = b''
+        while True:
+            block = s.recv(65536)
+            if not block:
+                break
+            reply += block
+            lines = reply.decode().splitlines()
+            if reply.endswith(b'\n') and lines and (lines[-1].startswith('OK') or lines[-1].startswith('ERR')):
+                break
+        s.close()
+        return reply.decode().splitlines()
+
+    def session_id(self, ftp):
+        port = ftp.sock.getsockname()[1]
+        for line in self.admin('sessions'):
+            match = re.match(r'(\d+) user=(\S+) ip=127\.0\.0\.1:%d ' % port, line)
+            if match:
+                return int(match.group(1)), line
+        return None, None
+
+    def start_transfer(self):
+        with open(os.path.join(self.server.home, 'big.bin'), 'wb') as f:
+            f.write(os.urandom(64 * 1024 * 1024))
+        ftp = self.server.login()
+        ftp.voidcmd('TYPE I')
+        return ftp, ftp.transfercmd('RETR big.bin')
+
+    def test_sessions_lists_logged_in_users(self):
+        ftp = self.server.login()
+        ftp.cwd('/')
+        session, line = self.session_id(ftp)
+        self.assertIsNotNone(session)
+        self.assertIn('user=%s' % FTP_USER, line)
+        self.assertIn('cwd=/', line)
+        self.assertIn('transfer=none', line)
+        self.assertIn('limit=none', line)
+        self.assertEqual(self.admin('sessions')[-1], 'OK 1 sessions')
+        ftp.quit()
+
+        self.assertEqual(self.admin('bogus')[-1], 'ERR unknown command bogus, try help')
+
+    def test_kill_closes_the_session(self):
+        ftp = self.server.login()
+        other = self.server.login()
+        session, line = self.session_id(ftp)
+
+        self.assertEqual(self.admin('kill %d' % session), ['OK session %d closed' % session])
+        self.assertTrue(ftp.getline().startswith('421'))
+        with self.assertRaises(EOFError):
+            ftp.getline()
+        self.assertTrue(wait_for(lambda: self.session_id(ftp)[0] is None))
+
+        self.assertTrue(self.admin('kill 99')[-1].startswith('ERR'))
+        self.assertTrue(other.voidcmd('NOOP').startswith('200'))
+        other.quit()
+
+    def test_cancel_stops_the_transfer(self):
+        ftp, data = self.start_transfer()
+        data.recv(65536)
+        session, line = self.session_id(ftp)
+
+        self.assertEqual(self.admin('cancel %d' % session), ['OK transfer of session %d cancelled' % session])
+        with self.assertRaises(ftplib.error_temp) as cancelled:
+            ftp.getresp()
+        self.assertTrue(str(cancelled.exception).startswith('426'), cancelled.exception)
+        data.close()
+
+        # The control connection survives, only the transfer is gone
+        self.assertEqual(ftp.pwd(), '/')
+        self.assertEqual(self.admin('cancel %d' % session), ['ERR session %d has no transfer running' % session])
+        ftp.quit()
+
+    def test_ratelimit_slows_the_running_transfer(self):
+        ftp, data = self.start_transfer()
+        session, line = self.session_id(ftp)
+        self.assertEqual(self.admin('ratelimit %d 512' % session), ['OK session %d rate limit 512' % session])
+        self.assertIn('limit=512KB/s', self.session_id(ftp)[1])
+
+        received = [0]
+        done = threading.Event()
+
+        def read():
+            while not done.is_set():
+                try:
+                    block = data.recv(65536)
+                except OSError:
+                    break
+                if not block:
+                    break
+                received[0] += len(block)
+        reader = threading.Thread(target=read)
+        reader.start()
+
+        # Let the socket buffers drain, then measure
+        time.sleep(1)
+        before = received[0]
+        time.sleep(2)
+        measured = received[0] - before
+        done.set()
+        data.close()
+        reader.join()
+
+        self.assertGreater(measured, 0)
+        self.assertLess(measured, 2 * 2 * 512 * 1024)
+
+        self.assertTrue(self.admin('ratelimit %d fast' % session)[-1].startswith('ERR invalid rate limit'))
+        self.assertEqual(self.admin('ratelimit %d default' % session), ['OK session %d rate limit default' % session])
+
+
+if __name__ == '__main__':
+    unittest.main()
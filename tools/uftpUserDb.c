@@ -0,0 +1,443 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2018 Ugo Cirmignani.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * uftpUserDb, builds the binary user database read by uFTP (USER_DATABASE_PATH)
+ *
+ * Input: one user per line, empty lines and lines starting with # are skipped
+ *   name:password:home[:userOwner:groupOwner]
+ *
+ * The database is written to a temporary file and renamed over the output,
+ * a running server picks up the new file atomically.
+ *
+ * hash prints a crypt(3) hash for the password read from stdin, usable as
+ * PASSWORD_n or in the database. bench measures how many logins per second
+ * the auth workers can verify at each cost, to pick one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../library/userDatabase.h"
+#include "../library/hashTable.h"
+#include "../library/passwordHash.h"
+
+#define USERDB_FIELDS   5
+
+struct inputUser
+{
+    char *fields[USERDB_FIELDS];
+    uint16_t lengths[USERDB_FIELDS];
+    uint32_t hash;
+    uint32_t offset;
+} typedef inputUser_DataType;
+
+static void usage(const char *program);
+static int parseLine(char *line, inputUser_DataType *user);
+static int buildDatabase(const char *inputPath, const char *outputPath);
+static int lookupUser(const char *databasePath, const char *name);
+static int hashPassword(const char *method, const char *cost);
+static int benchmarkHash(const char *method, int threads, int costCount, char *costs[]);
+static void *benchmarkThread(void *arg);
+
+#define BENCHMARK_SECONDS   2
+
+struct benchmarkData
+{
+    const char *hash;
+    volatile int *stop;
+    long verifications;
+} typedef benchmarkData_DataType;
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s build <users.txt> <users.db>\n", program);
+    fprintf(stderr, "  %s lookup <users.db> <username>\n", program);
+    fprintf(stderr, "  %s hash <yescrypt|bcrypt|sha512|sha256> [cost] < password\n", program);
+    fprintf(stderr, "  %s bench <yescrypt|bcrypt|sha512|sha256> <threads> <cost> [cost ...]\n", program);
+}
+
+/* Splits name:password:home[:userOwner:groupOwner] in place */
+static int parseLine(char *line, inputUser_DataType *user)
+{
+    int field = 0;
+    char *start = line;
+
+    memset(user, 0, sizeof(inputUser_DataType));
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (line[0] == '\0' || line[0] == '#')
+        return 0;
+
+    for (char *cursor = line; ; cursor++)
+    {
+        if (*cursor == ':' || *cursor == '\0')
+        {
+            int isEnd = (*cursor == '\0');
+
+            if (field >= USERDB_FIELDS)
+                return -1;
+
+            *cursor = '\0';
+            user->fields[field++] = start;
+            start = cursor + 1;
+
+            if (isEnd)
+                break;
+        }
+    }
+
+    if (field != 3 && field != USERDB_FIELDS)
+        return -1;
+
+    for (int i = 0; i < USERDB_FIELDS; i++)
+    {
+        size_t length;
+
+        if (user->fields[i] == NULL)
+            user->fields[i] = "";
+
+        length = strlen(user->fields[i]);
+        if (length >= (i == 2 ? PATH_MAX : USERDB_FIELD_SIZE))
+            return -1;
+
+        user->lengths[i] = (uint16_t) length;
+    }
+
+    if (user->lengths[0] == 0 || user->lengths[1] == 0 || user->lengths[2] == 0)
+        return -1;
+
+    user->hash = HASH_String(user->fields[0]);
+    return 1;
+}
+
+static int buildDatabase(const char *inputPath, const char *outputPath)
+{
+    FILE *input, *output;
+    char *line = NULL, temporaryPath[PATH_MAX];
+    size_t lineSize = 0;
+    int lineNumber = 0, userCount = 0, userCapacity = 0, written = 0;
+    inputUser_DataType *users = NULL;
+    USERDB_Header_DataType header;
+    USERDB_Slot_DataType *slots;
+    uint32_t slotCount = 16, offset;
+    int *slotOwners;
+
+    input = fopen(inputPath, "r");
+    if (input == NULL)
+    {
+        perror(inputPath);
+        return 1;
+    }
+
+    while (getline(&line, &lineSize, input) != -1)
+    {
+        inputUser_DataType user;
+        int returnCode;
+
+        lineNumber++;
+        returnCode = parseLine(line, &user);
+
+        if (returnCode == 0)
+            continue;
+
+        if (returnCode < 0)
+        {
+            fprintf(stderr, "%s:%d: invalid user line\n", inputPath, lineNumber);
+            fclose(input);
+            return 1;
+        }
+
+        for (int i = 0; i < USERDB_FIELDS; i++)
+        {
+            user.fields[i] = strdup(user.fields[i]);
+        }
+
+        if (userCount == userCapacity)
+        {
+            userCapacity = userCapacity ? userCapacity * 2 : 1024;
+            users = realloc(users, sizeof(inputUser_DataType) * userCapacity);
+            if (users == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                fclose(input);
+                return 1;
+            }
+        }
+
+        users[userCount++] = user;
+    }
+
+    free(line);
+    fclose(input);
+
+    while (slotCount < (uint32_t) userCount * 2)
+    {
+        slotCount <<= 1;
+    }
+
+    slots = calloc(slotCount, sizeof(USERDB_Slot_DataType));
+    slotOwners = calloc(slotCount, sizeof(int));
+    if (slots == NULL || slotOwners == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, USERDB_MAGIC, sizeof(header.magic));
+    header.version = USERDB_VERSION;
+    header.slotCount = slotCount;
+    header.slotsOffset = sizeof(USERDB_Header_DataType);
+    header.recordsOffset = header.slotsOffset + slotCount * sizeof(USERDB_Slot_DataType);
+
+    /* Assign record offsets and fill the slots, the first definition of a name wins */
+    offset = header.recordsOffset;
+    for (int i = 0; i < userCount; i++)
+    {
+        uint32_t slot = users[i].hash & (slotCount - 1);
+        int duplicated = 0;
+
+        while (slots[slot].recordOffset != 0)
+        {
+            if (slots[slot].hash == users[i].hash &&
+                strcmp(users[slotOwners[slot]].fields[0], users[i].fields[0]) == 0)
+            {
+                duplicated = 1;
+                break;
+            }
+
+            slot = (slot + 1) & (slotCount - 1);
+        }
+
+        if (duplicated)
+        {
+            fprintf(stderr, "warning: duplicated user %s ignored\n", users[i].fields[0]);
+            continue;
+        }
+
+        users[i].offset = offset;
+        slotOwners[slot] = i;
+        slots[slot].hash = users[i].hash;
+        slots[slot].recordOffset = offset;
+        header.recordCount++;
+
+        offset += sizeof(USERDB_Record_DataType);
+        for (int field = 0; field < USERDB_FIELDS; field++)
+        {
+            offset += users[i].lengths[field] + 1;
+        }
+    }
+
+    header.fileSize = offset;
+
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp.%ld", outputPath, (long) getpid());
+    output = fopen(temporaryPath, "wb");
+    if (output == NULL)
+    {
+        perror(temporaryPath);
+        return 1;
+    }
+
+    written += fwrite(&header, sizeof(header), 1, output);
+    written += fwrite(slots, sizeof(USERDB_Slot_DataType), slotCount, output) == slotCount;
+
+    for (int i = 0; i < userCount; i++)
+    {
+        USERDB_Record_DataType record;
+
+        if (users[i].offset == 0)
+            continue;
+
+        memset(&record, 0, sizeof(record));
+        record.nameLength = users[i].lengths[0];
+        record.passwordLength = users[i].lengths[1];
+        record.homeLength = users[i].lengths[2];
+        record.userOwnerLength = users[i].lengths[3];
+        record.groupOwnerLength = users[i].lengths[4];
+
+        fwrite(&record, sizeof(record), 1, output);
+        for (int field = 0; field < USERDB_FIELDS; field++)
+        {
+            fwrite(users[i].fields[field], users[i].lengths[field] + 1, 1, output);
+        }
+    }
+
+    if (written != 2 || fflush(output) != 0 || fsync(fileno(output)) != 0 || ferror(output))
+    {
+        fprintf(stderr, "error writing %s\n", temporaryPath);
+        fclose(output);
+        unlink(temporaryPath);
+        return 1;
+    }
+
+    fclose(output);
+
+    if (rename(temporaryPath, outputPath) != 0)
+    {
+        perror(outputPath);
+        unlink(temporaryPath);
+        return 1;
+    }
+
+    printf("%u users written to %s\n", header.recordCount, outputPath);
+    return 0;
+}
+
+static int lookupUser(const char *databasePath, const char *name)
+{
+    USERDB_Database_DataType database;
+    USERDB_User_DataType user;
+
+    if (USERDB_Open(&database, databasePath) != 1)
+    {
+        fprintf(stderr, "%s: not a valid user database\n", databasePath);
+        return 1;
+    }
+
+    if (USERDB_Lookup(&database, name, &user) != 1)
+    {
+        printf("%s not found\n", name);
+        USERDB_Close(&database);
+        return 1;
+    }
+
+    printf("name: %s\nhome: %s\nuser owner: %s\ngroup owner: %s\n", user.name, user.homePath, user.userOwner, user.groupOwner);
+    USERDB_Close(&database);
+    return 0;
+}
+
+static int hashPassword(const char *method, const char *cost)
+{
+    char password[1024];
+    char hash[PWHASH_MAXIMUM_SIZE];
+
+    if (fgets(password, sizeof(password), stdin) == NULL)
+    {
+        fprintf(stderr, "no password on stdin\n");
+        return 1;
+    }
+
+    password[strcspn(password, "\r\n")] = '\0';
+
+    if (PWHASH_Generate(method, cost != NULL ? strtoul(cost, NULL, 10) : 0, password, hash, sizeof(hash)) != 1)
+    {
+        fprintf(stderr, "cannot hash with %s, unknown method or invalid cost (is uFTP built with CRYPT_SUPPORT_ENABLED?)\n", method);
+        return 1;
+    }
+
+    memset(password, 0, sizeof(password));
+    printf("%s\n", hash);
+    return 0;
+}
+
+static void *benchmarkThread(void *arg)
+{
+    benchmarkData_DataType *data = arg;
+
+    while (*data->stop == 0)
+    {
+        PWHASH_Verify("benchmark-password", data->hash);
+        data->verifications++;
+    }
+
+    return NULL;
+}
+
+/* Verifications per second with the given thread count, the login throughput of AUTH_WORKER_THREADS workers */
+static int benchmarkHash(const char *method, int threads, int costCount, char *costs[])
+{
+    if (threads < 1)
+        threads = 1;
+
+    printf("%-10s %10s %8s %14s %12s\n", "method", "cost", "threads", "logins/s", "ms/login");
+
+    for (int c = 0; c < costCount; c++)
+    {
+        char hash[PWHASH_MAXIMUM_SIZE];
+        volatile int stop = 0;
+        long total = 0;
+        pthread_t threadIds[threads];
+        benchmarkData_DataType data[threads];
+        struct timespec start, end;
+        double elapsed;
+
+        if (PWHASH_Generate(method, strtoul(costs[c], NULL, 10), "benchmark-password", hash, sizeof(hash)) != 1)
+        {
+            fprintf(stderr, "cannot hash with %s cost %s, unknown method or invalid cost (is uFTP built with CRYPT_SUPPORT_ENABLED?)\n", method, costs[c]);
+            return 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (int i = 0; i < threads; i++)
+        {
+            data[i].hash = hash;
+            data[i].stop = &stop;
+            data[i].verifications = 0;
+            pthread_create(&threadIds[i], NULL, benchmarkThread, &data[i]);
+        }
+
+        sleep(BENCHMARK_SECONDS);
+        stop = 1;
+
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_join(threadIds[i], NULL);
+            total += data[i].verifications;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("%-10s %10s %8d %14.1f %12.2f\n", method, costs[c], threads, total / elapsed, total > 0 ? elapsed * 1000.0 * threads / total : 0.0);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "build") == 0)
+        return buildDatabase(argv[2], argv[3]);
+
+    if (argc == 4 && strcmp(argv[1], "lookup") == 0)
+        return lookupUser(argv[2], argv[3]);
+
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "hash") == 0)
+        return hashPassword(argv[2], argc == 4 ? argv[3] : NULL);
+
+    if (argc >= 5 && strcmp(argv[1], "bench") == 0)
+        return benchmarkHash(argv[2], atoi(argv[3]), argc - 4, &argv[4]);
+
+    usage(argv[0]);
+    return 2;
+}
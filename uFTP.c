@@ -24,11 +24,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ftpServer.h"
+#include "library/daemon.h"
 
 int main(int argc, char** argv) 
 {
+    if (argc >= 2 && strcmp(argv[1], "--tls-benchmark") == 0)
+        return runTlsBenchmark(argc >= 3 ? atof(argv[2]) : 1.0) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    setServerArguments(argv);
     runFtpServer();
     return EXIT_SUCCESS;
 }